@@ -0,0 +1,161 @@
+/**
+ * Builds the BVH over a sphere_field two ways and renders both:
+ *   heap    every sphere is a make_shared of its own and points at the
+ *           scene's materials, the way the BVH used to be built
+ *   arena   Scene::bvh, the spheres and copies of their materials are made
+ *           in the scene's arena in the order of the tree's leaves
+ * For both it prints the build time, the number of allocations of the build,
+ * and the rays per second of a render with the recursive and with the
+ * wavefront integrator, and the allocations made while rendering.
+ *
+ * The two trees are the same and trace the same paths, only the memory the
+ * objects sit in differs. The arena should build with a few allocations
+ * instead of one per sphere, and trace at least as fast, more so once the
+ * scene no longer fits in the cache. The render allocations should be the
+ * same few for both, however big the scene.
+ *
+ * Usage: bench_arena [spheres,spheres,...] [threads]
+ **/
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "allocation_counter.h"
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "scene.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "renderer.h"
+#include "integrator.h"
+
+RT_COUNT_ALLOCATIONS()
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+struct Timing {
+    double mrays = 0;
+    uint64_t allocations = 0;
+};
+
+// The best of three renders of world, with the wavefront tracer or one path at a time
+static Timing render(ThreadPool& pool, const Scene& scene, const Hittable& world, bool wavefront) {
+    const int width = 240, height = 135, samples = 4;
+    const auto& view = scene.settings;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov,
+                  static_cast<double>(width) / height, view.aperture, view.focus_dist);
+    PathSettings settings;
+
+    auto camera_ray = [&](int i, int j, int s) {
+        thread_sampler().start_pixel_sample(0, i, j, s);
+        auto u = (i + random_double()) / (width - 1);
+        auto v = (j + random_double()) / (height - 1);
+        return camera.get_ray(u, v);
+    };
+
+    Timing best;
+    for (int k = 0; k < 3; k++) {
+        auto allocations = allocation_count();
+        RenderResult pass;
+        if (wavefront) {
+            pass = render_tile_tasks(pool, width, height, 16, [&](const Tile& tile, std::vector<Color>& pixels) {
+                auto& scratch = thread_scratch();
+                ArenaScope scope(scratch);
+                auto count = static_cast<std::size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+                auto colors = scratch.allocate_array<Color>(count);
+                for (std::size_t p = 0; p < count; p++)
+                    colors[p] = Color(0, 0, 0);
+
+                auto tile_width = tile.x1 - tile.x0;
+                WavefrontTracer tracer;
+                tracer.trace(world, settings, count, 0, samples, [&](std::size_t p, int s) {
+                    return camera_ray(tile.x0 + static_cast<int>(p) % tile_width, tile.y0 + static_cast<int>(p) / tile_width, s);
+                }, colors);
+
+                for (std::size_t p = 0; p < count; p++) {
+                    int i = tile.x0 + static_cast<int>(p) % tile_width, j = tile.y0 + static_cast<int>(p) / tile_width;
+                    pixels[pixel_index(width, height, i, j)] = colors[p];
+                }
+            }, false);
+        } else {
+            pass = render_tiles(pool, width, height, 16, [&](int i, int j) {
+                Color pixel_color(0, 0, 0);
+                for (int s = 0; s < samples; s++)
+                    pixel_color += trace_path(camera_ray(i, j, s), world, settings);
+                return pixel_color;
+            }, false);
+        }
+        // The first render also fills the scratch arenas of the threads
+        if (k > 0)
+            best.allocations = std::max(best.allocations, allocation_count() - allocations);
+        best.mrays = std::max(best.mrays, pass.rays / pass.seconds / 1e6);
+    }
+    return best;
+}
+
+static void run(ThreadPool& pool, int count) {
+    thread_sampler().seed(0);
+    auto scene = sphere_field(count);
+    const auto& spheres = scene.spheres;
+
+    auto allocations = allocation_count();
+    auto start = Clock::now();
+    HittableList list;
+    for (std::size_t k = 0; k < spheres.size(); k++) {
+        Point3 center(spheres.cx[k], spheres.cy[k], spheres.cz[k]);
+        list.add(make_shared<Sphere>(center, spheres.radius[k], spheres.materials[k]));
+    }
+    BVH heap(list);
+    double heap_build = seconds_since(start);
+    auto heap_allocations = allocation_count() - allocations;
+
+    allocations = allocation_count();
+    start = Clock::now();
+    auto arena = scene.bvh();
+    double arena_build = seconds_since(start);
+    auto arena_allocations = allocation_count() - allocations;
+
+    std::cout << count << " spheres, " << scene.arena.bytes_used() / 1024 << "KB in the arena" << '\n';
+    auto line = [&](const char* name, const Hittable& world, double build, uint64_t build_allocations) {
+        auto path = render(pool, scene, world, false);
+        auto wavefront = render(pool, scene, world, true);
+        std::cout << "  " << std::left << std::setw(6) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(9) << build * 1000 << " ms build"
+                  << std::setw(9) << build_allocations << " allocations"
+                  << std::setw(8) << path.mrays << " Mrays/s path"
+                  << std::setw(8) << wavefront.mrays << " Mrays/s wavefront"
+                  << std::setw(6) << std::max(path.allocations, wavefront.allocations)
+                  << " allocations per render" << '\n';
+    };
+    line("heap", heap, heap_build, heap_allocations);
+    line("arena", *arena, arena_build, arena_allocations);
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> counts = { 1000, 100000, 1000000 };
+    if (argc > 1) {
+        counts.clear();
+        std::stringstream list(argv[1]);
+        std::string count;
+        while (std::getline(list, count, ','))
+            if (!count.empty())
+                counts.push_back(std::max(1, std::atoi(count.c_str())));
+    }
+    ThreadPool pool(argc > 2 ? std::atoi(argv[2]) : 0);
+
+    for (int count : counts)
+        run(pool, count);
+}
@@ -0,0 +1,207 @@
+/**
+ * Renders a few scenes at low sample counts, denoises them and compares
+ * both the noisy and the denoised image to a reference rendered with many
+ * samples. For every sample count it prints:
+ *   render    the time of the render itself
+ *   aovs      the time of tracing the AOVs (see render_aovs)
+ *   denoise   the time of the filter (see Denoiser)
+ *   rmse      of the noisy and the denoised image against the reference
+ *   relmse    the same as a relative MSE, see ImageError
+ *   same rmse the samples per pixel a render without denoising would need
+ *             for the RMSE of the denoised one, the RMSE of a render goes
+ *             down with the square root of the samples
+ * and the throughput of the filter on its own, in megapixels per second.
+ *
+ * The reference takes a while, --references keeps the references in
+ * <prefix>_<scene>.pfm and reads them back on the next run. The sigmas of
+ * DenoiseSettings can be changed to try other values.
+ *
+ * Usage: bench_denoise [--reference-spp n] [--threads n] [--references prefix]
+ *                      [--sigma-color x] [--sigma-normal x] [--sigma-depth x]
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "utility.h"
+#include "camera.h"
+#include "denoiser.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "lights.h"
+#include "scene.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "integrator.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+const int WIDTH = 320, HEIGHT = 180;
+
+// A scene set up to render, like main does
+struct BenchScene {
+    std::string name;
+    Scene scene;
+    shared_ptr<Hittable> world;
+    LightList lights;
+    PathSettings settings;
+};
+
+static BenchScene bench_scene(const std::string& name, Scene scene) {
+    BenchScene b;
+    b.name = name;
+    b.scene = std::move(scene);
+    b.world = b.scene.bvh();
+    b.lights = b.scene.lights();
+    b.settings.sky = b.scene.settings.sky;
+    b.settings.max_depth = b.scene.settings.max_depth;
+    return b;
+}
+
+// The image of samples samples per pixel, its variance from the first half
+// of the samples against all of them, and the AOVs of the same camera rays
+struct Render {
+    Framebuffer image;
+    std::vector<Color> variance;
+    AovBuffers aovs;
+    double seconds = 0;
+    double aov_seconds = 0;
+};
+
+static Render render(ThreadPool& pool, BenchScene& b, int samples, uint64_t seed, bool with_aovs) {
+    b.settings.lights = b.lights.empty() ? nullptr : &b.lights;
+    const auto& view = b.scene.settings;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov,
+                  static_cast<double>(WIDTH) / HEIGHT, view.aperture, view.focus_dist);
+    SamplerSettings sampler_settings;
+    sampler_settings.samples_per_pixel = samples;
+    sampler_settings.seed = seed;
+    auto camera_ray = [&](int i, int j, int s) {
+        thread_sampler().start_pixel_sample(sampler_settings, i, j, s);
+        auto u = (i + random_double()) / (WIDTH - 1);
+        auto v = (j + random_double()) / (HEIGHT - 1);
+        return camera.get_ray(u, v);
+    };
+
+    // The sums of samples [s0, s1) added to sums
+    auto render_pass = [&](const std::vector<Color>& sums, int s0, int s1) {
+        return render_tiles(pool, WIDTH, HEIGHT, 16, [&](int i, int j) {
+            Color pixel_color = sums[pixel_index(WIDTH, HEIGHT, i, j)];
+            for (int s = s0; s < s1; s++)
+                pixel_color += trace_path(camera_ray(i, j, s), *b.world, b.settings);
+            return pixel_color;
+        }, false);
+    };
+
+    Render r;
+    int half = (samples + 1) / 2;
+    auto first = render_pass(std::vector<Color>(static_cast<std::size_t>(WIDTH) * HEIGHT), 0, half);
+    auto all = render_pass(first.pixels, half, samples);
+    r.image = Framebuffer(WIDTH, HEIGHT, all.pixels, samples);
+    r.seconds = first.seconds + all.seconds;
+    for (std::size_t p = 0; p < all.pixels.size(); p++)
+        r.variance.push_back(mean_variance(all.pixels[p], samples, first.pixels[p], half));
+
+    if (with_aovs) {
+        auto start = Clock::now();
+        r.aovs = render_aovs(pool, *b.world, WIDTH, HEIGHT, std::min(samples, AOV_MAX_SAMPLES), 16, camera_ray);
+        r.aov_seconds = seconds_since(start);
+    }
+    return r;
+}
+
+int main(int argc, char** argv) {
+    int reference_samples = 1024;
+    int threads = 0;
+    std::string references;
+    DenoiseSettings denoise_settings;
+
+    for (int k = 1; k + 1 < argc; k += 2) {
+        std::string arg = argv[k];
+        if (arg == "--reference-spp") reference_samples = std::max(1, std::atoi(argv[k + 1]));
+        else if (arg == "--threads") threads = std::atoi(argv[k + 1]);
+        else if (arg == "--references") references = argv[k + 1];
+        else if (arg == "--sigma-color") denoise_settings.sigma_color = std::strtof(argv[k + 1], nullptr);
+        else if (arg == "--sigma-normal") denoise_settings.sigma_normal = std::strtof(argv[k + 1], nullptr);
+        else if (arg == "--sigma-depth") denoise_settings.sigma_depth = std::strtof(argv[k + 1], nullptr);
+    }
+
+    ThreadPool pool(threads);
+    Denoiser denoiser(denoise_settings);
+
+    thread_sampler().seed(0);
+    BenchScene scenes[] = { bench_scene("random", random_scene()), bench_scene("small_light", small_light()) };
+
+    std::cout << WIDTH << "x" << HEIGHT << ", " << pool.size() << " threads, " << RT_SIMD_NAME
+              << " kernels, sigmas " << denoise_settings.sigma_color << " " << denoise_settings.sigma_normal
+              << " " << denoise_settings.sigma_depth << '\n';
+
+    for (auto& b : scenes) {
+        Framebuffer reference;
+        auto reference_path = references.empty() ? "" : references + "_" + b.name + ".pfm";
+        if (reference_path.empty() || !read_pfm(reference_path, reference)
+            || reference.width != WIDTH || reference.height != HEIGHT) {
+            std::cerr << "Rendering the " << b.name << " reference with " << reference_samples
+                      << " samples per pixel" << '\n';
+            // Another seed, so the reference doesn't share its first samples with the renders
+            reference = render(pool, b, reference_samples, 1, false).image;
+            if (!reference_path.empty() && !write_image(reference_path, reference, ImageFormat::PFM))
+                std::cerr << "Could not write " << reference_path << '\n';
+        }
+
+        std::cout << '\n' << b.name << '\n'
+                  << "  spp   render ms  aovs ms  denoise ms    rmse noisy  denoised   relmse noisy  denoised   same rmse" << '\n';
+        for (int samples : { 4, 8, 16, 32 }) {
+            auto noisy = render(pool, b, samples, 0, true);
+            auto start = Clock::now();
+            auto denoised = denoiser.denoise(pool, noisy.image, noisy.variance, noisy.aovs);
+            auto denoise_seconds = seconds_since(start);
+
+            auto noisy_error = image_error(noisy.image, reference);
+            auto denoised_error = image_error(denoised, reference);
+            auto ratio = noisy_error.rmse / denoised_error.rmse;
+            std::cout << std::fixed << std::setw(5) << samples << std::setprecision(1)
+                      << std::setw(12) << noisy.seconds * 1000 << std::setw(9) << noisy.aov_seconds * 1000
+                      << std::setw(12) << denoise_seconds * 1000
+                      << std::setprecision(4) << std::setw(14) << noisy_error.rmse << std::setw(10) << denoised_error.rmse
+                      << std::setw(15) << noisy_error.relative_mse << std::setw(10) << denoised_error.relative_mse
+                      << std::setprecision(0) << std::setw(12) << samples * ratio * ratio << '\n';
+        }
+    }
+
+    // The filter on its own, on a bigger image
+    auto big = render(pool, scenes[0], 2, 0, true);
+    Framebuffer image(WIDTH * 4, HEIGHT * 4);
+    std::vector<Color> variance;
+    AovBuffers aovs;
+    aovs.width = image.width;
+    aovs.height = image.height;
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            auto from = static_cast<std::size_t>(y / 4) * WIDTH + x / 4;
+            image.at(x, y) = big.image.pixels[from];
+            variance.push_back(big.variance[from]);
+            aovs.albedo.push_back(big.aovs.albedo[from]);
+            aovs.normal.push_back(big.aovs.normal[from]);
+            aovs.depth.push_back(big.aovs.depth[from]);
+        }
+    }
+    double best = INF;
+    for (int run = 0; run < 5; run++) {
+        auto start = Clock::now();
+        denoiser.denoise(pool, image, variance, aovs);
+        best = std::min(best, seconds_since(start));
+    }
+    std::cout << '\n' << "Denoiser alone at " << image.width << "x" << image.height << ": " << std::setprecision(1)
+              << best * 1000 << "ms, " << std::setprecision(2) << image.pixels.size() / best / 1e6
+              << " Mpixels/s" << '\n';
+}
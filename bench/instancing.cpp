@@ -0,0 +1,150 @@
+/**
+ * Renders sphere_forest twice: once with the trees as instances of one
+ * prototype (a two level BVH), and once flattened, with every sphere of every
+ * tree moved into the world and put in a single PackedSpheres tree. For both
+ * it prints the memory of the geometry and its trees and the rays per second.
+ *
+ * The instanced forest should stay about the same size however many trees
+ * there are, while the flattened one grows with every tree. The speed should
+ * be close, an instanced ray pays for the trip into the prototype's tree and
+ * for moving the ray, the flattened tree is deeper instead.
+ *
+ * The two renders trace the same paths, so the mean difference of their
+ * pixels is printed too, it should be close to zero.
+ *
+ * Usage: bench_instancing [trees,trees,...] [threads]
+ **/
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "packed_spheres.h"
+#include "scene.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "renderer.h"
+#include "integrator.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+// Every sphere of every instance, moved into the world. The forest only
+// scales uniformly, so a sphere stays a sphere
+static void flatten(const Scene& scene, PackedSpheres& flat) {
+    for (const auto& instance : scene.instances) {
+        const auto& spheres = *static_cast<const PackedSpheres*>(instance.geometry);
+        const auto& t = instance.object_to_world;
+        auto size = t.vector(Vec3(1, 0, 0)).length();
+        for (std::size_t k = 0; k < spheres.size(); k++) {
+            auto center = t.point(Point3(spheres.cx[k], spheres.cy[k], spheres.cz[k]));
+            flat.add(center, spheres.radius[k] * size,
+                     instance.material ? instance.material : spheres.materials[k]);
+        }
+    }
+    flat.commit(true);
+}
+
+// The best of three renders of world
+static RenderResult render(ThreadPool& pool, const Scene& scene, const Hittable& world) {
+    const int width = 240, height = 135, samples = 4;
+    const auto& view = scene.settings;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov,
+                  static_cast<double>(width) / height, view.aperture, view.focus_dist);
+    PathSettings settings;
+
+    RenderResult best;
+    best.seconds = INF;
+    for (int k = 0; k < 3; k++) {
+        auto pass = render_tiles(pool, width, height, 16, [&](int i, int j) {
+            Color pixel_color(0, 0, 0);
+            for (int s = 0; s < samples; s++) {
+                thread_sampler().start_pixel_sample(0, i, j, s);
+                auto u = (i + random_double()) / (width - 1);
+                auto v = (j + random_double()) / (height - 1);
+                pixel_color += trace_path(camera.get_ray(u, v), world, settings);
+            }
+            return pixel_color;
+        }, false);
+        if (pass.seconds < best.seconds)
+            best = std::move(pass);
+    }
+    return best;
+}
+
+static void run(ThreadPool& pool, int trees) {
+    thread_sampler().seed(0);
+    auto scene = sphere_forest(trees);
+    const auto& ground = scene.spheres;
+    Sphere ground_sphere(Point3(ground.cx[0], ground.cy[0], ground.cz[0]), ground.radius[0], ground.materials[0]);
+    auto ground_ptr = shared_ptr<Hittable>(shared_ptr<Hittable>(), &ground_sphere);
+
+    auto start = Clock::now();
+    auto top = make_shared<InstanceBvh>(scene.instances);
+    double instanced_build = seconds_since(start);
+    std::size_t instanced_bytes = top->memory_bytes();
+    for (const auto& prototype : scene.prototypes)
+        instanced_bytes += prototype.spheres.memory_bytes();
+
+    start = Clock::now();
+    PackedSpheres flat;
+    flatten(scene, flat);
+    double flat_build = seconds_since(start);
+    auto flat_ptr = shared_ptr<Hittable>(shared_ptr<Hittable>(), &flat);
+
+    HittableList instanced_world, flat_world;
+    instanced_world.add(ground_ptr);
+    instanced_world.add(top);
+    flat_world.add(ground_ptr);
+    flat_world.add(flat_ptr);
+
+    auto instanced = render(pool, scene, instanced_world);
+    auto flattened = render(pool, scene, flat_world);
+
+    double difference = 0;
+    for (std::size_t p = 0; p < instanced.pixels.size(); p++) {
+        auto d = instanced.pixels[p] - flattened.pixels[p];
+        difference += std::fabs(d[0]) + std::fabs(d[1]) + std::fabs(d[2]);
+    }
+    difference /= 3.0 * instanced.pixels.size();
+
+    auto line = [&](const char* name, std::size_t bytes, double build, const RenderResult& r) {
+        std::cout << "  " << std::left << std::setw(10) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(10) << bytes / 1e6 << " MB"
+                  << std::setw(10) << build * 1000 << " ms build"
+                  << std::setw(10) << r.rays / r.seconds / 1e6 << " Mrays/s" << '\n';
+    };
+    std::cout << trees << " trees, " << flat.size() << " spheres" << '\n';
+    line("instanced", instanced_bytes, instanced_build, instanced);
+    line("flattened", flat.memory_bytes(), flat_build, flattened);
+    std::cout << "  mean pixel difference " << std::setprecision(5) << difference << '\n';
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> counts = { 100, 1000, 10000 };
+    if (argc > 1) {
+        counts.clear();
+        std::stringstream list(argv[1]);
+        std::string count;
+        while (std::getline(list, count, ','))
+            if (!count.empty())
+                counts.push_back(std::max(1, std::atoi(count.c_str())));
+    }
+    ThreadPool pool(argc > 2 ? std::atoi(argv[2]) : 0);
+
+    for (int trees : counts)
+        run(pool, trees);
+}
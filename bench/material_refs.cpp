@@ -0,0 +1,189 @@
+/**
+ * Compares closest hit queries where the hit record owns its material through a
+ * shared_ptr (how the renderer used to work) against the current hit record
+ * that keeps a plain pointer into the scene.
+ *
+ * Both run the same rays against a row of spheres in a flat list. The spheres
+ * are sorted far to near, so every sphere is a closer hit than the last one and
+ * overwrites the record, the worst case the BVH can run into. With shared_ptr
+ * each overwrite is an atomic increment and decrement on a reference count that
+ * every thread shares.
+ *
+ * Usage: bench_material_refs [threads] [rays per thread]
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "utility.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene.h"
+#include "sphere.h"
+
+// The old hit record, it shares ownership of the material
+struct SharedHitRecord {
+    Point3 p;
+    Vec3 normal;
+    shared_ptr<Material> mat_ptr;
+    double t;
+    bool front_face;
+};
+
+// Virtual like Hittable, so both sides pay for the same indirect call
+class SharedHittable {
+public:
+    virtual ~SharedHittable() = default;
+    virtual bool hit(const Ray& r, double t_min, double t_max, SharedHitRecord& rec) const = 0;
+};
+
+class SharedSphere : public SharedHittable {
+public:
+    Point3 center;
+    double radius;
+    shared_ptr<Material> mat_ptr;
+public:
+    SharedSphere(Point3 c, double r, shared_ptr<Material> m) : center(c), radius(r), mat_ptr(m) {}
+
+    // This is the only SharedHittable, so without noinline the compiler guesses
+    // the call target and inlines it, which Sphere::hit never gets
+    [[gnu::noinline]]
+    virtual bool hit(const Ray& r, double t_min, double t_max, SharedHitRecord& rec) const override {
+        Vec3 oc = r.origin() - center;
+        auto a = r.direction().lengthSquared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.lengthSquared() - radius * radius;
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0) return false;
+
+        auto sqrt_d = sqrt(discriminant);
+        auto root = (-half_b - sqrt_d) / a;
+        if (root < t_min || t_max < root) {
+            root = (-half_b + sqrt_d) / a;
+            if (root < t_min || t_max < root) return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        Vec3 outward_normal = (rec.p - center) / radius;
+        rec.front_face = dot(r.direction(), outward_normal) < 0;
+        rec.normal = rec.front_face ? outward_normal : -outward_normal;
+        rec.mat_ptr = mat_ptr;
+        return true;
+    }
+};
+
+// The old HittableList::hit, including the copy from the temp record
+bool shared_list_hit(
+    const std::vector<shared_ptr<SharedHittable>>& spheres,
+    const Ray& r, double t_min, double t_max, SharedHitRecord& rec
+) {
+    SharedHitRecord temp_rec;
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& sphere : spheres) {
+        if (sphere->hit(r, t_min, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+        }
+    }
+    return hit_anything;
+}
+
+// Number of spheres every ray goes through
+const int SPHERE_COUNT = 8;
+
+// Sphere k sits on the -z axis, the first one is the furthest away
+Point3 sphere_center(int k) {
+    return Point3(0, 0, -2.0 * (SPHERE_COUNT - k));
+}
+
+// Deterministic rays down the -z axis, close enough to it to hit every sphere
+std::vector<Ray> make_rays(int count, uint64_t seed) {
+    Pcg32 rng(seed, 1);
+    std::vector<Ray> rays;
+    for (int k = 0; k < count; k++) {
+        Point3 origin(0.2 * rng.next_double() - 0.1, 0.2 * rng.next_double() - 0.1, 0);
+        Vec3 direction(0.01 * rng.next_double(), 0.01 * rng.next_double(), -1);
+        rays.push_back(Ray(origin, direction));
+    }
+    return rays;
+}
+
+// Runs query(ray) for every ray on thread_count threads, returns Mrays/s
+template <typename QueryFn>
+double run(int thread_count, int rays_per_thread, QueryFn query) {
+    std::vector<std::vector<Ray>> rays;
+    for (int t = 0; t < thread_count; t++)
+        rays.push_back(make_rays(rays_per_thread, t));
+
+    std::vector<int> hit_counts(thread_count);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t] {
+            int hits = 0;
+            for (const auto& r : rays[t])
+                hits += query(r);
+            hit_counts[t] = hits;
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(thread_count) * rays_per_thread / elapsed.count() / 1e6;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? std::atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+    int rays_per_thread = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    if (max_threads < 1) max_threads = 1;
+
+    // Every sphere uses the same material, which is the worst case for the shared
+    // reference count, and also the common one (the ground and every glass
+    // sphere in the book's scene share one)
+    Scene scene;
+    auto raw_material = scene.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+    auto shared_material = make_shared<Material>(Lambertian(Color(0.5, 0.5, 0.5)));
+
+    std::vector<shared_ptr<SharedHittable>> shared_spheres;
+    HittableList raw_spheres;
+    for (int k = 0; k < SPHERE_COUNT; k++) {
+        shared_spheres.push_back(make_shared<SharedSphere>(sphere_center(k), 0.5, shared_material));
+        raw_spheres.add(make_shared<Sphere>(sphere_center(k), 0.5, raw_material));
+    }
+
+    std::cout << "hit record updates per ray: " << SPHERE_COUNT << '\n';
+
+    std::vector<int> thread_counts = { 1 };
+    if (max_threads > 1)
+        thread_counts.push_back(max_threads);
+
+    for (auto threads : thread_counts) {
+        // Best of a few runs, alternating between the two so that noise from
+        // other processes or clock changes hits both the same way
+        double shared = 0, raw = 0;
+        for (int k = 0; k < 5; k++) {
+            shared = std::max(shared, run(threads, rays_per_thread, [&](const Ray& r) {
+                SharedHitRecord rec;
+                return shared_list_hit(shared_spheres, r, 0.001, INF, rec) ? 1 : 0;
+            }));
+            raw = std::max(raw, run(threads, rays_per_thread, [&](const Ray& r) {
+                hit_record rec;
+                return raw_spheres.hit(r, 0.001, INF, rec) ? 1 : 0;
+            }));
+        }
+
+        std::cout << threads << " thread(s): shared_ptr " << shared << " Mrays/s, "
+                  << "raw pointer " << raw << " Mrays/s, "
+                  << "speedup " << raw / shared << "x" << '\n';
+    }
+}
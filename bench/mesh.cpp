@@ -0,0 +1,219 @@
+/**
+ * Loads a triangle mesh and reports how long that takes, then traces it.
+ *
+ * Without a file it makes its own: a lumpy ball of about a million
+ * triangles, written both as an OBJ file and as a binary PLY file, and loads
+ * both. For the mesh it prints
+ *   - the load time and speed, and the time to build the BVH
+ *   - the memory of the vertices, triangles and tree
+ *   - leaks: rays shot from the inside of the ball that found no triangle,
+ *     once in random directions and once straight at the vertices, where
+ *     most rays would slip through the cracks of a test that isn't
+ *     watertight. It should be 0 for both kernels. Only for the made up mesh,
+ *     a file may not be closed
+ *   - the rays per second of a render, with the SIMD and the scalar kernel
+ *
+ * Usage: bench_mesh [file.obj|file.ply] [threads]
+ **/
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh.h"
+#include "mesh_file.h"
+#include "scene.h"
+#include "sphere.h"
+#include "renderer.h"
+#include "integrator.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+// A ball of radius about 1 around the origin, with bumps, rings * segments * 2 triangles
+static TriangleMesh lumpy_ball(int rings, int segments) {
+    TriangleMesh mesh;
+    mesh.add_vertex(Point3(0, 1, 0));
+    for (int i = 1; i < rings; i++) {
+        double theta = PI * i / rings;
+        for (int j = 0; j < segments; j++) {
+            double phi = 2 * PI * j / segments;
+            double r = 1 + 0.04 * std::sin(7 * theta) * std::sin(9 * phi) + 0.01 * std::sin(40 * theta + 3 * phi);
+            mesh.add_vertex(Point3(r * std::sin(theta) * std::cos(phi), r * std::cos(theta),
+                                   -r * std::sin(theta) * std::sin(phi)));
+        }
+    }
+    auto bottom = mesh.add_vertex(Point3(0, -1, 0));
+
+    // Counter clockwise seen from the outside
+    auto ring = [&](int i, int j) { return 1 + (i - 1) * segments + (j % segments); };
+    for (int j = 0; j < segments; j++) {
+        mesh.add_triangle(0, ring(1, j), ring(1, j + 1));
+        for (int i = 1; i < rings - 1; i++) {
+            mesh.add_triangle(ring(i, j), ring(i + 1, j), ring(i + 1, j + 1));
+            mesh.add_triangle(ring(i, j), ring(i + 1, j + 1), ring(i, j + 1));
+        }
+        mesh.add_triangle(ring(rings - 1, j), bottom, ring(rings - 1, j + 1));
+    }
+    return mesh;
+}
+
+static void write_obj(const std::string& path, const TriangleMesh& mesh) {
+    std::ofstream out(path);
+    out << std::setprecision(9);
+    for (const auto& p : mesh.vertices)
+        out << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+    for (std::size_t k = 0; k < mesh.indices.size(); k += 3)
+        out << "f " << mesh.indices[k] + 1 << ' ' << mesh.indices[k + 1] + 1 << ' ' << mesh.indices[k + 2] + 1 << '\n';
+}
+
+// Binary PLY in the byte order of the machine, like most tools write it
+static void write_ply(const std::string& path, const TriangleMesh& mesh) {
+    std::ofstream out(path, std::ios::binary);
+    out << "ply\n"
+        << "format " << (mesh_file_detail::machine_is_little_endian() ? "binary_little_endian" : "binary_big_endian") << " 1.0\n"
+        << "element vertex " << mesh.vertices.size() << "\n"
+        << "property float x\nproperty float y\nproperty float z\n"
+        << "element face " << mesh.size() << "\n"
+        << "property list uchar int vertex_indices\n"
+        << "end_header\n";
+    for (const auto& p : mesh.vertices) {
+        float xyz[3] = { static_cast<float>(p[0]), static_cast<float>(p[1]), static_cast<float>(p[2]) };
+        out.write(reinterpret_cast<const char*>(xyz), sizeof(xyz));
+    }
+    for (std::size_t k = 0; k < mesh.indices.size(); k += 3) {
+        unsigned char corners = 3;
+        int32_t abc[3] = { static_cast<int32_t>(mesh.indices[k]), static_cast<int32_t>(mesh.indices[k + 1]),
+                           static_cast<int32_t>(mesh.indices[k + 2]) };
+        out.write(reinterpret_cast<const char*>(&corners), 1);
+        out.write(reinterpret_cast<const char*>(abc), sizeof(abc));
+    }
+}
+
+static bool load(const std::string& path, TriangleMesh& mesh) {
+    std::string error;
+    auto start = Clock::now();
+    if (!load_mesh(path, mesh, error)) {
+        std::cerr << error << '\n';
+        return false;
+    }
+    double seconds = seconds_since(start);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    double megabytes = static_cast<double>(file.tellg()) / 1e6;
+    std::cout << std::fixed << std::setprecision(1) << "Loaded " << path << ": " << mesh.size()
+              << " triangles, " << mesh.vertices.size() << " vertices in " << seconds * 1000 << "ms ("
+              << megabytes / seconds << " MB/s, " << mesh.size() / seconds / 1e6 << "M triangles/s)" << '\n';
+    return true;
+}
+
+// Rays from the center of the ball that hit nothing, with either kernel
+static void count_leaks(TriangleMesh& mesh) {
+    const int count = 1000000;
+    Point3 center(0, 0, 0);
+    for (bool simd : { true, false }) {
+        mesh.use_simd = simd;
+        int random_leaks = 0, vertex_leaks = 0;
+        hit_record rec;
+        for (int k = 0; k < count; k++) {
+            if (!mesh.hit(Ray(center, random_unit_vector()), 0, INF, rec))
+                random_leaks++;
+            const auto& v = mesh.vertices[k % mesh.vertices.size()];
+            if (!mesh.hit(Ray(center, v - center), 0, INF, rec))
+                vertex_leaks++;
+        }
+        std::cout << "  " << (simd ? "simd  " : "scalar") << " leaks: " << random_leaks << " of " << count
+                  << " random rays, " << vertex_leaks << " of " << count << " rays through vertices" << '\n';
+    }
+}
+
+// The best of three renders of the mesh on a ground sphere
+static void render(ThreadPool& pool, TriangleMesh& mesh) {
+    Scene scene;
+    auto ground = scene.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+    mesh.material = scene.make_material<Lambertian>(Color(0.7, 0.3, 0.2));
+
+    // Look at the mesh from the front, standing on the ground
+    AABB box;
+    mesh.bounding_box(box);
+    auto size = (box.maximum - box.minimum).length();
+    auto center = box.centroid();
+    Sphere floor(Point3(center[0], box.minimum[1] - 1000 * size, center[2]), 1000 * size, ground);
+    HittableList world;
+    world.add(shared_ptr<Hittable>(shared_ptr<Hittable>(), &floor));
+    world.add(shared_ptr<Hittable>(shared_ptr<Hittable>(), &mesh));
+
+    const int width = 240, height = 135, samples = 4;
+    Camera camera(center + Vec3(0.3, 0.4, 1.5) * size, center, Vec3(0, 1, 0), 30,
+                  static_cast<double>(width) / height, 0, size);
+    PathSettings settings;
+
+    for (bool simd : { true, false }) {
+        mesh.use_simd = simd;
+        RenderResult best;
+        best.seconds = INF;
+        for (int k = 0; k < 3; k++) {
+            auto pass = render_tiles(pool, width, height, 16, [&](int i, int j) {
+                Color pixel_color(0, 0, 0);
+                for (int s = 0; s < samples; s++) {
+                    thread_sampler().start_pixel_sample(0, i, j, s);
+                    auto u = (i + random_double()) / (width - 1);
+                    auto v = (j + random_double()) / (height - 1);
+                    pixel_color += trace_path(camera.get_ray(u, v), world, settings);
+                }
+                return pixel_color;
+            }, false);
+            if (pass.seconds < best.seconds)
+                best = std::move(pass);
+        }
+        std::cout << "  " << (simd ? "simd  " : "scalar") << " render: " << std::setprecision(2)
+                  << best.rays / best.seconds / 1e6 << " Mrays/s" << '\n';
+    }
+}
+
+static void run(ThreadPool& pool, TriangleMesh& mesh, bool closed) {
+    auto start = Clock::now();
+    mesh.commit();
+    std::cout << std::setprecision(1) << "  BVH built in " << seconds_since(start) * 1000 << "ms, "
+              << mesh.memory_bytes() / 1e6 << " MB in all (" << std::setprecision(1)
+              << static_cast<double>(mesh.memory_bytes()) / mesh.size() << " bytes per triangle)" << '\n';
+    if (closed)
+        count_leaks(mesh);
+    render(pool, mesh);
+}
+
+int main(int argc, char** argv) {
+    ThreadPool pool(argc > 2 ? std::atoi(argv[2]) : 0);
+
+    if (argc > 1) {
+        TriangleMesh mesh;
+        if (!load(argv[1], mesh))
+            return EXIT_FAILURE;
+        run(pool, mesh, false);
+        return 0;
+    }
+
+    thread_sampler().seed(0);
+    auto ball = lumpy_ball(500, 1000);
+    write_obj("bench_mesh.obj", ball);
+    write_ply("bench_mesh.ply", ball);
+
+    for (const char* path : { "bench_mesh.obj", "bench_mesh.ply" }) {
+        TriangleMesh mesh;
+        if (!load(path, mesh))
+            return EXIT_FAILURE;
+        run(pool, mesh, true);
+    }
+}
@@ -0,0 +1,116 @@
+/**
+ * Renders the small_light scene (one small bright lamp, no sky) with and
+ * without sampling the lights, and compares both to a reference rendered
+ * with many samples:
+ *   nee    every diffuse bounce sends a shadow ray to a light, weighed
+ *          against the bounces that hit a light with MIS (see integrator.h)
+ *   bsdf   the lights are only found by bouncing into them
+ * For a few sample counts it prints the RMSE against the reference and the
+ * time of both. The RMSE goes down with the square root of the samples, so
+ * (rmse bsdf / rmse nee)^2 is how many times the samples the bsdf render
+ * would need for the same noise.
+ *
+ * Both have to converge to the same image, the mean of the last renders is
+ * printed next to the mean of the reference to check there is no bias.
+ *
+ * Usage: bench_nee [reference samples] [threads]
+ **/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "utility.h"
+#include "camera.h"
+#include "lights.h"
+#include "scene.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "integrator.h"
+
+struct Render {
+    std::vector<Color> pixels;
+    double seconds = 0;
+};
+
+const int WIDTH = 160, HEIGHT = 90;
+
+// The average of samples samples per pixel of world
+static Render render(ThreadPool& pool, const Scene& scene, const Hittable& world,
+                     const PathSettings& settings, int samples, uint64_t seed = 0) {
+    const auto& view = scene.settings;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov,
+                  static_cast<double>(WIDTH) / HEIGHT, view.aperture, view.focus_dist);
+    SamplerSettings sampler_settings;
+    sampler_settings.samples_per_pixel = samples;
+    sampler_settings.seed = seed;
+
+    auto pass = render_tiles(pool, WIDTH, HEIGHT, 16, [&](int i, int j) {
+        Color pixel_color(0, 0, 0);
+        for (int s = 0; s < samples; s++) {
+            thread_sampler().start_pixel_sample(sampler_settings, i, j, s);
+            auto u = (i + random_double()) / (WIDTH - 1);
+            auto v = (j + random_double()) / (HEIGHT - 1);
+            pixel_color += trace_path(camera.get_ray(u, v), world, settings);
+        }
+        return pixel_color / samples;
+    }, false);
+    return { std::move(pass.pixels), pass.seconds };
+}
+
+static double rmse(const std::vector<Color>& image, const std::vector<Color>& reference) {
+    double sum = 0;
+    for (std::size_t p = 0; p < image.size(); p++)
+        for (int c = 0; c < 3; c++)
+            sum += (image[p][c] - reference[p][c]) * (image[p][c] - reference[p][c]);
+    return std::sqrt(sum / (3 * image.size()));
+}
+
+static double mean(const std::vector<Color>& image) {
+    double sum = 0;
+    for (const auto& pixel : image)
+        sum += pixel[0] + pixel[1] + pixel[2];
+    return sum / (3 * image.size());
+}
+
+int main(int argc, char** argv) {
+    int reference_samples = argc > 1 ? std::max(1, std::atoi(argv[1])) : 1024;
+    ThreadPool pool(argc > 2 ? std::atoi(argv[2]) : 0);
+
+    auto scene = small_light();
+    auto world = scene.bvh();
+    auto lights = scene.lights();
+
+    PathSettings nee;
+    nee.sky = scene.settings.sky;
+    nee.lights = &lights;
+    PathSettings bsdf = nee;
+    bsdf.lights = nullptr;
+
+    std::cerr << "Rendering the reference with " << reference_samples << " samples per pixel" << '\n';
+    // Another seed, so the reference doesn't share its first samples with the renders
+    auto reference = render(pool, scene, *world, nee, reference_samples, 1);
+
+    std::cout << lights.size() << " lights, " << WIDTH << "x" << HEIGHT << ", reference mean "
+              << std::setprecision(4) << mean(reference.pixels) << '\n'
+              << "  spp      rmse nee   rmse bsdf      ms nee    ms bsdf   bsdf spp for the same noise" << '\n';
+
+    Render last_nee, last_bsdf;
+    for (int samples : { 1, 4, 16, 64 }) {
+        last_nee = render(pool, scene, *world, nee, samples);
+        last_bsdf = render(pool, scene, *world, bsdf, samples);
+        auto error_nee = rmse(last_nee.pixels, reference.pixels);
+        auto error_bsdf = rmse(last_bsdf.pixels, reference.pixels);
+        auto ratio = error_bsdf * error_bsdf / (error_nee * error_nee);
+        std::cout << std::fixed << std::setw(5) << samples
+                  << std::setprecision(4) << std::setw(12) << error_nee << std::setw(12) << error_bsdf
+                  << std::setprecision(1) << std::setw(12) << last_nee.seconds * 1000
+                  << std::setw(11) << last_bsdf.seconds * 1000
+                  << std::setw(12) << ratio * samples << " (" << ratio << "x)" << '\n';
+    }
+    std::cout << std::setprecision(4) << "mean at 64 spp: nee " << mean(last_nee.pixels)
+              << ", bsdf " << mean(last_bsdf.pixels) << ", reference " << mean(reference.pixels) << '\n';
+}
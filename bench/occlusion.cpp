@@ -0,0 +1,137 @@
+/**
+ * Times shadow rays three ways:
+ *   hit        world.hit with the shadow ray's length, the closest hit and
+ *              its full hit record, which is all a shadow ray could do before
+ *   occluded   world.occluded, stops at the first hit and fills in nothing
+ *   batched    occluded_rays, the rays in packets of MAX_PACKET_SIZE
+ * on a few scenes: a field of spheres as a BVH of Sphere objects and as
+ * packed spheres, and a forest of instances.
+ *
+ * The shadow rays start where the camera rays of a 320x180 image hit the
+ * scene and go to random points of a disk high above it, like the rays of a
+ * big lamp. They run on one thread, in pixel order, so the rays of a packet
+ * start close together. All three have to agree on every ray, the number of
+ * rays where they don't is printed and should be 0.
+ *
+ * Usage: bench_occlusion [spheres] [trees]
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "camera.h"
+#include "hittable.h"
+#include "scene.h"
+#include "scenes.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+struct ShadowRays {
+    std::vector<Ray> rays;
+    std::vector<real> t_max;
+};
+
+// A shadow ray from every camera ray hit toward the disk of radius light_radius around light
+static ShadowRays shadow_rays(const Scene& scene, const Hittable& world, const Point3& light, real light_radius) {
+    const int width = 320, height = 180;
+    const auto& view = scene.settings;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov,
+                  static_cast<double>(width) / height, 0, view.focus_dist);
+
+    ShadowRays shadows;
+    hit_record rec;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto r = camera.get_ray((i + 0.5) / (width - 1), (j + 0.5) / (height - 1));
+            if (!world.hit(r, 0, INF, rec))
+                continue;
+            // The disk lies flat, random_in_unit_disk is in the z = 0 plane
+            auto d = random_in_unit_disk();
+            auto target = light + light_radius * Vec3(d[0], 0, d[1]);
+            // The ray reaches the disk at t = 1
+            shadows.rays.push_back(spawn_ray(rec, target - rec.p));
+            shadows.t_max.push_back(1);
+        }
+    }
+    return shadows;
+}
+
+// Best of three runs of test over all the rays, in Mrays/s
+template <typename TestFn>
+static double time_rays(const ShadowRays& shadows, bool* blocked, TestFn test) {
+    double best = INF;
+    for (int run = 0; run < 3; run++) {
+        auto start = Clock::now();
+        test(blocked);
+        best = std::min(best, seconds_since(start));
+    }
+    return shadows.rays.size() / best / 1e6;
+}
+
+static void run(const std::string& name, const Scene& scene, const Hittable& world,
+                const Point3& light, real light_radius) {
+    auto shadows = shadow_rays(scene, world, light, light_radius);
+    auto count = shadows.rays.size();
+    std::unique_ptr<bool[]> by_hit(new bool[count]), by_occluded(new bool[count]), by_batch(new bool[count]);
+
+    auto hit_rate = time_rays(shadows, by_hit.get(), [&](bool* blocked) {
+        hit_record rec;
+        for (std::size_t k = 0; k < count; k++)
+            blocked[k] = world.hit(shadows.rays[k], 0, shadows.t_max[k], rec);
+    });
+    auto occluded_rate = time_rays(shadows, by_occluded.get(), [&](bool* blocked) {
+        for (std::size_t k = 0; k < count; k++)
+            blocked[k] = world.occluded(shadows.rays[k], 0, shadows.t_max[k]);
+    });
+    auto batch_rate = time_rays(shadows, by_batch.get(), [&](bool* blocked) {
+        occluded_rays(world, count, shadows.rays.data(), 0, shadows.t_max.data(), blocked);
+    });
+
+    std::size_t blocked = 0, disagree = 0;
+    for (std::size_t k = 0; k < count; k++) {
+        blocked += by_hit[k];
+        disagree += by_hit[k] != by_occluded[k] || by_hit[k] != by_batch[k];
+    }
+
+    std::cout << std::left << std::setw(22) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << count << " rays, " << std::setw(5) << 100.0 * blocked / count << "% blocked"
+              << std::setw(8) << hit_rate << " hit"
+              << std::setw(8) << occluded_rate << " occluded (" << occluded_rate / hit_rate << "x)"
+              << std::setw(8) << batch_rate << " batched (" << batch_rate / hit_rate << "x)"
+              << "  Mrays/s, " << disagree << " disagree" << '\n';
+}
+
+int main(int argc, char** argv) {
+    int spheres = argc > 1 ? std::max(2, std::atoi(argv[1])) : 100000;
+    int trees = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1000;
+
+    thread_sampler().seed(0);
+    auto field = sphere_field(spheres);
+    auto field_scale = field.settings.lookfrom.length() / Point3(13, 2, 3).length();
+    Point3 field_light(0, 10 * field_scale, 0);
+    {
+        auto world = field.bvh();
+        run("field, bvh", field, *world, field_light, 3 * field_scale);
+    }
+    field.spheres.commit(true);
+    field.spheres.use_tree = true;
+    run("field, packed-bvh", field, field.spheres, field_light, 3 * field_scale);
+    field.spheres.use_simd = false;
+    run("field, packed scalar", field, field.spheres, field_light, 3 * field_scale);
+
+    auto forest = sphere_forest(trees);
+    InstanceBvh instances(forest.instances);
+    run("forest, instances", forest, instances, forest.settings.lookat + Vec3(0, 20, 0), 5);
+}
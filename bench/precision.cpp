@@ -0,0 +1,106 @@
+/**
+ * Renders the book's scene with the real type this was built with (see
+ * real.h) and reports the rays per second, to compare float and double.
+ *
+ * The cmake build makes two copies, bench_precision_double and
+ * bench_precision_float. Run the double one first and let it write its image,
+ * then give that image to the float one as the reference: it reports how far
+ * its own image is from it. The bench_precision target does both.
+ *
+ * The error is measured after the gamma 2 correction used for 8 bit images,
+ * an RMSE of 1/255 is about one step of an 8 bit pixel. The bias (the mean
+ * of the differences) shows whether the float image is darker or brighter,
+ * which is what self intersections would do.
+ *
+ * Usage: bench_precision_<type> [--spp n] [--threads n] [--out file.pfm] [--reference file.pfm]
+ **/
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "utility.h"
+#include "camera.h"
+#include "bvh.h"
+#include "scene.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "integrator.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+
+int main(int argc, char** argv) {
+    int samples = 16;
+    int threads = 0;
+    std::string out_path;
+    std::string reference_path;
+
+    for (int k = 1; k + 1 < argc; k += 2) {
+        std::string arg = argv[k];
+        if (arg == "--spp") samples = std::atoi(argv[k + 1]);
+        else if (arg == "--threads") threads = std::atoi(argv[k + 1]);
+        else if (arg == "--out") out_path = argv[k + 1];
+        else if (arg == "--reference") reference_path = argv[k + 1];
+    }
+
+    // Same image and camera as main
+    const auto aspect_ratio = 16.0 / 9.0;
+    const int width = 400;
+    const int height = static_cast<int>(width / aspect_ratio);
+    Camera camera(Point3(13, 2, 3), Point3(0, 0, 0), Vec3(0, 1, 0), 20, aspect_ratio, 0.1, 10.0);
+
+    thread_sampler().seed(0);
+    auto scene = random_scene();
+    BVH world(scene.hittables());
+
+    PathSettings settings;
+    ThreadPool pool(threads);
+
+    auto result = render_tiles(pool, width, height, 16, [&](int i, int j) {
+        Color pixel_color(0, 0, 0);
+        for (int s = 0; s < samples; s++) {
+            thread_sampler().start_pixel_sample(0, i, j, s);
+            auto u = (i + random_double()) / (width - 1);
+            auto v = (j + random_double()) / (height - 1);
+            pixel_color += trace_path(camera.get_ray(u, v), world, settings);
+        }
+        return pixel_color;
+    });
+    std::cerr << '\n';
+
+    Framebuffer image(width, height, result.pixels, samples);
+
+    std::cout << RT_REAL_NAME << ": " << result.rays << " rays in " << result.seconds << "s, "
+              << result.rays_per_second() / 1e6 << " Mrays/s on " << pool.size() << " threads ("
+              << RT_SIMD_NAME << ", " << SimdReal::WIDTH << " lanes)" << '\n';
+
+    if (!out_path.empty() && !write_image(out_path, image, ImageFormat::PFM)) {
+        std::cerr << "Could not write " << out_path << '\n';
+        return EXIT_FAILURE;
+    }
+
+    if (!reference_path.empty()) {
+        Framebuffer reference;
+        if (!read_pfm(reference_path, reference)
+            || reference.width != width || reference.height != height) {
+            std::cerr << "Could not read a " << width << "x" << height << " image from "
+                      << reference_path << '\n';
+            return EXIT_FAILURE;
+        }
+
+        double sum = 0, sum_sq = 0, worst = 0;
+        for (std::size_t p = 0; p < image.pixels.size(); p++) {
+            for (int c = 0; c < 3; c++) {
+                double a = std::sqrt(std::max<double>(image.pixels[p][c], 0));
+                double b = std::sqrt(std::max<double>(reference.pixels[p][c], 0));
+                sum += a - b;
+                sum_sq += (a - b) * (a - b);
+                worst = std::max(worst, std::fabs(a - b));
+            }
+        }
+        auto n = static_cast<double>(image.pixels.size() * 3);
+        std::cout << "error against " << reference_path << ": rmse " << std::sqrt(sum_sq / n)
+                  << ", bias " << sum / n << ", max " << worst << '\n';
+    }
+}
@@ -0,0 +1,156 @@
+/**
+ * Compares the rejection sampling loops the renderer used to have against the
+ * direct mappings in sampling.h, then times the sample patterns of sampler.h.
+ *
+ * Every routine draws its random numbers from the same Pcg32 and the results
+ * are summed up, so the compiler can't throw the work away. Besides the time
+ * per sample it reports how many random numbers a sample used up on average.
+ *
+ * Usage: bench_sampling [samples]
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "utility.h"
+#include "sampling.h"
+
+// Hands out random numbers and counts them
+struct CountingRng {
+    Pcg32 rng{42, 7};
+    uint64_t draws = 0;
+
+    real next() {
+        draws++;
+        return static_cast<real>(rng.next_double());
+    }
+};
+
+// The old routines from vec3.h, with the random numbers passed in
+
+Vec3 rejection_unit_sphere(CountingRng& rng) {
+    while (true) {
+        auto x = 2 * rng.next() - 1;
+        auto y = 2 * rng.next() - 1;
+        auto p = Vec3(x, y, 2 * rng.next() - 1);
+        if (p.lengthSquared() >= 1) continue;
+        return p;
+    }
+}
+
+Vec3 rejection_unit_vector(CountingRng& rng) {
+    return unit_vector(rejection_unit_sphere(rng));
+}
+
+Vec3 rejection_unit_disk(CountingRng& rng) {
+    while (true) {
+        auto x = 2 * rng.next() - 1;
+        auto p = Vec3(x, 2 * rng.next() - 1, 0);
+        if (p.lengthSquared() >= 1) continue;
+        return p;
+    }
+}
+
+// Runs sample(rng) count times, prints ns per sample and random numbers per sample
+template <typename SampleFn>
+void run(const std::string& name, long count, SampleFn sample) {
+    double best = INF;
+    double draws_per_sample = 0;
+    Vec3 sum;
+
+    // Best of a few runs
+    for (int k = 0; k < 5; k++) {
+        CountingRng rng;
+        auto start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++)
+            sum += sample(rng);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        best = std::min(best, elapsed.count());
+        draws_per_sample = static_cast<double>(rng.draws) / count;
+    }
+
+    std::cout << std::left << std::setw(28) << name << std::right
+              << std::setw(8) << std::fixed << std::setprecision(2) << best / count * 1e9 << " ns"
+              << std::setw(8) << draws_per_sample << " randoms"
+              << "   (checksum " << std::setprecision(3) << sum[0] + sum[1] + sum[2] << ")" << '\n';
+}
+
+/**
+ * Times the numbers of a typical path sample drawn from a Sampler: the pixel,
+ * the lens and three bounces that draw three numbers each. Prints the time
+ * per number.
+ **/
+void run_sampler(const std::string& name, long count) {
+    SamplerSettings settings;
+    parse_sample_pattern(name, settings.pattern);
+    settings.samples_per_pixel = 64;
+    const int numbers = Sampler::CAMERA_DIMENSIONS + 3 * 3;
+
+    Sampler sampler;
+    double best = INF;
+    double sum = 0;
+    for (int k = 0; k < 5; k++) {
+        auto start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count / numbers; n++) {
+            auto pixel = static_cast<int>(n / 64);
+            sampler.start_pixel_sample(settings, pixel % 400, pixel / 400, static_cast<int>(n % 64));
+            for (int d = 0; d < Sampler::CAMERA_DIMENSIONS; d++)
+                sum += sampler.next_double();
+            for (int depth = 1; depth <= 3; depth++) {
+                sampler.start_bounce(depth);
+                for (int d = 0; d < 3; d++)
+                    sum += sampler.next_double();
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    std::cout << std::left << std::setw(28) << "  " + name << std::right
+              << std::setw(8) << std::fixed << std::setprecision(2)
+              << best / (count / numbers * numbers) * 1e9 << " ns"
+              << "   (mean " << std::setprecision(4) << sum / (5 * (count / numbers * numbers)) << ")" << '\n';
+}
+
+int main(int argc, char** argv) {
+    long count = argc > 1 ? std::atol(argv[1]) : 10000000;
+    Vec3 normal(0, 1, 0);
+
+    std::cout << "unit sphere (" << RT_REAL_NAME << ")" << '\n';
+    run("  rejection", count, [](CountingRng& rng) { return rejection_unit_sphere(rng); });
+    run("  sample_uniform_ball", count, [](CountingRng& rng) {
+        auto u1 = rng.next();
+        auto u2 = rng.next();
+        return sample_uniform_ball(u1, u2, rng.next());
+    });
+
+    std::cout << "unit vector" << '\n';
+    run("  rejection + normalize", count, [](CountingRng& rng) { return rejection_unit_vector(rng); });
+    run("  sample_uniform_sphere", count, [](CountingRng& rng) {
+        auto u1 = rng.next();
+        return sample_uniform_sphere(u1, rng.next());
+    });
+
+    std::cout << "lambertian direction" << '\n';
+    run("  normal + rejection", count, [&](CountingRng& rng) { return normal + rejection_unit_vector(rng); });
+    run("  sample_cosine_hemisphere", count, [&](CountingRng& rng) {
+        auto u1 = rng.next();
+        return sample_cosine_hemisphere(normal, u1, rng.next());
+    });
+
+    std::cout << "unit disk" << '\n';
+    run("  rejection", count, [](CountingRng& rng) { return rejection_unit_disk(rng); });
+    run("  sample_concentric_disk", count, [](CountingRng& rng) {
+        auto u1 = rng.next();
+        return sample_concentric_disk(u1, rng.next());
+    });
+
+    std::cout << "sampler, per number" << '\n';
+    for (auto name : { "independent", "stratified", "sobol", "bluenoise" })
+        run_sampler(name, count);
+}
@@ -0,0 +1,456 @@
+/**
+ * The benchmark suite, run by the bench target. It has two kinds of
+ * benchmarks:
+ *   micro  the hot functions on their own, one thread, in ns per call:
+ *          Sphere::hit, HittableList::hit, every Material::scatter,
+ *          Camera::get_ray and the random numbers
+ *   macro  whole renders of sphere_field scenes of 10, 500, 50k and 1M
+ *          spheres on all the threads, in rays per second
+ * Everything is built from fixed seeds, so every run measures the same work.
+ *
+ * A micro benchmark first finds how many calls take about --min-time seconds,
+ * then keeps the best of five runs of that many, which filters out most of
+ * the noise of other processes. The renders are the best of three, and don't
+ * print any progress.
+ *
+ * The results are written as JSON, one benchmark per line, with the speed of
+ * each one as ops_per_second (calls or rays, higher is better). Given the
+ * JSON of an earlier run with --baseline, every benchmark is compared to the
+ * same one there and the run fails if any got slower by more than
+ * --threshold (a fraction, 0.1 is 10%).
+ *
+ * Usage: bench_suite [--out file.json] [--baseline file.json] [--threshold 0.1]
+ *                    [--filter text] [--sizes 10,500,...] [--threads n]
+ *                    [--width n] [--height n] [--spp n] [--accel bvh|packed-bvh]
+ *                    [--min-time seconds] [--label text]
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "camera.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "scene.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "renderer.h"
+#include "integrator.h"
+#include "run_summary.h"
+
+struct BenchOptions {
+    std::string out;
+    std::string baseline;
+    double threshold = 0.1;
+    std::string filter;
+    std::vector<int> sizes = { 10, 500, 50000, 1000000 };
+    int threads = 0;
+    int width = 240;
+    int height = 135;
+    int samples = 4;
+    std::string accel = "bvh";
+    double min_time = 0.1;
+    std::string label;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops = 0;
+    double seconds = 0;
+    // More fields for the JSON, already formatted as ", \"key\": value"
+    std::string extra;
+
+    double ops_per_second() const { return seconds > 0 ? ops / seconds : 0; }
+};
+
+// Every benchmark adds its results here, so the compiler can't drop the work
+static double checksum = 0;
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+/**
+ * Times body(n), which makes n calls of the function measured and returns
+ * something computed from them. Prints the result as it goes.
+ **/
+template <typename Body>
+BenchResult run_micro(const BenchOptions& options, const std::string& name, Body body) {
+    // Grow the number of calls until a run takes long enough to time
+    long n = 1000;
+    double seconds = 0;
+    while (true) {
+        auto start = Clock::now();
+        checksum += body(n);
+        seconds = seconds_since(start);
+        if (seconds >= options.min_time / 4 || n > (1L << 40))
+            break;
+        n *= 4;
+    }
+    n = std::max(1000L, static_cast<long>(n * options.min_time / std::max(seconds, 1e-9)));
+
+    double best = INF;
+    for (int k = 0; k < 5; k++) {
+        auto start = Clock::now();
+        checksum += body(n);
+        best = std::min(best, seconds_since(start));
+    }
+
+    BenchResult result;
+    result.name = name;
+    result.ops = static_cast<uint64_t>(n);
+    result.seconds = best;
+    std::ostringstream extra;
+    extra << ", \"ns_per_op\": " << best / n * 1e9;
+    result.extra = extra.str();
+
+    std::cerr << std::left << std::setw(32) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << best / n * 1e9 << " ns" << '\n';
+    return result;
+}
+
+// A few thousand rays from the default camera into a scene, and its camera
+static std::vector<Ray> camera_rays(const SceneSettings& view, std::size_t count) {
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov, view.aspect_ratio(),
+                  view.aperture, view.focus_dist);
+    std::vector<Ray> rays;
+    for (std::size_t k = 0; k < count; k++)
+        rays.push_back(camera.get_ray(random_double(), random_double()));
+    return rays;
+}
+
+static void micro_benchmarks(const BenchOptions& options, std::vector<BenchResult>& results) {
+    const std::size_t COUNT = 4096;
+    const std::size_t MASK = COUNT - 1;
+    thread_sampler().seed(1);
+
+    auto add = [&](const std::string& name, auto body) {
+        if (name.find(options.filter) != std::string::npos)
+            results.push_back(run_micro(options, name, body));
+    };
+
+    // A sphere in front of the origin, about half of the rays hit it
+    Lambertian gray(Color(0.5, 0.5, 0.5));
+    Material gray_material(gray);
+    Sphere sphere(Point3(0, 0, -2), 0.5, &gray_material);
+    std::vector<Ray> sphere_rays;
+    for (std::size_t k = 0; k < COUNT; k++) {
+        auto d = Vec3(random_double(-0.4, 0.4), random_double(-0.4, 0.4), -1);
+        sphere_rays.push_back(Ray(Point3(0, 0, 0), d));
+    }
+
+    add("micro/sphere_hit", [&](long n) {
+        hit_record rec;
+        double sum = 0;
+        for (long k = 0; k < n; k++)
+            if (sphere.hit(sphere_rays[k & MASK], 0, INF, rec))
+                sum += rec.t;
+        return sum;
+    });
+
+    // The flat list of a 10 sphere field, every ray is tested against all of them
+    thread_sampler().seed(2);
+    auto field = sphere_field(10);
+    HittableList list(field.hittables());
+    auto list_rays = camera_rays(field.settings, COUNT);
+
+    add("micro/hittable_list_hit", [&](long n) {
+        hit_record rec;
+        double sum = 0;
+        for (long k = 0; k < n; k++)
+            if (list.hit(list_rays[k & MASK], 0, INF, rec))
+                sum += rec.t;
+        return sum;
+    });
+
+    // Hits on the list to scatter off, with every material
+    std::vector<Ray> hit_rays;
+    std::vector<hit_record> hits;
+    for (const auto& r : list_rays) {
+        hit_record rec;
+        if (list.hit(r, 0, INF, rec))
+            hit_rays.push_back(r), hits.push_back(rec);
+    }
+    const std::size_t hit_count = hits.size();
+
+    std::vector<std::pair<std::string, Material>> materials = {
+        { "lambertian", Material(Lambertian(Color(0.5, 0.5, 0.5))) },
+        { "metal", Material(Metal(Color(0.7, 0.6, 0.5), 0.2)) },
+        { "dielectric", Material(Dielectric(1.5)) },
+    };
+    for (const auto& [model, material] : materials) {
+        add("micro/scatter_" + model, [&](long n) {
+            Color attenuation;
+            Ray scattered;
+            double sum = 0;
+            for (long k = 0; k < n; k++) {
+                auto h = static_cast<std::size_t>(k) % hit_count;
+                if (material.scatter(hit_rays[h], hits[h], attenuation, scattered))
+                    sum += scattered.direction()[1];
+            }
+            return sum;
+        });
+    }
+
+    // With the lens of the book's camera, so get_ray samples the disk too
+    SceneSettings view;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov, view.aspect_ratio(),
+                  view.aperture, view.focus_dist);
+    std::vector<double> uv(2 * COUNT);
+    for (auto& x : uv)
+        x = random_double();
+
+    add("micro/camera_get_ray", [&](long n) {
+        double sum = 0;
+        for (long k = 0; k < n; k++) {
+            auto i = 2 * (k & MASK);
+            sum += camera.get_ray(uv[i], uv[i + 1]).direction()[0];
+        }
+        return sum;
+    });
+
+    add("micro/rng_pcg32", [&](long n) {
+        Pcg32 rng(42, 7);
+        double sum = 0;
+        for (long k = 0; k < n; k++)
+            sum += rng.next_double();
+        return sum;
+    });
+
+    // Numbers of the pixel samples as the renderer draws them, a new pixel
+    // sample every 16 numbers
+    for (auto pattern : { "independent", "sobol" }) {
+        add(std::string("micro/rng_sampler_") + pattern, [&](long n) {
+            SamplerSettings settings;
+            parse_sample_pattern(pattern, settings.pattern);
+            Sampler sampler;
+            double sum = 0;
+            for (long k = 0; k < n; k++) {
+                if (k % 16 == 0) {
+                    auto pixel = static_cast<int>(k / 16);
+                    sampler.start_pixel_sample(settings, pixel % 400, pixel / 400 % 225, 0);
+                }
+                sum += sampler.next_double();
+            }
+            return sum;
+        });
+    }
+}
+
+/**
+ * Renders sphere_field(count) and reports the rays per second, along with how
+ * long the scene and its acceleration structure took to build.
+ **/
+static BenchResult run_macro(const BenchOptions& options, ThreadPool& pool, int count) {
+    thread_sampler().seed(0);
+    auto start = Clock::now();
+    auto scene = sphere_field(count);
+    double load_seconds = seconds_since(start);
+
+    start = Clock::now();
+    shared_ptr<Hittable> world;
+    if (options.accel == "packed-bvh") {
+        scene.spheres.commit(true);
+        world = shared_ptr<Hittable>(shared_ptr<Hittable>(), &scene.spheres);
+    } else {
+        world = make_shared<BVH>(scene.hittables());
+    }
+    double build_seconds = seconds_since(start);
+
+    const auto& view = scene.settings;
+    const double aspect_ratio = static_cast<double>(options.width) / options.height;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov, aspect_ratio,
+                  view.aperture, view.focus_dist);
+    PathSettings settings;
+
+    RenderResult render;
+    render.seconds = INF;
+    for (int k = 0; k < 3; k++) {
+        auto pass = render_tiles(pool, options.width, options.height, 16, [&](int i, int j) {
+            Color pixel_color(0, 0, 0);
+            for (int s = 0; s < options.samples; s++) {
+                thread_sampler().start_pixel_sample(0, i, j, s);
+                auto u = (i + random_double()) / (options.width - 1);
+                auto v = (j + random_double()) / (options.height - 1);
+                pixel_color += trace_path(camera.get_ray(u, v), *world, settings);
+            }
+            return pixel_color;
+        }, false);
+        // Every pass traces the same rays
+        if (pass.seconds < render.seconds)
+            render = std::move(pass);
+    }
+    for (const auto& c : render.pixels)
+        checksum += c[0];
+
+    BenchResult result;
+    result.name = "macro/spheres_" + std::to_string(count);
+    result.ops = render.rays;
+    result.seconds = render.seconds;
+    std::ostringstream extra;
+    extra << ", \"spheres\": " << count
+          << ", \"load_seconds\": " << load_seconds
+          << ", \"build_seconds\": " << build_seconds
+          << ", \"peak_memory_bytes\": " << peak_memory_bytes();
+    result.extra = extra.str();
+
+    std::cerr << std::left << std::setw(32) << result.name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << result.ops_per_second() / 1e6
+              << " Mrays/s (load " << load_seconds * 1000 << "ms, build " << build_seconds * 1000
+              << "ms)" << '\n';
+    return result;
+}
+
+/**
+ * Reads the ops_per_second of every benchmark out of the JSON of an earlier
+ * run. It only understands the files this program writes, one benchmark per
+ * line.
+ **/
+static bool read_baseline(const std::string& path, std::map<std::string, double>& baseline) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    auto field = [](const std::string& line, const std::string& key) {
+        auto at = line.find("\"" + key + "\": ");
+        return at == std::string::npos ? std::string::npos : at + key.size() + 4;
+    };
+
+    std::string line;
+    while (std::getline(file, line)) {
+        auto name_at = field(line, "name");
+        auto ops_at = field(line, "ops_per_second");
+        if (name_at == std::string::npos || ops_at == std::string::npos || line[name_at] != '"')
+            continue;
+        auto name_end = line.find('"', name_at + 1);
+        baseline[line.substr(name_at + 1, name_end - name_at - 1)] = std::atof(line.c_str() + ops_at);
+    }
+    return true;
+}
+
+static std::vector<int> parse_sizes(const std::string& text) {
+    std::vector<int> sizes;
+    std::stringstream stream(text);
+    std::string size;
+    while (std::getline(stream, size, ','))
+        if (!size.empty())
+            sizes.push_back(std::atoi(size.c_str()));
+    return sizes;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int k = 1; k < argc; k += 2) {
+        std::string arg = argv[k];
+        if (k + 1 == argc) {
+            std::cerr << "Missing value for " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[k + 1];
+        if (arg == "--out") options.out = value;
+        else if (arg == "--baseline") options.baseline = value;
+        else if (arg == "--threshold") options.threshold = std::atof(value.c_str());
+        else if (arg == "--filter") options.filter = value;
+        else if (arg == "--sizes") options.sizes = parse_sizes(value);
+        else if (arg == "--threads") options.threads = std::atoi(value.c_str());
+        else if (arg == "--width") options.width = std::max(2, std::atoi(value.c_str()));
+        else if (arg == "--height") options.height = std::max(2, std::atoi(value.c_str()));
+        else if (arg == "--spp") options.samples = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--accel") options.accel = value;
+        else if (arg == "--min-time") options.min_time = std::atof(value.c_str());
+        else if (arg == "--label") options.label = value;
+        else {
+            std::cerr << "Unknown option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!options.baseline.empty() && !read_baseline(options.baseline, baseline)) {
+        std::cerr << "Could not read " << options.baseline << '\n';
+        return EXIT_FAILURE;
+    }
+
+    std::vector<BenchResult> results;
+    micro_benchmarks(options, results);
+
+    ThreadPool pool(options.threads);
+    for (int count : options.sizes)
+        if (("macro/spheres_" + std::to_string(count)).find(options.filter) != std::string::npos)
+            results.push_back(run_macro(options, pool, count));
+
+    // Compare against the baseline
+    bool regressed = false;
+    std::vector<std::string> comparisons(results.size());
+    if (!baseline.empty())
+        std::cerr << '\n' << "against " << options.baseline << '\n';
+    for (std::size_t k = 0; k < results.size(); k++) {
+        auto found = baseline.find(results[k].name);
+        if (found == baseline.end() || found->second <= 0)
+            continue;
+        double change = results[k].ops_per_second() / found->second - 1;
+        bool slower = change < -options.threshold;
+        regressed |= slower;
+
+        std::ostringstream fields;
+        fields << ", \"baseline_ops_per_second\": " << found->second
+               << ", \"change\": " << change << ", \"regressed\": " << (slower ? "true" : "false");
+        comparisons[k] = fields.str();
+
+        std::cerr << std::left << std::setw(32) << results[k].name << std::right << std::showpos
+                  << std::setw(9) << std::setprecision(1) << change * 100 << "%" << std::noshowpos
+                  << (slower ? "  REGRESSION" : "") << '\n';
+    }
+
+    std::ostringstream json;
+    json << std::setprecision(6)
+         << "{\"label\": " << json_quote(options.label)
+         << ", \"precision\": \"" << RT_REAL_NAME << "\""
+         << ", \"simd\": \"" << RT_SIMD_NAME << "\""
+         << ", \"threads\": " << pool.size()
+         << ", \"accel\": " << json_quote(options.accel)
+         << ", \"image\": [" << options.width << ", " << options.height << ", " << options.samples << "]"
+         << ", \"checksum\": " << checksum
+         << ", \"regressed\": " << (regressed ? "true" : "false")
+         << ", \"benchmarks\": [\n";
+    for (std::size_t k = 0; k < results.size(); k++) {
+        const auto& r = results[k];
+        json << "  {\"name\": \"" << r.name << "\", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+             << ", \"ops_per_second\": " << r.ops_per_second() << r.extra << comparisons[k] << "}"
+             << (k + 1 < results.size() ? "," : "") << '\n';
+    }
+    json << "]}\n";
+
+    if (options.out.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream file(options.out);
+        file << json.str();
+        if (!file) {
+            std::cerr << "Could not write " << options.out << '\n';
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Wrote " << options.out << '\n';
+    }
+
+    if (regressed) {
+        std::cerr << "Slower than " << options.baseline << " by more than "
+                  << options.threshold * 100 << "%" << '\n';
+        return EXIT_FAILURE;
+    }
+}
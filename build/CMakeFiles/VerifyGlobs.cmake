@@ -0,0 +1,65 @@
+# CMAKE generated file: DO NOT EDIT!
+# Generated by CMake Version 3.25
+cmake_policy(SET CMP0009 NEW)
+
+# SOURCE_FILES at CMakeLists.txt:61 (file)
+file(GLOB_RECURSE NEW_GLOB LIST_DIRECTORIES false "/root/repo/src/*.h")
+set(OLD_GLOB
+  "/root/repo/src/aabb.h"
+  "/root/repo/src/adaptive.h"
+  "/root/repo/src/allocation_counter.h"
+  "/root/repo/src/animation.h"
+  "/root/repo/src/arena.h"
+  "/root/repo/src/bvh.h"
+  "/root/repo/src/camera.h"
+  "/root/repo/src/checkpoint.h"
+  "/root/repo/src/color.h"
+  "/root/repo/src/deflate.h"
+  "/root/repo/src/denoiser.h"
+  "/root/repo/src/framebuffer.h"
+  "/root/repo/src/heatmap.h"
+  "/root/repo/src/hittable.h"
+  "/root/repo/src/hittable_list.h"
+  "/root/repo/src/image_writer.h"
+  "/root/repo/src/instance.h"
+  "/root/repo/src/integrator.h"
+  "/root/repo/src/lights.h"
+  "/root/repo/src/mapped_file.h"
+  "/root/repo/src/material.h"
+  "/root/repo/src/mesh.h"
+  "/root/repo/src/mesh_file.h"
+  "/root/repo/src/options.h"
+  "/root/repo/src/packed_spheres.h"
+  "/root/repo/src/random.h"
+  "/root/repo/src/ray.h"
+  "/root/repo/src/ray_packet.h"
+  "/root/repo/src/real.h"
+  "/root/repo/src/renderer.h"
+  "/root/repo/src/run_summary.h"
+  "/root/repo/src/sampler.h"
+  "/root/repo/src/sampling.h"
+  "/root/repo/src/scene.h"
+  "/root/repo/src/scene_file.h"
+  "/root/repo/src/scenes.h"
+  "/root/repo/src/sequences.h"
+  "/root/repo/src/simd.h"
+  "/root/repo/src/sphere.h"
+  "/root/repo/src/stats.h"
+  "/root/repo/src/thread_pool.h"
+  "/root/repo/src/utility.h"
+  "/root/repo/src/vec3.h"
+  )
+if(NOT "${NEW_GLOB}" STREQUAL "${OLD_GLOB}")
+  message("-- GLOB mismatch!")
+  file(TOUCH_NOCREATE "/root/repo/build/CMakeFiles/cmake.verify_globs")
+endif()
+
+# SOURCE_FILES at CMakeLists.txt:61 (file)
+file(GLOB_RECURSE NEW_GLOB LIST_DIRECTORIES false "/root/repo/src/*cpp")
+set(OLD_GLOB
+  "/root/repo/src/main.cpp"
+  )
+if(NOT "${NEW_GLOB}" STREQUAL "${OLD_GLOB}")
+  message("-- GLOB mismatch!")
+  file(TOUCH_NOCREATE "/root/repo/build/CMakeFiles/cmake.verify_globs")
+endif()
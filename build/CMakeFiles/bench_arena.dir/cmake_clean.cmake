@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_arena.dir/bench/arena.cpp.o"
+  "CMakeFiles/bench_arena.dir/bench/arena.cpp.o.d"
+  "bench_arena"
+  "bench_arena.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_arena.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_denoise.dir/bench/denoise.cpp.o"
+  "CMakeFiles/bench_denoise.dir/bench/denoise.cpp.o.d"
+  "bench_denoise"
+  "bench_denoise.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_denoise.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_instancing.dir/bench/instancing.cpp.o"
+  "CMakeFiles/bench_instancing.dir/bench/instancing.cpp.o.d"
+  "bench_instancing"
+  "bench_instancing.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_instancing.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
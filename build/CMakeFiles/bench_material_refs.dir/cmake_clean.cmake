@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_material_refs.dir/bench/material_refs.cpp.o"
+  "CMakeFiles/bench_material_refs.dir/bench/material_refs.cpp.o.d"
+  "bench_material_refs"
+  "bench_material_refs.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_material_refs.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
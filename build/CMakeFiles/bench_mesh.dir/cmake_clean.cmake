@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_mesh.dir/bench/mesh.cpp.o"
+  "CMakeFiles/bench_mesh.dir/bench/mesh.cpp.o.d"
+  "bench_mesh"
+  "bench_mesh.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_mesh.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_nee.dir/bench/nee.cpp.o"
+  "CMakeFiles/bench_nee.dir/bench/nee.cpp.o.d"
+  "bench_nee"
+  "bench_nee.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_nee.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
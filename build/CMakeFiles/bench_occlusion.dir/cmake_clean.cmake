@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_occlusion.dir/bench/occlusion.cpp.o"
+  "CMakeFiles/bench_occlusion.dir/bench/occlusion.cpp.o.d"
+  "bench_occlusion"
+  "bench_occlusion.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_occlusion.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
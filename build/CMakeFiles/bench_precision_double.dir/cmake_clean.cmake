@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_precision_double.dir/bench/precision.cpp.o"
+  "CMakeFiles/bench_precision_double.dir/bench/precision.cpp.o.d"
+  "bench_precision_double"
+  "bench_precision_double.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_precision_double.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_sampling.dir/bench/sampling.cpp.o"
+  "CMakeFiles/bench_sampling.dir/bench/sampling.cpp.o.d"
+  "bench_sampling"
+  "bench_sampling.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_sampling.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_suite.dir/bench/suite.cpp.o"
+  "CMakeFiles/bench_suite.dir/bench/suite.cpp.o.d"
+  "bench_suite"
+  "bench_suite.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench_suite.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
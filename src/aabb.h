@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include "utility.h"
+
+/**
+ * The t where a ray leaves a box is rounded, and can come out a little too
+ * small. A ray that grazes the box (through a vertex of a mesh that lies on
+ * the side of the box, say) would then miss the box while it hits what is
+ * inside. Stretching the exit by a few roundings makes the test err on the
+ * side of a hit (Physically Based Rendering, 3rd edition, 3.9.2).
+ **/
+const real BOX_EXIT_SCALE = 1 + 6 * std::numeric_limits<real>::epsilon();
+
+/**
+ * Axis aligned bounding box
+ *
+ * A box whose sides are parallel to the x, y and z axis. It is described by
+ * just two corners, the smallest and the largest point inside the box. Testing
+ * a ray against a box is a lot cheaper than testing it against whatever is
+ * inside the box, so if a ray misses the box we can skip everything in it.
+ **/
+class AABB {
+public:
+    Point3 minimum;
+    Point3 maximum;
+public:
+    // An empty box, adding anything to it gives back the other box
+    AABB() : minimum(INF, INF, INF), maximum(-INF, -INF, -INF) {}
+    AABB(const Point3& a, const Point3& b) : minimum(a), maximum(b) {}
+
+    Point3 min() const { return minimum; }
+    Point3 max() const { return maximum; }
+
+    Point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+    // Grow the box so that it also contains the point p
+    void expand(const Point3& p) {
+        for (int a = 0; a < 3; a++) {
+            minimum[a] = fmin(minimum[a], p[a]);
+            maximum[a] = fmax(maximum[a], p[a]);
+        }
+    }
+
+    // Grow the box so that it also contains the box b
+    void expand(const AABB& b) {
+        expand(b.minimum);
+        expand(b.maximum);
+    }
+
+    // Returns the axis (0 = x, 1 = y, 2 = z) along which the box is the longest
+    int longest_axis() const {
+        auto d = maximum - minimum;
+        if (d[0] > d[1] && d[0] > d[2]) return 0;
+        return d[1] > d[2] ? 1 : 2;
+    }
+
+    // Area of the six faces, the chance of a random ray hitting a box
+    // is proportional to its surface area
+    real surface_area() const {
+        auto d = maximum - minimum;
+        if (d[0] < 0 || d[1] < 0 || d[2] < 0) return 0;
+        return 2.0 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+    }
+
+    /**
+     * The slab method. For every axis the box is the space between two planes,
+     * we find the t at which the ray enters and leaves that slab. The ray hits
+     * the box if the intervals of all three axes overlap.
+     *
+     * inv_dir is 1 / r.direction(), dividing is slow so the caller computes it
+     * once per ray instead of once per box.
+     **/
+    bool hit(const Ray& r, const Vec3& inv_dir, real t_min, real t_max) const {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (minimum[a] - r.orig[a]) * inv_dir[a];
+            auto t1 = (maximum[a] - r.orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0.0)
+                std::swap(t0, t1);
+            t1 *= BOX_EXIT_SCALE;
+
+            // Written so that a NaN (0 * inf) leaves the interval unchanged
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+
+    bool hit(const Ray& r, real t_min, real t_max) const {
+        auto d = r.direction();
+        return hit(r, Vec3(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]), t_min, t_max);
+    }
+};
+
+// Returns the smallest box containing both boxes
+inline AABB surrounding_box(const AABB& box0, const AABB& box1) {
+    AABB box = box0;
+    box.expand(box1);
+    return box;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "utility.h"
+
+/**
+ * Estimates how noisy every pixel still is, for adaptive sampling.
+ *
+ * The samples of a pixel are taken in batches (one render pass each). The mean
+ * of a batch is a random number itself, and the spread of the batch means tells
+ * us how far the average of all of them can still be from the true pixel
+ * color: the standard error is sqrt(variance of the batch means / batches).
+ * Working with batches means the renderer only has to hand us the sum of
+ * every pass, not every single sample.
+ *
+ * The error is measured on the luminance after the gamma 2 correction used
+ * for the 8 bit images. d(sqrt(L)) = dL / (2 sqrt(L)), so the same error in
+ * the linear radiance is much more visible in a dark pixel than a bright one.
+ * A noise of 0.01 is about 2.5 steps out of 255.
+ **/
+class NoiseEstimator {
+public:
+    int width = 0;
+    int height = 0;
+    // Sum and sum of squares of the luminance of the batch means
+    std::vector<double> sum;
+    std::vector<double> sum_sq;
+    std::vector<int> batches;
+public:
+    NoiseEstimator(int w, int h)
+        : width(w), height(h),
+          sum(static_cast<std::size_t>(w) * h), sum_sq(sum.size()), batches(sum.size()) {}
+
+    static double luminance(const Color& c) {
+        return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+    }
+
+    // batch_mean is the average of the samples pixel p got in the last pass
+    void add_batch(std::size_t p, const Color& batch_mean) {
+        auto l = luminance(batch_mean);
+        sum[p] += l;
+        sum_sq[p] += l * l;
+        batches[p]++;
+    }
+
+    // The standard error of the pixel as seen on screen
+    double noise(std::size_t p) const {
+        auto n = batches[p];
+        if (n < 2)
+            return INF;
+
+        auto mean = sum[p] / n;
+        auto variance = std::max(0.0, (sum_sq[p] - n * mean * mean) / (n - 1));
+        auto standard_error = sqrt(variance / n);
+        return standard_error / (2 * sqrt(mean) + 1e-3);
+    }
+
+    /**
+     * Marks the pixels with a noise above threshold as active, returns how
+     * many there are. Every pixel next to a noisy one stays active too: a
+     * pixel that only rarely sees a small bright light can look converged
+     * after a few batches that all missed it, its neighbours usually haven't.
+     **/
+    std::size_t update_active(double threshold, std::vector<char>& active) const {
+        std::vector<char> noisy(sum.size());
+        for (std::size_t p = 0; p < sum.size(); p++)
+            noisy[p] = active[p] && noise(p) > threshold;
+
+        std::size_t count = 0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                std::size_t p = static_cast<std::size_t>(y) * width + x;
+                char keep = 0;
+                for (int dy = -1; dy <= 1 && !keep; dy++) {
+                    for (int dx = -1; dx <= 1 && !keep; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && nx < width && ny >= 0 && ny < height)
+                            keep = noisy[static_cast<std::size_t>(ny) * width + nx];
+                    }
+                }
+                // A pixel that stopped never starts again, it would miss the
+                // batches taken in between
+                active[p] = active[p] && keep;
+                count += active[p];
+            }
+        }
+        return count;
+    }
+};
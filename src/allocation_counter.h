@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Counts the calls to the global operator new, to see how often a part of the
+ * program goes to the heap: take allocation_count() before and after and
+ * subtract.
+ *
+ * The count is kept by replacing operator new, which a program can only do
+ * once, so a header can't just do it for everyone. A program that wants the
+ * count writes RT_COUNT_ALLOCATIONS() at the top level of one of its source
+ * files (main.cpp does). In any other program the count stays 0.
+ *
+ * The counter is a single atomic that every thread bumps, which is fine for
+ * something that should hardly ever happen while rendering.
+ **/
+inline std::atomic<uint64_t>& allocation_counter() {
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+
+inline uint64_t allocation_count() {
+    return allocation_counter().load(std::memory_order_relaxed);
+}
+
+namespace allocation_counter_detail {
+
+inline void* allocate(std::size_t size) {
+    allocation_counter().fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+inline void* allocate_aligned(std::size_t size, std::size_t align) {
+    allocation_counter().fetch_add(1, std::memory_order_relaxed);
+    // aligned_alloc wants the size to be a multiple of the alignment
+    size = (std::max<std::size_t>(size, 1) + align - 1) / align * align;
+    if (void* p = std::aligned_alloc(align, size))
+        return p;
+    throw std::bad_alloc();
+}
+
+} // namespace allocation_counter_detail
+
+// The array and nothrow forms of new call these by default, so they get counted too
+#define RT_COUNT_ALLOCATIONS()                                                                  \
+    void* operator new(std::size_t size) { return allocation_counter_detail::allocate(size); } \
+    void* operator new(std::size_t size, std::align_val_t align) {                             \
+        return allocation_counter_detail::allocate_aligned(size, static_cast<std::size_t>(align)); \
+    }                                                                                           \
+    void operator delete(void* p) noexcept { std::free(p); }                                    \
+    void operator delete(void* p, std::size_t) noexcept { std::free(p); }                       \
+    void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }                  \
+    void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
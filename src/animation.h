@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+// Where the camera is and what it looks at, at some moment of an animation
+struct CameraView {
+    Point3 lookfrom;
+    Point3 lookat;
+    // Vertical field of view in degrees
+    double vfov = 20;
+};
+
+struct Keyframe {
+    double time = 0;
+    CameraView view;
+};
+
+/**
+ * The path of the camera through an animation, a list of keyframes with
+ * increasing times.
+ *
+ * Between two keyframes the camera follows a Catmull-Rom spline: a cubic
+ * curve through the keyframes whose direction at every keyframe points from
+ * the keyframe before it to the one after it. Going straight from keyframe
+ * to keyframe would turn the camera sharply at every one of them, with the
+ * spline it moves on smoothly. The keyframes don't have to be evenly spaced
+ * in time, the directions are divided by the time between the neighbours so
+ * the speed doesn't jump either. The field of view is simply blended.
+ **/
+class CameraPath {
+public:
+    std::vector<Keyframe> keys;
+public:
+    void add(double time, const CameraView& view) {
+        keys.push_back({ time, view });
+    }
+
+    double start() const { return keys.empty() ? 0 : keys.front().time; }
+    double end() const { return keys.empty() ? 0 : keys.back().time; }
+
+    // The view at time, before the first keyframe and after the last one the camera stands still
+    CameraView at(double time) const {
+        if (keys.size() == 1 || time <= keys.front().time)
+            return keys.front().view;
+        if (time >= keys.back().time)
+            return keys.back().view;
+
+        // The keyframes k and k + 1 around time
+        auto next = std::upper_bound(keys.begin(), keys.end(), time,
+            [](double t, const Keyframe& key) { return t < key.time; });
+        std::size_t k = (next - keys.begin()) - 1;
+        const auto& a = keys[k];
+        const auto& b = keys[k + 1];
+        auto h = b.time - a.time;
+        auto s = (time - a.time) / h;
+
+        // The cubic Hermite basis
+        auto s2 = s * s, s3 = s2 * s;
+        auto h00 = 2 * s3 - 3 * s2 + 1;
+        auto h10 = s3 - 2 * s2 + s;
+        auto h01 = -2 * s3 + 3 * s2;
+        auto h11 = s3 - s2;
+
+        auto curve = [&](Point3 CameraView::*point) {
+            return h00 * (a.view.*point) + h10 * h * velocity(k, point)
+                 + h01 * (b.view.*point) + h11 * h * velocity(k + 1, point);
+        };
+
+        CameraView view;
+        view.lookfrom = curve(&CameraView::lookfrom);
+        view.lookat = curve(&CameraView::lookat);
+        view.vfov = a.view.vfov + s * (b.view.vfov - a.view.vfov);
+        return view;
+    }
+
+    /**
+     * lookfrom going around lookat, about the up direction vup, turns times
+     * in keyframes from time 0 to 1. A keyframe every 10 degrees keeps the
+     * spline within a hair of the circle.
+     **/
+    static CameraPath orbit(const CameraView& view, const Vec3& vup, double turns = 1) {
+        CameraPath path;
+        auto axis = unit_vector(vup);
+        auto offset = view.lookfrom - view.lookat;
+        const int steps = std::max(1, static_cast<int>(std::ceil(36 * std::fabs(turns))));
+        for (int k = 0; k <= steps; k++) {
+            auto theta = 2 * PI * turns * k / steps;
+            // Rodrigues' rotation of the offset around the axis
+            auto turned = std::cos(theta) * offset + std::sin(theta) * cross(axis, offset)
+                        + (1 - std::cos(theta)) * dot(axis, offset) * axis;
+            CameraView key = view;
+            key.lookfrom = view.lookat + turned;
+            path.add(static_cast<double>(k) / steps, key);
+        }
+        return path;
+    }
+private:
+    // How fast the point moves at keyframe k, from its neighbours
+    Vec3 velocity(std::size_t k, Point3 CameraView::*point) const {
+        auto before = k > 0 ? k - 1 : k;
+        auto after = std::min(k + 1, keys.size() - 1);
+        return (keys[after].view.*point - keys[before].view.*point) / (keys[after].time - keys[before].time);
+    }
+};
+
+/**
+ * Reads a camera path, one keyframe per line:
+ *
+ *   # time  lookfrom    lookat   [fov]
+ *   0       13 2 3      0 0 0
+ *   2.5     6 3 -8      0 1 0    30
+ *
+ * The times have to increase. A keyframe without a field of view gets
+ * default_vfov. Returns false and sets error if the file can't be read.
+ **/
+inline bool load_camera_path(const std::string& path, double default_vfov, CameraPath& camera_path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "can't open the file";
+        return false;
+    }
+
+    camera_path.keys.clear();
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words(line);
+        std::vector<double> numbers;
+        std::string word;
+        while (words >> word) {
+            char* end;
+            double v = std::strtod(word.c_str(), &end);
+            if (*end != '\0') {
+                error = "line " + std::to_string(line_number) + ": expected a number, got " + word;
+                return false;
+            }
+            numbers.push_back(v);
+        }
+        if (numbers.empty())
+            continue;
+        if (numbers.size() != 7 && numbers.size() != 8) {
+            error = "line " + std::to_string(line_number) + ": expected a time, lookfrom, lookat and optionally a fov";
+            return false;
+        }
+        if (!camera_path.keys.empty() && numbers[0] <= camera_path.end()) {
+            error = "line " + std::to_string(line_number) + ": the times have to increase";
+            return false;
+        }
+
+        CameraView view;
+        view.lookfrom = Point3(numbers[1], numbers[2], numbers[3]);
+        view.lookat = Point3(numbers[4], numbers[5], numbers[6]);
+        view.vfov = numbers.size() == 8 ? numbers[7] : default_vfov;
+        camera_path.add(numbers[0], view);
+    }
+
+    if (camera_path.keys.empty()) {
+        error = "no keyframes";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The file of frame k. A %d in path, with an optional zero padded width
+ * like frame_%04d.png, is replaced by k. Without one the number goes in front
+ * of the extension, so out.png becomes out_0000.png.
+ **/
+inline std::string frame_path(const std::string& path, int k) {
+    auto percent = path.find('%');
+    if (percent != std::string::npos) {
+        // Only a %d, %5d or %05d, anything else is kept as it is
+        auto d = percent + 1;
+        while (d < path.size() && path[d] >= '0' && path[d] <= '9')
+            d++;
+        if (d < path.size() && path[d] == 'd') {
+            auto spec = path.substr(percent, d - percent + 1);
+            char number[32];
+            std::snprintf(number, sizeof(number), spec.c_str(), k);
+            return path.substr(0, percent) + number + path.substr(d + 1);
+        }
+    }
+
+    char number[32];
+    std::snprintf(number, sizeof(number), "_%04d", k);
+    auto slash = path.find_last_of("/\\");
+    auto dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + number;
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+// What render_animation did and how long it took
+struct AnimationResult {
+    int frames = 0;
+    uint64_t rays = 0;
+    // Wall clock time of the whole animation
+    double seconds = 0;
+    // Summed over the frames: rendering, writing (on the writer thread) and
+    // the time the renderer had to wait for the writer to catch up
+    double render_seconds = 0;
+    double write_seconds = 0;
+    double wait_seconds = 0;
+    // The frame that couldn't be written, empty if all of them were
+    std::string failed_path;
+
+    double frames_per_hour() const { return seconds > 0 ? frames * 3600 / seconds : 0; }
+};
+
+/**
+ * Renders frames images along the camera path, evenly spread from its first
+ * keyframe to its last one, and writes frame k to frame_path(output, k).
+ *
+ * render_frame(view) renders the image seen from view, summing
+ * samples_per_pixel samples per pixel. Everything it uses, the scene, the
+ * tree and the render threads, stays the same for all the frames, only the
+ * camera moves.
+ *
+ * Writing a frame, a PNG mostly, takes a while and only uses one thread. So
+ * it happens on a writer thread of its own while the next frame renders.
+ * Only one frame is written at a time: before a frame is handed over the
+ * previous one has to be done, which keeps at most two frames in memory.
+ **/
+template <typename RenderFn>
+AnimationResult render_animation(
+    const CameraPath& path, int frames, int width, int height, int samples_per_pixel,
+    const std::string& output, ImageFormat format, RenderFn render_frame
+) {
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    AnimationResult result;
+
+    // The frame being written and how that went, only touched by the writer
+    // between submit and wait
+    struct PendingWrite {
+        std::vector<Color> pixels;
+        std::string path;
+        double seconds = 0;
+        bool ok = true;
+    } pending;
+    ThreadPool writer(1);
+    bool writing = false;
+
+    auto finish_write = [&]() {
+        if (!writing)
+            return;
+        auto wait_start = Clock::now();
+        writer.wait();
+        std::chrono::duration<double> waited = Clock::now() - wait_start;
+        result.wait_seconds += waited.count();
+        result.write_seconds += pending.seconds;
+        if (!pending.ok && result.failed_path.empty())
+            result.failed_path = pending.path;
+        writing = false;
+    };
+
+    for (int k = 0; k < frames && result.failed_path.empty(); k++) {
+        auto time = frames > 1 ? path.start() + (path.end() - path.start()) * k / (frames - 1) : path.start();
+        auto frame = render_frame(path.at(time));
+        result.rays += frame.rays;
+        result.render_seconds += frame.seconds;
+        result.frames++;
+        std::cerr << "\rFrame " << k + 1 << "/" << frames << " rendered in " << frame.seconds << "s    " << '\n';
+
+        finish_write();
+        pending.pixels = std::move(frame.pixels);
+        pending.path = frame_path(output, k);
+        writer.submit([&pending, width, height, samples_per_pixel, format] {
+            auto write_start = Clock::now();
+            Framebuffer image(width, height, pending.pixels, samples_per_pixel);
+            pending.ok = write_image(pending.path, image, format);
+            std::chrono::duration<double> elapsed = Clock::now() - write_start;
+            pending.seconds = elapsed.count();
+        });
+        writing = true;
+    }
+    finish_write();
+
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A bump allocator. Memory is handed out from big blocks by moving an offset
+ * forward, and is given back all at once.
+ *
+ * Objects that are made one after the other sit next to each other in memory,
+ * in the order they were made. With make_shared every sphere of a scene is an
+ * allocation of its own, wherever malloc finds room, with a reference count
+ * in front of it. Made in an arena, the spheres of a BVH leaf can be made one
+ * after the other and read from the same few cache lines.
+ *
+ * It is also cheap enough for memory that is only needed for a moment, like
+ * the path queues of the wavefront tracer: every render thread has a scratch
+ * arena (see thread_scratch) that is rewound after every tile. Once its first
+ * block is big enough for a tile, the render loop doesn't call malloc at all.
+ *
+ * Objects that need their destructor called get it on reset, in the reverse
+ * order they were made. Arrays (allocate_array) are only for types without
+ * one, they are simply forgotten.
+ **/
+class Arena {
+public:
+    static constexpr std::size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+    // Where the arena was at some point, see mark and rewind
+    struct Mark {
+        std::size_t block = 0;
+        std::size_t offset = 0;
+        std::size_t cleanups = 0;
+    };
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size = 0;
+    };
+
+    struct Cleanup {
+        void (*destroy)(void*);
+        void* object;
+    };
+
+    std::vector<Block> blocks;
+    // The block being filled and how much of it is used
+    std::size_t current = 0;
+    std::size_t offset = 0;
+    std::size_t block_size;
+    // Kept outside the blocks, so the objects stay packed next to each other
+    std::vector<Cleanup> cleanups;
+    // Blocks taken from malloc over the life of the arena
+    std::size_t blocks_allocated = 0;
+public:
+    explicit Arena(std::size_t block_size = DEFAULT_BLOCK_SIZE) : block_size(block_size) {}
+    ~Arena() { run_cleanups(0); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator= (const Arena&) = delete;
+    // The blocks stay where they are, so the pointers handed out stay valid
+    Arena(Arena&& other) noexcept { *this = std::move(other); }
+    Arena& operator= (Arena&& other) noexcept {
+        if (this != &other) {
+            run_cleanups(0);
+            blocks = std::move(other.blocks);
+            cleanups = std::move(other.cleanups);
+            current = std::exchange(other.current, 0);
+            offset = std::exchange(other.offset, 0);
+            block_size = other.block_size;
+            blocks_allocated = std::exchange(other.blocks_allocated, 0);
+            other.blocks.clear();
+            other.cleanups.clear();
+        }
+        return *this;
+    }
+
+    // Raw memory for bytes bytes, align has to be a power of two
+    void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t)) {
+        while (current < blocks.size()) {
+            auto& block = blocks[current];
+            auto base = reinterpret_cast<std::uintptr_t>(block.data.get());
+            auto start = ((base + offset + align - 1) & ~(std::uintptr_t(align) - 1)) - base;
+            if (start + bytes <= block.size) {
+                offset = start + bytes;
+                return block.data.get() + start;
+            }
+            // Left over from before a reset, or full
+            current++;
+            offset = 0;
+        }
+
+        add_block(std::max(block_size, bytes + align));
+        return allocate(bytes, align);
+    }
+
+    // A T made from args, it lives until the arena is reset or rewound past it
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        auto object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            cleanups.push_back({ [](void* p) { static_cast<T*>(p)->~T(); }, object });
+        return object;
+    }
+
+    // count default initialized Ts in a row
+    template <typename T>
+    T* allocate_array(std::size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena arrays are never destroyed");
+        auto first = static_cast<T*>(allocate(sizeof(T) * std::max<std::size_t>(count, 1), alignof(T)));
+        for (std::size_t k = 0; k < count; k++)
+            new (first + k) T;
+        return first;
+    }
+
+    Mark mark() const { return { current, offset, cleanups.size() }; }
+
+    // Frees everything made since mark, rewinding to the start is a reset
+    void rewind(const Mark& m) {
+        if (m.block == 0 && m.offset == 0) {
+            reset();
+            return;
+        }
+        run_cleanups(m.cleanups);
+        current = m.block;
+        offset = m.offset;
+    }
+
+    /**
+     * Frees everything. The memory is kept for what comes next, and if it
+     * took more than one block this time the blocks are merged into one big
+     * enough for all of it, so the next round fits without asking for more.
+     **/
+    void reset() {
+        run_cleanups(0);
+        if (blocks.size() > 1) {
+            std::size_t total = 0;
+            for (const auto& block : blocks)
+                total += block.size;
+            blocks.clear();
+            add_block(total);
+        }
+        current = 0;
+        offset = 0;
+    }
+
+    // Bytes handed out so far, counting the padding for alignment
+    std::size_t bytes_used() const {
+        std::size_t used = offset;
+        for (std::size_t k = 0; k < current && k < blocks.size(); k++)
+            used += blocks[k].size;
+        return used;
+    }
+
+    // Bytes of all the blocks together
+    std::size_t bytes_reserved() const {
+        std::size_t total = 0;
+        for (const auto& block : blocks)
+            total += block.size;
+        return total;
+    }
+
+    std::size_t block_allocations() const { return blocks_allocated; }
+private:
+    void add_block(std::size_t size) {
+        blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+        blocks_allocated++;
+        current = blocks.size() - 1;
+        offset = 0;
+    }
+
+    void run_cleanups(std::size_t keep) {
+        while (cleanups.size() > keep) {
+            cleanups.back().destroy(cleanups.back().object);
+            cleanups.pop_back();
+        }
+    }
+};
+
+// Rewinds the arena to where it was when the scope started
+class ArenaScope {
+private:
+    Arena& arena;
+    Arena::Mark start;
+public:
+    explicit ArenaScope(Arena& a) : arena(a), start(a.mark()) {}
+    ~ArenaScope() { arena.rewind(start); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator= (const ArenaScope&) = delete;
+};
+
+/**
+ * Memory for the calling thread to use for a moment, like the queues of a
+ * tile. Take it in an ArenaScope, so it is given back when the work is done.
+ **/
+inline Arena& thread_scratch() {
+    thread_local Arena arena(256 * 1024);
+    return arena;
+}
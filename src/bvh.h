@@ -0,0 +1,601 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "utility.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray_packet.h"
+#include "simd.h"
+
+/**
+ * A node of a flattened bounding volume hierarchy.
+ *
+ * The nodes are stored depth first in one array. An interior node is always
+ * followed by its first child, so it only needs to store the index of its
+ * second child. A leaf stores the range of primitives it contains instead.
+ **/
+struct BvhNode {
+    AABB box;
+    // Interior node: index of the second child
+    // Leaf node: index of the first primitive
+    uint32_t offset;
+    // Number of primitives in a leaf, 0 for an interior node
+    uint16_t count;
+    // The axis the node was split along, used to visit the nearer child first
+    uint8_t axis;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+/**
+ * The bounding volume hierarchy itself, it only knows about the boxes of the
+ * primitives and not what the primitives are. Whoever owns the primitives
+ * reorders them using prim_order after the build, so that the primitives of a
+ * leaf are next to each other in memory, and tests them in a callback during
+ * the traversal.
+ *
+ * The tree is built with the surface area heuristic. The chance of a ray
+ * hitting a box is proportional to its surface area, so the cost of a split is
+ *   area(left) * count(left) + area(right) * count(right)
+ * and we pick the split with the lowest cost. We don't try every possible
+ * split, the centroids are sorted into a few bins along each axis and only the
+ * bin boundaries are tried.
+ *
+ * The traversal keeps the nodes still to visit on a small fixed stack, a node
+ * at depth d leaves at most d nodes on it. Very uneven scenes could make the
+ * surface area heuristic build a tree deeper than that, so past
+ * MEDIAN_SPLIT_DEPTH the nodes are split into two halves of the same count
+ * instead. Halving reaches a leaf within 32 more levels even for 2^32
+ * primitives, so no node is ever MAX_DEPTH deep.
+ **/
+class BvhTree {
+public:
+    // Size of the traversal stack, every node of a tree is less deep than this
+    static constexpr int MAX_DEPTH = 64;
+
+    std::vector<BvhNode> nodes;
+    // prim_order[k] is the index of the primitive that ends up at position k
+    std::vector<uint32_t> prim_order;
+private:
+    static constexpr int BIN_COUNT = 16;
+    // Cost of visiting a node compared to testing one primitive
+    static constexpr real TRAVERSAL_COST = 1.0;
+    static constexpr real INTERSECTION_COST = 1.0;
+    static constexpr int MEDIAN_SPLIT_DEPTH = MAX_DEPTH - 33;
+
+    std::vector<AABB> prim_boxes;
+    std::vector<Point3> centroids;
+    // Leaves never hold more primitives than this
+    uint32_t max_leaf_size = 4;
+public:
+    BvhTree() {}
+
+    void build(const std::vector<AABB>& boxes, uint32_t leaf_size = 4);
+
+    /**
+     * Whether the nodes are a tree the traversal can walk safely: both
+     * children of a node come after it inside the array, no node is used
+     * twice or is MAX_DEPTH deep, and the leaves only hold primitives below
+     * prim_count. For trees read from files, build() always makes one.
+     **/
+    bool valid(uint64_t prim_count) const;
+
+    /**
+     * Walk the tree and call test_leaf(first, count, closest_so_far) for every
+     * leaf whose box the ray hits. test_leaf tests the primitives first to
+     * first+count-1, and if it hits something returns true after lowering
+     * closest_so_far to the distance of the hit.
+     **/
+    template <typename LeafFn>
+    bool traverse(const Ray& r, real t_min, real t_max, LeafFn test_leaf) const;
+
+    /**
+     * Walk the tree until test_leaf(first, count) finds any hit in a leaf,
+     * for shadow rays. There is no closest hit to lower, so the first hit
+     * ends the walk.
+     **/
+    template <typename LeafFn>
+    bool traverse_any(const Ray& r, real t_min, real t_max, LeafFn test_leaf) const;
+
+    /**
+     * Walk the tree once for the whole packet. A node is visited if any ray of
+     * the packet hits its box, closest[k] is the current closest hit of ray k.
+     * test_leaf(first, count) tests the primitives of a leaf against the rays
+     * of the packet and lowers closest for the rays that hit something.
+     **/
+    template <typename LeafFn>
+    void traverse_packet(
+        const RayPacket& packet, real t_min, const real* closest, LeafFn test_leaf
+    ) const;
+private:
+    // Does any ray of the packet hit the box
+    static bool packet_hits_box(
+        const AABB& box, const RayPacket& packet, real t_min, const real* closest
+    );
+    uint32_t build_recursive(uint32_t begin, uint32_t end, int depth);
+};
+
+inline void BvhTree::build(const std::vector<AABB>& boxes, uint32_t leaf_size) {
+    max_leaf_size = leaf_size < 1 ? 1 : leaf_size;
+    nodes.clear();
+    prim_boxes = boxes;
+    centroids.clear();
+    prim_order.resize(boxes.size());
+
+    for (uint32_t k = 0; k < boxes.size(); k++) {
+        prim_order[k] = k;
+        centroids.push_back(boxes[k].centroid());
+    }
+
+    // A tree with n leaves has 2n - 1 nodes at most
+    nodes.reserve(boxes.empty() ? 0 : 2 * boxes.size() - 1);
+    if (!boxes.empty())
+        build_recursive(0, static_cast<uint32_t>(boxes.size()), 0);
+
+    // Only needed while building
+    prim_boxes.clear();
+    prim_boxes.shrink_to_fit();
+    centroids.clear();
+    centroids.shrink_to_fit();
+}
+
+inline uint32_t BvhTree::build_recursive(uint32_t begin, uint32_t end, int depth) {
+    auto node_index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(BvhNode{});
+
+    // Boxes around all the primitives and around their centroids
+    AABB bounds, centroid_bounds;
+    for (auto k = begin; k < end; k++) {
+        bounds.expand(prim_boxes[prim_order[k]]);
+        centroid_bounds.expand(centroids[prim_order[k]]);
+    }
+    nodes[node_index].box = bounds;
+
+    auto count = end - begin;
+    auto make_leaf = [&] {
+        nodes[node_index].offset = begin;
+        nodes[node_index].count = static_cast<uint16_t>(count);
+        nodes[node_index].axis = 0;
+        return node_index;
+    };
+
+    if (count == 1)
+        return make_leaf();
+
+    // Too deep for the cost to matter, halve the primitives along the longest
+    // axis of their centroids so the tree ends soon
+    if (depth >= MEDIAN_SPLIT_DEPTH) {
+        if (count <= max_leaf_size)
+            return make_leaf();
+
+        auto extent = centroid_bounds.maximum - centroid_bounds.minimum;
+        int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+        auto mid = begin + count / 2;
+        std::nth_element(
+            prim_order.begin() + begin, prim_order.begin() + mid, prim_order.begin() + end,
+            [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; }
+        );
+        nodes[node_index].axis = static_cast<uint8_t>(axis);
+        nodes[node_index].count = 0;
+        build_recursive(begin, mid, depth + 1);
+        nodes[node_index].offset = build_recursive(mid, end, depth + 1);
+        return node_index;
+    }
+
+    // Try the bin boundaries along every axis and keep the cheapest split
+    real best_cost = INF;
+    int best_axis = -1, best_split = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto extent = centroid_bounds.maximum[axis] - lo;
+        // All centroids are on one plane, nothing to split along this axis
+        if (extent <= 0) continue;
+
+        AABB bin_boxes[BIN_COUNT];
+        uint32_t bin_counts[BIN_COUNT] = {};
+        auto scale = BIN_COUNT / extent;
+
+        for (auto k = begin; k < end; k++) {
+            auto b = static_cast<int>((centroids[prim_order[k]][axis] - lo) * scale);
+            b = b < BIN_COUNT ? b : BIN_COUNT - 1;
+            bin_counts[b]++;
+            bin_boxes[b].expand(prim_boxes[prim_order[k]]);
+        }
+
+        // Sweep from the right to get the cost of everything right of a split,
+        // and then from the left to add the cost of everything left of it
+        real right_cost[BIN_COUNT];
+        AABB right_box;
+        uint32_t right_count = 0;
+        for (int b = BIN_COUNT - 1; b > 0; b--) {
+            right_box.expand(bin_boxes[b]);
+            right_count += bin_counts[b];
+            right_cost[b] = right_count * right_box.surface_area();
+        }
+
+        AABB left_box;
+        uint32_t left_count = 0;
+        for (int b = 0; b < BIN_COUNT - 1; b++) {
+            left_box.expand(bin_boxes[b]);
+            left_count += bin_counts[b];
+            auto cost = left_count * left_box.surface_area() + right_cost[b + 1];
+            if (left_count > 0 && left_count < count && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    // Compare the split against just testing every primitive in a leaf
+    auto area = bounds.surface_area();
+    auto split_cost = TRAVERSAL_COST + INTERSECTION_COST * best_cost / (area > 0 ? area : 1);
+    auto leaf_cost = INTERSECTION_COST * count;
+
+    if (best_axis == -1) {
+        // All the centroids are on the same point, they can't be split by
+        // position. But a leaf can only hold so many, so split them down the middle
+        if (count <= max_leaf_size)
+            return make_leaf();
+
+        auto mid = begin + count / 2;
+        nodes[node_index].axis = 0;
+        nodes[node_index].count = 0;
+        build_recursive(begin, mid, depth + 1);
+        nodes[node_index].offset = build_recursive(mid, end, depth + 1);
+        return node_index;
+    }
+
+    if (count <= max_leaf_size && leaf_cost <= split_cost)
+        return make_leaf();
+
+    // Move the primitives left of the split to the front
+    auto lo = centroid_bounds.minimum[best_axis];
+    auto scale = BIN_COUNT / (centroid_bounds.maximum[best_axis] - lo);
+    auto mid = begin;
+    for (auto k = begin; k < end; k++) {
+        auto b = static_cast<int>((centroids[prim_order[k]][best_axis] - lo) * scale);
+        b = b < BIN_COUNT ? b : BIN_COUNT - 1;
+        if (b <= best_split)
+            std::swap(prim_order[k], prim_order[mid++]);
+    }
+
+    // The first child comes right after this node, so only the second is stored
+    nodes[node_index].axis = static_cast<uint8_t>(best_axis);
+    nodes[node_index].count = 0;
+    build_recursive(begin, mid, depth + 1);
+    nodes[node_index].offset = build_recursive(mid, end, depth + 1);
+    return node_index;
+}
+
+inline bool BvhTree::valid(uint64_t prim_count) const {
+    if (nodes.empty())
+        return true;
+
+    // Visit every node with its depth, a tree visits each of its nodes once
+    std::vector<std::pair<uint32_t, int>> stack = { { 0, 0 } };
+    std::size_t visited = 0;
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        if (depth >= MAX_DEPTH || ++visited > nodes.size())
+            return false;
+
+        const auto& node = nodes[index];
+        if (node.is_leaf()) {
+            if (node.offset + static_cast<uint64_t>(node.count) > prim_count)
+                return false;
+            continue;
+        }
+        // The first child is the next node, the second one comes after it
+        if (index + 1 >= nodes.size() || node.offset <= index + 1 || node.offset >= nodes.size())
+            return false;
+        stack.push_back({ index + 1, depth + 1 });
+        stack.push_back({ node.offset, depth + 1 });
+    }
+    return true;
+}
+
+template <typename LeafFn>
+bool BvhTree::traverse(const Ray& r, real t_min, real t_max, LeafFn test_leaf) const {
+    if (nodes.empty()) return false;
+
+    auto d = r.direction();
+    Vec3 inv_dir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+    bool dir_negative[3] = { d[0] < 0, d[1] < 0, d[2] < 0 };
+
+    // Nodes still to visit, instead of recursion we keep our own small stack
+    uint32_t stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    while (true) {
+        const auto& node = nodes[index];
+        RT_STAT(thread_stats().node_visits++);
+
+        if (node.box.hit(r, inv_dir, t_min, closest_so_far)) {
+            if (node.is_leaf()) {
+                if (test_leaf(node.offset, node.count, closest_so_far))
+                    hit_anything = true;
+            } else {
+                // Visit the child nearer to the ray origin first, a hit in it
+                // lowers closest_so_far and lets us skip the other one
+                assert(stack_size < MAX_DEPTH);
+                if (dir_negative[node.axis]) {
+                    stack[stack_size++] = index + 1;
+                    index = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0) break;
+        index = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+template <typename LeafFn>
+bool BvhTree::traverse_any(const Ray& r, real t_min, real t_max, LeafFn test_leaf) const {
+    if (nodes.empty()) return false;
+
+    auto d = r.direction();
+    Vec3 inv_dir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+    bool dir_negative[3] = { d[0] < 0, d[1] < 0, d[2] < 0 };
+
+    uint32_t stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    while (true) {
+        const auto& node = nodes[index];
+        RT_STAT(thread_stats().node_visits++);
+
+        if (node.box.hit(r, inv_dir, t_min, t_max)) {
+            if (node.is_leaf()) {
+                if (test_leaf(node.offset, node.count))
+                    return true;
+            } else {
+                // The nearer child first still pays off, the blockers close
+                // to the ray origin are found sooner
+                assert(stack_size < MAX_DEPTH);
+                if (dir_negative[node.axis]) {
+                    stack[stack_size++] = index + 1;
+                    index = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0) break;
+        index = stack[--stack_size];
+    }
+    return false;
+}
+
+inline bool BvhTree::packet_hits_box(
+    const AABB& box, const RayPacket& packet, real t_min, const real* closest
+) {
+    constexpr int W = SimdReal::WIDTH;
+    SimdReal min_x(box.minimum[0]), min_y(box.minimum[1]), min_z(box.minimum[2]);
+    SimdReal max_x(box.maximum[0]), max_y(box.maximum[1]), max_z(box.maximum[2]);
+
+    // The same slab test as AABB::hit, for W rays at a time
+    for (int g = 0; g < packet.lane_groups(); g++) {
+        auto k = g * W;
+        auto ox = SimdReal::load(&packet.ox[k]);
+        auto oy = SimdReal::load(&packet.oy[k]);
+        auto oz = SimdReal::load(&packet.oz[k]);
+        auto ix = SimdReal::load(&packet.inv_dx[k]);
+        auto iy = SimdReal::load(&packet.inv_dy[k]);
+        auto iz = SimdReal::load(&packet.inv_dz[k]);
+
+        auto tx0 = (min_x - ox) * ix, tx1 = (max_x - ox) * ix;
+        auto ty0 = (min_y - oy) * iy, ty1 = (max_y - oy) * iy;
+        auto tz0 = (min_z - oz) * iz, tz1 = (max_z - oz) * iz;
+
+        auto t_enter = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), SimdReal(t_min)));
+        auto t_exit = min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)) * SimdReal(BOX_EXIT_SCALE);
+        t_exit = min(t_exit, SimdReal::load(&closest[k]));
+
+        if ((t_enter <= t_exit).any())
+            return true;
+    }
+    return false;
+}
+
+template <typename LeafFn>
+void BvhTree::traverse_packet(
+    const RayPacket& packet, real t_min, const real* closest, LeafFn test_leaf
+) const {
+    if (nodes.empty()) return;
+
+    // The rays of a packet go in about the same direction, so the first ray
+    // decides which child is the nearer one for all of them
+    bool dir_negative[3] = { packet.dx[0] < 0, packet.dy[0] < 0, packet.dz[0] < 0 };
+
+    uint32_t stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    while (true) {
+        const auto& node = nodes[index];
+        // Counted once for every ray, like the rays traced on their own
+        RT_STAT(thread_stats().node_visits += packet.size);
+
+        if (packet_hits_box(node.box, packet, t_min, closest)) {
+            if (node.is_leaf()) {
+                test_leaf(node.offset, node.count);
+            } else {
+                assert(stack_size < MAX_DEPTH);
+                if (dir_negative[node.axis]) {
+                    stack[stack_size++] = index + 1;
+                    index = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0) break;
+        index = stack[--stack_size];
+    }
+}
+
+/**
+ * A bounding volume hierarchy over a list of hittables, can be used as the
+ * world anywhere a HittableList is used.
+ *
+ * Instead of testing every object, we test the ray against boxes which contain
+ * groups of objects, and only look inside the boxes the ray hits. This makes
+ * each ray O(log N) instead of O(N).
+ **/
+class BVH : public Hittable {
+public:
+    // The objects in the order of the tree leaves
+    std::vector<shared_ptr<Hittable>> objects;
+    BvhTree tree;
+    AABB bounds;
+public:
+    BVH() {}
+    BVH(const HittableList& list);
+    // A tree that is already built, with the objects in the order of its leaves
+    BVH(BvhTree built, std::vector<shared_ptr<Hittable>> leaf_objects)
+        : objects(std::move(leaf_objects)), tree(std::move(built)) {
+        if (!tree.nodes.empty())
+            bounds = tree.nodes[0].box;
+    }
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        output_box = bounds;
+        return !objects.empty();
+    }
+
+    virtual void hit_packet(
+        const RayPacket& packet, real t_min, real t_max, hit_record* recs, bool* hits
+    ) const override;
+
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+            for (auto k = first; k < first + count; k++)
+                if (objects[k]->occluded(r, t_min, t_max))
+                    return true;
+            return false;
+        });
+    }
+
+    virtual void occluded_packet(
+        const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+    ) const override;
+};
+
+inline BVH::BVH(const HittableList& list) {
+    std::vector<AABB> boxes;
+    std::vector<shared_ptr<Hittable>> bounded;
+    AABB box;
+
+    for (const auto& object : list.objects) {
+        if (!object->bounding_box(box)) {
+            std::cerr << "BVH: skipping an object without a bounding box" << '\n';
+            continue;
+        }
+        boxes.push_back(box);
+        bounded.push_back(object);
+        bounds.expand(box);
+    }
+
+    tree.build(boxes);
+
+    // Store the objects in leaf order
+    objects.reserve(bounded.size());
+    for (auto k : tree.prim_order)
+        objects.push_back(bounded[k]);
+}
+
+inline bool BVH::hit(const Ray& r, real t_min, real t_max, hit_record& rec) const {
+    return tree.traverse(r, t_min, t_max,
+        [&](uint32_t first, uint32_t count, real& closest_so_far) {
+            bool hit_anything = false;
+            for (auto k = first; k < first + count; k++) {
+                if (objects[k]->hit(r, t_min, closest_so_far, rec)) {
+                    hit_anything = true;
+                    closest_so_far = rec.t;
+                }
+            }
+            return hit_anything;
+        }
+    );
+}
+
+inline void BVH::occluded_packet(
+    const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+) const {
+    // A ray that is blocked gets a t_max behind it, so it drops out of the
+    // walk, once all of them have the boxes left on the stack all miss
+    real remaining[MAX_PACKET_SIZE];
+    for (int k = 0; k < MAX_PACKET_SIZE; k++)
+        remaining[k] = k < packet.size ? t_max[k] : -INF;
+    for (int k = 0; k < packet.size; k++)
+        occluded[k] = false;
+
+    tree.traverse_packet(packet, t_min, remaining, [&](uint32_t first, uint32_t count) {
+        for (int k = 0; k < packet.size; k++) {
+            if (remaining[k] < t_min)
+                continue;
+            auto r = packet.ray(k);
+            for (auto o = first; o < first + count; o++) {
+                if (objects[o]->occluded(r, t_min, remaining[k])) {
+                    occluded[k] = true;
+                    remaining[k] = -INF;
+                    break;
+                }
+            }
+        }
+    });
+}
+
+inline void BVH::hit_packet(
+    const RayPacket& packet, real t_min, real t_max, hit_record* recs, bool* hits
+) const {
+    // The unused slots get a closest hit behind the ray, so they never hit a box
+    real closest[MAX_PACKET_SIZE];
+    for (int k = 0; k < MAX_PACKET_SIZE; k++)
+        closest[k] = k < packet.size ? t_max : -INF;
+    for (int k = 0; k < packet.size; k++)
+        hits[k] = false;
+
+    // The objects are arbitrary hittables, so they are still tested one ray at
+    // a time, but the packet shares a single walk through the tree
+    tree.traverse_packet(packet, t_min, closest, [&](uint32_t first, uint32_t count) {
+        for (int k = 0; k < packet.size; k++) {
+            auto r = packet.ray(k);
+            for (auto o = first; o < first + count; o++) {
+                if (objects[o]->hit(r, t_min, closest[k], recs[k])) {
+                    hits[k] = true;
+                    closest[k] = recs[k].t;
+                }
+            }
+        }
+    });
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "utility.h"
+#include "sampling.h"
 
 class Camera {
 private:
@@ -11,16 +12,16 @@ private:
     Vec3 vertical;
 
     Vec3 u, v, w;
-    double lens_radius;
+    real lens_radius;
 public:
     Camera(
       Point3 lookfrom, // the point to look from
       Point3 lookat, // the point to look to
       Vec3 vup, // the rotation around the lookat-lookfrom axis
-      double vfov, // vertical field of view in degrees
-      double aspect_ratio, // the aspect ration for the camera
-      double aperture,
-      double focus_dist
+      real vfov, // vertical field of view in degrees
+      real aspect_ratio, // the aspect ration for the camera
+      real aperture,
+      real focus_dist
     ) {
         // The view port dimensions
         auto theta = degrees_to_radians(vfov);
@@ -57,7 +58,7 @@ public:
         lens_radius = aperture / 2;
     }
 
-    Ray get_ray(double s, double t) const {
+    Ray get_ray(real s, real t) const {
         Vec3 rd = lens_radius * random_in_unit_disk();
         Vec3 offset = u * rd[0] + v * rd[1];
         // Remember we had a lower left corner on the view port. We can simply
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+
+/**
+ * Everything needed to pick a progressive render up where it stopped.
+ *
+ * The accumulation buffer holds the sum of all the samples taken so far, so
+ * more samples can simply be added on top. The random numbers of a sample only
+ * depend on the seed, the sample pattern, the pixel and the sample index (see
+ * Sampler), so those and the number of samples done are the complete random
+ * state: the resumed render continues exactly where the old one stopped and
+ * gives the same image as a render that was never interrupted.
+ *
+ * The sums are stored as doubles for that reason, rounding them to floats
+ * would make the resumed image differ in the last bits.
+ *
+ * The scene itself isn't stored, only a hash of it (see scene_hash), which
+ * is enough to refuse resuming the render of another scene.
+ *
+ * The sums of the first half of the samples are stored too once the render
+ * got there. The denoiser compares them with the sums of all the samples to
+ * find the noise of every pixel, a render resumed with --denoise that has
+ * nothing left to render couldn't denoise without them.
+ **/
+struct Checkpoint {
+    int width = 0;
+    int height = 0;
+    uint64_t seed = 0;
+    // Settings that change the image, resuming with other values would mix two different renders
+    int max_depth = 0;
+    int rr_depth = 0;
+    // scene_hash of the scene and camera
+    uint64_t scene = 0;
+    // The SamplePattern, and the samples per pixel it spreads the samples over
+    int sampler = 0;
+    int samples_per_pixel = 0;
+    // Samples per pixel already in the accumulation buffer
+    int samples = 0;
+    // Sum of the samples of every pixel, top row first
+    std::vector<Color> accum;
+    // The sums of the first first_samples samples, empty and 0 until the render got that far
+    int first_samples = 0;
+    std::vector<Color> first_accum;
+};
+
+namespace checkpoint_detail {
+
+const char MAGIC[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '0', '4' };
+
+template <typename T>
+void write_value(std::ostream& out, const T& v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+bool read_value(std::istream& in, T& v) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&v), sizeof(v)));
+}
+
+} // namespace checkpoint_detail
+
+/**
+ * Writes the checkpoint to path. It is written to a temporary file first and
+ * then renamed over the old one, so a process killed halfway through writing
+ * still leaves the previous checkpoint intact.
+ **/
+inline bool save_checkpoint(const std::string& path, const Checkpoint& checkpoint) {
+    using namespace checkpoint_detail;
+
+    auto temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary);
+        if (!out)
+            return false;
+
+        out.write(MAGIC, sizeof(MAGIC));
+        write_value(out, static_cast<int32_t>(checkpoint.width));
+        write_value(out, static_cast<int32_t>(checkpoint.height));
+        write_value(out, checkpoint.seed);
+        write_value(out, static_cast<int32_t>(checkpoint.max_depth));
+        write_value(out, static_cast<int32_t>(checkpoint.rr_depth));
+        write_value(out, checkpoint.scene);
+        write_value(out, static_cast<int32_t>(checkpoint.sampler));
+        write_value(out, static_cast<int32_t>(checkpoint.samples_per_pixel));
+        write_value(out, static_cast<int32_t>(checkpoint.samples));
+        auto first_samples = checkpoint.first_accum.empty() ? 0 : checkpoint.first_samples;
+        write_value(out, static_cast<int32_t>(first_samples));
+        // Always doubles, so float and double builds can read each other's checkpoints
+        auto write_sums = [&](const std::vector<Color>& sums) {
+            for (const auto& c : sums)
+                for (int k = 0; k < 3; k++)
+                    write_value(out, static_cast<double>(c[k]));
+        };
+        write_sums(checkpoint.accum);
+        if (first_samples > 0)
+            write_sums(checkpoint.first_accum);
+
+        if (!out.flush())
+            return false;
+    }
+
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+/**
+ * Reads a checkpoint written by save_checkpoint, returns false if it is
+ * missing or broken. The sums are only read if the checkpoint is of a width x
+ * height image, otherwise accum is left empty and the caller finds the other
+ * size in the checkpoint. The size in a damaged file could be anything, it
+ * isn't trusted to allocate the sums.
+ **/
+inline bool load_checkpoint(const std::string& path, int width, int height, Checkpoint& checkpoint) {
+    using namespace checkpoint_detail;
+
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        return false;
+
+    int32_t file_width, file_height, max_depth, rr_depth, sampler, samples_per_pixel, samples, first_samples;
+    uint64_t seed, scene;
+    if (!read_value(in, file_width) || !read_value(in, file_height) || !read_value(in, seed)
+        || !read_value(in, max_depth) || !read_value(in, rr_depth) || !read_value(in, scene)
+        || !read_value(in, sampler) || !read_value(in, samples_per_pixel) || !read_value(in, samples)
+        || !read_value(in, first_samples))
+        return false;
+    if (file_width <= 0 || file_height <= 0 || samples < 0 || first_samples < 0 || first_samples > samples)
+        return false;
+
+    checkpoint.width = file_width;
+    checkpoint.height = file_height;
+    checkpoint.seed = seed;
+    checkpoint.max_depth = max_depth;
+    checkpoint.rr_depth = rr_depth;
+    checkpoint.scene = scene;
+    checkpoint.sampler = sampler;
+    checkpoint.samples_per_pixel = samples_per_pixel;
+    checkpoint.samples = samples;
+    checkpoint.first_samples = first_samples;
+    checkpoint.accum.clear();
+    checkpoint.first_accum.clear();
+    if (file_width != width || file_height != height)
+        return true;
+
+    auto read_sums = [&](std::vector<Color>& sums) {
+        sums.assign(static_cast<std::size_t>(width) * height, Color(0, 0, 0));
+        for (auto& c : sums) {
+            for (int k = 0; k < 3; k++) {
+                double v;
+                if (!read_value(in, v))
+                    return false;
+                c[k] = static_cast<real>(v);
+            }
+        }
+        return true;
+    };
+    return read_sums(checkpoint.accum) && (first_samples == 0 || read_sums(checkpoint.first_accum));
+}
@@ -1,21 +1,15 @@
 #pragma once
 
-#include <iostream>
+#include <cstdint>
 #include "utility.h"
 
-void write_color(std::ostream &out, Color pixel_color, int samples_per_pixel) {
-    // Divide the color by the number of samples
-    auto scale = 1.0 / samples_per_pixel;
-
+// Converts one linear color component to the [0,255] value stored in 8 bit images
+inline uint8_t color_to_byte(double linear) {
     // gamma correct for gamma = 2.0
-    auto r = sqrt(scale * pixel_color[0]);
-    auto g = sqrt(scale * pixel_color[1]);
-    auto b = sqrt(scale * pixel_color[2]);
+    auto c = sqrt(linear);
 
-    // Write the translated [0,255] value of each color component.
+    // Translate to a [0,255] value.
     // as colour values range from 0 to 1 we clamp them to 0 to 0.999
     // and then multiply by 256
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
+    return static_cast<uint8_t>(256 * clamp(c, 0.0, 0.999));
 }
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A small zlib/deflate compressor (RFC 1950 and 1951), enough to write PNG
+ * files without pulling in a library.
+ *
+ * Repeated byte strings are found with a hash table of the last 32KB
+ * (LZ77), and the result is written as a single block with the fixed Huffman
+ * codes from the spec. Building our own Huffman tables would shave off a few
+ * more percent, the fixed ones keep the code short.
+ **/
+
+// CRC-32 as used by PNG chunks, crc is the value so far
+inline uint32_t crc32(const uint8_t* data, std::size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (std::size_t k = 0; k < size; k++)
+        crc = table[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Adler-32 checksum at the end of a zlib stream
+inline uint32_t adler32(const uint8_t* data, std::size_t size) {
+    uint32_t a = 1, b = 0;
+    for (std::size_t k = 0; k < size; k++) {
+        a = (a + data[k]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+namespace deflate_detail {
+
+// Deflate packs bits starting from the lowest bit of each byte
+class BitWriter {
+public:
+    std::vector<uint8_t>& out;
+    uint32_t bits = 0;
+    int count = 0;
+public:
+    explicit BitWriter(std::vector<uint8_t>& o) : out(o) {}
+
+    // Writes the lowest n bits of value, lowest bit first
+    void write(uint32_t value, int n) {
+        bits |= value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(static_cast<uint8_t>(bits));
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    // Huffman codes are stored highest bit first
+    void write_code(uint32_t code, int n) {
+        uint32_t reversed = 0;
+        for (int k = 0; k < n; k++)
+            reversed |= ((code >> k) & 1) << (n - 1 - k);
+        write(reversed, n);
+    }
+
+    void flush() {
+        if (count > 0)
+            out.push_back(static_cast<uint8_t>(bits));
+        bits = 0;
+        count = 0;
+    }
+};
+
+// Fixed Huffman code of a literal/length symbol
+inline void write_symbol(BitWriter& writer, int symbol) {
+    if (symbol < 144)      writer.write_code(0x30 + symbol, 8);
+    else if (symbol < 256) writer.write_code(0x190 + symbol - 144, 9);
+    else if (symbol < 280) writer.write_code(symbol - 256, 7);
+    else                   writer.write_code(0xc0 + symbol - 280, 8);
+}
+
+inline void write_match(BitWriter& writer, int length, int distance) {
+    static const int length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const int length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const int distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static const int distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    int l = 28;
+    while (length_base[l] > length) l--;
+    write_symbol(writer, 257 + l);
+    writer.write(length - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    writer.write_code(d, 5);
+    writer.write(distance - distance_base[d], distance_extra[d]);
+}
+
+} // namespace deflate_detail
+
+// Compresses data into a zlib stream
+inline std::vector<uint8_t> zlib_compress(const std::vector<uint8_t>& data) {
+    using namespace deflate_detail;
+
+    const int WINDOW = 32768;
+    const int MIN_MATCH = 3;
+    const int MAX_MATCH = 258;
+    // How many earlier positions with the same hash we look at, more finds
+    // longer matches but takes longer
+    const int MAX_CHAIN = 64;
+    const int HASH_BITS = 15;
+
+    std::vector<uint8_t> out = { 0x78, 0x01 };
+    BitWriter writer(out);
+
+    // A single block that is also the last one, with fixed Huffman codes
+    writer.write(1, 1);
+    writer.write(1, 2);
+
+    // head[h] is the last position with hash h, prev[p % WINDOW] the one before p
+    std::vector<int> head(1 << HASH_BITS, -1);
+    std::vector<int> prev(WINDOW, -1);
+
+    auto size = static_cast<int>(data.size());
+    auto hash = [&](int p) {
+        uint32_t v = data[p] | (data[p + 1] << 8) | (data[p + 2] << 16);
+        return static_cast<int>((v * 2654435761u) >> (32 - HASH_BITS));
+    };
+    auto insert = [&](int p) {
+        if (p + MIN_MATCH > size) return;
+        auto h = hash(p);
+        prev[p % WINDOW] = head[h];
+        head[h] = p;
+    };
+
+    int p = 0;
+    while (p < size) {
+        int best_length = 0, best_distance = 0;
+
+        if (p + MIN_MATCH <= size) {
+            int max_length = std::min(MAX_MATCH, size - p);
+            int candidate = head[hash(p)];
+            for (int chain = 0; chain < MAX_CHAIN && candidate >= 0 && p - candidate <= WINDOW; chain++) {
+                int length = 0;
+                while (length < max_length && data[candidate + length] == data[p + length])
+                    length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = p - candidate;
+                    if (length == max_length) break;
+                }
+                int next = prev[candidate % WINDOW];
+                // The slot was reused by a newer position, the chain ends here
+                if (next >= candidate) break;
+                candidate = next;
+            }
+        }
+
+        if (best_length >= MIN_MATCH) {
+            write_match(writer, best_length, best_distance);
+            for (int k = 0; k < best_length; k++)
+                insert(p + k);
+            p += best_length;
+        } else {
+            write_symbol(writer, data[p]);
+            insert(p);
+            p++;
+        }
+    }
+
+    // End of block
+    write_symbol(writer, 256);
+    writer.flush();
+
+    auto checksum = adler32(data.data(), data.size());
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(checksum >> shift));
+    return out;
+}
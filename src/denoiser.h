@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "utility.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "renderer.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+/**
+ * Auxiliary buffers (AOVs): what the camera sees first through every pixel,
+ * before any lighting. They are smooth even when the image is still noisy,
+ * and the denoiser uses them to tell an edge in the scene from noise.
+ *
+ * A mirror or glass shows the surfaces it reflects, those have the edges
+ * that need to stay sharp. So the AOVs follow the ray through mirrors and
+ * glass to the first surface that isn't one, the albedo tinted by them on
+ * the way and the depth the length of the whole way there.
+ **/
+struct AovBuffers {
+    int width = 0;
+    int height = 0;
+    // All three in the order of the framebuffer, top row first
+    // The base color of the material (see Material::base_color), 1 for the sky
+    std::vector<Color> albedo;
+    // The normal of the surface, 0 for the sky
+    std::vector<Vec3> normal;
+    // Distance from the camera to the surface, 0 for the sky
+    std::vector<real> depth;
+};
+
+// The AOVs are smooth, a few samples per pixel are enough for the edges
+const int AOV_MAX_SAMPLES = 4;
+
+// Mirrors and glass followed at most, a ray caught between mirrors gets the last one
+const int AOV_MAX_BOUNCES = 4;
+
+/**
+ * Traces the first hit of samples samples per pixel and averages their
+ * AOVs. camera_ray(i, j, s) gives the ray of sample s of pixel (i, j), the
+ * same one the render used, so the AOVs line up with the image exactly.
+ * Only the camera rays and their way through mirrors and glass are traced,
+ * but the pass still costs more than the filter itself, about 110ms against
+ * 8ms for a 320x180 image of the random scene (see bench_denoise).
+ **/
+template <typename CameraRayFn>
+AovBuffers render_aovs(
+    ThreadPool& pool, const Hittable& world, int width, int height, int samples, int tile_size,
+    CameraRayFn camera_ray
+) {
+    AovBuffers aovs;
+    aovs.width = width;
+    aovs.height = height;
+    auto size = static_cast<std::size_t>(width) * height;
+    aovs.albedo.resize(size);
+    aovs.normal.resize(size);
+    aovs.depth.resize(size);
+    samples = std::max(samples, 1);
+
+    render_tile_tasks(pool, width, height, tile_size, [&](const Tile& tile, std::vector<Color>&) {
+        hit_record rec;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                Color albedo(0, 0, 0);
+                Vec3 normal(0, 0, 0);
+                real depth = 0;
+                for (int s = 0; s < samples; s++) {
+                    auto r = camera_ray(i, j, s);
+                    Color tint(1, 1, 1);
+                    real distance = 0;
+                    for (int bounce = 0; ; bounce++) {
+                        if (!world.hit(r, 0, INF, rec)) {
+                            albedo += tint;
+                            break;
+                        }
+                        distance += (rec.p - r.origin()).length();
+                        // Only mirrors and glass don't sample the lights, see material.h
+                        bool specular = std::visit([](const auto& m) {
+                            return !std::decay_t<decltype(m)>::SAMPLES_LIGHTS;
+                        }, rec.mat_ptr->model) && !rec.mat_ptr->is<DiffuseLight>();
+                        Color attenuation;
+                        Ray scattered;
+                        if (!specular || bounce == AOV_MAX_BOUNCES
+                            || !rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
+                            albedo += tint * rec.mat_ptr->base_color(rec);
+                            normal += rec.normal;
+                            depth += distance;
+                            break;
+                        }
+                        tint = tint * attenuation;
+                        r = scattered;
+                    }
+                }
+                auto index = pixel_index(width, height, i, j);
+                aovs.albedo[index] = albedo / samples;
+                aovs.normal[index] = normal / samples;
+                aovs.depth[index] = depth / samples;
+            }
+        }
+    }, false);
+    return aovs;
+}
+
+/**
+ * The AOVs as images to look at: the albedo as it is, the normals mapped
+ * from [-1, 1] to [0, 1] and the depth from white close by to black far
+ * away. The image writers apply gamma 2, so the last two are squared to come
+ * out as they are (like the heatmap).
+ **/
+inline Framebuffer albedo_image(const AovBuffers& aovs) {
+    Framebuffer image(aovs.width, aovs.height);
+    image.pixels = aovs.albedo;
+    return image;
+}
+
+inline Framebuffer normal_image(const AovBuffers& aovs) {
+    Framebuffer image(aovs.width, aovs.height);
+    for (std::size_t p = 0; p < image.pixels.size(); p++) {
+        auto c = 0.5 * (aovs.normal[p] + Vec3(1, 1, 1));
+        image.pixels[p] = c * c;
+    }
+    return image;
+}
+
+inline Framebuffer depth_image(const AovBuffers& aovs) {
+    Framebuffer image(aovs.width, aovs.height);
+    real farthest = 0;
+    for (auto z : aovs.depth)
+        farthest = std::max(farthest, z);
+    for (std::size_t p = 0; p < image.pixels.size(); p++) {
+        double c = aovs.depth[p] > 0 ? 1 - aovs.depth[p] / (farthest * 1.1) : 0;
+        image.pixels[p] = Color(c * c, c * c, c * c);
+    }
+    return image;
+}
+
+// The file of AOV name next to path, out.png becomes out_albedo.png
+inline std::string aov_path(const std::string& path, const std::string& name) {
+    auto slash = path.find_last_of("/\\");
+    auto dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + "_" + name;
+    return path.substr(0, dot) + "_" + name + path.substr(dot);
+}
+
+/**
+ * The variance of the mean of all n samples of a pixel, for every color,
+ * from the sum of all of them and the sum of just the first n_first. The
+ * first samples and the rest are two independent renders of the pixel, how
+ * far apart they are tells how noisy it still is. 0 if either part has no
+ * samples.
+ **/
+inline Color mean_variance(const Color& sum, int n, const Color& first_sum, int n_first) {
+    if (n_first <= 0 || n_first >= n)
+        return Color(0, 0, 0);
+    auto difference = first_sum / n_first - sum / n;
+    // E[(first mean - mean)^2] = variance of a sample * (1/n_first - 1/n),
+    // the mean of all n has variance of a sample / n
+    return difference * difference * (static_cast<real>(n_first) / (n - n_first));
+}
+
+// How strongly Denoiser keeps the edges, see there
+struct DenoiseSettings {
+    // Passes of the filter, pass k reaches 2^(k+1) pixels to every side
+    int iterations = 5;
+    // A difference in brightness of this many standard deviations of the
+    // noise counts as an edge
+    float sigma_color = 4.0f;
+    // Differences in the normal, and in the depth relative to the distance,
+    // that count as an edge
+    float sigma_normal = 0.3f;
+    float sigma_depth = 0.02f;
+};
+
+/**
+ * An edge avoiding a-trous wavelet filter (Dammertz et al. 2010), guided by
+ * the variance of every pixel like SVGF (Schied et al. 2017).
+ *
+ * Every pass blurs the image with a 5x5 B3 spline kernel whose taps are
+ * spread 2^k pixels apart in pass k, so five passes cover 125x125 pixels
+ * with only 25 taps a pass. To keep the edges sharp a tap is weighed down by
+ * how different its pixel is from the center pixel: in normal, in depth and
+ * in brightness. Noise averages out across a surface, but nothing is
+ * averaged across the silhouette of a sphere or the line where it touches
+ * the ground.
+ *
+ * A difference in brightness could be noise or a shadow, which one depends
+ * on how noisy the pixel is. So the difference is measured in standard
+ * deviations of the noise, from the variance of every pixel (see
+ * mean_variance). A noisy pixel is smoothed a lot, a pixel that already
+ * converged is left almost alone. Every pass also works out the variance of
+ * what it made, which goes down as the noise gets averaged out, and the
+ * later passes blur less.
+ *
+ * The image is divided by the albedo before the filter and multiplied back
+ * after it, so the filter only smooths the light falling on the surfaces and
+ * the colors of neighbouring objects don't bleed into each other.
+ *
+ * The buffers are planes of floats with a border of zeros around each row,
+ * so a row is filtered SimdFloat::WIDTH pixels at a time without checking
+ * every tap against the edges of the image, and the rows are spread over
+ * the thread pool. The planes are kept between calls, denoising the frames
+ * of an animation doesn't allocate.
+ **/
+class Denoiser {
+public:
+    DenoiseSettings settings;
+private:
+    int width = 0, height = 0;
+    // Floats from the start of a row to the next, and from there to pixel 0
+    std::size_t stride = 0, border = 0;
+    std::vector<float> planes;
+    // The variance is of the brightness (see luminance)
+    enum Plane { RED, GREEN, BLUE, VARIANCE, PLANES_PER_IMAGE };
+    enum AovPlane { NORMAL_X = 2 * PLANES_PER_IMAGE, NORMAL_Y, NORMAL_Z, DEPTH, PLANE_COUNT };
+public:
+    Denoiser() {}
+    explicit Denoiser(const DenoiseSettings& s) : settings(s) {}
+
+    /**
+     * Denoises image, variance holds the variance of every pixel of it (see
+     * mean_variance). Where the variance is 0 nothing gets smoothed.
+     **/
+    Framebuffer denoise(
+        ThreadPool& pool, const Framebuffer& image, const std::vector<Color>& variance, const AovBuffers& aovs
+    ) {
+        resize(image.width, image.height);
+        const int W = SimdFloat::WIDTH;
+
+        // Demodulate, divide by the albedo, and fill in the planes
+        const int TEMP = PLANES_PER_IMAGE + VARIANCE;
+        for_rows(pool, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                auto p = static_cast<std::size_t>(y) * width + x;
+                float demodulated_variance = 0;
+                for (int c = 0; c < 3; c++) {
+                    auto albedo = std::max(aovs.albedo[p][c], real(0.01));
+                    at(RED + c, x, y) = static_cast<float>(image.pixels[p][c] / albedo);
+                    demodulated_variance += LUMINANCE[c] * LUMINANCE[c]
+                                          * static_cast<float>(variance[p][c] / (albedo * albedo));
+                    at(NORMAL_X + c, x, y) = static_cast<float>(aovs.normal[p][c]);
+                }
+                at(TEMP, x, y) = demodulated_variance;
+                at(DEPTH, x, y) = static_cast<float>(aovs.depth[p]);
+            }
+        });
+
+        // The variance of a single pixel comes from two estimates, it is
+        // noisy itself. Smoothed over 3x3 pixels with 1 2 1 weights
+        for_rows(pool, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                float sum = 0, weights = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        if (y + dy < 0 || y + dy >= height || x + dx < 0 || x + dx >= width)
+                            continue;
+                        float w = (dx == 0 ? 2.0f : 1.0f) * (dy == 0 ? 2.0f : 1.0f);
+                        sum += w * at(TEMP, x + dx, y + dy);
+                        weights += w;
+                    }
+                }
+                at(VARIANCE, x, y) = sum / weights;
+            }
+        });
+
+        int from = 0;
+        for (int k = 0; k < settings.iterations; k++) {
+            int to = PLANES_PER_IMAGE - from;
+            for_rows(pool, [&](int y) {
+                for (int x = 0; x < width; x += W)
+                    filter(from, to, x, y, 1 << k);
+            });
+            from = to;
+        }
+
+        // Multiply the albedo back in
+        Framebuffer result(width, height);
+        for_rows(pool, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                auto p = static_cast<std::size_t>(y) * width + x;
+                for (int c = 0; c < 3; c++)
+                    result.pixels[p][c] = at(from + RED + c, x, y) * std::max(aovs.albedo[p][c], real(0.01));
+            }
+        });
+        return result;
+    }
+private:
+    static constexpr float LUMINANCE[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+    // Pixel 0 of row y of a plane, the rows are counted from the top like the framebuffer
+    float* row(int plane, int y) {
+        return planes.data() + (static_cast<std::size_t>(plane) * height + y) * stride + border;
+    }
+
+    float& at(int plane, int x, int y) { return row(plane, y)[x]; }
+
+    void resize(int w, int h) {
+        const int W = SimdFloat::WIDTH;
+        width = w;
+        height = h;
+        // The farthest tap of the last pass, rounded up to whole registers
+        auto reach = static_cast<std::size_t>(2) << std::max(settings.iterations - 1, 0);
+        border = (reach + W - 1) / W * W;
+        stride = border + (static_cast<std::size_t>(width) + W - 1) / W * W + border;
+        // Zeros everywhere, the borders have to be finite numbers
+        planes.assign(PLANE_COUNT * stride * height, 0.0f);
+    }
+
+    // Calls fn(y) for every row, spread over the pool in bands of rows
+    template <typename RowFn>
+    void for_rows(ThreadPool& pool, RowFn fn) {
+        const int BAND = 8;
+        auto band = [&](int y0) {
+            for (int y = y0; y < std::min(y0 + BAND, height); y++)
+                fn(y);
+        };
+        for (int y0 = 0; y0 < height; y0 += BAND)
+            pool.submit([run = &band, y0] { (*run)(y0); });
+        pool.wait();
+    }
+
+    /**
+     * e^-d for d >= 0, as (1 + d/16)^-16. Close enough for a weight, and only
+     * needs a division and four multiplications, which every SimdFloat has.
+     * Past d = 64 the weight is nothing anyway, and the powers of a tiny r
+     * would go through denormal floats, which are very slow.
+     **/
+    static SimdFloat exp_negative(SimdFloat d) {
+        d = min(d, SimdFloat(64.0f));
+        auto r = SimdFloat(1.0f) / (SimdFloat(1.0f) + d * SimdFloat(1.0f / 16));
+        r = r * r;
+        r = r * r;
+        r = r * r;
+        return r * r;
+    }
+
+    // Filters the SimdFloat::WIDTH pixels from (x, y) of the planes from into to
+    void filter(int from, int to, int x, int y, int step) {
+        // The B3 spline, 1 4 6 4 1 over 16
+        static const float KERNEL[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+        auto load = [&](int plane, int yy, int xx) { return SimdFloat::load(row(plane, yy) + xx); };
+        auto luminance = [&](int yy, int xx) {
+            return SimdFloat(LUMINANCE[0]) * load(from + RED, yy, xx) + SimdFloat(LUMINANCE[1]) * load(from + GREEN, yy, xx)
+                 + SimdFloat(LUMINANCE[2]) * load(from + BLUE, yy, xx);
+        };
+
+        auto l = luminance(y, x);
+        auto nx = load(NORMAL_X, y, x), ny = load(NORMAL_Y, y, x), nz = load(NORMAL_Z, y, x);
+        auto z = load(DEPTH, y, x);
+
+        // A brightness difference is measured against the standard deviation
+        // of the noise, the tiny constant keeps a pixel without any noise
+        // from dividing by 0
+        auto sigma_color = SimdFloat(settings.sigma_color * settings.sigma_color);
+        auto inv_color = SimdFloat(1.0f) / (sigma_color * load(from + VARIANCE, y, x) + SimdFloat(1e-10f));
+        auto inv_normal = SimdFloat(1 / (settings.sigma_normal * settings.sigma_normal));
+        // The depth may change more across the farther taps, along a surface
+        // seen at a grazing angle for example
+        auto sigma_depth = settings.sigma_depth * step;
+        auto inv_depth = SimdFloat(1.0f) / (z * z * SimdFloat(sigma_depth * sigma_depth) + SimdFloat(1e-12f));
+        auto lane_x = SimdFloat::lane_index() + SimdFloat(static_cast<float>(x));
+
+        SimdFloat sum_w(0.0f), sum_r(0.0f), sum_g(0.0f), sum_b(0.0f), sum_variance(0.0f);
+        for (int ty = 0; ty < 5; ty++) {
+            int yy = y + (ty - 2) * step;
+            if (yy < 0 || yy >= height)
+                continue;
+            for (int tx = 0; tx < 5; tx++) {
+                int dx = (tx - 2) * step;
+                int xx = x + dx;
+                // Taps outside the image read the border, and get no weight
+                auto tap_x = lane_x + SimdFloat(static_cast<float>(dx));
+                auto inside = (tap_x >= SimdFloat(0.0f)) & (tap_x < SimdFloat(static_cast<float>(width)));
+
+                auto dl = l - luminance(yy, xx);
+                auto dnx = nx - load(NORMAL_X, yy, xx);
+                auto dny = ny - load(NORMAL_Y, yy, xx);
+                auto dnz = nz - load(NORMAL_Z, yy, xx);
+                auto dz = z - load(DEPTH, yy, xx);
+                // One exponential for all three, e^-a e^-b e^-c = e^-(a+b+c)
+                auto d = dl * dl * inv_color + (dnx * dnx + dny * dny + dnz * dnz) * inv_normal + dz * dz * inv_depth;
+                auto w = select(inside, SimdFloat(KERNEL[ty] * KERNEL[tx]) * exp_negative(d), SimdFloat(0.0f));
+
+                sum_w = sum_w + w;
+                sum_r = sum_r + w * load(from + RED, yy, xx);
+                sum_g = sum_g + w * load(from + GREEN, yy, xx);
+                sum_b = sum_b + w * load(from + BLUE, yy, xx);
+                sum_variance = sum_variance + w * w * load(from + VARIANCE, yy, xx);
+            }
+        }
+
+        // The lanes past the end of the row have no taps at all, they stay 0
+        auto norm = SimdFloat(1.0f) / max(sum_w, SimdFloat(1e-20f));
+        (sum_r * norm).store(row(to + RED, y) + x);
+        (sum_g * norm).store(row(to + GREEN, y) + x);
+        (sum_b * norm).store(row(to + BLUE, y) + x);
+        // The variance of a weighted average of independent pixels
+        (sum_variance * norm * norm).store(row(to + VARIANCE, y) + x);
+    }
+};
+
+// The differences between an image and a reference of the same size
+struct ImageError {
+    // Root mean square error over all the color components
+    double rmse = 0;
+    // Mean of (x - ref)^2 / (ref^2 + 0.01), which doesn't let the bright
+    // pixels outweigh the rest
+    double relative_mse = 0;
+};
+
+inline ImageError image_error(const Framebuffer& image, const Framebuffer& reference) {
+    ImageError error;
+    double sum = 0, relative = 0;
+    for (std::size_t p = 0; p < image.pixels.size(); p++) {
+        for (int c = 0; c < 3; c++) {
+            auto diff = image.pixels[p][c] - reference.pixels[p][c];
+            sum += diff * diff;
+            relative += diff * diff / (reference.pixels[p][c] * reference.pixels[p][c] + 0.01);
+        }
+    }
+    auto n = 3.0 * image.pixels.size();
+    error.rmse = std::sqrt(sum / n);
+    error.relative_mse = relative / n;
+    return error;
+}
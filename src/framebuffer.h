@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "color.h"
+
+/**
+ * The rendered image, kept in memory until it gets written to a file.
+ *
+ * The pixels hold the linear radiance (the average of the samples, before any
+ * gamma correction), so the floating point formats can store exactly what the
+ * renderer computed. The 8 bit formats convert it with to_rgb8.
+ **/
+class Framebuffer {
+public:
+    int width = 0;
+    int height = 0;
+    // Top row first, left to right
+    std::vector<Color> pixels;
+public:
+    Framebuffer() {}
+    Framebuffer(int w, int h) : width(w), height(h), pixels(static_cast<std::size_t>(w) * h) {}
+
+    // Takes the summed colors of samples_per_pixel samples and averages them
+    Framebuffer(int w, int h, const std::vector<Color>& sums, int samples_per_pixel)
+        : Framebuffer(w, h) {
+        auto scale = 1.0 / samples_per_pixel;
+        for (std::size_t k = 0; k < pixels.size(); k++)
+            pixels[k] = scale * sums[k];
+    }
+
+    // Same, but every pixel has its own number of samples
+    Framebuffer(int w, int h, const std::vector<Color>& sums, const std::vector<int>& samples)
+        : Framebuffer(w, h) {
+        for (std::size_t k = 0; k < pixels.size(); k++)
+            pixels[k] = (1.0 / std::max(samples[k], 1)) * sums[k];
+    }
+
+    // Pixel in column x and row y, counting rows from the top
+    Color& at(int x, int y) { return pixels[static_cast<std::size_t>(y) * width + x]; }
+    const Color& at(int x, int y) const { return pixels[static_cast<std::size_t>(y) * width + x]; }
+
+    // Gamma corrected 8 bit RGB, three bytes per pixel, top row first
+    std::vector<uint8_t> to_rgb8() const {
+        std::vector<uint8_t> bytes(pixels.size() * 3);
+        for (std::size_t k = 0; k < pixels.size(); k++) {
+            bytes[3*k + 0] = color_to_byte(pixels[k][0]);
+            bytes[3*k + 1] = color_to_byte(pixels[k][1]);
+            bytes[3*k + 2] = color_to_byte(pixels[k][2]);
+        }
+        return bytes;
+    }
+};
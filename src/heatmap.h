@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <vector>
+
+#include "utility.h"
+#include "framebuffer.h"
+
+/**
+ * A false color picture of the time spent on every pixel: black and purple
+ * for the cheap pixels, through red and orange to pale yellow for the most
+ * expensive ones (the inferno color map).
+ *
+ * A handful of pixels (a caustic through the glass, or a pixel that happened
+ * to be interrupted by the OS) can take many times longer than the rest, and
+ * scaling by the slowest pixel would make everything else black. So the top
+ * of the scale is the 99th percentile, anything slower is clamped to it.
+ * scale returns that top value in seconds.
+ **/
+inline Framebuffer cost_heatmap(int width, int height, const std::vector<float>& cost, double& scale) {
+    Framebuffer image(width, height);
+    if (cost.empty())
+        return image;
+
+    auto sorted = cost;
+    auto top = sorted.begin() + static_cast<std::ptrdiff_t>((sorted.size() - 1) * 0.99);
+    std::nth_element(sorted.begin(), top, sorted.end());
+    scale = *top > 0 ? *top : 1;
+
+    // Points along the inferno color map, evenly spaced
+    const Color stops[] = {
+        Color(0.001, 0.000, 0.014), Color(0.258, 0.039, 0.406), Color(0.578, 0.148, 0.404),
+        Color(0.865, 0.317, 0.226), Color(0.988, 0.645, 0.040), Color(0.988, 0.998, 0.645),
+    };
+    const int last = static_cast<int>(std::size(stops)) - 1;
+
+    for (std::size_t p = 0; p < cost.size(); p++) {
+        double x = clamp(cost[p] / scale, 0.0, 1.0) * last;
+        int k = std::min(static_cast<int>(x), last - 1);
+        auto color = stops[k] + (x - k) * (stops[k + 1] - stops[k]);
+        // The image writers apply gamma 2, square the color so it comes out as it is
+        image.pixels[p] = color * color;
+    }
+    return image;
+}
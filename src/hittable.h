@@ -1,6 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
 #include "utility.h"
+#include "aabb.h"
+#include "ray_packet.h"
+#include "stats.h"
 
 class Material;
 
@@ -9,9 +16,14 @@ struct hit_record {
     Vec3 normal;
 
     // mat_ptr keeps track of the material used with the hit_record
-    shared_ptr<Material> mat_ptr;
+    // It doesn't own the material, the scene does (see scene.h), so filling
+    // and copying hit records never touches a reference count
+    const Material* mat_ptr = nullptr;
 
-    double t;
+    real t;
+    // How far p may be from the exact hit point, because of rounding
+    // errors. Rays leaving the surface start this far away from it
+    real error = 0;
     // We somehow need to keep track of whether the ray
     // intersected on the front face or from the inside
     bool front_face;
@@ -30,7 +42,96 @@ struct hit_record {
     }
 };
 
+/**
+ * Rounding errors scale with the size of the numbers involved, so the error
+ * bound of a hit is this times the largest coordinate that went into it.
+ * Machine epsilon is about 1e-16 for double and 1e-7 for float, the factor
+ * covers the handful of operations between the inputs and the result.
+ **/
+const real SELF_HIT_EPSILON = 8 * std::numeric_limits<real>::epsilon();
+
+/**
+ * A ray leaving the surface hit at rec in direction.
+ *
+ * The computed hit point is only close to the surface, it can be just
+ * under it, and a ray starting there finds the same surface again at t ~ 0
+ * (shadow acne). We used to skip every hit closer than t = 0.001, which is
+ * far too much for small objects and too little once the numbers are floats.
+ * Instead the ray starts rec.error away from the hit point along the normal,
+ * on the side it is going to, which is always outside the error bound.
+ **/
+inline Ray spawn_ray(const hit_record& rec, const Vec3& direction) {
+    auto offset = rec.error * rec.normal;
+    return Ray(dot(direction, rec.normal) > 0 ? rec.p + offset : rec.p - offset, direction);
+}
+
 class Hittable {
 public:
-    virtual bool hit(const Ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-};
\ No newline at end of file
+    virtual ~Hittable() = default;
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+
+    // Sets output_box to a box that contains the whole object, and returns
+    // false if the object has no finite bounds
+    virtual bool bounding_box(AABB& output_box) const = 0;
+
+    /**
+     * Does the ray hit anything between t_min and t_max. A shadow ray only
+     * needs to know whether something is in the way, not what is closest,
+     * so an object can stop at the first hit it finds and skip filling in a
+     * hit record. Objects that can answer faster than hit override this.
+     **/
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    /**
+     * Find the closest hit for every ray of the packet, hits[k] tells whether
+     * ray k hit anything and recs[k] is its hit record. Objects that can trace
+     * packets faster than one ray at a time override this, everything else
+     * just traces the rays one by one.
+     **/
+    virtual void hit_packet(
+        const RayPacket& packet, real t_min, real t_max, hit_record* recs, bool* hits
+    ) const {
+        for (int k = 0; k < packet.size; k++)
+            hits[k] = hit(packet.ray(k), t_min, t_max, recs[k]);
+    }
+
+    /**
+     * occluded for every ray of the packet, ray k between t_min and t_max[k]
+     * (shadow rays all have their own length). A t_max of -INF means the ray
+     * is already known to be blocked and doesn't need testing. Objects that
+     * can share work between the rays override this.
+     **/
+    virtual void occluded_packet(
+        const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+    ) const {
+        for (int k = 0; k < packet.size; k++)
+            occluded[k] = this->occluded(packet.ray(k), t_min, t_max[k]);
+    }
+};
+
+/**
+ * occluded for count rays at once, ray k between t_min and t_max[k]. The
+ * rays go through occluded_packet MAX_PACKET_SIZE at a time, in the order
+ * they are given, so rays that go about the same way should be next to each
+ * other.
+ **/
+inline void occluded_rays(
+    const Hittable& world, std::size_t count, const Ray* rays, real t_min, const real* t_max, bool* occluded
+) {
+    RayPacket packet;
+    real packet_t_max[MAX_PACKET_SIZE];
+    for (std::size_t first = 0; first < count; first += MAX_PACKET_SIZE) {
+        auto n = std::min<std::size_t>(MAX_PACKET_SIZE, count - first);
+        packet.size = 0;
+        for (std::size_t k = 0; k < n; k++) {
+            packet.add(rays[first + k]);
+            packet_t_max[k] = t_max[first + k];
+        }
+        packet.pad();
+        world.occluded_packet(packet, t_min, packet_t_max, occluded + first);
+    }
+}
\ No newline at end of file
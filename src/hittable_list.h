@@ -26,17 +26,49 @@ public:
         objects.push_back(object);
     }
 
-    virtual bool hit(const Ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool bounding_box(AABB& output_box) const override;
+
+    // Any object in the way will do, so stop at the first one
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        for (const auto& object : objects)
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+
+    // Every object gets the whole packet, the rays it blocks are left out for the next ones
+    virtual void occluded_packet(
+        const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+    ) const override {
+        real remaining[MAX_PACKET_SIZE];
+        for (int k = 0; k < packet.size; k++) {
+            remaining[k] = t_max[k];
+            occluded[k] = false;
+        }
+        bool blocked[MAX_PACKET_SIZE];
+        for (const auto& object : objects) {
+            object->occluded_packet(packet, t_min, remaining, blocked);
+            bool all = true;
+            for (int k = 0; k < packet.size; k++) {
+                if (blocked[k]) {
+                    occluded[k] = true;
+                    remaining[k] = -INF;
+                }
+                all = all && occluded[k];
+            }
+            if (all)
+                return;
+        }
+    }
 };
 
-bool HittableList::hit(const Ray& r, double t_min, double t_max, hit_record& rec) const {
+bool HittableList::hit(const Ray& r, real t_min, real t_max, hit_record& rec) const {
     // As we did in other hittables the function returns true if the object is hit
     // else false and also change the hit_record.
     // We do the same thing here except for the fact that we check for every object
     // in the objects vector and return accordingly
 
-    // a temp record
-    hit_record temp_rec;
     bool hit_anything = false;
 
     // As we only care about the objects that are closest to the ray
@@ -47,18 +79,33 @@ bool HittableList::hit(const Ray& r, double t_min, double t_max, hit_record& rec
     // iterate over all the object in objects
     for (const auto& object : objects) {
         // If the object gets hit
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        // An object only writes to rec when it is hit closer than closest_so_far,
+        // so we can hand it rec directly instead of copying from a temp record
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             // Change hit anything to true
             hit_anything =  true;
             // Update closest so far, as in next iteration we only care
             // about if the object is more closer than the previous object
-            closest_so_far = temp_rec.t;
-
-            // change the rec to temp_record
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
     // return hit_anythin
     return hit_anything;
 }
+
+bool HittableList::bounding_box(AABB& output_box) const {
+    // The box around the list is the box around the boxes of all the objects
+    if (objects.empty()) return false;
+
+    AABB temp_box;
+    output_box = AABB();
+
+    for (const auto& object : objects) {
+        // If any object is unbounded the whole list is
+        if (!object->bounding_box(temp_box)) return false;
+        output_box.expand(temp_box);
+    }
+
+    return true;
+}
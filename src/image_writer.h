@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+#include "deflate.h"
+
+/**
+ * Writers for the rendered image, and a reader for PFM.
+ *
+ *   ppm  binary PPM (P6), 8 bit gamma corrected, no compression
+ *   png  8 bit gamma corrected, compressed with deflate.h
+ *   pfm  Portable Float Map, 32 bit floats of the linear radiance, keeps
+ *        everything brighter than 1 for tone mapping or comparing renders
+ *
+ * The old text P3 file went through operator<< three times per pixel, which
+ * for a big image takes longer than some of the renders. These write the
+ * whole image with a single call.
+ **/
+enum class ImageFormat { PPM, PNG, PFM };
+
+// Parses a format name, returns false if it isn't one we know
+inline bool parse_image_format(const std::string& name, ImageFormat& format) {
+    if (name == "ppm") format = ImageFormat::PPM;
+    else if (name == "png") format = ImageFormat::PNG;
+    else if (name == "pfm") format = ImageFormat::PFM;
+    else return false;
+    return true;
+}
+
+// Guesses the format from the file extension, PNG if there is none we know
+inline ImageFormat image_format_for_path(const std::string& path) {
+    ImageFormat format = ImageFormat::PNG;
+    auto dot = path.rfind('.');
+    if (dot != std::string::npos)
+        parse_image_format(path.substr(dot + 1), format);
+    return format;
+}
+
+inline void write_ppm(std::ostream& out, const Framebuffer& image) {
+    auto bytes = image.to_rgb8();
+    out << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+namespace png_detail {
+
+inline void put_u32(std::vector<uint8_t>& out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(v >> shift));
+}
+
+inline void write_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> chunk;
+    put_u32(chunk, static_cast<uint32_t>(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    // The checksum covers the type and the data, not the length
+    put_u32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+    out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/**
+ * PNG stores every row after a filter that predicts each byte from its
+ * neighbours, smooth images turn into mostly small numbers that compress
+ * much better. We try all five filters on each row and keep the one with the
+ * smallest sum of absolute values, the usual rule of thumb.
+ **/
+inline std::vector<uint8_t> filter_rows(const std::vector<uint8_t>& rgb, int width, int height) {
+    const int BPP = 3;
+    std::size_t stride = static_cast<std::size_t>(width) * BPP;
+    std::vector<uint8_t> out;
+    out.reserve((stride + 1) * height);
+
+    std::vector<uint8_t> zero(stride, 0);
+    std::vector<uint8_t> candidate[5];
+    for (auto& c : candidate)
+        c.resize(stride);
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = &rgb[y * stride];
+        const uint8_t* up = y > 0 ? &rgb[(y - 1) * stride] : zero.data();
+
+        for (std::size_t x = 0; x < stride; x++) {
+            int a = x >= BPP ? row[x - BPP] : 0;
+            int b = up[x];
+            int c = x >= BPP ? up[x - BPP] : 0;
+            candidate[0][x] = row[x];
+            candidate[1][x] = static_cast<uint8_t>(row[x] - a);
+            candidate[2][x] = static_cast<uint8_t>(row[x] - b);
+            candidate[3][x] = static_cast<uint8_t>(row[x] - (a + b) / 2);
+            candidate[4][x] = static_cast<uint8_t>(row[x] - paeth(a, b, c));
+        }
+
+        int best = 0;
+        uint64_t best_cost = UINT64_MAX;
+        for (int f = 0; f < 5; f++) {
+            uint64_t cost = 0;
+            for (auto v : candidate[f])
+                cost += v < 128 ? v : 256 - v;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = f;
+            }
+        }
+
+        out.push_back(static_cast<uint8_t>(best));
+        out.insert(out.end(), candidate[best].begin(), candidate[best].end());
+    }
+    return out;
+}
+
+} // namespace png_detail
+
+inline void write_png(std::ostream& out, const Framebuffer& image) {
+    using namespace png_detail;
+
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.write(reinterpret_cast<const char*>(SIGNATURE), sizeof(SIGNATURE));
+
+    std::vector<uint8_t> header;
+    put_u32(header, static_cast<uint32_t>(image.width));
+    put_u32(header, static_cast<uint32_t>(image.height));
+    // 8 bits per channel, RGB, deflate, adaptive filters, no interlacing
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });
+    write_chunk(out, "IHDR", header);
+
+    auto filtered = filter_rows(image.to_rgb8(), image.width, image.height);
+    write_chunk(out, "IDAT", zlib_compress(filtered));
+    write_chunk(out, "IEND", {});
+}
+
+inline void write_pfm(std::ostream& out, const Framebuffer& image) {
+    // A negative scale means little endian floats
+    uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<uint8_t*>(&probe) == 1;
+    out << "PF\n" << image.width << ' ' << image.height << '\n'
+        << (little_endian ? "-1.0" : "1.0") << '\n';
+
+    // PFM stores the bottom row first
+    std::vector<float> row(static_cast<std::size_t>(image.width) * 3);
+    for (int y = image.height - 1; y >= 0; y--) {
+        for (int x = 0; x < image.width; x++) {
+            const auto& c = image.at(x, y);
+            row[3*x + 0] = static_cast<float>(c[0]);
+            row[3*x + 1] = static_cast<float>(c[1]);
+            row[3*x + 2] = static_cast<float>(c[2]);
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+/**
+ * Reads a PFM written by write_pfm back, so renders can be compared with a
+ * reference. Returns false if the file is missing or isn't a color PFM.
+ **/
+inline bool read_pfm(const std::string& path, Framebuffer& image) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0)
+        return false;
+    // Exactly one whitespace character separates the header from the data
+    in.get();
+
+    uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<uint8_t*>(&probe) == 1;
+    bool swap = (scale < 0) != little_endian;
+
+    image = Framebuffer(width, height);
+    std::vector<float> row(static_cast<std::size_t>(width) * 3);
+    for (int y = height - 1; y >= 0; y--) {
+        if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float)))
+            return false;
+        for (std::size_t k = 0; k < row.size(); k++) {
+            if (swap) {
+                uint8_t* b = reinterpret_cast<uint8_t*>(&row[k]);
+                std::swap(b[0], b[3]);
+                std::swap(b[1], b[2]);
+            }
+        }
+        for (int x = 0; x < width; x++)
+            image.at(x, y) = Color(row[3*x + 0], row[3*x + 1], row[3*x + 2]);
+    }
+    return true;
+}
+
+inline void write_image(std::ostream& out, const Framebuffer& image, ImageFormat format) {
+    switch (format) {
+        case ImageFormat::PPM: write_ppm(out, image); break;
+        case ImageFormat::PNG: write_png(out, image); break;
+        case ImageFormat::PFM: write_pfm(out, image); break;
+    }
+}
+
+// Writes the image to path, "-" writes to the standard output. Returns false if the file can't be written
+inline bool write_image(const std::string& path, const Framebuffer& image, ImageFormat format) {
+    if (path == "-") {
+        write_image(std::cout, image, format);
+        return static_cast<bool>(std::cout.flush());
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    write_image(file, image, format);
+    return static_cast<bool>(file.flush());
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "utility.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+
+/**
+ * An affine transform, a 3x3 matrix for the rotation, scale and shear
+ * followed by a translation: p' = M p + t. Stored as the three rows of the
+ * 3x4 matrix [M | t].
+ **/
+class Transform {
+public:
+    real m[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+public:
+    Transform() {}
+
+    static Transform translate(const Vec3& offset) {
+        Transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    static Transform scale(const Vec3& factors) {
+        Transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = factors[i];
+        return t;
+    }
+
+    // A rotation by degrees around axis, counter clockwise looking down the axis
+    static Transform rotate(const Vec3& axis, real degrees) {
+        auto a = unit_vector(axis);
+        auto theta = degrees_to_radians(degrees);
+        real s = std::sin(theta), c = std::cos(theta), k = 1 - c;
+
+        // Rodrigues' rotation formula written out as a matrix
+        Transform t;
+        t.m[0][0] = c + a[0]*a[0]*k;      t.m[0][1] = a[0]*a[1]*k - a[2]*s; t.m[0][2] = a[0]*a[2]*k + a[1]*s;
+        t.m[1][0] = a[1]*a[0]*k + a[2]*s; t.m[1][1] = c + a[1]*a[1]*k;      t.m[1][2] = a[1]*a[2]*k - a[0]*s;
+        t.m[2][0] = a[2]*a[0]*k - a[1]*s; t.m[2][1] = a[2]*a[1]*k + a[0]*s; t.m[2][2] = c + a[2]*a[2]*k;
+        return t;
+    }
+
+    // The transform that applies other first and then this one
+    Transform operator* (const Transform& other) const {
+        Transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                t.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j]
+                          + (j == 3 ? m[i][3] : 0);
+            }
+        }
+        return t;
+    }
+
+    real determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+             - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+             + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // The transform that undoes this one, M must not be singular
+    Transform inverse() const {
+        // The inverse of M is its adjugate divided by its determinant, the
+        // rows of the adjugate are cross products of the columns of M
+        Vec3 c0(m[0][0], m[1][0], m[2][0]);
+        Vec3 c1(m[0][1], m[1][1], m[2][1]);
+        Vec3 c2(m[0][2], m[1][2], m[2][2]);
+        Vec3 rows[3] = { cross(c1, c2), cross(c2, c0), cross(c0, c1) };
+        real inv_det = 1 / dot(c0, rows[0]);
+
+        Transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                t.m[i][j] = rows[i][j] * inv_det;
+            t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+        }
+        return t;
+    }
+
+    Point3 point(const Point3& p) const {
+        return Point3(
+            m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+            m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+            m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]
+        );
+    }
+
+    // Directions don't move with the translation
+    Vec3 vector(const Vec3& v) const {
+        return Vec3(
+            m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+            m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+            m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]
+        );
+    }
+
+    // M transposed times v. A normal goes through the inverse transposed, so
+    // an Instance transforms its normals with this on the inverse transform
+    Vec3 transposed_vector(const Vec3& v) const {
+        return Vec3(
+            m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+            m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+            m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]
+        );
+    }
+
+    /**
+     * The box around the transformed box. Instead of transforming all eight
+     * corners, every entry of M adds its smaller and larger product to the
+     * new minimum and maximum (Arvo's method).
+     **/
+    AABB box(const AABB& b) const {
+        AABB out;
+        for (int i = 0; i < 3; i++) {
+            out.minimum[i] = out.maximum[i] = m[i][3];
+            for (int j = 0; j < 3; j++) {
+                auto lo = m[i][j] * b.minimum[j];
+                auto hi = m[i][j] * b.maximum[j];
+                out.minimum[i] += std::min(lo, hi);
+                out.maximum[i] += std::max(lo, hi);
+            }
+        }
+        return out;
+    }
+
+    // How much longer a vector can get, at most. Used to scale the error
+    // bound of a hit point
+    real max_stretch() const {
+        real worst = 0;
+        for (int i = 0; i < 3; i++)
+            worst = std::max(worst, std::fabs(m[i][0]) + std::fabs(m[i][1]) + std::fabs(m[i][2]));
+        return worst;
+    }
+};
+
+/**
+ * A copy of some geometry placed in the world with a transform, and
+ * optionally a different material.
+ *
+ * The geometry (a PackedSpheres, a BVH, a mesh) lives once in memory with
+ * its own tree. An instance only keeps a pointer to it and the transform, so
+ * a thousand copies of a detailed object cost a thousand transforms and not
+ * a thousand copies of the object.
+ *
+ * To test a ray, the ray is moved into the space of the geometry with the
+ * inverse transform. The direction isn't normalized again, so t along the
+ * moved ray is the same t as along the world ray, and the closest hit so far
+ * carries over between instances. The hit point and normal are moved back
+ * into the world afterwards.
+ **/
+class Instance : public Hittable {
+public:
+    // Not owned, the scene keeps the geometry alive
+    const Hittable* geometry = nullptr;
+    Transform object_to_world;
+    Transform world_to_object;
+    // Replaces the materials of the geometry if set
+    const Material* material = nullptr;
+public:
+    Instance() {}
+    Instance(const Hittable* g, const Transform& t, const Material* m = nullptr)
+        : geometry(g), object_to_world(t), world_to_object(t.inverse()), material(m) {}
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override {
+        Ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+        if (!geometry->hit(local, t_min, t_max, rec))
+            return false;
+        place_hit(rec);
+        return true;
+    }
+
+    // Nothing to move back into the world, just the ray into the geometry
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        Ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+        return geometry->occluded(local, t_min, t_max);
+    }
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        AABB local;
+        if (!geometry->bounding_box(local))
+            return false;
+        output_box = object_to_world.box(local);
+        return true;
+    }
+
+    /**
+     * Moves a hit of the geometry into the world. The normal goes through
+     * the inverse transposed matrix, which keeps it at a right angle to the
+     * surface under any scale or shear, and keeps its side: the dot product
+     * with the moved ray direction has the same sign as before, so front_face
+     * stays right. The error of the point grows with the transform, and the
+     * transform itself rounds once more.
+     **/
+    void place_hit(hit_record& rec) const {
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+        auto largest = std::max(std::fabs(rec.p[0]), std::max(std::fabs(rec.p[1]), std::fabs(rec.p[2])));
+        rec.error = rec.error * object_to_world.max_stretch() + SELF_HIT_EPSILON * largest;
+        if (material)
+            rec.mat_ptr = material;
+    }
+};
+
+/**
+ * The top level of a two level acceleration structure: a BVH over instances,
+ * whose geometry has a BVH of its own (the bottom level).
+ *
+ * The instances are kept by value in leaf order, so there is no allocation
+ * or reference count per instance, and a leaf's instances sit next to each
+ * other in memory. The top level tree is small, it only has a node per few
+ * instances, so the memory of a scene grows with its unique geometry.
+ **/
+class InstanceBvh : public Hittable {
+public:
+    std::vector<Instance> instances;
+    BvhTree tree;
+    AABB bounds;
+public:
+    InstanceBvh() {}
+    InstanceBvh(const std::vector<Instance>& list) {
+        std::vector<AABB> boxes;
+        std::vector<const Instance*> bounded;
+        AABB box;
+        for (const auto& instance : list) {
+            if (!instance.bounding_box(box)) {
+                std::cerr << "InstanceBvh: skipping an instance without a bounding box" << '\n';
+                continue;
+            }
+            boxes.push_back(box);
+            bounded.push_back(&instance);
+            bounds.expand(box);
+        }
+
+        // Testing an instance is a trip into another tree, so leaves are kept small
+        tree.build(boxes, 2);
+        instances.reserve(bounded.size());
+        for (auto k : tree.prim_order)
+            instances.push_back(*bounded[k]);
+    }
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return tree.traverse(r, t_min, t_max,
+            [&](uint32_t first, uint32_t count, real& closest_so_far) {
+                bool hit_anything = false;
+                for (auto k = first; k < first + count; k++) {
+                    // Calls Instance::hit directly, not through the vtable
+                    if (instances[k].Instance::hit(r, t_min, closest_so_far, rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+                return hit_anything;
+            }
+        );
+    }
+
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+            for (auto k = first; k < first + count; k++)
+                if (instances[k].Instance::occluded(r, t_min, t_max))
+                    return true;
+            return false;
+        });
+    }
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        output_box = bounds;
+        return !instances.empty();
+    }
+
+    // Bytes used by the instances and the top level tree
+    std::size_t memory_bytes() const {
+        return instances.capacity() * sizeof(Instance) + tree.nodes.capacity() * sizeof(BvhNode)
+             + tree.prim_order.capacity() * sizeof(uint32_t);
+    }
+};
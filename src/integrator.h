@@ -0,0 +1,442 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "utility.h"
+#include "arena.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "renderer.h"
+#include "stats.h"
+
+static_assert(MATERIAL_TYPE_COUNT <= STATS_MAX_MATERIAL_TYPES, "RenderStats needs room for every material type");
+
+// Settings shared by all the ways of tracing a path
+struct PathSettings {
+    // Max depth is the ray bounce limit
+    int max_depth = 50;
+    // Russian roulette starts after this many bounces
+    int rr_depth = 5;
+    // The lights sampled at every diffuse bounce, none if null (see lights.h)
+    const LightList* lights = nullptr;
+    // The sky gradient is multiplied by this
+    Color sky = Color(1, 1, 1);
+};
+
+/**
+ * A shadow ray stops this much (relative to its length) short of the point
+ * on the light, so it doesn't find the light itself.
+ **/
+const real SHADOW_RAY_SHORTENING = 1e-4;
+
+// The color of the sky seen along a ray which didn't hit anything
+inline Color sky_color(const Ray& r) {
+    // Get the unit vector from the ray
+    // Think of a unit vector as a vector which gets
+    // us the direction of the vector by dividing by the length
+
+    // Note: that each value in unit_direction ranges from -1 to 1
+    Vec3 unit_direction = unit_vector(r.direction());
+
+    // Note that y for unit vector for pixels at the top will be more
+    // y for unit vector at center will be 0
+    // y for unit vector at bottom will be less than 0
+
+    // t goes from 0 to 1 vertical direction
+    // try changing unit_direction[1] to [0] what do you see?
+    auto t = 1 - (0.5 * (unit_direction[1] + 1));
+
+    // Start of the gradiend (Sky blue)
+    Color startColor(0.5, 0.7, 1.0);
+    // End of the gradient (White)
+    Color endColor(1, 1, 1);
+
+    // We should see a gradient where at the top is sky blue, and
+    // at the bottom is white
+
+    // For t=1 it will return endColor and for t=0 it will return startColor
+    // This is also known as a linear blend
+    return startColor + t * (endColor - startColor);
+}
+
+/**
+ * Everything we need to know about a path while it is being traced.
+ *
+ * The old recursive ray_color multiplied the attenuation of each bounce on the
+ * way back out of the recursion. Multiplication doesn't care about the order,
+ * so we can just as well multiply them on the way in: throughput is the product
+ * of the attenuations so far, and when the path reaches the sky the sky color
+ * times the throughput is the light it carries back to the camera.
+ **/
+struct PathState {
+    Ray ray;
+    Color throughput = Color(1, 1, 1);
+    Color radiance = Color(0, 0, 0);
+    // Number of rays traced so far
+    int depth = 0;
+    bool alive = true;
+    // The chance the last bounce picked the direction of ray with, 0 for the
+    // camera ray and for mirrors and glass, whose light wasn't sampled
+    real scatter_pdf = 0;
+};
+
+// The path didn't hit anything, it picks up the sky and ends
+inline void miss_path(PathState& path, const PathSettings& settings) {
+    path.radiance += path.throughput * settings.sky * sky_color(path.ray);
+    path.alive = false;
+    RT_STAT(thread_stats().escaped++);
+}
+
+/**
+ * The path hit the world and the material scattered it (did_scatter), set up
+ * the ray for the next bounce. Returns false if the path ended.
+ *
+ * Russian roulette: after a few bounces most paths carry very little light,
+ * tracing them all the way to max_depth is wasted time. Instead we stop the
+ * path at random, with a higher chance the darker it is. The paths that
+ * survive are divided by their chance of surviving, which makes up for the
+ * ones we stopped, so on average the image stays the same.
+ **/
+inline bool continue_path(
+    PathState& path, bool did_scatter, const Color& attenuation, const Ray& scattered,
+    const PathSettings& settings
+) {
+    // The material absorbed the ray
+    if (!did_scatter) {
+        path.alive = false;
+        RT_STAT(thread_stats().absorbed_paths++);
+        return false;
+    }
+
+    path.throughput = path.throughput * attenuation;
+    path.ray = scattered;
+
+    // If we reach the max depth limit the path carries no more light
+    if (path.depth >= settings.max_depth) {
+        path.alive = false;
+        RT_STAT(thread_stats().max_depth_paths++);
+        return false;
+    }
+
+    if (path.depth >= settings.rr_depth) {
+        auto p = std::max(path.throughput[0], std::max(path.throughput[1], path.throughput[2]));
+        p = clamp(p, 0.05, 1.0);
+        if (random_double() >= p) {
+            path.alive = false;
+            RT_STAT(thread_stats().roulette_paths++);
+            return false;
+        }
+        path.throughput /= p;
+    }
+
+    return true;
+}
+
+// A ray toward a light, and the light it brings to its path if nothing is in the way
+struct ShadowRay {
+    Ray ray;
+    real t_max;
+    Color radiance;
+};
+
+/**
+ * Next event estimation: the light reaching rec straight from a light,
+ * through a shadow ray toward a point on one of them. Returns false if there
+ * is nothing to test, otherwise sets shadow to the ray and the light it
+ * would add to the path. Testing it is left to the caller, so the wavefront
+ * tracer can test the shadow rays of all its paths together.
+ *
+ * The same light is also found when the bounce after this one happens to go
+ * into a light. Both ways are kept and weighed with the power heuristic,
+ * here by the chance of the light sample against the chance the material
+ * would have picked the same direction, in add_emitted the other way around.
+ * A big light close by is better found by the bounce, a small one by the
+ * light sample, and neither of them counts twice.
+ **/
+template <typename Model>
+bool sample_direct_light(
+    const PathState& path, const hit_record& rec, const Model& m, const PathSettings& settings, ShadowRay& shadow
+) {
+    if (!settings.lights || settings.lights->empty())
+        return false;
+    thread_sampler().start_light(path.depth);
+    auto u_pick = random_double();
+    auto u1 = random_double();
+    auto u2 = random_double();
+
+    LightSample light;
+    if (!settings.lights->sample(rec.p, u_pick, u1, u2, light))
+        return false;
+    real bsdf_pdf;
+    auto f = m.evaluate(path.ray, rec, light.direction, bsdf_pdf);
+    // The light is behind the surface
+    if (bsdf_pdf <= 0)
+        return false;
+
+    auto weight = power_heuristic(light.pdf, bsdf_pdf);
+    shadow.ray = spawn_ray(rec, light.direction);
+    shadow.t_max = light.distance * (1 - SHADOW_RAY_SHORTENING);
+    shadow.radiance = path.throughput * f * light.emit * (weight / light.pdf);
+    return true;
+}
+
+// The shadow ray was tested, it adds its light unless it was blocked
+inline void finish_shadow_ray(PathState& path, const ShadowRay& shadow, bool blocked) {
+    thread_ray_count()++;
+    RT_STAT(thread_stats().shadow_rays++);
+    if (blocked) {
+        RT_STAT(thread_stats().shadow_rays_blocked++);
+        return;
+    }
+    path.radiance += shadow.radiance;
+}
+
+// The light the surface at rec gives off itself
+template <typename Model>
+void add_emitted(PathState& path, const hit_record& rec, const Model& m, const PathSettings& settings) {
+    auto emitted = m.emitted(rec);
+    if (emitted[0] > 0 || emitted[1] > 0 || emitted[2] > 0) {
+        // Weighed against the chance of sampling this light directly at the
+        // last bounce, if it was sampled there
+        real weight = 1;
+        if (settings.lights && path.scatter_pdf > 0)
+            weight = power_heuristic(path.scatter_pdf, settings.lights->pdf(path.ray, rec.t));
+        path.radiance += weight * path.throughput * emitted;
+    }
+}
+
+// m (the type-th model) scatters the path at rec, returns false if the path ended
+template <typename Model>
+bool scatter_hit(
+    PathState& path, const hit_record& rec, const Model& m, [[maybe_unused]] std::size_t type,
+    const PathSettings& settings
+) {
+    Color attenuation;
+    Ray scattered;
+    thread_sampler().start_bounce(path.depth);
+    bool did_scatter = m.scatter(path.ray, rec, attenuation, scattered);
+    RT_STAT(thread_stats().count_scatter(type, did_scatter));
+    path.scatter_pdf = 0;
+    if (settings.lights && did_scatter && Model::SAMPLES_LIGHTS)
+        m.evaluate(path.ray, rec, scattered.direction(), path.scatter_pdf);
+    return continue_path(path, did_scatter, attenuation, scattered, settings);
+}
+
+/**
+ * The path hit rec on a surface of model m (the type-th model): it picks up
+ * the light the surface gives off and the light sampled from the lights, then
+ * m scatters it. Returns false if the path ended.
+ **/
+template <typename Model>
+bool shade_hit(
+    PathState& path, const hit_record& rec, const Model& m, std::size_t type,
+    const Hittable& world, const PathSettings& settings
+) {
+    add_emitted(path, rec, m, settings);
+    if constexpr (Model::SAMPLES_LIGHTS) {
+        ShadowRay shadow;
+        if (sample_direct_light(path, rec, m, settings, shadow))
+            finish_shadow_ray(path, shadow, world.occluded(shadow.ray, 0, shadow.t_max));
+    }
+    return scatter_hit(path, rec, m, type, settings);
+}
+
+// Same as shade_hit, for a hit whose material model isn't known up front
+inline bool scatter_path(PathState& path, const hit_record& rec, const Hittable& world, const PathSettings& settings) {
+    auto type = rec.mat_ptr->type();
+    return std::visit([&](const auto& m) {
+        return shade_hit(path, rec, m, type, world, settings);
+    }, rec.mat_ptr->model);
+}
+
+// Follow the path until it leaves the scene or ends, and return the light it brings back
+inline Color trace_path(PathState path, const Hittable& world, const PathSettings& settings) {
+    hit_record rec;
+
+    while (path.alive) {
+        // Count the rays for the throughput report
+        thread_ray_count()++;
+        path.depth++;
+        RT_STAT(thread_stats().count_ray(path.depth));
+
+        // The rays start just off the surface they left (see spawn_ray), so
+        // every hit in front of the origin counts
+        if (world.hit(path.ray, 0, INF, rec))
+            scatter_path(path, rec, world, settings);
+        else
+            miss_path(path, settings);
+    }
+
+    return path.radiance;
+}
+
+inline Color trace_path(const Ray& r, const Hittable& world, const PathSettings& settings) {
+    PathState path;
+    path.ray = r;
+    return trace_path(path, world, settings);
+}
+
+/**
+ * The color of a primary ray r that was already traced and hit the world at
+ * rec (by a ray packet for example), follows the rest of the path.
+ **/
+inline Color trace_path_from_hit(
+    const Ray& r, const hit_record& rec, const Hittable& world, const PathSettings& settings
+) {
+    PathState path;
+    path.ray = r;
+    path.depth = 1;
+    scatter_path(path, rec, world, settings);
+    return trace_path(path, world, settings);
+}
+
+/**
+ * Wavefront path tracing.
+ *
+ * Instead of following one path from start to end, we keep a whole batch of
+ * paths in flight and push all of them through one stage at a time:
+ *   extend   find the closest hit of every active path
+ *   shade    paths that missed pick up the sky, the rest are sorted by material
+ *            type, pick up the light of their hit and scatter off their
+ *            material, one type at a time
+ *   shadow   the shadow rays toward the lights the shade stage picked are
+ *            tested together, with occluded_rays
+ *   compact  the paths that are still alive become the queue for the next bounce
+ * Each stage is a tight loop doing the same work for many paths, which keeps the
+ * same code and data hot in the cache.
+ *
+ * Every path has its own sampler, so it draws exactly the random numbers it
+ * would draw if it was traced on its own, the image is the same as trace_path.
+ *
+ * The queues are taken from the thread's scratch arena and given back at the
+ * end of trace, so once the arena is big enough a batch doesn't allocate.
+ **/
+class WavefrontTracer {
+private:
+    struct PathSlot {
+        PathState path;
+        Sampler sampler;
+        // Which pixel of the batch the path belongs to
+        std::size_t pixel;
+    };
+public:
+    /**
+     * Trace samples [s0, s1) of every pixel in pixel_count pixels.
+     * start_path(p, s) sets up the thread sampler for sample s of pixel p and
+     * returns its primary ray, the radiance is added to colors[p].
+     **/
+    template <typename StartFn>
+    void trace(
+        const Hittable& world, const PathSettings& settings,
+        std::size_t pixel_count, int s0, int s1, StartFn start_path, Color* colors
+    ) {
+        auto& scratch = thread_scratch();
+        ArenaScope scope(scratch);
+
+        const std::size_t path_count = pixel_count * static_cast<std::size_t>(std::max(s1 - s0, 0));
+        auto slots = scratch.allocate_array<PathSlot>(path_count);
+        // Indices into slots of the paths that are still alive
+        auto active = scratch.allocate_array<uint32_t>(path_count);
+        auto recs = scratch.allocate_array<hit_record>(path_count);
+        auto hits = scratch.allocate_array<char>(path_count);
+        // The active paths that hit something, sorted by material type
+        auto sorted = scratch.allocate_array<uint32_t>(path_count);
+        // The shadow rays of a bounce, and the path each one belongs to
+        auto shadows = scratch.allocate_array<ShadowRay>(path_count);
+        auto shadow_paths = scratch.allocate_array<uint32_t>(path_count);
+        auto shadow_rays = scratch.allocate_array<Ray>(path_count);
+        auto shadow_t_max = scratch.allocate_array<real>(path_count);
+        auto blocked = scratch.allocate_array<bool>(path_count);
+
+        // Generate all the primary rays
+        std::size_t active_count = 0;
+        for (std::size_t p = 0; p < pixel_count; p++) {
+            for (int s = s0; s < s1; s++) {
+                auto& slot = slots[active_count];
+                slot.path.ray = start_path(p, s);
+                slot.sampler = thread_sampler();
+                slot.pixel = p;
+                active[active_count] = static_cast<uint32_t>(active_count);
+                active_count++;
+            }
+        }
+
+        while (active_count > 0) {
+            // Extend
+            for (std::size_t a = 0; a < active_count; a++) {
+                auto k = active[a];
+                auto& path = slots[k].path;
+                thread_ray_count()++;
+                path.depth++;
+                RT_STAT(thread_stats().count_ray(path.depth));
+                hits[k] = world.hit(path.ray, 0, INF, recs[k]);
+            }
+
+            // Shade, the misses first, then sort the hits by material type
+            std::size_t type_start[MATERIAL_TYPE_COUNT + 1] = {};
+            for (std::size_t a = 0; a < active_count; a++) {
+                auto k = active[a];
+                if (!hits[k])
+                    miss_path(slots[k].path, settings);
+                else
+                    type_start[recs[k].mat_ptr->type() + 1]++;
+            }
+            for (std::size_t t = 0; t < MATERIAL_TYPE_COUNT; t++)
+                type_start[t + 1] += type_start[t];
+
+            std::size_t type_end[MATERIAL_TYPE_COUNT];
+            std::copy(type_start, type_start + MATERIAL_TYPE_COUNT, type_end);
+            for (std::size_t a = 0; a < active_count; a++) {
+                auto k = active[a];
+                if (hits[k])
+                    sorted[type_end[recs[k].mat_ptr->type()]++] = k;
+            }
+
+            // One loop per material type, each calls that type's functions directly
+            std::size_t shadow_count = 0;
+            for_each_material_type([&](auto type) {
+                constexpr std::size_t I = decltype(type)::value;
+                using Model = std::variant_alternative_t<I, MaterialModel>;
+                for (std::size_t n = type_start[I]; n < type_start[I + 1]; n++) {
+                    auto k = sorted[n];
+                    auto& slot = slots[k];
+                    const auto& m = std::get<I>(recs[k].mat_ptr->model);
+                    thread_sampler() = slot.sampler;
+                    add_emitted(slot.path, recs[k], m, settings);
+                    if constexpr (Model::SAMPLES_LIGHTS) {
+                        if (sample_direct_light(slot.path, recs[k], m, settings, shadows[shadow_count]))
+                            shadow_paths[shadow_count++] = k;
+                    }
+                    scatter_hit(slot.path, recs[k], m, I, settings);
+                    slot.sampler = thread_sampler();
+                }
+            });
+
+            // Shadow, before the paths that ended are added to their pixels.
+            // The light of the hit comes before the light of the next bounce
+            // either way, so the sums are the same as trace_path's
+            if (shadow_count > 0) {
+                for (std::size_t n = 0; n < shadow_count; n++) {
+                    shadow_rays[n] = shadows[n].ray;
+                    shadow_t_max[n] = shadows[n].t_max;
+                }
+                occluded_rays(world, shadow_count, shadow_rays, 0, shadow_t_max, blocked);
+                for (std::size_t n = 0; n < shadow_count; n++)
+                    finish_shadow_ray(slots[shadow_paths[n]].path, shadows[n], blocked[n]);
+            }
+
+            // Compact
+            std::size_t alive = 0;
+            for (std::size_t a = 0; a < active_count; a++) {
+                auto k = active[a];
+                if (slots[k].path.alive)
+                    active[alive++] = k;
+                else
+                    colors[slots[k].pixel] += slots[k].path.radiance;
+            }
+            active_count = alive;
+        }
+    }
+};
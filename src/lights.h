@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "sampling.h"
+
+// A sphere that gives off light, from the outside
+struct SphereLight {
+    Point3 center;
+    real radius;
+    Color emit;
+};
+
+// A direction toward a light, picked by LightList::sample
+struct LightSample {
+    Vec3 direction;
+    // How far along direction the light is
+    real distance;
+    // The light it gives off along -direction
+    Color emit;
+    // The chance of picking direction, per unit of solid angle
+    real pdf;
+};
+
+/**
+ * The lights of a scene, for sampling them directly.
+ *
+ * A path that only finds a light by bouncing into it rarely does when the
+ * light is small, and the few paths that do make the bright speckles of a
+ * noisy render. At every diffuse bounce the integrator picks a point on a
+ * light instead and sends a shadow ray to it (next event estimation).
+ *
+ * A light is picked with a chance proportional to its power, the area of the
+ * sphere times how bright it is, so the lamps that light most of the scene
+ * get most of the shadow rays. Then a direction is picked inside the cone the
+ * sphere fills as seen from the point. Every direction in the cone hits the
+ * sphere, so unlike picking a point on its surface no sample is wasted on the
+ * back of the sphere, and the chance of a direction is the same everywhere in
+ * the cone: 1 / (2 pi (1 - cos theta_max)).
+ *
+ * The integrator also needs the chance that a path that did bounce into a
+ * light would have been sampled directly (see pdf), to weigh the two against
+ * each other. The lights are kept in a BVH for that.
+ **/
+class LightList {
+public:
+    std::vector<SphereLight> lights;
+private:
+    // cdf[k] is the chance of picking one of the lights before k, cdf[size] is 1
+    std::vector<real> cdf;
+    BvhTree tree;
+public:
+    LightList() {}
+
+    // Builds the tree and the power distribution, the lights can't change after this
+    explicit LightList(std::vector<SphereLight> all) {
+        std::vector<AABB> boxes;
+        for (const auto& light : all) {
+            auto extent = Vec3(light.radius, light.radius, light.radius);
+            boxes.emplace_back(light.center - extent, light.center + extent);
+        }
+        tree.build(boxes);
+        for (auto k : tree.prim_order)
+            lights.push_back(all[k]);
+
+        cdf.assign(lights.size() + 1, 0);
+        for (std::size_t k = 0; k < lights.size(); k++) {
+            const auto& e = lights[k].emit;
+            auto power = (0.2126 * e[0] + 0.7152 * e[1] + 0.0722 * e[2]) * lights[k].radius * lights[k].radius;
+            cdf[k + 1] = cdf[k] + std::max(real(0), static_cast<real>(power));
+        }
+        // Lights without any power are never picked, if that is all of them
+        // there is nothing to sample
+        if (cdf.back() <= 0) {
+            lights.clear();
+            cdf.assign(1, 0);
+            tree = BvhTree();
+            return;
+        }
+        auto total = cdf.back();
+        for (auto& c : cdf)
+            c /= total;
+    }
+
+    bool empty() const { return lights.empty(); }
+    std::size_t size() const { return lights.size(); }
+
+    /**
+     * Picks a light with u_pick and a direction toward it from origin with u1
+     * and u2. Returns false if there is nothing to sample, or origin is
+     * inside the light that was picked.
+     **/
+    bool sample(const Point3& origin, real u_pick, real u1, real u2, LightSample& s) const {
+        if (lights.empty())
+            return false;
+        auto k = static_cast<std::size_t>(std::upper_bound(cdf.begin() + 1, cdf.end() - 1, u_pick) - (cdf.begin() + 1));
+        const auto& light = lights[k];
+
+        Vec3 to_center = light.center - origin;
+        auto distance_sq = to_center.lengthSquared();
+        auto radius_sq = light.radius * light.radius;
+        if (distance_sq <= radius_sq)
+            return false;
+
+        // 1 - cos theta_max, written so it doesn't round to 0 for a far away light
+        auto sin2_max = radius_sq / distance_sq;
+        auto cos_max = std::sqrt(std::max(real(0), 1 - sin2_max));
+        auto one_minus_cos_max = sin2_max / (1 + cos_max);
+
+        // cos theta is uniform between cos theta_max and 1
+        auto one_minus_cos = u1 * one_minus_cos_max;
+        auto cos_theta = 1 - one_minus_cos;
+        auto sin_theta = std::sqrt(std::max(real(0), one_minus_cos * (2 - one_minus_cos)));
+        real sin_phi, cos_phi;
+        sincos_turns(u2, sin_phi, cos_phi);
+
+        auto w = to_center / std::sqrt(distance_sq);
+        Vec3 u, v;
+        basis(w, u, v);
+        s.direction = sin_theta * cos_phi * u + sin_theta * sin_phi * v + cos_theta * w;
+
+        // The near root of the ray against the sphere, at the edge of the
+        // cone rounding can push the discriminant just below 0
+        auto along = dot(to_center, s.direction);
+        auto discriminant = std::max(real(0), along * along - (distance_sq - radius_sq));
+        s.distance = along - std::sqrt(discriminant);
+        s.emit = light.emit;
+        s.pdf = (cdf[k + 1] - cdf[k]) / (2 * PI * one_minus_cos_max);
+        return s.distance > 0;
+    }
+
+    /**
+     * The chance that sample picks the direction of r, given that r hits a
+     * light at t. 0 if r doesn't hit any of the lights there, a light that
+     * isn't in the list can't be sampled.
+     **/
+    real pdf(const Ray& r, real t) const {
+        if (lights.empty())
+            return 0;
+        // The light that was hit, the one with a root closest to t
+        auto direction_length = r.direction().length();
+        real found = 0;
+        real closest_gap = INF;
+        auto t_min = t * real(0.999), t_max = t * real(1.001);
+        tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count, real&) {
+            for (auto k = first; k < first + count; k++) {
+                const auto& light = lights[k];
+                Vec3 oc = r.origin() - light.center;
+                auto a = direction_length * direction_length;
+                auto half_b = dot(oc, r.direction());
+                auto c = oc.lengthSquared() - light.radius * light.radius;
+                auto discriminant = half_b * half_b - a * c;
+                if (discriminant < 0 || c <= 0)
+                    continue;
+                auto root = (-half_b - std::sqrt(discriminant)) / a;
+                if (std::fabs(root - t) < closest_gap) {
+                    closest_gap = std::fabs(root - t);
+                    found = solid_angle_pdf(k, c + light.radius * light.radius);
+                }
+            }
+            return false;
+        });
+        return closest_gap <= t_max - t ? found : 0;
+    }
+private:
+    // The pdf of light k from a point distance_sq away from its center
+    real solid_angle_pdf(std::size_t k, real distance_sq) const {
+        auto sin2_max = lights[k].radius * lights[k].radius / distance_sq;
+        auto cos_max = std::sqrt(std::max(real(0), 1 - sin2_max));
+        return (cdf[k + 1] - cdf[k]) / (2 * PI * (sin2_max / (1 + cos_max)));
+    }
+
+    // Two unit vectors that make a frame with w (Duff et al., without branches on the sign)
+    static void basis(const Vec3& w, Vec3& u, Vec3& v) {
+        real sign = std::copysign(real(1), w[2]);
+        real a = -1 / (sign + w[2]);
+        real b = w[0] * w[1] * a;
+        u = Vec3(1 + sign * w[0] * w[0] * a, sign * b, -sign * w[0]);
+        v = Vec3(b, sign + w[1] * w[1] * a, -w[1]);
+    }
+};
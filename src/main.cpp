@@ -1,69 +1,105 @@
 #include "utility.h"
+#include "allocation_counter.h"
+#include "arena.h"
 #include "camera.h"
-#include "color.h"
+#include "framebuffer.h"
+#include "image_writer.h"
 #include "hittable_list.h"
+#include "bvh.h"
+#include "packed_spheres.h"
+#include "instance.h"
 #include "sphere.h"
 #include "material.h"
-
-Color ray_color(const Ray& r, const Hittable& , int max_depth);
-
-HittableList random_scene() {
-    HittableList world;
-
-    // random elements
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            Point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<Material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = Color::random() * Color::random();
-                    sphere_material = make_shared<Lambertian>(albedo);
-                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = Color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<Metal>(albedo, fuzz);
-                    world.  add(make_shared<Sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<Dielectric>(1.5);
-                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-                }
-            }
+#include "scene.h"
+#include "scenes.h"
+#include "scene_file.h"
+#include "options.h"
+#include "renderer.h"
+#include "integrator.h"
+#include "checkpoint.h"
+#include "adaptive.h"
+#include "animation.h"
+#include "run_summary.h"
+#include "stats.h"
+#include "heatmap.h"
+#include "denoiser.h"
+
+#include <chrono>
+
+// Count the allocations, to report how many the scene and the render took
+RT_COUNT_ALLOCATIONS()
+
+int main(int argc, char** argv) {
+    auto start = std::chrono::steady_clock::now();
+    auto options = parse_options(argc, argv);
+
+    /**
+     * The scene comes from a file, or is the book's random scene. That one is
+     * built from the seed, so that the same seed always gives the same scene
+     **/
+    auto load_start = std::chrono::steady_clock::now();
+    auto load_allocations = allocation_count();
+    Scene scene;
+    if (!options.scene.empty()) {
+        std::string error;
+        if (!load_scene(options.scene, scene, error)) {
+            std::cerr << "Could not load " << options.scene << ": " << error << '\n';
+            return EXIT_FAILURE;
         }
+    } else {
+        thread_sampler().seed(options.seed);
+        scene = random_scene();
+    }
+    std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+    load_allocations = allocation_count() - load_allocations;
+
+    std::cerr << "Loaded " << (options.scene.empty() ? "the random scene" : options.scene) << " ("
+              << scene.object_count() << " objects, ";
+    if (!scene.meshes.empty())
+        std::cerr << scene.triangle_count() << " triangles, ";
+    std::cerr << scene.materials.size() << " materials) in "
+              << load_time.count() * 1000 << "ms, " << load_allocations << " allocations" << '\n';
+
+    /**
+     * The command line wins over the scene. With only the width or only the
+     * height given, the other one follows from the aspect ratio of the scene
+     **/
+    auto& view = scene.settings;
+    if (options.width > 0 && options.height == 0)
+        view.image_height = std::max(2, static_cast<int>(options.width / view.aspect_ratio() + 0.5));
+    else if (options.height > 0 && options.width == 0)
+        view.image_width = std::max(2, static_cast<int>(options.height * view.aspect_ratio() + 0.5));
+    if (options.width > 0) view.image_width = options.width;
+    if (options.height > 0) view.image_height = options.height;
+    if (options.samples > 0) view.samples = options.samples;
+    if (options.max_depth > 0) view.max_depth = options.max_depth;
+
+    auto to_vec3 = [](const std::array<double, 3>& v) { return Vec3(v[0], v[1], v[2]); };
+    if (options.lookfrom) view.lookfrom = to_vec3(*options.lookfrom);
+    if (options.lookat) view.lookat = to_vec3(*options.lookat);
+    if (options.vup) view.vup = to_vec3(*options.vup);
+    if (options.vfov) view.vfov = *options.vfov;
+    if (options.aperture) view.aperture = *options.aperture;
+    if (options.focus_dist) view.focus_dist = *options.focus_dist;
+
+    if (!options.save_scene.empty()) {
+        if (!save_scene(options.save_scene, scene)) {
+            std::cerr << "Could not write " << options.save_scene << '\n';
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Wrote " << options.save_scene << '\n';
+        return EXIT_SUCCESS;
     }
 
-    // Basic elements
-    auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
-    auto metal = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-    auto dielectric = make_shared<Dielectric>(1.5);
-    auto lamber = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-
-    world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
-    world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, metal));
-    world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, dielectric));
-    world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, lamber));
-
-    return world;
-}
-
-int main() {
     // Image dimensions
-    auto aspect_ratio = 16.0 / 9.0;
-    const int IMAGE_WIDTH = 400;
-    const int IMAGE_HEIGHT = static_cast<int>(IMAGE_WIDTH / aspect_ratio);
+    const int IMAGE_WIDTH = scene.settings.image_width;
+    const int IMAGE_HEIGHT = scene.settings.image_height;
 
     // Number of samples to take for each pixel
     // When rendering a pixel, samples around the pixel will be taken
     // and then averaged to create a antialiased pixel
-    const int SAMPLES_PER_PIXEL = static_cast<int>(
-        clamp(90000000 / (IMAGE_WIDTH * IMAGE_HEIGHT), 1, 500)
+    const int SAMPLES_PER_PIXEL = scene.settings.samples > 0 ? scene.settings.samples : static_cast<int>(
+        clamp(90000000 / (static_cast<int64_t>(IMAGE_WIDTH) * IMAGE_HEIGHT), 1, 500)
     );
     // 1440 width results in about 130 samples per pixel
 
@@ -73,118 +109,694 @@ int main() {
     // So i just use a formula to determine the samples per pixel
     // I don't think its very good but works fine
 
-    // Max depth is the ray bounce limit
-    const int MAX_DEPTH = 50;
+    // The denoiser tells the noise of a pixel from two halves of its samples
+    if (options.denoise && SAMPLES_PER_PIXEL < 2) {
+        std::cerr << "--denoise needs at least 2 samples per pixel" << '\n';
+        return EXIT_FAILURE;
+    }
 
-    // PPM image headers
-    std::cout << "P3" << '\n'
-        << IMAGE_WIDTH << ' ' << IMAGE_HEIGHT << '\n'
-        << 255 << '\n';
+    // Max depth is the ray bounce limit
+    PathSettings path_settings;
+    path_settings.max_depth = scene.settings.max_depth;
+    path_settings.rr_depth = options.rr_depth;
+    path_settings.sky = scene.settings.sky;
+
+    // The lights sampled at every diffuse bounce
+    auto lights = scene.lights();
+    if (options.nee)
+        path_settings.lights = &lights;
+    if (!lights.empty())
+        std::cerr << "Sampling " << lights.size() << " lights" << (options.nee ? "" : " (off)") << '\n';
 
     // Camera
-    Point3 lookfrom(13, 2, 3);
-    Point3 lookat(0, 0, 0);
-    Vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    auto aperture = 0.1;
+    Camera camera(view.lookfrom, view.lookat, view.vup, view.vfov, view.aspect_ratio(),
+                  view.aperture, view.focus_dist);
+
+    /**
+     * Testing every ray against every sphere is slow, so by default we build a
+     * bounding volume hierarchy over the scene. The build time is reported on
+     * its own so it doesn't get mixed up with the time spent tracing rays.
+     *
+     * The packed spheres are the scene's own arrays, a binary scene file
+     * already comes with their tree and nothing needs to be built at all
+     **/
+    bool prebuilt = scene.spheres.committed && scene.spheres.use_tree;
+    std::string accel = !options.accel.empty() ? options.accel : prebuilt ? "packed-bvh" : "bvh";
+
+    for (auto& mesh : scene.meshes) {
+        mesh.use_simd = options.simd;
+        mesh.check_simd_limit();
+    }
 
-    Camera camera(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
+    auto build_start = std::chrono::steady_clock::now();
+    auto build_allocations = allocation_count();
+    shared_ptr<Hittable> world;
+    if (accel == "packed" || accel == "packed-bvh") {
+        if (!scene.objects.objects.empty())
+            std::cerr << "PackedSpheres: skipping the objects that are not spheres" << '\n';
+        bool use_tree = accel == "packed-bvh";
+        if (!scene.spheres.committed)
+            scene.spheres.commit(use_tree);
+        scene.spheres.use_tree = use_tree && !scene.spheres.tree.nodes.empty();
+        scene.spheres.use_simd = options.simd;
+        scene.spheres.check_simd_limit();
+        // The scene owns the spheres, the world only points at them
+        world = shared_ptr<Hittable>(shared_ptr<Hittable>(), &scene.spheres);
+        // The instances and meshes have trees of their own, they all sit side by side
+        if (!scene.instances.empty() || !scene.meshes.empty()) {
+            auto all = make_shared<HittableList>(world);
+            if (!scene.instances.empty())
+                all->add(make_shared<InstanceBvh>(scene.instances));
+            for (auto& mesh : scene.meshes)
+                all->add(shared_ptr<Hittable>(shared_ptr<Hittable>(), &mesh));
+            world = all;
+        }
+    } else if (accel == "bvh") {
+        // The spheres and their materials are laid out in the order of the leaves
+        world = scene.bvh();
+    } else {
+        world = make_shared<HittableList>(scene.hittables());
+    }
+    std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+    build_allocations = allocation_count() - build_allocations;
+
+    std::cerr << (prebuilt && accel == "packed-bvh" ? "Prepared prebuilt " : "Built ") << accel
+              << " over " << scene.object_count() << " objects in "
+              << build_time.count() * 1000 << "ms, " << build_allocations << " allocations";
+    if (scene.arena.bytes_used() > 0)
+        std::cerr << " (" << scene.arena.bytes_used() / 1024 << "KB of objects in the arena)";
+    std::cerr << '\n';
+
+    // The render threads, tiles of the image are spread over them
+    ThreadPool pool(options.threads);
+    std::cerr << "Rendering with " << pool.size() << " threads ("
+              << RT_SIMD_NAME << " kernels, " << RT_REAL_NAME << ")" << '\n';
+
+    // How the samples of a pixel are spread out, see SamplePattern
+    SamplerSettings sampler_settings;
+    parse_sample_pattern(options.sampler, sampler_settings.pattern);
+    sampler_settings.seed = options.seed;
+    sampler_settings.samples_per_pixel = SAMPLES_PER_PIXEL;
+
+    // Generates the ray for sample s of pixel (i, j)
+    auto camera_ray = [&](int i, int j, int s) {
+        // Every sample gets its own random sequence, this way the image
+        // does not depend on which thread rendered which pixel
+        thread_sampler().start_pixel_sample(sampler_settings, i, j, s);
+
+        // u specifies the horizontal distance, and goes from 0.0 to 1.0
+        auto u = double(i + random_double()) / (IMAGE_WIDTH-1);
+        // v specifies the vertical distance, and goes from 1.0 to 0.0
+        auto v = double(j + random_double()) / (IMAGE_HEIGHT-1);
+
+        // Get the ray from the camera
+        return camera.get_ray(u, v);
+    };
+
+    /**
+     * The sum of all the samples taken so far for every pixel, in scanline
+     * order. A pass adds samples [s0, s1) of every pixel on top of it, a normal
+     * render is just a single pass over all the samples.
+     **/
+    std::vector<Color> accum(static_cast<std::size_t>(IMAGE_WIDTH) * IMAGE_HEIGHT, Color(0, 0, 0));
+
+    // With adaptive sampling only the pixels marked here get more samples,
+    // the others keep what they have. Empty means every pixel is active
+    std::vector<char> active;
+    auto is_active = [&](int i, int j) {
+        return active.empty() || active[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, i, j)];
+    };
+
+    auto render_pass = [&](int s0, int s1) {
+        if (options.integrator == "wavefront") {
+            // Whole tiles of paths are traced together, one bounce at a time
+            return render_tile_tasks(pool, IMAGE_WIDTH, IMAGE_HEIGHT, options.tile_size,
+                [&](const Tile& tile, std::vector<Color>& pixels) {
+                    WavefrontTracer tracer;
+
+                    // The pixel lists come from the thread's scratch arena,
+                    // like the tracer's queues, and go back after the tile
+                    auto& scratch = thread_scratch();
+                    ArenaScope scope(scratch);
+                    auto tile_pixels = static_cast<std::size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+                    auto pi = scratch.allocate_array<int>(tile_pixels);
+                    auto pj = scratch.allocate_array<int>(tile_pixels);
+                    std::size_t count = 0;
+                    for (int j = tile.y0; j < tile.y1; j++) {
+                        for (int i = tile.x0; i < tile.x1; i++) {
+                            auto index = pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, i, j);
+                            pixels[index] = accum[index];
+                            if (is_active(i, j))
+                                pi[count] = i, pj[count++] = j;
+                        }
+                    }
+                    if (count == 0)
+                        return;
+
+                    auto colors = scratch.allocate_array<Color>(count);
+                    for (std::size_t p = 0; p < count; p++)
+                        colors[p] = accum[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, pi[p], pj[p])];
+
+                    // Keep a few thousand paths in flight at a time
+                    int batch = std::max(1, 4096 / static_cast<int>(count));
+                    for (int b0 = s0; b0 < s1; b0 += batch) {
+                        int b1 = std::min(b0 + batch, s1);
+                        tracer.trace(*world, path_settings, count, b0, b1,
+                            [&](std::size_t p, int s) { return camera_ray(pi[p], pj[p], s); },
+                            colors);
+                    }
+
+                    for (std::size_t p = 0; p < count; p++)
+                        pixels[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, pi[p], pj[p])] = colors[p];
+                }
+            );
+        } else if (options.packet_size == 0) {
+            // Every pixel is shaded independently, so the image can be cut into tiles
+            // and rendered on all the threads at once. The renderer gives the pixels
+            // back in scanline order, the same order the framebuffer keeps them in
+            return render_tiles(pool, IMAGE_WIDTH, IMAGE_HEIGHT, options.tile_size,
+                [&](int i, int j) {
+                    // Now we are iterating over every point on the scene
+
+                    // Start from the samples of the earlier passes
+                    Color pixel_color = accum[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, i, j)];
+                    if (!is_active(i, j))
+                        return pixel_color;
+
+                    // Take the samples of this pass for each pixel
+                    for (int s = s0; s < s1; s++) {
+                        Ray r = camera_ray(i, j, s);
+
+                        // Get the corresponding pixel color for the ray and the world
+                        pixel_color += trace_path(r, *world, path_settings);
+                    }
+
+                    return pixel_color;
+                }
+            );
+        } else {
+            /**
+             * Packet tracing. The primary rays of a small block of neighbouring
+             * pixels (2x2, 4x2 or 4x4) are traced through the world together as a
+             * packet. After the first bounce the scattered rays go in all sorts of
+             * directions, so from there on each ray is traced on its own.
+             *
+             * Each ray keeps a copy of its sampler, so after the packet is traced
+             * its bounces use the same random numbers they would have used without
+             * packets, and the image comes out the same.
+             **/
+            int block_w = options.packet_size >= 8 ? 4 : 2;
+            int block_h = options.packet_size / block_w;
+
+            return render_tile_tasks(pool, IMAGE_WIDTH, IMAGE_HEIGHT, options.tile_size,
+                [&](const Tile& tile, std::vector<Color>& pixels) {
+                    RayPacket packet;
+                    Sampler samplers[MAX_PACKET_SIZE];
+                    hit_record recs[MAX_PACKET_SIZE];
+                    bool hits[MAX_PACKET_SIZE];
+
+                    for (int y = tile.y0; y < tile.y1; y += block_h) {
+                        for (int x = tile.x0; x < tile.x1; x += block_w) {
+                            // The active pixels of this block, the blocks at the
+                            // edges of the tile may be smaller
+                            int pi[MAX_PACKET_SIZE], pj[MAX_PACKET_SIZE], count = 0;
+                            for (int j = y; j < std::min(y + block_h, tile.y1); j++) {
+                                for (int i = x; i < std::min(x + block_w, tile.x1); i++) {
+                                    auto index = pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, i, j);
+                                    pixels[index] = accum[index];
+                                    if (is_active(i, j))
+                                        pi[count] = i, pj[count++] = j;
+                                }
+                            }
+                            if (count == 0)
+                                continue;
+
+                            Color colors[MAX_PACKET_SIZE];
+                            for (int k = 0; k < count; k++)
+                                colors[k] = accum[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, pi[k], pj[k])];
+
+                            for (int s = s0; s < s1; s++) {
+                                packet.size = 0;
+                                for (int k = 0; k < count; k++) {
+                                    packet.add(camera_ray(pi[k], pj[k], s));
+                                    samplers[k] = thread_sampler();
+                                }
+                                packet.pad();
+
+                                thread_ray_count() += count;
+                                RT_STAT(thread_stats().rays_by_depth[0] += count);
+                                world->hit_packet(packet, 0, INF, recs, hits);
+
+                                for (int k = 0; k < count; k++) {
+                                    thread_sampler() = samplers[k];
+                                    auto r = packet.ray(k);
+                                    colors[k] += hits[k]
+                                        ? trace_path_from_hit(r, recs[k], *world, path_settings)
+                                        : path_settings.sky * sky_color(r);
+                                }
+                            }
+
+                            for (int k = 0; k < count; k++)
+                                pixels[pixel_index(IMAGE_WIDTH, IMAGE_HEIGHT, pi[k], pj[k])] = colors[k];
+                        }
+                    }
+                }
+            );
+        }
+    };
+
+    // Where the image goes, also used for the intermediate images
+    auto format = image_format_for_path(options.output);
+    if (!options.format.empty())
+        parse_image_format(options.format, format);
+
+    int samples_done = 0;
+    // The sums of the first half of the samples for the denoiser, see there
+    std::vector<Color> first_accum;
+    int first_samples = 0;
+    std::vector<int> first_pixel_samples;
+
+    // Only progressive renders write checkpoints, hashing a big scene takes a moment
+    uint64_t scene_id = options.progressive ? scene_hash(scene) : 0;
+    Checkpoint checkpoint;
+    if (options.resume && load_checkpoint(options.checkpoint, IMAGE_WIDTH, IMAGE_HEIGHT, checkpoint)) {
+        if (checkpoint.width != IMAGE_WIDTH || checkpoint.height != IMAGE_HEIGHT
+            || checkpoint.seed != options.seed || checkpoint.max_depth != path_settings.max_depth
+            || checkpoint.rr_depth != path_settings.rr_depth || checkpoint.scene != scene_id
+            || checkpoint.sampler != static_cast<int>(sampler_settings.pattern)
+            // Only the stratified samples are spread over the samples per pixel,
+            // the others can be resumed with more samples
+            || (sampler_settings.pattern == SamplePattern::Stratified
+                && checkpoint.samples_per_pixel != SAMPLES_PER_PIXEL)) {
+            std::cerr << options.checkpoint << " was rendered with different settings" << '\n';
+            return EXIT_FAILURE;
+        }
+        accum = std::move(checkpoint.accum);
+        samples_done = checkpoint.samples;
+        first_accum = std::move(checkpoint.first_accum);
+        first_samples = checkpoint.first_samples;
+        std::cerr << "Resuming " << options.checkpoint << " at " << samples_done
+                  << " samples per pixel" << '\n';
+    } else if (options.resume) {
+        std::cerr << "No checkpoint in " << options.checkpoint << ", starting over" << '\n';
+    }
 
-    // Create a hittable_list world
-    auto world = random_scene();
+    // Samples taken by every pixel, only needed when they differ
+    std::vector<int> pixel_samples;
+
+    // The seconds spent on every pixel over all the passes, with RT_STATS
+    std::vector<float> pixel_cost;
+
+    // The image as it is after samples_done samples
+    auto average_image = [&]() {
+        return pixel_samples.empty()
+            ? Framebuffer(IMAGE_WIDTH, IMAGE_HEIGHT, accum, std::max(samples_done, 1))
+            : Framebuffer(IMAGE_WIDTH, IMAGE_HEIGHT, accum, pixel_samples);
+    };
+    auto save_image = [&]() { return write_image(options.output, average_image(), format); };
+
+    /**
+     * The denoiser runs on the finished image, with the AOVs of the first
+     * hits traced after the render and the variance of every pixel. The
+     * variance comes from the sums of the first half of the samples, kept
+     * when a pass gets there, against the sums of all of them. Tracing the
+     * AOVs and denoising are timed together, they are what denoising costs
+     * on top of the render
+     **/
+    Denoiser denoiser;
+    double denoise_seconds = 0;
+    auto render_image_aovs = [&]() {
+        return render_aovs(pool, *world, IMAGE_WIDTH, IMAGE_HEIGHT, std::min(SAMPLES_PER_PIXEL, AOV_MAX_SAMPLES),
+                           options.tile_size, camera_ray);
+    };
+    // The variance of the pixels of sums, of samples samples each unless per_pixel has their own
+    auto image_variance = [&](const std::vector<Color>& sums, int samples, const std::vector<int>& per_pixel) {
+        std::vector<Color> variance(sums.size(), Color(0, 0, 0));
+        for (std::size_t p = 0; p < sums.size() && !first_accum.empty(); p++) {
+            variance[p] = mean_variance(sums[p], per_pixel.empty() ? samples : per_pixel[p], first_accum[p],
+                                        first_pixel_samples.empty() ? first_samples : first_pixel_samples[p]);
+        }
+        return variance;
+    };
+
+    auto save_checkpoint_file = [&]() {
+        checkpoint.width = IMAGE_WIDTH;
+        checkpoint.height = IMAGE_HEIGHT;
+        checkpoint.seed = options.seed;
+        checkpoint.max_depth = path_settings.max_depth;
+        checkpoint.rr_depth = path_settings.rr_depth;
+        checkpoint.scene = scene_id;
+        checkpoint.sampler = static_cast<int>(sampler_settings.pattern);
+        checkpoint.samples_per_pixel = SAMPLES_PER_PIXEL;
+        checkpoint.samples = samples_done;
+        checkpoint.accum = accum;
+        checkpoint.first_samples = first_samples;
+        checkpoint.first_accum = first_accum;
+        if (!save_checkpoint(options.checkpoint, checkpoint))
+            std::cerr << '\n' << "Could not write " << options.checkpoint << '\n';
+    };
+
+    /**
+     * A progressive render adds a few samples per pixel at a time. Every
+     * options.interval seconds the image so far and a checkpoint are written,
+     * so a render that gets killed can be looked at and resumed from there
+     **/
+    int pass_samples = options.progressive || options.adaptive ? options.pass_samples : SAMPLES_PER_PIXEL;
+    // The denoiser needs the first half of the samples on their own
+    if (options.denoise && pass_samples >= SAMPLES_PER_PIXEL)
+        pass_samples = (SAMPLES_PER_PIXEL + 1) / 2;
+    RenderResult result;
+    /**
+     * Allocations made while the passes ran. A pass allocates its image and
+     * its list of tiles, and the task queues grow now and then, but tracing
+     * the paths of a tile doesn't allocate, so this doesn't grow with the
+     * samples or the size of the scene
+     **/
+    uint64_t render_allocations = 0;
+    int passes = 0;
+    auto last_save = std::chrono::steady_clock::now();
+
+    /**
+     * Adaptive sampling also works in passes. Every pixel takes at least
+     * min_samples, after that a pass only goes over the pixels that are still
+     * noisy (see NoiseEstimator). The pixels that are still active all took
+     * the same samples so far, so every pass is still samples [s0, s1).
+     *
+     * On its own that only saves the samples of the quiet pixels. With
+     * --budget the render takes as many samples in all as a uniform one, the
+     * pixels that are still noisy at SAMPLES_PER_PIXEL go on with the samples
+     * the others didn't take, up to max_samples each. A pass past that only
+     * goes as far as the samples left pay for every active pixel.
+     **/
+    NoiseEstimator noise(options.adaptive ? IMAGE_WIDTH : 0, options.adaptive ? IMAGE_HEIGHT : 0);
+    std::size_t active_count = accum.size();
+    int sample_limit = SAMPLES_PER_PIXEL;
+    uint64_t sample_budget = static_cast<uint64_t>(accum.size()) * SAMPLES_PER_PIXEL;
+    uint64_t samples_taken = 0;
+    if (options.budget)
+        sample_limit = options.max_samples > 0 ? options.max_samples : 4 * SAMPLES_PER_PIXEL;
+    if (options.adaptive) {
+        active.assign(accum.size(), 1);
+        pixel_samples.assign(accum.size(), 0);
+    }
 
-    // Iterate over height and width
-    for (int j = IMAGE_HEIGHT-1; j >= 0; j--) {
-        /**
-         * We are outputting it as error because error output does not
-         * get redirected to the file by default we use std::flush,
-         * because otherwise this whole thing can get printed after
-         * the program finishes, which is kinda useless
-         * 
-         * r character escape is for carriage return, which just
-         * positions the cursor to the beginning
-         **/
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
+    /**
+     * An animation renders every frame with all the samples in one pass, and
+     * moves the camera in between. Everything else, the scene, its tree and
+     * the threads, is shared by all the frames. The frames are written while
+     * the next one renders, so they skip the loop and the final write below
+     **/
+    AnimationResult animation;
+    if (options.frames > 0) {
+        CameraView start_view;
+        start_view.lookfrom = view.lookfrom;
+        start_view.lookat = view.lookat;
+        start_view.vfov = view.vfov;
+
+        CameraPath camera_path;
+        if (!options.camera_path.empty()) {
+            std::string error;
+            if (!load_camera_path(options.camera_path, view.vfov, camera_path, error)) {
+                std::cerr << "Could not load " << options.camera_path << ": " << error << '\n';
+                return EXIT_FAILURE;
+            }
+        } else {
+            // Stops a frame short of the full turn, so the frames loop without a repeat
+            camera_path = CameraPath::orbit(start_view, view.vup,
+                                            static_cast<double>(options.frames - 1) / options.frames);
+        }
 
-        for (int i = 0; i < IMAGE_WIDTH; i++) {
-            // Now we are iterating over every point on the scene
+        animation = render_animation(camera_path, options.frames, IMAGE_WIDTH, IMAGE_HEIGHT,
+                                     SAMPLES_PER_PIXEL, options.output, format,
+            [&](const CameraView& frame_view) {
+                camera = Camera(frame_view.lookfrom, frame_view.lookat, view.vup, frame_view.vfov,
+                                view.aspect_ratio(), view.aperture, view.focus_dist);
+                auto pass_allocations = allocation_count();
+                int half = options.denoise ? (SAMPLES_PER_PIXEL + 1) / 2 : SAMPLES_PER_PIXEL;
+                auto pass = render_pass(0, half);
+                passes++;
+                if (half < SAMPLES_PER_PIXEL) {
+                    // The second half adds to the first, whose sums are kept
+                    // for the denoiser. accum goes back to zeros for the next frame
+                    accum.swap(pass.pixels);
+                    auto second = render_pass(half, SAMPLES_PER_PIXEL);
+                    passes++;
+                    accum.swap(pass.pixels);
+                    first_accum = std::move(pass.pixels);
+                    first_samples = half;
+                    second.rays += pass.rays;
+                    second.seconds += pass.seconds;
+                    for (std::size_t p = 0; p < second.cost.size(); p++)
+                        second.cost[p] += pass.cost[p];
+                    pass = std::move(second);
+                }
+                render_allocations += allocation_count() - pass_allocations;
+                if (options.denoise) {
+                    // The writer averages the sums, so the denoised frame goes back as sums
+                    auto denoise_start = std::chrono::steady_clock::now();
+                    auto frame = denoiser.denoise(pool, Framebuffer(IMAGE_WIDTH, IMAGE_HEIGHT, pass.pixels, SAMPLES_PER_PIXEL),
+                                                  image_variance(pass.pixels, SAMPLES_PER_PIXEL, {}),
+                                                  render_image_aovs());
+                    for (std::size_t p = 0; p < pass.pixels.size(); p++)
+                        pass.pixels[p] = SAMPLES_PER_PIXEL * frame.pixels[p];
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - denoise_start;
+                    denoise_seconds += elapsed.count();
+                }
+                pixel_cost.resize(pass.cost.size());
+                for (std::size_t p = 0; p < pass.cost.size(); p++)
+                    pixel_cost[p] += pass.cost[p];
+                return pass;
+            });
+        if (!animation.failed_path.empty()) {
+            std::cerr << "Could not write " << animation.failed_path << '\n';
+            return EXIT_FAILURE;
+        }
 
-            // Create a color
-            Color pixel_color(0, 0, 0);
+        result.rays = animation.rays;
+        result.seconds = animation.render_seconds;
+        samples_done = SAMPLES_PER_PIXEL;
+    }
 
-            // Take SAMPLES_PER_PIXEL samples for each pixel
-            for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
-                // u specifies the horizontal distance, and goes from 0.0 to 1.0
-                auto u = double(i + random_double()) / (IMAGE_WIDTH-1);
-                // v specifies the vertical distance, and goes from 1.0 to 0.0
-                auto v = double(j + random_double()) / (IMAGE_HEIGHT-1);
+    while (samples_done < sample_limit && active_count > 0) {
+        int s1 = std::min(samples_done + pass_samples, sample_limit);
+        if (options.budget) {
+            auto affordable = (sample_budget - samples_taken) / active_count;
+            if (affordable == 0)
+                break;
+            s1 = static_cast<int>(std::min<uint64_t>(s1, samples_done + affordable));
+            samples_taken += active_count * static_cast<uint64_t>(s1 - samples_done);
+        }
+        auto pass_allocations = allocation_count();
+        auto pass = render_pass(samples_done, s1);
+        render_allocations += allocation_count() - pass_allocations;
+        passes++;
+
+        accum.swap(pass.pixels);
+        result.rays += pass.rays;
+        result.seconds += pass.seconds;
+
+        pixel_cost.resize(pass.cost.size());
+        for (std::size_t p = 0; p < pass.cost.size(); p++)
+            pixel_cost[p] += pass.cost[p];
+
+        if (options.adaptive) {
+            // pass.pixels now holds the sums before this pass
+            for (std::size_t p = 0; p < accum.size(); p++) {
+                if (!active[p]) continue;
+                noise.add_batch(p, (1.0 / (s1 - samples_done)) * (accum[p] - pass.pixels[p]));
+                pixel_samples[p] = s1;
+            }
+            if (s1 >= options.min_samples)
+                active_count = noise.update_active(options.noise_threshold, active);
+            std::cerr << "\rSamples " << s1 << "/" << sample_limit << ", "
+                      << active_count << " pixels still noisy    ";
+        }
+        samples_done = s1;
 
-                // Get the ray from the camera
-                Ray r = camera.get_ray(u, v);
+        // A progressive render keeps them for the checkpoint, it may be resumed with --denoise
+        if ((options.denoise || options.progressive) && first_accum.empty() && 2 * samples_done >= SAMPLES_PER_PIXEL) {
+            first_accum = accum;
+            first_samples = samples_done;
+            first_pixel_samples = pixel_samples;
+        }
 
-                // Get the corresponding pixel color for the ray and the world
-                pixel_color += ray_color(r, world, MAX_DEPTH);
+        if (options.progressive) {
+            std::cerr << "\rSamples " << samples_done << "/" << SAMPLES_PER_PIXEL << "    ";
+            std::chrono::duration<double> since_save = std::chrono::steady_clock::now() - last_save;
+            if (since_save.count() >= options.interval && samples_done < SAMPLES_PER_PIXEL) {
+                save_image();
+                save_checkpoint_file();
+                last_save = std::chrono::steady_clock::now();
             }
-
-            // Output the color
-            write_color(std::cout, pixel_color, SAMPLES_PER_PIXEL);
         }
     }
 
-    // Print the done message
-    std::cerr << '\n' << "Done" << '\n';
-}
+    if (options.progressive)
+        save_checkpoint_file();
+
+    /**
+     * We are outputting progress as error because error output does not
+     * get redirected to the file by default
+     **/
+    std::cerr << '\n' << "Traced " << result.rays << " rays in " << result.seconds << "s ("
+              << result.rays_per_second() / 1e6 << " Mrays/s)" << '\n';
+    std::cerr << "Allocated " << render_allocations << " times while rendering (" << passes
+              << (passes == 1 ? " pass" : " passes") << ")" << '\n';
+
+    if (options.adaptive) {
+        uint64_t total_samples = 0;
+        for (auto n : pixel_samples)
+            total_samples += n;
+        auto uniform_samples = static_cast<double>(accum.size()) * SAMPLES_PER_PIXEL;
+        std::cerr << "Took " << total_samples << " samples, "
+                  << static_cast<double>(total_samples) / accum.size() << " per pixel on average ("
+                  << 100 * total_samples / uniform_samples << "% of " << SAMPLES_PER_PIXEL
+                  << " per pixel)" << '\n';
+    }
 
-Color ray_color(const Ray& r, const Hittable& world, int depth) {
-    // Create a record of the hits
-    hit_record rec;
-
-    // If we reach the max depth limit return black
-    if (depth <= 0)
-        return Color(0, 0, 0);
-
-    // Check if the rays hit the world
-    // we dont care about the rays at less than (t=0.001) because these rays
-    // are reflecting the object they are reflecting
-    if (world.hit(r, 0.001, INF, rec)) {
-        Color attenuation;
-        // The ray generated after hitting the world
-        Ray scattered;
-
-        // If the ray hits succesfully, scatter it using the material abstraction
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            // multiply by 0.5 bcs we want to reflect only 50% light
-            // multipling by 1 will reflect 100% light
-            // Return the color of the scattered ray
-            return attenuation * ray_color(scattered, world, depth-1);
-        
-        return Color(0, 0, 0);
+    if (options.stats) {
+        std::vector<std::string> material_names(MATERIAL_TYPE_NAMES, MATERIAL_TYPE_NAMES + MATERIAL_TYPE_COUNT);
+        print_stats_report(std::cerr, stats_registry().total(), material_names, pixel_cost);
     }
 
-    // Get the unit vector from the ray
-    // Think of a unit vector as a vector which gets
-    // us the direction of the vector by dividing by the length
+    if (!options.heatmap.empty()) {
+        double scale = 0;
+        auto heatmap = cost_heatmap(IMAGE_WIDTH, IMAGE_HEIGHT, pixel_cost, scale);
+        if (!write_image(options.heatmap, heatmap, image_format_for_path(options.heatmap))) {
+            std::cerr << "Could not write " << options.heatmap << '\n';
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Wrote the heatmap to " << options.heatmap << ", yellow is "
+                  << scale * 1e6 << "us per pixel or more" << '\n';
+    }
 
-    // Note: that each value in unit_direction ranges from -1 to 1
-    Vec3 unit_direction = unit_vector(r.direction());
+    // Write out the final image, the frames of an animation are written already
+    std::chrono::duration<double> write_time(animation.write_seconds);
+    if (options.frames == 0) {
+        auto image = average_image();
+        /**
+         * A checkpoint of a render that was never more than half done has
+         * the sums of all its samples as the first half, resumed without
+         * more samples there is no noise to tell the filter
+         **/
+        if (options.denoise && (first_accum.empty() || (pixel_samples.empty() && first_samples >= samples_done))) {
+            std::cerr << "The first half of the samples wasn't kept apart, not denoising."
+                      << " Resume with more samples per pixel to denoise" << '\n';
+            options.denoise = false;
+        }
+        // Kept to compare with the reference
+        Framebuffer noisy;
+        if (options.denoise && !options.reference.empty())
+            noisy = image;
+
+        if (options.denoise || !options.aovs.empty()) {
+            auto denoise_start = std::chrono::steady_clock::now();
+            auto aovs = render_image_aovs();
+            std::chrono::duration<double> aov_time = std::chrono::steady_clock::now() - denoise_start;
+            if (options.denoise) {
+                image = denoiser.denoise(pool, image, image_variance(accum, samples_done, pixel_samples), aovs);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - denoise_start;
+                denoise_seconds = elapsed.count();
+                std::cerr << "Denoised in " << denoise_seconds * 1000 << "ms ("
+                          << aov_time.count() * 1000 << "ms for the AOVs of "
+                          << std::min(SAMPLES_PER_PIXEL, AOV_MAX_SAMPLES) << " samples per pixel)" << '\n';
+            }
 
-    // Note that y for unit vector for pixels at the top will be more
-    // y for unit vector at center will be 0
-    // y for unit vector at bottom will be less than 0
+            if (!options.aovs.empty()) {
+                auto aov_format = image_format_for_path(options.aovs);
+                std::pair<const char*, Framebuffer> aov_images[] = {
+                    { "albedo", albedo_image(aovs) }, { "normal", normal_image(aovs) }, { "depth", depth_image(aovs) },
+                };
+                for (const auto& [name, aov_image] : aov_images) {
+                    auto path = aov_path(options.aovs, name);
+                    if (!write_image(path, aov_image, aov_format)) {
+                        std::cerr << "Could not write " << path << '\n';
+                        return EXIT_FAILURE;
+                    }
+                }
+                std::cerr << "Wrote the AOVs to " << aov_path(options.aovs, "*") << '\n';
+            }
+        }
 
-    // t goes from 0 to 1 vertical direction
-    // try changing unit_direction[1] to [0] what do you see?
-    auto t = 1 - (0.5 * (unit_direction[1] + 1));
+        if (!options.reference.empty()) {
+            Framebuffer reference;
+            if (!read_pfm(options.reference, reference)) {
+                std::cerr << "Could not read " << options.reference << '\n';
+                return EXIT_FAILURE;
+            }
+            if (reference.width != IMAGE_WIDTH || reference.height != IMAGE_HEIGHT) {
+                std::cerr << options.reference << " is " << reference.width << "x" << reference.height
+                          << ", not " << IMAGE_WIDTH << "x" << IMAGE_HEIGHT << '\n';
+                return EXIT_FAILURE;
+            }
+            auto error = image_error(image, reference);
+            std::cerr << "Against " << options.reference << ": RMSE " << error.rmse
+                      << ", relative MSE " << error.relative_mse;
+            if (options.denoise) {
+                auto noisy_error = image_error(noisy, reference);
+                std::cerr << " (" << noisy_error.rmse << " and " << noisy_error.relative_mse
+                          << " before denoising)";
+            }
+            std::cerr << '\n';
+        }
 
-    // Start of the gradiend (Sky blue)
-    Color startColor(0.5, 0.7, 1.0);
-    // End of the gradient (White)
-    Color endColor(1, 1, 1);
+        auto write_start = std::chrono::steady_clock::now();
+        if (!write_image(options.output, image, format)) {
+            std::cerr << "Could not write " << options.output << '\n';
+            return EXIT_FAILURE;
+        }
+        write_time = std::chrono::steady_clock::now() - write_start;
+
+        std::cerr << "Wrote " << options.output << " in " << write_time.count() * 1000 << "ms" << '\n';
+    } else {
+        std::cerr << "Rendered " << animation.frames << " frames in " << animation.seconds << "s, "
+                  << animation.frames_per_hour() << " frames/hour ("
+                  << animation.render_seconds / animation.frames << "s to render and "
+                  << animation.write_seconds / animation.frames << "s to write a frame, "
+                  << animation.wait_seconds << "s spent waiting for the writer)" << '\n';
+        if (options.denoise)
+            std::cerr << "Denoising took " << denoise_seconds / animation.frames << "s a frame" << '\n';
+    }
 
-    // We should see a gradient where at the top is sky blue, and
-    // at the bottom is white
+    // Print the done message
+    std::cerr << '\n' << "Done" << '\n';
 
-    // For t=1 it will return endColor and for t=0 it will return startColor
-    // This is also known as a linear blend
-    return startColor + t * (endColor - startColor);
+    if (!options.summary.empty()) {
+        RunSummary summary;
+        summary.width = IMAGE_WIDTH;
+        summary.height = IMAGE_HEIGHT;
+        summary.samples_per_pixel = SAMPLES_PER_PIXEL;
+        summary.max_depth = path_settings.max_depth;
+        summary.threads = pool.size();
+        summary.seed = options.seed;
+        summary.sampler = options.sampler;
+        summary.integrator = options.integrator;
+        summary.accel = accel;
+        summary.scene = options.scene.empty() ? "random" : options.scene;
+        summary.output = options.output;
+        summary.lights = options.nee ? static_cast<int>(lights.size()) : 0;
+        summary.rays = result.rays;
+        if (pixel_samples.empty()) {
+            summary.samples = static_cast<uint64_t>(accum.size()) * samples_done * std::max(options.frames, 1);
+        } else {
+            for (auto n : pixel_samples)
+                summary.samples += n;
+        }
+        summary.load_seconds = load_time.count();
+        summary.build_seconds = build_time.count();
+        summary.render_seconds = result.seconds;
+        summary.write_seconds = write_time.count();
+        summary.denoise_seconds = denoise_seconds;
+        summary.frames = std::max(animation.frames, 1);
+        std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+        summary.wall_seconds = wall_time.count();
+        summary.peak_memory = peak_memory_bytes();
+        summary.scene_allocations = load_allocations + build_allocations;
+        summary.render_allocations = render_allocations;
+
+        if (!write_run_summary(options.summary, summary)) {
+            std::cerr << "Could not write " << options.summary << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 }
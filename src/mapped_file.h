@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RT_HAS_MMAP 1
+#endif
+
+/**
+ * The contents of a file. On systems with mmap the file is mapped into memory
+ * instead of read, the pages are only loaded when something touches them and
+ * the kernel can share them with the page cache.
+ **/
+class MappedFile {
+public:
+    const char* data = nullptr;
+    std::size_t size = 0;
+private:
+    void* mapping = nullptr;
+    std::vector<char> buffer;
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef RT_HAS_MMAP
+        if (mapping)
+            munmap(mapping, size);
+#endif
+    }
+
+    bool open(const std::string& path) {
+#ifdef RT_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size = static_cast<std::size_t>(info.st_size);
+        if (size > 0) {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            // Everything gets read anyway, load all the pages in one go
+            // instead of taking a page fault for each of them
+            flags |= MAP_POPULATE;
+#endif
+            void* p = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+            if (p != MAP_FAILED) {
+                mapping = p;
+                data = static_cast<const char*>(p);
+            }
+        }
+        ::close(fd);
+        if (mapping || size == 0)
+            return true;
+#endif
+        // No mmap, read the whole file instead
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+    }
+};
@@ -1,62 +1,110 @@
 #pragma once
 
+#include <cstddef>
+#include <utility>
+#include <variant>
+
 #include "hittable.h"
+#include "sampling.h"
 #include "utility.h"
 
 struct hit_record;
 
-class Material {
-public:
-    virtual bool scatter(
-        const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
-    ) const = 0;
-};
+/**
+ * The material models. Each one is a plain class with a scatter function,
+ *   bool scatter(const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered) const
+ * which returns false if the ray got absorbed, otherwise sets the attenuation
+ * and the scattered ray. For the direct lighting of the integrator each one
+ * also has
+ *   Color emitted(const hit_record& rec) const
+ *     the light the surface gives off itself
+ *   Color evaluate(const Ray& r_in, const hit_record& rec, const Vec3& direction, real& pdf) const
+ *     how much of the light coming in from direction leaves along -r_in,
+ *     cosine included, and sets pdf to the chance scatter picks direction
+ *   Color base_color(const hit_record& rec) const
+ *     the color of the surface itself, without any lighting, which the
+ *     denoiser uses to keep the edges of colors sharp (see denoiser.h)
+ * and SAMPLES_LIGHTS, which is true if it is worth sending a shadow ray to a
+ * light from the surface. A mirror or glass only reflects light from one
+ * exact direction, a shadow ray would never be it.
+ *
+ * There is no common base class, instead Material (at the bottom) holds any one
+ * of them in a std::variant. See Material for why.
+ **/
 
-class Lambertian : public Material {
+class Lambertian {
 public:
+    static constexpr bool SAMPLES_LIGHTS = true;
     Color albedo;
 public:
     // Class constructors
     Lambertian(const Color& a) : albedo(a) {}
 
-    virtual bool scatter(
+    bool scatter(
         const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
-    ) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+    ) const {
+        auto u1 = random_double();
+        auto scatter_direction = sample_cosine_hemisphere(rec.normal, u1, random_double());
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
         // scattered ray is ray between hitpoint and the scatter direction
-        scattered = Ray(rec.p, scatter_direction);
+        scattered = spawn_ray(rec, scatter_direction);
         attenuation = albedo;
 
         return true;
     };
+
+    Color emitted(const hit_record&) const { return Color(0, 0, 0); }
+
+    Color base_color(const hit_record&) const { return albedo; }
+
+    // albedo / pi of the light, scatter picks directions by their cosine
+    Color evaluate(const Ray&, const hit_record& rec, const Vec3& direction, real& pdf) const {
+        auto cosine = dot(unit_vector(direction), rec.normal);
+        if (cosine <= 0) {
+            pdf = 0;
+            return Color(0, 0, 0);
+        }
+        pdf = cosine / PI;
+        return albedo * (cosine / PI);
+    }
 };
 
-class Metal : public Material {
+class Metal {
 public:
+    static constexpr bool SAMPLES_LIGHTS = false;
     Color albedo;
-    double fuzz;
+    real fuzz;
 public:
     // Class constructors
-    Metal(const Color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    Metal(const Color& a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    virtual bool scatter(
+    bool scatter(
         const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
-    ) const override {
+    ) const {
         // Get the vector after reflection from normal
         Vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
 
         // scattered ray is the ray join the hit point to the reflected vector
-        scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+        scattered = spawn_ray(rec, reflected + fuzz * random_in_unit_sphere());
         attenuation = albedo;
 
         // return true if the direction of scatter and normal is on same side
         return (dot(scattered.direction(), rec.normal) > 0);
     }
+
+    Color emitted(const hit_record&) const { return Color(0, 0, 0); }
+
+    Color base_color(const hit_record&) const { return albedo; }
+
+    // A fuzzy reflection is still picked from a tiny cone, treated as a mirror
+    Color evaluate(const Ray&, const hit_record&, const Vec3&, real& pdf) const {
+        pdf = 0;
+        return Color(0, 0, 0);
+    }
 };
 
 /** 
@@ -65,27 +113,28 @@ public:
  * We’ll handle that by randomly choosing between reflection or refraction,
  * and only generating one scattered ray per interaction.
  **/
-class Dielectric : public Material {
+class Dielectric {
 public:
+    static constexpr bool SAMPLES_LIGHTS = false;
     // ir specifies the index of refraction
-    double ir;
+    real ir;
 public:
-    Dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    Dielectric(real index_of_refraction) : ir(index_of_refraction) {}
 
-    virtual bool scatter(
+    bool scatter(
         const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
-    ) const override {
+    ) const {
         attenuation = Color(1.0, 1.0, 1.0);
-        double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+        real refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
         // change the input ray to unit vector bcs refract expects us to have unit vectors
         Vec3 unit_direction = unit_vector(r_in.direction());
 
         // dot product of two vector is the product of their length and cos of the angles
         // as we are using unit vectors, finding the dot product gets us the cos of theta
-        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+        real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
         // This is basically derived from sin^2 + cos^2 = 1
-        double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+        real sin_theta = sqrt(1.0 - cos_theta*cos_theta);
 
         // If the product of refraction ration and sin theta is greater than 1
         // thhen the ray can not refract bcs sin of an angle can not be greater than 1
@@ -101,14 +150,128 @@ public:
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
         // scattered is the ray between the hit point and the dirction of scattered ray
-        scattered = Ray(rec.p, direction);
+        scattered = spawn_ray(rec, direction);
         return true;
     }
+
+    Color emitted(const hit_record&) const { return Color(0, 0, 0); }
+
+    // Glass doesn't tint the light going through it
+    Color base_color(const hit_record&) const { return Color(1, 1, 1); }
+
+    Color evaluate(const Ray&, const hit_record&, const Vec3&, real& pdf) const {
+        pdf = 0;
+        return Color(0, 0, 0);
+    }
 private:
-    static double reflectance(double cosine, double ref_idx) {
+    static real reflectance(real cosine, real ref_idx) {
         // Use the Schlick's approcimation for reflectance
         auto r0 = (1-ref_idx) / (1+ref_idx);
         r0 = r0*r0;
         return r0 + (1-r0)*pow((1 - cosine), 5);
     }
-};
\ No newline at end of file
+};
+
+/**
+ * A surface that gives off light, from its front side only. It doesn't
+ * reflect anything, a path that hits it ends there.
+ **/
+class DiffuseLight {
+public:
+    static constexpr bool SAMPLES_LIGHTS = false;
+    Color emit;
+public:
+    DiffuseLight(const Color& c) : emit(c) {}
+
+    bool scatter(const Ray&, const hit_record&, Color&, Ray&) const {
+        return false;
+    }
+
+    Color emitted(const hit_record& rec) const {
+        return rec.front_face ? emit : Color(0, 0, 0);
+    }
+
+    // The light is all there is to see of it
+    Color base_color(const hit_record&) const { return Color(1, 1, 1); }
+
+    Color evaluate(const Ray&, const hit_record&, const Vec3&, real& pdf) const {
+        pdf = 0;
+        return Color(0, 0, 0);
+    }
+};
+
+/**
+ * Every material model the renderer knows about. To add a new model write a
+ * class like the ones above and add it to this list, everything else picks it
+ * up at compile time.
+ **/
+using MaterialModel = std::variant<Lambertian, Metal, Dielectric, DiffuseLight>;
+
+// Number of material models
+constexpr std::size_t MATERIAL_TYPE_COUNT = std::variant_size_v<MaterialModel>;
+
+// The name of every model, in the same order
+const char* const MATERIAL_TYPE_NAMES[MATERIAL_TYPE_COUNT] = { "lambertian", "metal", "dielectric", "light" };
+
+/**
+ * A material is one of the models from MaterialModel.
+ *
+ * With a virtual scatter every hit jumps through a vtable to whichever model
+ * the object happens to use, and the CPU can't guess where that jump goes.
+ * Here the model is a small tag (type()) next to its parameters, so the
+ * wavefront tracer can sort its hits by type and then shade all the hits of a
+ * type in one loop, calling that type's scatter directly (see scatter_as).
+ * When the type isn't known up front, scatter() dispatches on the tag.
+ **/
+class Material {
+public:
+    MaterialModel model;
+public:
+    template <typename T>
+    Material(T m) : model(std::move(m)) {}
+
+    // Index of the model in MaterialModel
+    std::size_t type() const { return model.index(); }
+
+    bool scatter(
+        const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
+    ) const {
+        return std::visit([&](const auto& m) {
+            return m.scatter(r_in, rec, attenuation, scattered);
+        }, model);
+    }
+
+    // Same as scatter, when the caller already knows the model is the I-th type
+    template <std::size_t I>
+    bool scatter_as(
+        const Ray& r_in, const hit_record& rec, Color& attenuation, Ray& scattered
+    ) const {
+        return std::get<I>(model).scatter(r_in, rec, attenuation, scattered);
+    }
+
+    Color emitted(const hit_record& rec) const {
+        return std::visit([&](const auto& m) { return m.emitted(rec); }, model);
+    }
+
+    Color base_color(const hit_record& rec) const {
+        return std::visit([&](const auto& m) { return m.base_color(rec); }, model);
+    }
+
+    Color evaluate(const Ray& r_in, const hit_record& rec, const Vec3& direction, real& pdf) const {
+        return std::visit([&](const auto& m) { return m.evaluate(r_in, rec, direction, pdf); }, model);
+    }
+
+    template <typename T>
+    bool is() const { return std::holds_alternative<T>(model); }
+};
+
+template <typename Fn, std::size_t... I>
+void for_each_material_type(Fn& fn, std::index_sequence<I...>) {
+    (fn(std::integral_constant<std::size_t, I>()), ...);
+}
+
+// Calls fn(std::integral_constant<std::size_t, I>()) for every material type I
+template <typename Fn>
+void for_each_material_type(Fn fn) {
+    for_each_material_type(fn, std::make_index_sequence<MATERIAL_TYPE_COUNT>());
+}
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utility.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "instance.h"
+#include "simd.h"
+
+/**
+ * A ray set up for the watertight ray triangle test of Woop, Benthin and
+ * Wald (2013).
+ *
+ * The test moves the triangle so the ray starts at the origin, then shears
+ * it so the ray points straight down the z axis. Whether the ray hits is then
+ * a 2D question: is the origin inside the sheared triangle. The axes are
+ * renamed so z is the largest component of the direction, which keeps the
+ * shear small.
+ **/
+struct WatertightRay {
+    Point3 origin;
+    int kx, ky, kz;
+    real sx, sy, sz;
+
+    WatertightRay(const Ray& r) : origin(r.origin()) {
+        auto d = r.direction();
+        auto ax = std::fabs(d[0]), ay = std::fabs(d[1]), az = std::fabs(d[2]);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // Keep the winding of the triangles the same
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+};
+
+/**
+ * a.x * b.y - a.y * b.x, the edge function of the edge from a to b.
+ *
+ * Two triangles that share an edge walk it in opposite directions, and the
+ * test is only watertight if the one gets exactly the negative of what the
+ * other gets. Written out plainly that is true in IEEE arithmetic, but with
+ * -march=native the compiler may fuse a multiply and the subtract into one
+ * FMA, and fma(a.x, b.y, -a.y * b.x) isn't the negative of
+ * fma(b.x, a.y, -b.y * a.x). So the points are put in order first and the
+ * same expression is always computed from the smaller point to the larger
+ * one, then negated if the edge goes the other way. A point to itself is 0.
+ **/
+inline real edge_function(real ax, real ay, real bx, real by) {
+    if (ax == bx && ay == by)
+        return 0;
+    bool forward = ax < bx || (ax == bx && ay < by);
+    real lo_x = forward ? ax : bx, lo_y = forward ? ay : by;
+    real hi_x = forward ? bx : ax, hi_y = forward ? by : ay;
+    real e = lo_x * hi_y - lo_y * hi_x;
+    return forward ? e : -e;
+}
+
+inline SimdReal edge_function(SimdReal ax, SimdReal ay, SimdReal bx, SimdReal by) {
+    auto same_x = (ax <= bx) & (ax >= bx);
+    auto same = same_x & (ay <= by) & (ay >= by);
+    auto forward = (ax < bx) | (same_x & (ay < by));
+    auto lo_x = select(forward, ax, bx), lo_y = select(forward, ay, by);
+    auto hi_x = select(forward, bx, ax), hi_y = select(forward, by, ay);
+    auto e = lo_x * hi_y - lo_y * hi_x;
+    e = select(forward, e, SimdReal(0.0) - e);
+    return select(same, SimdReal(0.0), e);
+}
+
+/**
+ * A triangle mesh: one buffer of vertices, and three 32 bit indices into it
+ * per triangle. Most vertices are shared by about six triangles, so this is
+ * a lot smaller than storing three points per triangle, and neighbouring
+ * triangles hit the exact same vertex values, which the watertight test
+ * needs.
+ *
+ * commit() builds a BVH over the triangles and puts the index triples in leaf
+ * order, like PackedSpheres does with its spheres. A leaf is tested W
+ * triangles at a time with the SIMD kernel: the vertices are gathered out of
+ * the shared buffer into SIMD registers, so nothing is stored twice for the
+ * sake of the SIMD loads.
+ *
+ * A ray that goes exactly through an edge or a vertex hits one of the
+ * triangles around it, never none: a 0 edge function counts as inside for
+ * both of the triangles. Rays can't slip through the cracks of a closed mesh.
+ * The normal is the geometric normal, from the winding of the triangle
+ * (counter clockwise seen from the front).
+ *
+ * Like PackedSpheres, the SIMD kernel keeps the index of the closest triangle
+ * in a SimdReal, past MAX_SIMD_TRIANGLES the scalar kernel is used instead.
+ **/
+class TriangleMesh : public Hittable {
+public:
+    // The most triangles whose indices (and the lanes after them) a SimdReal holds exactly
+    static constexpr uint64_t MAX_SIMD_TRIANGLES =
+        (uint64_t(1) << std::min(std::numeric_limits<real>::digits, 32)) - SimdReal::WIDTH;
+
+    std::vector<Point3> vertices;
+    // Triangle k is indices[3k], indices[3k + 1], indices[3k + 2]
+    std::vector<uint32_t> indices;
+    // Owned by the scene
+    const Material* material = nullptr;
+    // The file the mesh came from, if any, and how it was moved since
+    std::string source;
+    Transform placement;
+
+    BvhTree tree;
+    // Use the SIMD kernel, or the plain scalar loop if false
+    bool use_simd = true;
+    AABB bounds;
+public:
+    TriangleMesh() {}
+
+    uint32_t add_vertex(const Point3& p) {
+        vertices.push_back(p);
+        bounds.expand(p);
+        return static_cast<uint32_t>(vertices.size() - 1);
+    }
+
+    void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+
+    std::size_t size() const { return indices.size() / 3; }
+
+    // Moves the vertices, call before commit(). A mirroring transform turns
+    // the winding around, so the triangles are turned back to keep their fronts
+    void place(const Transform& t) {
+        bounds = AABB();
+        for (auto& p : vertices) {
+            p = t.point(p);
+            bounds.expand(p);
+        }
+        if (t.determinant() < 0)
+            for (std::size_t k = 0; k < indices.size(); k += 3)
+                std::swap(indices[k + 1], indices[k + 2]);
+        placement = t * placement;
+    }
+
+    // Call after the last add_triangle(), builds the tree
+    void commit();
+    // Turns use_simd off if there are more than MAX_SIMD_TRIANGLES, commit() calls it
+    void check_simd_limit();
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    // The first leaf with a triangle in range ends the walk
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        WatertightRay ray(r);
+        uint32_t index;
+        return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+            auto closest = t_max;
+            return use_simd
+                ? hit_range(ray, first, count, t_min, closest, index)
+                : hit_range_scalar(ray, first, count, t_min, closest, index);
+        });
+    }
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        output_box = bounds;
+        return size() > 0;
+    }
+
+    // Bytes used by the vertices, the indices and the tree
+    std::size_t memory_bytes() const {
+        return vertices.capacity() * sizeof(Point3) + indices.capacity() * sizeof(uint32_t)
+             + tree.nodes.capacity() * sizeof(BvhNode) + tree.prim_order.capacity() * sizeof(uint32_t);
+    }
+
+    /**
+     * Test the ray against the triangles first to first+count-1. If any is
+     * closer than closest_so_far, lowers closest_so_far to it, sets
+     * closest_index and returns true.
+     **/
+    bool hit_range(
+        const WatertightRay& ray, uint32_t first, uint32_t count, real t_min,
+        real& closest_so_far, uint32_t& closest_index
+    ) const;
+    // The same one triangle at a time
+    bool hit_range_scalar(
+        const WatertightRay& ray, uint32_t first, uint32_t count, real t_min,
+        real& closest_so_far, uint32_t& closest_index
+    ) const;
+private:
+    // The sheared vertex v of triangle k, relative to the ray origin
+    void sheared_vertex(const WatertightRay& ray, uint32_t k, int v, real& x, real& y, real& z) const {
+        const auto& p = vertices[indices[3 * k + v]];
+        z = p[ray.kz] - ray.origin[ray.kz];
+        x = p[ray.kx] - ray.origin[ray.kx] - ray.sx * z;
+        y = p[ray.ky] - ray.origin[ray.ky] - ray.sy * z;
+    }
+
+    void fill_record(const Ray& r, uint32_t k, real t, hit_record& rec) const;
+};
+
+inline void TriangleMesh::check_simd_limit() {
+    if (use_simd && size() > MAX_SIMD_TRIANGLES) {
+        std::cerr << "TriangleMesh: more than " << MAX_SIMD_TRIANGLES
+                  << " triangles, using the scalar kernel" << '\n';
+        use_simd = false;
+    }
+}
+
+inline void TriangleMesh::commit() {
+    auto n = size();
+    check_simd_limit();
+    std::vector<AABB> boxes(n);
+    for (std::size_t k = 0; k < n; k++) {
+        AABB box;
+        for (int v = 0; v < 3; v++)
+            box.expand(vertices[indices[3 * k + v]]);
+        boxes[k] = box;
+    }
+
+    // A leaf holds at most one SIMD register worth of triangles
+    auto leaf_size = SimdReal::WIDTH < 4 ? 4 : SimdReal::WIDTH;
+    tree.build(boxes, leaf_size);
+
+    // Put the triangles in leaf order so a leaf is a contiguous range
+    auto old = indices;
+    for (std::size_t k = 0; k < n; k++)
+        for (int v = 0; v < 3; v++)
+            indices[3 * k + v] = old[3 * tree.prim_order[k] + v];
+
+    // The order is only needed to reorder, and it is as big as the indices
+    tree.prim_order.clear();
+    tree.prim_order.shrink_to_fit();
+    tree.nodes.shrink_to_fit();
+    // A loader can't always know the sizes up front, give back what it over allocated
+    vertices.shrink_to_fit();
+    indices.shrink_to_fit();
+}
+
+inline bool TriangleMesh::hit(const Ray& r, real t_min, real t_max, hit_record& rec) const {
+    WatertightRay ray(r);
+    auto closest_so_far = t_max;
+    uint32_t closest_index = 0;
+
+    bool hit_anything = tree.traverse(r, t_min, t_max,
+        [&](uint32_t first, uint32_t count, real& closest) {
+            bool hit_leaf = use_simd
+                ? hit_range(ray, first, count, t_min, closest, closest_index)
+                : hit_range_scalar(ray, first, count, t_min, closest, closest_index);
+            if (hit_leaf)
+                closest_so_far = closest;
+            return hit_leaf;
+        }
+    );
+
+    if (!hit_anything)
+        return false;
+
+    fill_record(r, closest_index, closest_so_far, rec);
+    return true;
+}
+
+inline bool TriangleMesh::hit_range_scalar(
+    const WatertightRay& ray, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, uint32_t& closest_index
+) const {
+    bool hit_anything = false;
+    RT_STAT(thread_stats().intersection_tests += count);
+
+    for (auto k = first; k < first + count; k++) {
+        real ax, ay, az, bx, by, bz, cx, cy, cz;
+        sheared_vertex(ray, k, 0, ax, ay, az);
+        sheared_vertex(ray, k, 1, bx, by, bz);
+        sheared_vertex(ray, k, 2, cx, cy, cz);
+
+        // The edge functions, the ray is inside if they all have the same sign
+        auto u = edge_function(cx, cy, bx, by);
+        auto v = edge_function(ax, ay, cx, cy);
+        auto w = edge_function(bx, by, ax, ay);
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            continue;
+        auto det = u + v + w;
+        if (det == 0)
+            continue;
+
+        // u, v, w over det are the barycentric coordinates, which give the
+        // distance along the ray by interpolating the z of the vertices
+        auto t = (u * az + v * bz + w * cz) * ray.sz / det;
+        if (t < t_min || closest_so_far < t)
+            continue;
+
+        closest_so_far = t;
+        closest_index = k;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
+
+inline bool TriangleMesh::hit_range(
+    const WatertightRay& ray, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, uint32_t& closest_index
+) const {
+    constexpr int W = SimdReal::WIDTH;
+    RT_STAT(thread_stats().intersection_tests += count);
+
+    SimdReal vt_min(t_min), zero(0.0), sz(ray.sz);
+    SimdReal best_t(closest_so_far);
+    SimdReal best_index(-1.0);
+    SimdRealMask hit_any = SimdReal::first_lanes(0);
+
+    // The sheared vertices of W triangles, gathered one lane at a time
+    real p[9][W];
+
+    auto end = first + count;
+    for (auto k = first; k < end; k += W) {
+        auto lanes = static_cast<int>(std::min<uint32_t>(W, end - k));
+        for (int lane = 0; lane < W; lane++) {
+            // The missing lanes repeat the first triangle and are masked out
+            auto triangle = k + (lane < lanes ? lane : 0);
+            for (int v = 0; v < 3; v++)
+                sheared_vertex(ray, triangle, v, p[3 * v][lane], p[3 * v + 1][lane], p[3 * v + 2][lane]);
+        }
+        auto ax = SimdReal::load(p[0]), ay = SimdReal::load(p[1]), az = SimdReal::load(p[2]);
+        auto bx = SimdReal::load(p[3]), by = SimdReal::load(p[4]), bz = SimdReal::load(p[5]);
+        auto cx = SimdReal::load(p[6]), cy = SimdReal::load(p[7]), cz = SimdReal::load(p[8]);
+
+        // Same math as hit_range_scalar, on W triangles at once
+        auto u = edge_function(cx, cy, bx, by);
+        auto v = edge_function(ax, ay, cx, cy);
+        auto w = edge_function(bx, by, ax, ay);
+        auto all_positive = (u >= zero) & (v >= zero) & (w >= zero);
+        auto all_negative = (u <= zero) & (v <= zero) & (w <= zero);
+        auto det = u + v + w;
+        auto valid = (all_positive | all_negative) & ((det < zero) | (det > zero))
+                   & SimdReal::first_lanes(lanes);
+        if (!valid.any()) continue;
+
+        auto t = (u * az + v * bz + w * cz) * sz / det;
+        auto hit = valid & (t >= vt_min) & (t <= best_t);
+        if (!hit.any()) continue;
+
+        best_t = select(hit, t, best_t);
+        best_index = select(hit, SimdReal(static_cast<real>(k)) + SimdReal::lane_index(), best_index);
+        hit_any = hit_any | hit;
+    }
+
+    if (!hit_any.any())
+        return false;
+
+    // Find the closest hit among the lanes
+    real t[W], index[W];
+    best_t.store(t);
+    best_index.store(index);
+
+    bool found = false;
+    for (int lane = 0; lane < W; lane++) {
+        if (index[lane] >= 0 && t[lane] <= closest_so_far) {
+            closest_so_far = t[lane];
+            closest_index = static_cast<uint32_t>(index[lane]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * The hit point is put together from the barycentric coordinates and the
+ * vertices rather than from r.at(t), so it lies on the triangle up to a few
+ * roundings of the vertex coordinates, and that is its error bound.
+ **/
+inline void TriangleMesh::fill_record(const Ray& r, uint32_t k, real t, hit_record& rec) const {
+    const auto& a = vertices[indices[3 * k]];
+    const auto& b = vertices[indices[3 * k + 1]];
+    const auto& c = vertices[indices[3 * k + 2]];
+
+    // The barycentric coordinates again, for this one triangle
+    WatertightRay ray(r);
+    real ax, ay, az, bx, by, bz, cx, cy, cz;
+    sheared_vertex(ray, k, 0, ax, ay, az);
+    sheared_vertex(ray, k, 1, bx, by, bz);
+    sheared_vertex(ray, k, 2, cx, cy, cz);
+    auto u = edge_function(cx, cy, bx, by);
+    auto v = edge_function(ax, ay, cx, cy);
+    auto w = edge_function(bx, by, ax, ay);
+    auto inv_det = 1 / (u + v + w);
+    real b0 = u * inv_det, b1 = v * inv_det, b2 = w * inv_det;
+
+    rec.t = t;
+    rec.p = b0 * a + b1 * b + b2 * c;
+    rec.set_face_normal(r, unit_vector(cross(b - a, c - a)));
+    rec.mat_ptr = material;
+
+    real extent = 0;
+    for (int i = 0; i < 3; i++)
+        extent = std::max(extent, std::fabs(b0 * a[i]) + std::fabs(b1 * b[i]) + std::fabs(b2 * c[i]));
+    rec.error = SELF_HIT_EPSILON * extent;
+}
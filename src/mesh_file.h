@@ -0,0 +1,397 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "utility.h"
+#include "mesh.h"
+#include "mapped_file.h"
+
+/**
+ * Loading triangle meshes from Wavefront OBJ and Stanford PLY files.
+ *
+ * Both readers stream through the mapped file once and parse the numbers in
+ * place, there is no string or vector made per line or per face, so a mesh
+ * with millions of faces loads about as fast as the disk can deliver it.
+ * Faces with more than three corners are split into a fan of triangles.
+ *
+ * From an OBJ file only the v (vertex) and f (face) lines are used, texture
+ * coordinates and normals in the faces (f 1/2/3 ...) are skipped, negative
+ * indices count back from the last vertex. A PLY file can be ascii or binary
+ * of either byte order, the vertices need x, y and z and the faces a
+ * vertex_indices (or vertex_index) list, anything else is skipped.
+ **/
+namespace mesh_file_detail {
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+inline void skip_spaces(const char*& p, const char* end) {
+    while (p < end && is_space(*p)) p++;
+}
+
+// Parses a number at p and moves p past it
+template <typename T>
+bool parse_value(const char*& p, const char* end, T& value) {
+    skip_spaces(p, end);
+    // from_chars doesn't take a leading +
+    if (p < end && *p == '+') p++;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+// The end of the line starting at p, the \n or end
+inline const char* line_end(const char* p, const char* end) {
+    auto found = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return found ? found : end;
+}
+
+// Adds the triangles of a face, corner by corner
+struct FanBuilder {
+    TriangleMesh& mesh;
+    uint32_t first = 0, previous = 0;
+    int corners = 0;
+
+    void start() { corners = 0; }
+
+    void add(uint32_t index) {
+        if (corners == 0) first = index;
+        else if (corners >= 2) mesh.add_triangle(first, previous, index);
+        previous = index;
+        corners++;
+    }
+};
+
+inline bool parse_obj(const char* data, std::size_t size, TriangleMesh& mesh, std::string& error) {
+    const char* end = data + size;
+    FanBuilder fan{ mesh };
+    int line = 0;
+
+    for (const char* p = data; p < end; ) {
+        line++;
+        auto stop = line_end(p, end);
+        skip_spaces(p, stop);
+        auto fail = [&](const char* message) {
+            error = "line " + std::to_string(line) + ": " + message;
+            return false;
+        };
+
+        if (stop - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+            p++;
+            double x, y, z;
+            if (!parse_value(p, stop, x) || !parse_value(p, stop, y) || !parse_value(p, stop, z))
+                return fail("expected v x y z");
+            mesh.add_vertex(Point3(x, y, z));
+        } else if (stop - p >= 2 && p[0] == 'f' && is_space(p[1])) {
+            p++;
+            fan.start();
+            while (true) {
+                skip_spaces(p, stop);
+                if (p == stop)
+                    break;
+                int64_t index;
+                if (!parse_value(p, stop, index) || index == 0)
+                    return fail("expected f followed by vertex numbers");
+                // Skip the texture coordinate and normal of the corner
+                while (p < stop && !is_space(*p)) p++;
+
+                // Counted from 1, or back from the last vertex if negative
+                int64_t k = index > 0 ? index - 1 : static_cast<int64_t>(mesh.vertices.size()) + index;
+                if (k < 0 || k >= static_cast<int64_t>(mesh.vertices.size()))
+                    return fail("the face uses a vertex that isn't there");
+                fan.add(static_cast<uint32_t>(k));
+            }
+            if (fan.corners < 3)
+                return fail("a face needs at least three corners");
+        }
+        p = stop + 1;
+    }
+    return true;
+}
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, None };
+
+inline PlyType ply_type(const std::string& name) {
+    if (name == "char" || name == "int8") return PlyType::Int8;
+    if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+    if (name == "short" || name == "int16") return PlyType::Int16;
+    if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+    if (name == "int" || name == "int32") return PlyType::Int32;
+    if (name == "uint" || name == "uint32") return PlyType::UInt32;
+    if (name == "float" || name == "float32") return PlyType::Float32;
+    if (name == "double" || name == "float64") return PlyType::Float64;
+    return PlyType::None;
+}
+
+inline std::size_t ply_size(PlyType type) {
+    switch (type) {
+        case PlyType::Int8: case PlyType::UInt8: return 1;
+        case PlyType::Int16: case PlyType::UInt16: return 2;
+        case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default: return 0;
+    }
+}
+
+struct PlyProperty {
+    std::string name;
+    PlyType type = PlyType::None;
+    // A list has a count of type count_type, then that many values of type
+    bool list = false;
+    PlyType count_type = PlyType::None;
+};
+
+struct PlyElement {
+    std::string name;
+    uint64_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+// Reads the values of a PLY body, ascii or binary
+struct PlyReader {
+    const char* p;
+    const char* end;
+    bool ascii;
+    // The file's byte order isn't the machine's
+    bool swap;
+
+    bool read(PlyType type, double& value) {
+        if (ascii) {
+            // The values of an element may go on over several lines
+            while (p < end && (is_space(*p) || *p == '\n')) p++;
+            return parse_value(p, end, value);
+        }
+
+        auto bytes = ply_size(type);
+        if (static_cast<std::size_t>(end - p) < bytes)
+            return false;
+        unsigned char raw[8];
+        for (std::size_t k = 0; k < bytes; k++)
+            raw[k] = static_cast<unsigned char>(p[swap ? bytes - 1 - k : k]);
+        p += bytes;
+
+        switch (type) {
+            case PlyType::Int8: { int8_t v; std::memcpy(&v, raw, 1); value = v; break; }
+            case PlyType::UInt8: { uint8_t v; std::memcpy(&v, raw, 1); value = v; break; }
+            case PlyType::Int16: { int16_t v; std::memcpy(&v, raw, 2); value = v; break; }
+            case PlyType::UInt16: { uint16_t v; std::memcpy(&v, raw, 2); value = v; break; }
+            case PlyType::Int32: { int32_t v; std::memcpy(&v, raw, 4); value = v; break; }
+            case PlyType::UInt32: { uint32_t v; std::memcpy(&v, raw, 4); value = v; break; }
+            case PlyType::Float32: { float v; std::memcpy(&v, raw, 4); value = v; break; }
+            case PlyType::Float64: { double v; std::memcpy(&v, raw, 8); value = v; break; }
+            default: return false;
+        }
+        return true;
+    }
+};
+
+inline bool machine_is_little_endian() {
+    uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+inline bool parse_ply(const char* data, std::size_t size, TriangleMesh& mesh, std::string& error) {
+    const char* end = data + size;
+    const char* p = data;
+
+    // The header is a few short lines of text, splitting it into words is fine
+    std::vector<PlyElement> elements;
+    std::vector<std::string> words;
+    std::string format;
+    bool header_done = false;
+    while (p < end && !header_done) {
+        auto stop = line_end(p, end);
+        words.clear();
+        for (const char* q = p; q < stop; ) {
+            while (q < stop && (is_space(*q))) q++;
+            auto word = q;
+            while (q < stop && !is_space(*q)) q++;
+            if (q > word)
+                words.emplace_back(word, q);
+        }
+        p = stop + 1;
+
+        if (words.empty() || words[0] == "ply" || words[0] == "comment" || words[0] == "obj_info")
+            continue;
+        if (words[0] == "end_header") {
+            header_done = true;
+        } else if (words[0] == "format" && words.size() >= 2) {
+            format = words[1];
+        } else if (words[0] == "element" && words.size() == 3) {
+            PlyElement element;
+            element.name = words[1];
+            const char* count = words[2].c_str();
+            if (!parse_value(count, count + words[2].size(), element.count)) {
+                error = "bad element count " + words[2];
+                return false;
+            }
+            elements.push_back(element);
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty property;
+            if (words.size() == 5 && words[1] == "list") {
+                property.list = true;
+                property.count_type = ply_type(words[2]);
+                property.type = ply_type(words[3]);
+                property.name = words[4];
+            } else if (words.size() == 3) {
+                property.type = ply_type(words[1]);
+                property.name = words[2];
+            }
+            if (property.type == PlyType::None || (property.list && property.count_type == PlyType::None)) {
+                error = "unknown property type in the header";
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else {
+            error = "unknown header line " + words[0];
+            return false;
+        }
+    }
+    if (!header_done) {
+        error = "the header has no end_header";
+        return false;
+    }
+
+    PlyReader reader{ p, end, format == "ascii", false };
+    if (format == "binary_little_endian" || format == "binary_big_endian")
+        reader.swap = (format == "binary_little_endian") != machine_is_little_endian();
+    else if (format != "ascii") {
+        error = "unknown format " + format;
+        return false;
+    }
+
+    FanBuilder fan{ mesh };
+    for (const auto& element : elements) {
+        bool is_vertex = element.name == "vertex";
+        bool is_face = element.name == "face";
+
+        // Which property is which
+        int xyz[3] = { -1, -1, -1 };
+        int face_list = -1;
+        for (std::size_t k = 0; k < element.properties.size(); k++) {
+            const auto& property = element.properties[k];
+            for (int axis = 0; axis < 3; axis++)
+                if (is_vertex && !property.list && property.name == std::string(1, char('x' + axis)))
+                    xyz[axis] = static_cast<int>(k);
+            if (is_face && property.list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                face_list = static_cast<int>(k);
+        }
+        if (is_vertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)) {
+            error = "the vertices have no x, y and z";
+            return false;
+        }
+        if (is_face && face_list < 0) {
+            error = "the faces have no vertex_indices";
+            return false;
+        }
+        // The count in the header could be anything. Every property of an
+        // element takes at least a byte, binary or text, so a count the rest
+        // of the file can't hold means the file is cut short
+        auto room = static_cast<uint64_t>(reader.end - reader.p);
+        if (element.properties.empty() ? element.count > 0 : element.count > room / element.properties.size()) {
+            error = "the file is cut short in the " + element.name + " elements";
+            return false;
+        }
+        if (is_vertex)
+            mesh.vertices.reserve(mesh.vertices.size() + element.count);
+        if (is_face)
+            mesh.indices.reserve(mesh.indices.size() + 3 * element.count);
+
+        for (uint64_t n = 0; n < element.count; n++) {
+            double point[3] = { 0, 0, 0 };
+            for (std::size_t k = 0; k < element.properties.size(); k++) {
+                const auto& property = element.properties[k];
+                double value;
+                if (!property.list) {
+                    if (!reader.read(property.type, value)) {
+                        error = "the file is cut short in the " + element.name + " elements";
+                        return false;
+                    }
+                    for (int axis = 0; axis < 3; axis++)
+                        if (xyz[axis] == static_cast<int>(k))
+                            point[axis] = value;
+                    continue;
+                }
+
+                double count;
+                if (!reader.read(property.count_type, count) || count < 0) {
+                    error = "the file is cut short in the " + element.name + " elements";
+                    return false;
+                }
+                bool is_corners = face_list == static_cast<int>(k);
+                if (is_corners)
+                    fan.start();
+                for (uint64_t c = 0; c < static_cast<uint64_t>(count); c++) {
+                    if (!reader.read(property.type, value)) {
+                        error = "the file is cut short in the " + element.name + " elements";
+                        return false;
+                    }
+                    if (is_corners) {
+                        // The cast would wrap a negative or huge index into one that may be there
+                        if (!(value >= 0 && value <= UINT32_MAX) || value != std::floor(value)) {
+                            error = "a face uses a vertex that isn't there";
+                            return false;
+                        }
+                        fan.add(static_cast<uint32_t>(value));
+                    }
+                }
+                if (is_corners && fan.corners < 3) {
+                    error = "face " + std::to_string(n) + " has less than three corners";
+                    return false;
+                }
+            }
+            if (is_vertex)
+                mesh.add_vertex(Point3(point[0], point[1], point[2]));
+        }
+    }
+
+    // The faces may come before the vertices, so the indices are checked at the end
+    for (auto index : mesh.indices) {
+        if (index >= mesh.vertices.size()) {
+            error = "a face uses a vertex that isn't there";
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace mesh_file_detail
+
+/**
+ * Loads an OBJ or PLY file into mesh, replacing its triangles, a PLY file is
+ * recognized by its first line. Doesn't commit the mesh. Returns false and
+ * sets error if the file can't be read or has a mistake in it.
+ **/
+inline bool load_mesh(const std::string& path, TriangleMesh& mesh, std::string& error) {
+    using namespace mesh_file_detail;
+
+    MappedFile file;
+    if (!file.open(path)) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    mesh.bounds = AABB();
+    mesh.source = path;
+    bool is_ply = file.size >= 4 && std::memcmp(file.data, "ply", 3) == 0
+        && (file.data[3] == '\n' || file.data[3] == '\r');
+    bool ok = is_ply ? parse_ply(file.data, file.size, mesh, error)
+                     : parse_obj(file.data, file.size, mesh, error);
+    if (!ok)
+        error = path + ": " + error;
+    return ok;
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+
+// More render threads than this is surely a typo
+const int MAX_THREADS = 1 << 12;
+// Over a day of video at 60 frames a second
+const int MAX_FRAMES = 1 << 23;
+
+// Settings that can be changed from the command line
+struct RenderOptions {
+    // Number of worker threads, 0 uses every hardware thread
+    int threads = 0;
+    // The image is rendered in tile_size x tile_size blocks
+    int tile_size = 16;
+    // Seed for the scene and every pixel sample, the same seed gives
+    // the same image no matter how many threads are used
+    uint64_t seed = 0;
+    // The acceleration structure for the world, see print_usage. Empty picks
+    // packed-bvh for a binary scene that comes with its tree, bvh otherwise
+    std::string accel;
+    // Use the SIMD kernels of the packed spheres
+    bool simd = true;
+    // Trace primary rays in packets of 4, 8 or 16 rays, 0 traces single rays
+    int packet_size = 0;
+    // "path" traces one path at a time, "wavefront" a batch of paths per bounce
+    std::string integrator = "path";
+    // Sample the lights at every diffuse bounce, see lights.h
+    bool nee = true;
+    // Bounces before russian roulette may stop a path
+    int rr_depth = 5;
+    // Scene file to render instead of the book's random scene, see scene_file.h
+    std::string scene;
+    // Write the scene to this file and quit, .rtscene writes the binary format
+    std::string save_scene;
+
+    // Overrides for the image and camera of the scene, 0 or empty keeps the
+    // scene's value. Giving only one of width and height keeps the aspect ratio
+    int width = 0;
+    int height = 0;
+    int max_depth = 0;
+    std::optional<std::array<double, 3>> lookfrom, lookat, vup;
+    std::optional<double> vfov, aperture, focus_dist;
+
+    // Where the machine readable summary of the run goes, "-" is the standard
+    // output and empty writes none
+    std::string summary;
+
+    // Print the counters of stats.h, and write the time spent on every pixel
+    // as a false color image. Both need a build with RT_STATS
+    bool stats = false;
+    std::string heatmap;
+    // Where the image is written, "-" writes it to the standard output
+    std::string output = "image.png";
+    // ppm, png or pfm, empty picks the format from the output extension
+    std::string format;
+    // Samples per pixel, 0 picks a number from the image size
+    int samples = 0;
+    // independent, stratified, sobol or bluenoise, see SamplePattern
+    std::string sampler = "sobol";
+    // Render in passes, writing the image and a checkpoint in between
+    bool progressive = false;
+    // Samples per pixel added by every progressive pass
+    int pass_samples = 4;
+    // Where the progressive render keeps its checkpoint
+    std::string checkpoint = "render.ckpt";
+    // Continue from the checkpoint instead of starting over
+    bool resume = false;
+    // Seconds between the intermediate images and checkpoints
+    double interval = 30;
+    // Stop sampling pixels once their noise is below noise_threshold,
+    // the samples per pixel become the most a pixel can get
+    bool adaptive = false;
+    double noise_threshold = 0.01;
+    // Samples every pixel gets before adaptive sampling may stop it
+    int min_samples = 32;
+    // Give the samples the quiet pixels didn't take to the noisy ones, the
+    // render takes about width * height * samples in all and a pixel gets
+    // at most max_samples (0 is 4 times the samples per pixel)
+    bool budget = false;
+    int max_samples = 0;
+    // Render this many frames along camera_path instead of a single image, 0
+    // renders one image. Without a camera path the camera circles the scene
+    int frames = 0;
+    std::string camera_path;
+    // Smooth out the noise of the finished image, see denoiser.h
+    bool denoise = false;
+    // Write the albedo, normal and depth of the first hits next to this path
+    std::string aovs;
+    // A PFM of the same scene rendered with many samples, the error of the
+    // image against it is printed
+    std::string reference;
+};
+
+inline void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "Options:\n"
+              << "  -t, --threads <n>   number of render threads (default: all cores)\n"
+              << "  --tile-size <n>     size of a render tile in pixels (default: 16)\n"
+              << "  --seed <n>          seed for the random numbers (default: 0)\n"
+              << "  --scene <path>      scene file to render (default: the book's random scene)\n"
+              << "  --save-scene <path> write the scene to a file and quit, .rtscene for the\n"
+              << "                      binary format with a prebuilt tree, text otherwise\n"
+              << "  --width <n>         image width in pixels (default: from the scene, 400)\n"
+              << "  --height <n>        image height in pixels (default: from the scene, 225)\n"
+              << "  --depth <n>         max bounces of a path (default: from the scene, 50)\n"
+              << "  --lookfrom <x,y,z>  camera position (default: from the scene)\n"
+              << "  --lookat <x,y,z>    point the camera looks at (default: from the scene)\n"
+              << "  --vup <x,y,z>       up direction of the camera (default: from the scene)\n"
+              << "  --fov <degrees>     vertical field of view (default: from the scene)\n"
+              << "  --aperture <a>      lens diameter, 0 for a pinhole (default: from the scene)\n"
+              << "  --focus <d>         distance to the plane in focus (default: from the scene)\n"
+              << "  --accel <name>      acceleration structure (default: bvh, packed-bvh for\n"
+              << "                      a binary scene)\n"
+              << "                        list        test every object\n"
+              << "                        bvh         bounding volume hierarchy\n"
+              << "                        packed      packed spheres, every sphere\n"
+              << "                        packed-bvh  packed spheres in a bvh\n"
+              << "  --no-simd           use the scalar kernels for the packed spheres and meshes\n"
+              << "  --packet <n>        trace primary rays in packets of 4, 8 or 16 (default: off)\n"
+              << "  --integrator <name> path or wavefront (default: path)\n"
+              << "  --rr-depth <n>      bounces before russian roulette starts (default: 5)\n"
+              << "  --no-nee            only find the lights by bouncing into them, don't sample them\n"
+              << "  -o, --output <path> image file, - for standard output (default: image.png)\n"
+              << "  --format <name>     ppm, png or pfm (default: from the file extension)\n"
+              << "  -s, --spp <n>       samples per pixel (default: picked from the image size)\n"
+              << "  --sampler <name>    how the samples of a pixel are placed (default: sobol)\n"
+              << "                        independent every number on its own\n"
+              << "                        stratified  multi-jittered over the samples per pixel\n"
+              << "                        sobol       Owen scrambled Sobol points\n"
+              << "                        bluenoise   Sobol points shifted by a blue noise mask\n"
+              << "  --progressive       render in passes, saving the image and a checkpoint\n"
+              << "  --pass-spp <n>      samples per pixel of every progressive or adaptive pass (default: 4)\n"
+              << "  --checkpoint <path> checkpoint file of the progressive render (default: render.ckpt)\n"
+              << "  --resume            continue the render in the checkpoint, implies --progressive\n"
+              << "  --interval <s>      seconds between intermediate images and checkpoints (default: 30)\n"
+              << "  --adaptive          stop sampling pixels once they are less noisy than --noise\n"
+              << "  --noise <x>         noise threshold of adaptive sampling (default: 0.01)\n"
+              << "  --min-spp <n>       samples per pixel before adaptive sampling may stop (default: 32)\n"
+              << "                      --spp is the most a pixel gets, the samples the quiet pixels\n"
+              << "                      don't take are saved\n"
+              << "  --budget            with --adaptive, spend the samples the quiet pixels saved on\n"
+              << "                      the noisy ones, width x height x spp samples in all\n"
+              << "  --max-spp <n>       most samples a pixel gets with --budget (default: 4 x spp)\n"
+              << "  --frames <n>        render an animation of n frames, the frame number goes\n"
+              << "                      into the output name (out.png becomes out_0000.png, or\n"
+              << "                      replaces a %04d in it)\n"
+              << "  --camera-path <path> keyframes of the camera for --frames, one per line:\n"
+              << "                      time, lookfrom x y z, lookat x y z and optionally the fov\n"
+              << "                      (default: one turn around the scene)\n"
+              << "  --denoise           denoise the image (every frame of an animation), for\n"
+              << "                      clean images from 16 to 32 samples per pixel\n"
+              << "  --aovs <path>       write the albedo, normal and depth the denoiser uses,\n"
+              << "                      out.png becomes out_albedo.png and so on\n"
+              << "  --reference <path>  PFM of the same render with many samples, prints the\n"
+              << "                      error of the image (and before denoising) against it\n"
+              << "  --summary <path>    write a JSON summary of the run, - for standard output\n"
+              << "  --stats             print where the render time went (RT_STATS builds)\n"
+              << "  --heatmap <path>    write the time spent on every pixel as an image (RT_STATS builds)\n"
+              << "  -h, --help          show this message\n";
+}
+
+inline RenderOptions parse_options(int argc, char** argv) {
+    RenderOptions options;
+
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+
+        // Returns the value following a flag, or quits if there is none
+        auto value = [&]() -> std::string {
+            if (k + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << '\n';
+                std::exit(EXIT_FAILURE);
+            }
+            return argv[++k];
+        };
+
+        // The value as a number, or quits if it isn't one
+        auto number = [&]() {
+            auto text = value();
+            char* end;
+            double v = std::strtod(text.c_str(), &end);
+            if (text.empty() || *end != '\0') {
+                std::cerr << "Expected a number for " << arg << ", got " << text << '\n';
+                std::exit(EXIT_FAILURE);
+            }
+            return v;
+        };
+
+        // The value as a whole number from min to max, or quits if it isn't one
+        auto integer = [&](int min, int max) {
+            auto v = number();
+            if (v != std::floor(v) || v < min || v > max) {
+                std::cerr << "Expected a whole number from " << min << " to " << max << " for "
+                          << arg << ", got " << v << '\n';
+                std::exit(EXIT_FAILURE);
+            }
+            return static_cast<int>(v);
+        };
+
+        // The value as a number that isn't negative, or quits
+        auto non_negative = [&]() {
+            auto v = number();
+            if (!(v >= 0) || std::isinf(v)) {
+                std::cerr << "Expected a number of at least 0 for " << arg << ", got " << v << '\n';
+                std::exit(EXIT_FAILURE);
+            }
+            return v;
+        };
+
+        // The value as three numbers separated by commas, like 13,2,3
+        auto vector = [&]() {
+            auto text = value();
+            std::array<double, 3> v;
+            const char* p = text.c_str();
+            for (int c = 0; c < 3; c++) {
+                char* end;
+                v[c] = std::strtod(p, &end);
+                bool separator_ok = c < 2 ? *end == ',' : *end == '\0';
+                if (end == p || !separator_ok) {
+                    std::cerr << "Expected x,y,z for " << arg << ", got " << text << '\n';
+                    std::exit(EXIT_FAILURE);
+                }
+                p = end + 1;
+            }
+            return v;
+        };
+
+        if (arg == "-t" || arg == "--threads") {
+            options.threads = integer(0, MAX_THREADS);
+        } else if (arg == "--tile-size") {
+            options.tile_size = integer(1, MAX_IMAGE_SIZE);
+        } else if (arg == "--seed") {
+            auto text = value();
+            char* end;
+            options.seed = std::strtoull(text.c_str(), &end, 10);
+            if (text.empty() || *end != '\0' || text[0] == '-') {
+                std::cerr << "Expected a whole number for " << arg << ", got " << text << '\n';
+                std::exit(EXIT_FAILURE);
+            }
+        } else if (arg == "--scene") {
+            options.scene = value();
+        } else if (arg == "--save-scene") {
+            options.save_scene = value();
+        } else if (arg == "--width") {
+            options.width = integer(0, MAX_IMAGE_SIZE);
+        } else if (arg == "--height") {
+            options.height = integer(0, MAX_IMAGE_SIZE);
+        } else if (arg == "--depth") {
+            options.max_depth = integer(0, MAX_BOUNCES);
+        } else if (arg == "--lookfrom") {
+            options.lookfrom = vector();
+        } else if (arg == "--lookat") {
+            options.lookat = vector();
+        } else if (arg == "--vup") {
+            options.vup = vector();
+        } else if (arg == "--fov") {
+            options.vfov = number();
+        } else if (arg == "--aperture") {
+            options.aperture = number();
+        } else if (arg == "--focus") {
+            options.focus_dist = number();
+        } else if (arg == "--summary") {
+            options.summary = value();
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--heatmap") {
+            options.heatmap = value();
+        } else if (arg == "--accel") {
+            options.accel = value();
+        } else if (arg == "--no-simd") {
+            options.simd = false;
+        } else if (arg == "--no-nee") {
+            options.nee = false;
+        } else if (arg == "--packet") {
+            options.packet_size = integer(0, 16);
+        } else if (arg == "--integrator") {
+            options.integrator = value();
+        } else if (arg == "--rr-depth") {
+            options.rr_depth = integer(0, MAX_BOUNCES);
+        } else if (arg == "-o" || arg == "--output") {
+            options.output = value();
+        } else if (arg == "--format") {
+            options.format = value();
+        } else if (arg == "-s" || arg == "--spp") {
+            options.samples = integer(0, MAX_SAMPLES);
+        } else if (arg == "--sampler") {
+            options.sampler = value();
+        } else if (arg == "--progressive") {
+            options.progressive = true;
+        } else if (arg == "--pass-spp") {
+            options.pass_samples = integer(1, MAX_SAMPLES);
+        } else if (arg == "--checkpoint") {
+            options.checkpoint = value();
+        } else if (arg == "--resume") {
+            options.resume = true;
+            options.progressive = true;
+        } else if (arg == "--interval") {
+            options.interval = non_negative();
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--noise") {
+            options.noise_threshold = non_negative();
+        } else if (arg == "--min-spp") {
+            options.min_samples = integer(0, MAX_SAMPLES);
+        } else if (arg == "--budget") {
+            options.budget = true;
+        } else if (arg == "--max-spp") {
+            options.max_samples = integer(0, MAX_SAMPLES);
+        } else if (arg == "--frames") {
+            options.frames = integer(0, MAX_FRAMES);
+        } else if (arg == "--camera-path") {
+            options.camera_path = value();
+        } else if (arg == "--denoise") {
+            options.denoise = true;
+        } else if (arg == "--aovs") {
+            options.aovs = value();
+        } else if (arg == "--reference") {
+            options.reference = value();
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        } else {
+            std::cerr << "Unknown option " << arg << '\n';
+            print_usage(argv[0]);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    // The camera spreads the pixels over (width - 1) and (height - 1) steps
+    if (options.width == 1 || options.height == 1) {
+        std::cerr << "Width and height must be at least 2 pixels" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (!RT_STATS && (options.stats || !options.heatmap.empty())) {
+        std::cerr << "--stats and --heatmap need a build with RT_STATS, configure with -D RT_STATS=ON" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.summary == "-" && options.output == "-") {
+        std::cerr << "The image and the summary can't both go to the standard output" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (!options.accel.empty() && options.accel != "bvh" && options.accel != "list"
+        && options.accel != "packed" && options.accel != "packed-bvh") {
+        std::cerr << "Unknown acceleration structure " << options.accel << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.packet_size != 0 && options.packet_size != 4
+        && options.packet_size != 8 && options.packet_size != 16) {
+        std::cerr << "Packet size must be 4, 8 or 16" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.integrator != "path" && options.integrator != "wavefront") {
+        std::cerr << "Unknown integrator " << options.integrator << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.integrator == "wavefront" && options.packet_size != 0) {
+        std::cerr << "Packets can only be used with the path integrator" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    SamplePattern pattern;
+    if (!parse_sample_pattern(options.sampler, pattern)) {
+        std::cerr << "Unknown sampler " << options.sampler << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if ((options.budget || options.max_samples != 0) && !options.adaptive) {
+        std::cerr << "--budget and --max-spp need --adaptive" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.adaptive && options.progressive) {
+        std::cerr << "Adaptive sampling can't be combined with progressive rendering" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (!options.camera_path.empty() && options.frames == 0) {
+        std::cerr << "--camera-path needs --frames" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.frames > 0 && (options.progressive || options.adaptive || !options.heatmap.empty()
+                               || options.output == "-")) {
+        std::cerr << "An animation can't be progressive or adaptive, have a heatmap or go to the standard output" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (options.frames > 0 && (!options.aovs.empty() || !options.reference.empty())) {
+        std::cerr << "--aovs and --reference only work for a single image" << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (!options.format.empty() && options.format != "ppm"
+        && options.format != "png" && options.format != "pfm") {
+        std::cerr << "Unknown image format " << options.format << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+
+    return options;
+}
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "utility.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "simd.h"
+#include "ray_packet.h"
+
+/**
+ * A collection of spheres stored as a structure of arrays.
+ *
+ * A HittableList of Spheres keeps every sphere in its own heap allocation, and
+ * testing one is a virtual call. Here the x, y and z of all the centers and all
+ * the radii are each kept in one contiguous array, so loading the next few
+ * spheres is a single SIMD load and we can test one ray against SimdReal::WIDTH
+ * spheres at a time (see simd.h).
+ *
+ * The spheres can optionally be put in a BVH, the leaves then hold up to WIDTH
+ * spheres which are tested together.
+ *
+ * The SIMD kernels keep the index of the closest sphere in the lanes of a
+ * SimdReal, which only holds whole numbers exactly up to 2^24 with floats.
+ * Past MAX_SIMD_SPHERES the scalar kernels are used instead.
+ **/
+class PackedSpheres : public Hittable {
+public:
+    // The most spheres whose indices (and the padding after them) a SimdReal holds exactly
+    static constexpr uint64_t MAX_SIMD_SPHERES =
+        (uint64_t(1) << std::min(std::numeric_limits<real>::digits, 32)) - SimdReal::WIDTH;
+
+    // Sphere k has center (cx[k], cy[k], cz[k]) and radius[k]
+    std::vector<real> cx, cy, cz, radius;
+    std::vector<const Material*> materials;
+
+    BvhTree tree;
+    bool use_tree = false;
+    // Use the SIMD kernel, or the plain scalar loop if false
+    bool use_simd = true;
+    // commit() was called, the arrays are padded (and in leaf order with a tree)
+    bool committed = false;
+    AABB bounds;
+public:
+    PackedSpheres() {}
+    // Copy the spheres out of a list, anything that isn't a Sphere is skipped
+    PackedSpheres(const HittableList& list, bool build_tree, bool simd = true);
+
+    void add(const Point3& center, real r, const Material* m);
+    // Call after the last add(), builds the tree if asked for and pads the arrays
+    void commit(bool build_tree);
+    // Turns use_simd off if there are more than MAX_SIMD_SPHERES, commit() calls it
+    void check_simd_limit();
+
+    std::size_t size() const { return materials.size(); }
+
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        output_box = bounds;
+        return size() > 0;
+    }
+
+    // Bytes used by the arrays and the tree
+    std::size_t memory_bytes() const {
+        return (cx.capacity() + cy.capacity() + cz.capacity() + radius.capacity()) * sizeof(real)
+             + materials.capacity() * sizeof(const Material*)
+             + tree.nodes.capacity() * sizeof(BvhNode) + tree.prim_order.capacity() * sizeof(uint32_t);
+    }
+
+    /**
+     * Test the ray against the spheres first to first+count-1. If any is closer
+     * than closest_so_far, lowers closest_so_far to it, sets closest_index and
+     * returns true.
+     **/
+    bool hit_range(
+        const Ray& r, uint32_t first, uint32_t count, real t_min,
+        real& closest_so_far, uint32_t& closest_index
+    ) const;
+
+    // Same as hit_range, one sphere at a time without any SIMD
+    bool hit_range_scalar(
+        const Ray& r, uint32_t first, uint32_t count, real t_min,
+        real& closest_so_far, uint32_t& closest_index
+    ) const;
+
+    virtual void hit_packet(
+        const RayPacket& packet, real t_min, real t_max, hit_record* recs, bool* hits
+    ) const override;
+
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override;
+
+    virtual void occluded_packet(
+        const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+    ) const override;
+
+    /**
+     * Test every ray of the packet against the spheres first to first+count-1.
+     * Here the lanes are rays rather than spheres, every sphere is broadcast
+     * and tested against W rays at once. closest and closest_index are per ray.
+     **/
+    void hit_range_packet(
+        const RayPacket& packet, uint32_t first, uint32_t count, real t_min,
+        real* closest, real* closest_index
+    ) const;
+private:
+    void fill_record(const Ray& r, uint32_t k, real t, hit_record& rec) const;
+};
+
+inline PackedSpheres::PackedSpheres(const HittableList& list, bool build_tree, bool simd)
+    : use_simd(simd)
+{
+    for (const auto& object : list.objects) {
+        auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+        if (!sphere) {
+            std::cerr << "PackedSpheres: skipping an object that is not a sphere" << '\n';
+            continue;
+        }
+        add(sphere->center, sphere->radius, sphere->mat_ptr);
+    }
+    commit(build_tree);
+}
+
+inline void PackedSpheres::add(const Point3& center, real r, const Material* m) {
+    cx.push_back(center[0]);
+    cy.push_back(center[1]);
+    cz.push_back(center[2]);
+    radius.push_back(r);
+    materials.push_back(m);
+
+    auto extent = Vec3(r, r, r);
+    bounds.expand(AABB(center - extent, center + extent));
+}
+
+inline void PackedSpheres::check_simd_limit() {
+    if (use_simd && size() > MAX_SIMD_SPHERES) {
+        std::cerr << "PackedSpheres: more than " << MAX_SIMD_SPHERES
+                  << " spheres, using the scalar kernels" << '\n';
+        use_simd = false;
+    }
+}
+
+inline void PackedSpheres::commit(bool build_tree) {
+    auto n = size();
+    use_tree = build_tree;
+    committed = true;
+    check_simd_limit();
+
+    if (use_tree) {
+        std::vector<AABB> boxes;
+        for (std::size_t k = 0; k < n; k++) {
+            Vec3 extent(radius[k], radius[k], radius[k]);
+            Point3 center(cx[k], cy[k], cz[k]);
+            boxes.push_back(AABB(center - extent, center + extent));
+        }
+
+        // A leaf holds at most one SIMD register worth of spheres
+        auto leaf_size = SimdReal::WIDTH < 4 ? 4 : SimdReal::WIDTH;
+        tree.build(boxes, leaf_size);
+
+        // Put the spheres in leaf order so a leaf is a contiguous range
+        auto reorder = [&](auto& values) {
+            auto old = values;
+            for (std::size_t k = 0; k < n; k++)
+                values[k] = old[tree.prim_order[k]];
+        };
+        reorder(cx);
+        reorder(cy);
+        reorder(cz);
+        reorder(radius);
+        reorder(materials);
+    }
+
+    // The SIMD loads always read a full register, so pad the arrays with
+    // zero sized spheres. The extra lanes are masked out anyway
+    for (int k = 0; k < SimdReal::WIDTH; k++) {
+        cx.push_back(0);
+        cy.push_back(0);
+        cz.push_back(0);
+        radius.push_back(0);
+    }
+}
+
+inline bool PackedSpheres::hit(const Ray& r, real t_min, real t_max, hit_record& rec) const {
+    auto closest_so_far = t_max;
+    uint32_t closest_index = 0;
+    bool hit_anything;
+
+    if (use_tree) {
+        hit_anything = tree.traverse(r, t_min, t_max,
+            [&](uint32_t first, uint32_t count, real& closest) {
+                bool hit_leaf = use_simd
+                    ? hit_range(r, first, count, t_min, closest, closest_index)
+                    : hit_range_scalar(r, first, count, t_min, closest, closest_index);
+                if (hit_leaf)
+                    closest_so_far = closest;
+                return hit_leaf;
+            }
+        );
+    } else {
+        auto n = static_cast<uint32_t>(size());
+        hit_anything = use_simd
+            ? hit_range(r, 0, n, t_min, closest_so_far, closest_index)
+            : hit_range_scalar(r, 0, n, t_min, closest_so_far, closest_index);
+    }
+
+    if (!hit_anything)
+        return false;
+
+    // Only the closest sphere gets a full hit record
+    fill_record(r, closest_index, closest_so_far, rec);
+    return true;
+}
+
+inline bool PackedSpheres::hit_range(
+    const Ray& r, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, uint32_t& closest_index
+) const {
+    constexpr int W = SimdReal::WIDTH;
+    RT_STAT(thread_stats().intersection_tests += count);
+
+    // The ray is the same for every sphere, so broadcast it to all the lanes
+    SimdReal ox(r.orig[0]), oy(r.orig[1]), oz(r.orig[2]);
+    SimdReal dx(r.dir[0]), dy(r.dir[1]), dz(r.dir[2]);
+    auto a = r.direction().lengthSquared();
+    SimdReal inv_a(1.0 / a), va(a), vt_min(t_min);
+
+    // Every lane keeps the closest hit it has seen, we pick the closest of the
+    // lanes at the end
+    SimdReal best_t(closest_so_far);
+    SimdReal best_index(-1.0);
+    SimdRealMask hit_any = SimdReal::first_lanes(0);
+
+    auto end = first + count;
+    for (auto k = first; k < end; k += W) {
+        // Same math as Sphere::hit, on W spheres at once
+        auto ocx = ox - SimdReal::load(&cx[k]);
+        auto ocy = oy - SimdReal::load(&cy[k]);
+        auto ocz = oz - SimdReal::load(&cz[k]);
+        auto rad = SimdReal::load(&radius[k]);
+
+        auto half_b = ocx*dx + ocy*dy + ocz*dz;
+        auto c = ocx*ocx + ocy*ocy + ocz*ocz - rad*rad;
+        auto discriminant = half_b*half_b - va*c;
+
+        auto valid = (discriminant >= SimdReal(0.0))
+                   & SimdReal::first_lanes(static_cast<int>(end - k));
+        if (!valid.any()) continue;
+
+        auto sqrt_d = sqrt(max(discriminant, SimdReal(0.0)));
+
+        // The nearer root if it is in range, otherwise the further one
+        auto near_root = (SimdReal(0.0) - half_b - sqrt_d) * inv_a;
+        auto far_root = (SimdReal(0.0) - half_b + sqrt_d) * inv_a;
+        auto near_ok = (near_root >= vt_min) & (near_root <= best_t);
+        auto far_ok = (far_root >= vt_min) & (far_root <= best_t);
+
+        auto hit = valid & (near_ok | far_ok);
+        if (!hit.any()) continue;
+
+        auto root = select(near_ok, near_root, far_root);
+        best_t = select(hit, root, best_t);
+        best_index = select(hit, SimdReal(static_cast<real>(k)) + SimdReal::lane_index(), best_index);
+        hit_any = hit_any | hit;
+    }
+
+    if (!hit_any.any())
+        return false;
+
+    // Find the closest hit among the lanes
+    real t[W], index[W];
+    best_t.store(t);
+    best_index.store(index);
+
+    bool found = false;
+    for (int lane = 0; lane < W; lane++) {
+        if (index[lane] >= 0 && t[lane] <= closest_so_far) {
+            closest_so_far = t[lane];
+            closest_index = static_cast<uint32_t>(index[lane]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+inline bool PackedSpheres::hit_range_scalar(
+    const Ray& r, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, uint32_t& closest_index
+) const {
+    auto a = r.direction().lengthSquared();
+    bool hit_anything = false;
+    RT_STAT(thread_stats().intersection_tests += count);
+
+    for (auto k = first; k < first + count; k++) {
+        Vec3 oc = r.origin() - Point3(cx[k], cy[k], cz[k]);
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.lengthSquared() - radius[k] * radius[k];
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0) continue;
+
+        auto sqrt_d = sqrt(discriminant);
+        auto root = (-half_b - sqrt_d) / a;
+        if (root < t_min || closest_so_far < root) {
+            root = (-half_b + sqrt_d) / a;
+            if (root < t_min || closest_so_far < root)
+                continue;
+        }
+
+        closest_so_far = root;
+        closest_index = k;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
+
+inline void PackedSpheres::fill_record(const Ray& r, uint32_t k, real t, hit_record& rec) const {
+    set_sphere_hit(r, t, Point3(cx[k], cy[k], cz[k]), radius[k], materials[k], rec);
+}
+
+inline void PackedSpheres::hit_packet(
+    const RayPacket& packet, real t_min, real t_max, hit_record* recs, bool* hits
+) const {
+    if (!use_simd) {
+        Hittable::hit_packet(packet, t_min, t_max, recs, hits);
+        return;
+    }
+
+    // The unused slots get a closest hit behind the ray, so they never hit anything
+    real closest[MAX_PACKET_SIZE];
+    real closest_index[MAX_PACKET_SIZE];
+    for (int k = 0; k < MAX_PACKET_SIZE; k++) {
+        closest[k] = k < packet.size ? t_max : -INF;
+        closest_index[k] = -1;
+    }
+
+    if (use_tree) {
+        tree.traverse_packet(packet, t_min, closest, [&](uint32_t first, uint32_t count) {
+            hit_range_packet(packet, first, count, t_min, closest, closest_index);
+        });
+    } else {
+        hit_range_packet(packet, 0, static_cast<uint32_t>(size()), t_min, closest, closest_index);
+    }
+
+    for (int k = 0; k < packet.size; k++) {
+        hits[k] = closest_index[k] >= 0;
+        if (hits[k])
+            fill_record(packet.ray(k), static_cast<uint32_t>(closest_index[k]), closest[k], recs[k]);
+    }
+}
+
+/**
+ * The same kernels as hit, but any sphere in range will do: the walk stops
+ * at the first leaf with a hit, and without a tree the spheres are tested a
+ * register at a time so the first hit ends the loop. No hit record is filled.
+ **/
+inline bool PackedSpheres::occluded(const Ray& r, real t_min, real t_max) const {
+    uint32_t index;
+    auto any_hit = [&](uint32_t first, uint32_t count) {
+        auto closest = t_max;
+        return use_simd
+            ? hit_range(r, first, count, t_min, closest, index)
+            : hit_range_scalar(r, first, count, t_min, closest, index);
+    };
+
+    if (use_tree)
+        return tree.traverse_any(r, t_min, t_max, any_hit);
+
+    constexpr uint32_t W = SimdReal::WIDTH;
+    auto n = static_cast<uint32_t>(size());
+    for (uint32_t k = 0; k < n; k += W)
+        if (any_hit(k, std::min(W, n - k)))
+            return true;
+    return false;
+}
+
+inline void PackedSpheres::occluded_packet(
+    const RayPacket& packet, real t_min, const real* t_max, bool* occluded
+) const {
+    if (!use_simd) {
+        Hittable::occluded_packet(packet, t_min, t_max, occluded);
+        return;
+    }
+
+    // As in hit_packet, but a ray that hit something gets a closest hit
+    // behind it, which takes it out of the rest of the walk
+    real closest[MAX_PACKET_SIZE];
+    real closest_index[MAX_PACKET_SIZE];
+    for (int k = 0; k < MAX_PACKET_SIZE; k++) {
+        closest[k] = k < packet.size ? t_max[k] : -INF;
+        closest_index[k] = -1;
+    }
+    auto drop_blocked = [&]() {
+        for (int k = 0; k < packet.size; k++)
+            if (closest_index[k] >= 0)
+                closest[k] = -INF;
+    };
+
+    if (use_tree) {
+        tree.traverse_packet(packet, t_min, closest, [&](uint32_t first, uint32_t count) {
+            hit_range_packet(packet, first, count, t_min, closest, closest_index);
+            drop_blocked();
+        });
+    } else {
+        hit_range_packet(packet, 0, static_cast<uint32_t>(size()), t_min, closest, closest_index);
+    }
+
+    for (int k = 0; k < packet.size; k++)
+        occluded[k] = closest_index[k] >= 0;
+}
+
+inline void PackedSpheres::hit_range_packet(
+    const RayPacket& packet, uint32_t first, uint32_t count, real t_min,
+    real* closest, real* closest_index
+) const {
+    constexpr int W = SimdReal::WIDTH;
+    SimdReal vt_min(t_min), zero(0.0);
+    RT_STAT(thread_stats().intersection_tests += static_cast<uint64_t>(count) * packet.size);
+
+    for (int g = 0; g < packet.lane_groups(); g++) {
+        auto lane = g * W;
+        auto ox = SimdReal::load(&packet.ox[lane]);
+        auto oy = SimdReal::load(&packet.oy[lane]);
+        auto oz = SimdReal::load(&packet.oz[lane]);
+        auto dx = SimdReal::load(&packet.dx[lane]);
+        auto dy = SimdReal::load(&packet.dy[lane]);
+        auto dz = SimdReal::load(&packet.dz[lane]);
+        auto a = dx*dx + dy*dy + dz*dz;
+        auto inv_a = SimdReal(1.0) / a;
+
+        auto best_t = SimdReal::load(&closest[lane]);
+        auto best_index = SimdReal::load(&closest_index[lane]);
+
+        for (auto k = first; k < first + count; k++) {
+            // Same math as Sphere::hit, one sphere against W rays
+            auto ocx = ox - SimdReal(cx[k]);
+            auto ocy = oy - SimdReal(cy[k]);
+            auto ocz = oz - SimdReal(cz[k]);
+            auto rad = SimdReal(radius[k]);
+
+            auto half_b = ocx*dx + ocy*dy + ocz*dz;
+            auto c = ocx*ocx + ocy*ocy + ocz*ocz - rad*rad;
+            auto discriminant = half_b*half_b - a*c;
+
+            auto valid = discriminant >= zero;
+            if (!valid.any()) continue;
+
+            auto sqrt_d = sqrt(max(discriminant, zero));
+            auto near_root = (zero - half_b - sqrt_d) * inv_a;
+            auto far_root = (zero - half_b + sqrt_d) * inv_a;
+            auto near_ok = (near_root >= vt_min) & (near_root <= best_t);
+            auto far_ok = (far_root >= vt_min) & (far_root <= best_t);
+
+            auto hit = valid & (near_ok | far_ok);
+            if (!hit.any()) continue;
+
+            best_t = select(hit, select(near_ok, near_root, far_root), best_t);
+            best_index = select(hit, SimdReal(static_cast<real>(k)), best_index);
+        }
+
+        best_t.store(&closest[lane]);
+        best_index.store(&closest_index[lane]);
+    }
+}
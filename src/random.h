@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * splitmix64 finalizer, it scrambles the bits of a 64 bit integer so that
+ * inputs which differ by a single bit give completely different outputs.
+ * We use it to turn (seed, pixel, sample) into a starting state for the
+ * random generator.
+ **/
+inline uint64_t mix_bits(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * PCG32 random number generator, see https://www.pcg-random.org
+ *
+ * The state is a 64 bit linear congruential generator, and the output is the
+ * state with a permutation (xorshift followed by a random rotation) applied.
+ * It is much faster than rand(), has no hidden global state, and has a
+ * period of 2^64 for each of its 2^63 streams.
+ **/
+class Pcg32 {
+public:
+    uint64_t state;
+    // inc selects the stream, it always has to be odd
+    uint64_t inc;
+public:
+    Pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    Pcg32(uint64_t init_state, uint64_t stream) { seed(init_state, stream); }
+
+    void seed(uint64_t init_state, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next_uint();
+        state += init_state;
+        next_uint();
+    }
+
+    // Returns a uniformly distributed 32 bit integer
+    uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        auto xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+        auto rot = static_cast<uint32_t>(old_state >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // Returns a random real in [0, 1)
+    double next_double() {
+        // 32 random bits divided by 2^32
+        return next_uint() * 0x1p-32;
+    }
+};
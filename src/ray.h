@@ -26,7 +26,7 @@ public:
     // Get the point on the ray at specific distance
     // All we are doing is adding t distance to the origin
     // of the ray
-    Point3 at(double t) const {
+    Point3 at(real t) const {
         return orig + t*dir;
     }
 };
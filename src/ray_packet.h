@@ -0,0 +1,55 @@
+#pragma once
+
+#include "utility.h"
+#include "simd.h"
+
+// The largest packet we trace, packets of 4, 8 and 16 rays are supported
+constexpr int MAX_PACKET_SIZE = 16;
+
+/**
+ * A group of rays that get traced through the scene together.
+ *
+ * Primary rays from neighbouring pixels start at the same point and go in
+ * almost the same direction, so they hit the same boxes and the same objects.
+ * By tracing them together we walk the BVH once for the whole packet, and the
+ * intersection code can test SimdReal::WIDTH rays against an object at once.
+ *
+ * The rays are stored as a structure of arrays so a SIMD register worth of
+ * rays can be loaded with a single load. Unused slots are filled with a copy
+ * of the first ray so the SIMD code never sees garbage.
+ **/
+struct RayPacket {
+    int size = 0;
+
+    // The origins, directions and 1 / direction of the rays
+    real ox[MAX_PACKET_SIZE], oy[MAX_PACKET_SIZE], oz[MAX_PACKET_SIZE];
+    real dx[MAX_PACKET_SIZE], dy[MAX_PACKET_SIZE], dz[MAX_PACKET_SIZE];
+    real inv_dx[MAX_PACKET_SIZE], inv_dy[MAX_PACKET_SIZE], inv_dz[MAX_PACKET_SIZE];
+
+    void add(const Ray& r) {
+        auto k = size++;
+        ox[k] = r.orig[0]; oy[k] = r.orig[1]; oz[k] = r.orig[2];
+        dx[k] = r.dir[0]; dy[k] = r.dir[1]; dz[k] = r.dir[2];
+        inv_dx[k] = 1.0 / dx[k];
+        inv_dy[k] = 1.0 / dy[k];
+        inv_dz[k] = 1.0 / dz[k];
+    }
+
+    // Call once all the rays are added, fills the unused slots
+    void pad() {
+        for (int k = size; k < MAX_PACKET_SIZE; k++) {
+            ox[k] = ox[0]; oy[k] = oy[0]; oz[k] = oz[0];
+            dx[k] = dx[0]; dy[k] = dy[0]; dz[k] = dz[0];
+            inv_dx[k] = inv_dx[0]; inv_dy[k] = inv_dy[0]; inv_dz[k] = inv_dz[0];
+        }
+    }
+
+    Ray ray(int k) const {
+        return Ray(Point3(ox[k], oy[k], oz[k]), Vec3(dx[k], dy[k], dz[k]));
+    }
+
+    // Number of SIMD registers needed to hold all the rays
+    int lane_groups() const {
+        return (size + SimdReal::WIDTH - 1) / SimdReal::WIDTH;
+    }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+/**
+ * The floating point type used for all the geometry: vectors, rays, the
+ * camera, the intersection code and the materials.
+ *
+ * It is double by default. Building with the RT_SINGLE_PRECISION cmake option
+ * switches it to float, which halves the size of every vector and hit record
+ * and fits twice as many lanes in a SIMD register, at the cost of precision.
+ * See spawn_ray in hittable.h for how rays avoid hitting the surface
+ * they start from with either type.
+ **/
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#define RT_REAL_NAME "float"
+#else
+using real = double;
+#define RT_REAL_NAME "double"
+#endif
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "utility.h"
+#include "thread_pool.h"
+#include "stats.h"
+
+// A rectangular block of pixels, x0 <= i < x1 and y0 <= j < y1
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Cut a width x height image into tile_size x tile_size tiles,
+// the tiles on the right and top edge may be smaller
+inline std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tiles.push_back({
+                x, y,
+                std::min(x + tile_size, width), std::min(y + tile_size, height)
+            });
+        }
+    }
+    return tiles;
+}
+
+// Rays traced by the calling thread, the tracing code bumps it for every ray
+// and the renderer adds it up over all the threads after each tile
+inline uint64_t& thread_ray_count() {
+    thread_local uint64_t count = 0;
+    return count;
+}
+
+// What a call to render_tiles gives back
+struct RenderResult {
+    // The pixels in scanline order, top row first
+    std::vector<Color> pixels;
+    // Total rays traced on all the threads
+    uint64_t rays = 0;
+    // Wall clock time of the whole render
+    double seconds = 0;
+    // With RT_STATS, the seconds spent on every pixel in scanline order. Tile
+    // renderers only know the time of the whole tile, which is spread evenly
+    // over its pixels
+    std::vector<float> cost;
+
+    double rays_per_second() const { return seconds > 0 ? rays / seconds : 0; }
+};
+
+// Index of pixel (i, j) in a scanline ordered buffer, the top row (j = height-1) comes first
+inline std::size_t pixel_index(int width, int height, int i, int j) {
+    return static_cast<std::size_t>(height - 1 - j) * width + i;
+}
+
+/**
+ * Render a width x height image in parallel using the thread pool.
+ *
+ * The image is cut into tiles and every tile is a task for the pool. Tiles are
+ * small compared to the image, so when a thread finishes its own tiles it can
+ * steal the remaining ones from the slower threads.
+ *
+ * shade_tile(tile, pixels) has to fill in every pixel of the tile, pixels is the
+ * whole image in scanline order (see pixel_index). It is called from many
+ * threads at the same time, so it must not touch anything outside its tile.
+ *
+ * The tiles left are printed as they finish, unless show_progress is false
+ * (the benchmarks don't want the output in their timings).
+ **/
+template <typename TileFn>
+RenderResult render_tile_tasks(
+    ThreadPool& pool, int width, int height, int tile_size, TileFn shade_tile,
+    bool show_progress = true
+) {
+    RenderResult result;
+    result.pixels.resize(static_cast<std::size_t>(width) * height);
+    auto tiles = make_tiles(width, height, tile_size);
+
+    std::atomic<uint64_t> rays{0};
+    auto start = std::chrono::steady_clock::now();
+#if RT_STATS
+    result.cost.resize(result.pixels.size());
+#endif
+
+    // Only used for the progress output
+    std::atomic<std::size_t> tiles_done{0};
+    std::mutex progress_mutex;
+    const auto tile_count = tiles.size();
+
+    auto run_tile = [&](const Tile& tile) {
+        auto rays_before = thread_ray_count();
+#if RT_STATS
+        auto tile_start = std::chrono::steady_clock::now();
+#endif
+
+        shade_tile(tile, result.pixels);
+
+#if RT_STATS
+        std::chrono::duration<float> tile_time = std::chrono::steady_clock::now() - tile_start;
+        auto pixel_time = tile_time.count() / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+        for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++)
+                result.cost[pixel_index(width, height, i, j)] = pixel_time;
+#endif
+
+        rays += thread_ray_count() - rays_before;
+
+        // Every tile writes a disjoint set of pixels, so only the progress
+        // output needs a lock
+        auto remaining = tile_count - ++tiles_done;
+        if (!show_progress)
+            return;
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        std::cerr << "\rTiles remaining: " << remaining << "    " << std::flush;
+    };
+
+    // A task only holds two pointers, which std::function keeps inside itself
+    // instead of allocating room for a copy of everything the tile needs
+    for (const auto& tile : tiles)
+        pool.submit([run = &run_tile, tile = &tile] { (*run)(*tile); });
+
+    pool.wait();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    result.rays = rays;
+    return result;
+}
+
+/**
+ * Same as render_tile_tasks, but for renderers that shade one pixel at a time.
+ *
+ * shade_pixel(i, j) is called exactly once for every pixel and has to return its
+ * color, i goes from left to right and j from bottom to top just like in the
+ * camera. It must not touch any shared state.
+ *
+ * The returned buffer is stored in scanline order, top row first, so it can be
+ * written out from start to end.
+ **/
+template <typename PixelFn>
+RenderResult render_tiles(
+    ThreadPool& pool, int width, int height, int tile_size, PixelFn shade_pixel,
+    bool show_progress = true
+) {
+#if RT_STATS
+    // Every pixel is timed on its own
+    std::vector<float> cost(static_cast<std::size_t>(width) * height);
+    auto result = render_tile_tasks(pool, width, height, tile_size,
+        [&](const Tile& tile, std::vector<Color>& pixels) {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    auto start = std::chrono::steady_clock::now();
+                    pixels[pixel_index(width, height, i, j)] = shade_pixel(i, j);
+                    std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+                    cost[pixel_index(width, height, i, j)] = elapsed.count();
+                }
+            }
+        },
+        show_progress
+    );
+    result.cost = std::move(cost);
+    return result;
+#else
+    return render_tile_tasks(pool, width, height, tile_size,
+        [&](const Tile& tile, std::vector<Color>& pixels) {
+            for (int j = tile.y0; j < tile.y1; j++)
+                for (int i = tile.x0; i < tile.x1; i++)
+                    pixels[pixel_index(width, height, i, j)] = shade_pixel(i, j);
+        },
+        show_progress
+    );
+#endif
+}
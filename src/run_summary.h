@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/**
+ * A string as a JSON string, in quotes.
+ *
+ * Strings are paths, names and labels, only quotes, backslashes and control
+ * characters need escaping.
+ **/
+inline std::string json_quote(const std::string& s) {
+    std::ostringstream text;
+    text << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') text << '\\' << c;
+        else if (c < 0x20) text << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+        else text << c;
+    }
+    text << '"';
+    return text.str();
+}
+
+/**
+ * The most memory the process had at once, in bytes, or 0 where we can't ask.
+ *
+ * getrusage reports the peak resident set, the memory that actually sat in
+ * RAM. Linux counts it in kilobytes, macOS in bytes.
+ **/
+inline uint64_t peak_memory_bytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    auto peak = static_cast<uint64_t>(usage.ru_maxrss);
+#if defined(__APPLE__)
+    return peak;
+#else
+    return peak * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/**
+ * What a render did and how long it took, written as a single JSON object at
+ * the end of the run so scripts that sweep over the settings can collect the
+ * throughput of every run without scraping the progress messages.
+ **/
+struct RunSummary {
+    // The settings
+    int width = 0;
+    int height = 0;
+    int samples_per_pixel = 0;
+    int max_depth = 0;
+    int threads = 0;
+    uint64_t seed = 0;
+    std::string sampler;
+    std::string integrator;
+    std::string accel;
+    std::string scene;
+    std::string output;
+    // Lights sampled at every diffuse bounce, 0 with --no-nee
+    int lights = 0;
+
+    // Frames rendered, 1 unless it was an animation
+    int frames = 1;
+
+    // What it cost
+    uint64_t rays = 0;
+    uint64_t samples = 0;
+    double load_seconds = 0;
+    double build_seconds = 0;
+    double render_seconds = 0;
+    double write_seconds = 0;
+    // Tracing the AOVs and denoising, 0 without --denoise
+    double denoise_seconds = 0;
+    double wall_seconds = 0;
+    uint64_t peak_memory = 0;
+    // Calls to operator new while loading and building the scene, and while rendering
+    uint64_t scene_allocations = 0;
+    uint64_t render_allocations = 0;
+
+    double rays_per_second() const { return render_seconds > 0 ? rays / render_seconds : 0; }
+    double frames_per_hour() const { return wall_seconds > 0 ? frames * 3600 / wall_seconds : 0; }
+
+    void write_json(std::ostream& out) const {
+        std::ostringstream json;
+        json << std::setprecision(6)
+             << "{\"width\": " << width
+             << ", \"height\": " << height
+             << ", \"samples_per_pixel\": " << samples_per_pixel
+             << ", \"max_depth\": " << max_depth
+             << ", \"threads\": " << threads
+             << ", \"seed\": " << seed
+             << ", \"sampler\": " << json_quote(sampler)
+             << ", \"integrator\": " << json_quote(integrator)
+             << ", \"accel\": " << json_quote(accel)
+             << ", \"scene\": " << json_quote(scene)
+             << ", \"output\": " << json_quote(output)
+             << ", \"lights\": " << lights
+             << ", \"frames\": " << frames
+             << ", \"rays\": " << rays
+             << ", \"samples\": " << samples
+             << ", \"rays_per_second\": " << rays_per_second()
+             << ", \"load_seconds\": " << load_seconds
+             << ", \"build_seconds\": " << build_seconds
+             << ", \"render_seconds\": " << render_seconds
+             << ", \"write_seconds\": " << write_seconds
+             << ", \"denoise_seconds\": " << denoise_seconds
+             << ", \"wall_seconds\": " << wall_seconds
+             << ", \"frames_per_hour\": " << frames_per_hour()
+             << ", \"peak_memory_bytes\": " << peak_memory
+             << ", \"scene_allocations\": " << scene_allocations
+             << ", \"render_allocations\": " << render_allocations
+             << "}\n";
+        out << json.str();
+    }
+};
+
+// Writes the summary to path, "-" is the standard output
+inline bool write_run_summary(const std::string& path, const RunSummary& summary) {
+    if (path == "-") {
+        summary.write_json(std::cout);
+        std::cout.flush();
+        return static_cast<bool>(std::cout);
+    }
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    summary.write_json(file);
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "random.h"
+#include "sequences.h"
+
+/**
+ * How the samples of a pixel are spread out.
+ *
+ * Independent draws every number on its own, the error of the average goes
+ * down with 1 / sqrt(samples). The others place the samples of a pixel so they
+ * cover every dimension evenly, which for smooth parts of the image (soft
+ * shadows, defocus, the edges of objects) brings the error down much faster:
+ *   stratified  correlated multi-jittered samples, needs the samples per pixel
+ *   sobol       Owen scrambled Sobol points, best with a power of two samples
+ *   bluenoise   the same Sobol points for every pixel, shifted by a blue noise
+ *               mask so the error that is left looks like fine grain instead
+ *               of blotches
+ **/
+enum class SamplePattern { Independent, Stratified, Sobol, BlueNoise };
+
+// Parses a sampler name, returns false if it isn't one we know
+inline bool parse_sample_pattern(const std::string& name, SamplePattern& pattern) {
+    if (name == "independent") pattern = SamplePattern::Independent;
+    else if (name == "stratified") pattern = SamplePattern::Stratified;
+    else if (name == "sobol") pattern = SamplePattern::Sobol;
+    else if (name == "bluenoise") pattern = SamplePattern::BlueNoise;
+    else return false;
+    return true;
+}
+
+// What the sampler needs to know about the render to place the pixel samples
+struct SamplerSettings {
+    SamplePattern pattern = SamplePattern::Sobol;
+    uint64_t seed = 0;
+    // Stratified samples are spread over this many samples per pixel
+    int samples_per_pixel = 1;
+};
+
+/**
+ * The sampler hands out the random numbers used while rendering.
+ *
+ * For a render to be reproducible with any number of threads, the random
+ * numbers used for a sample can't depend on which thread happens to render it,
+ * or on what that thread rendered before. So before every sample the renderer
+ * calls start_pixel_sample, which restarts the sampler from the render seed,
+ * the pixel and the sample index alone.
+ *
+ * Every number of a pixel sample is a dimension, and the same dimension has to
+ * mean the same thing in every sample of the pixel for the patterns to help:
+ *   0, 1   the position inside the pixel
+ *   2, 3   the point on the lens
+ *   then BOUNCE_DIMENSIONS for every bounce, the material's scatter decision
+ *   first and russian roulette after it
+ * The integrator calls start_bounce before a material scatters, so a material
+ * that draws fewer numbers doesn't shift the dimensions of the next bounce.
+ * The light sampled at every bounce (see lights.h) takes LIGHT_DIMENSIONS
+ * from a block far past all the bounces, see start_light, so the bounce
+ * dimensions stay where they were in scenes without lights.
+ **/
+class Sampler {
+public:
+    static const int CAMERA_DIMENSIONS = 4;
+    static const int BOUNCE_DIMENSIONS = 4;
+    static const int LIGHT_DIMENSIONS = 4;
+    static const int LIGHT_DIMENSIONS_START = 1 << 16;
+private:
+    Pcg32 rng;
+    SamplePattern pattern = SamplePattern::Independent;
+    // Seeds the patterns of this pixel, or of the whole image for blue noise
+    uint64_t pattern_seed = 0;
+    int pixel_x = 0, pixel_y = 0;
+    uint32_t sample = 0;
+    uint32_t samples_per_pixel = 1;
+    // The next dimension, and the second half of the last pair
+    int dimension = 0;
+    int cached_dimension = -1;
+    double cached = 0;
+public:
+    // Seed the generator for work that isn't a pixel sample, like building the scene
+    void seed(uint64_t seed) {
+        rng.seed(mix_bits(seed), 0);
+        pattern = SamplePattern::Independent;
+    }
+
+    // Restart the random sequence for sample s of pixel (i, j), every number independent
+    void start_pixel_sample(uint64_t seed, int i, int j, int s) {
+        SamplerSettings settings;
+        settings.pattern = SamplePattern::Independent;
+        settings.seed = seed;
+        start_pixel_sample(settings, i, j, s);
+    }
+
+    // Restart the sequence for sample s of pixel (i, j), placed by settings.pattern
+    void start_pixel_sample(const SamplerSettings& settings, int i, int j, int s) {
+        auto pixel = (static_cast<uint64_t>(static_cast<uint32_t>(j)) << 32)
+                   | static_cast<uint32_t>(i);
+        rng.seed(mix_bits(settings.seed ^ mix_bits(pixel)), static_cast<uint64_t>(s));
+
+        pattern = settings.pattern;
+        pattern_seed = pattern == SamplePattern::BlueNoise
+            ? mix_bits(settings.seed)
+            : mix_bits(settings.seed ^ mix_bits(pixel));
+        pixel_x = i;
+        pixel_y = j;
+        sample = static_cast<uint32_t>(s);
+        samples_per_pixel = static_cast<uint32_t>(std::max(settings.samples_per_pixel, s + 1));
+        dimension = 0;
+        cached_dimension = -1;
+    }
+
+    // Jump to the dimensions of bounce depth (counting from 1)
+    void start_bounce(int depth) {
+        dimension = CAMERA_DIMENSIONS + (depth - 1) * BOUNCE_DIMENSIONS;
+    }
+
+    // Jump to the dimensions of the light sampled at bounce depth
+    void start_light(int depth) {
+        dimension = LIGHT_DIMENSIONS_START + (depth - 1) * LIGHT_DIMENSIONS;
+    }
+
+    // Returns the next number of the sample, a real in [0, 1)
+    double next_double() {
+        if (pattern == SamplePattern::Independent)
+            return rng.next_double();
+
+        int d = dimension++;
+        if (d == cached_dimension)
+            return cached;
+
+        double x, y;
+        sample_pair(static_cast<uint32_t>(d / 2), x, y);
+        cached_dimension = d | 1;
+        cached = y;
+        return d & 1 ? y : x;
+    }
+
+    Pcg32& generator() { return rng; }
+private:
+    // The point of this sample in dimensions 2 * pair and 2 * pair + 1
+    void sample_pair(uint32_t pair, double& x, double& y) const {
+        auto seed = hash_pair(pattern_seed, pair);
+        switch (pattern) {
+            case SamplePattern::Stratified:
+                multi_jittered_2d(sample, samples_per_pixel, seed, x, y);
+                break;
+            case SamplePattern::Sobol:
+                scrambled_sobol_2d(sample, seed, x, y);
+                break;
+            default: {
+                // Every pixel has the same points, shifted around the square by
+                // the mask. Each pair looks at a different spot of the mask
+                scrambled_sobol_2d(sample, seed, x, y);
+                int ox = static_cast<int>(seed & 63), oy = static_cast<int>((seed >> 6) & 63);
+                x += blue_noise(pixel_x + ox, pixel_y + oy);
+                y += blue_noise(pixel_x + ox + BLUE_NOISE_SIZE / 2, pixel_y + oy + BLUE_NOISE_SIZE / 2);
+                x -= static_cast<int>(x);
+                y -= static_cast<int>(y);
+                break;
+            }
+        }
+    }
+};
+
+// Every thread has its own sampler, so threads never share any random state
+inline Sampler& thread_sampler() {
+    thread_local Sampler sampler;
+    return sampler;
+}
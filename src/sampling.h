@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "utility.h"
+
+/**
+ * Warping functions, they turn uniform random numbers in [0, 1) into points
+ * on a shape.
+ *
+ * The old versions picked random points in a cube until one landed inside the
+ * sphere (or a square until one landed in the disk). How many tries that
+ * takes is random, so the branch predictor can't learn the loop, and every
+ * try throws away two or three random numbers. These map the numbers onto the
+ * shape directly: always the same amount of work and the same number of
+ * random numbers, and no branches. The angles go through sincos_turns instead
+ * of std::sin and std::cos, which are function calls into the math library
+ * that take longer than the whole rejection loop did.
+ *
+ * They take the random numbers as arguments instead of drawing them, so
+ * neighbouring inputs give neighbouring points. A stratified or low
+ * discrepancy sequence put in gives points that are just as evenly spread
+ * over the shape.
+ **/
+
+/**
+ * Sine and cosine of the angle u * 2 pi, for any u in [-1, 1).
+ *
+ * The turn is cut into quarters, inside a quarter the angle is at most pi/4
+ * away from its middle, where a short Taylor series is accurate to about
+ * 1e-11. Rotating the result by the quarter is just swapping and negating.
+ **/
+inline void sincos_turns(real u, real& s, real& c) {
+    u = u < 0 ? u + 1 : u;
+    real quarters = 4 * u;
+    int q = static_cast<int>(quarters);
+    // Angle from the middle of the quarter, in [-pi/4, pi/4]
+    real x = (quarters - q - real(0.5)) * real(PI / 2);
+    real x2 = x * x;
+
+    // The coefficients are +-1/n!, written out so there are no divisions
+    real sin_x = x * (real(1) + x2 * (real(-1.6666666666666667e-1) + x2 * (real(8.3333333333333333e-3)
+        + x2 * (real(-1.9841269841269841e-4) + x2 * (real(2.7557319223985891e-6)
+        + x2 * real(-2.5052108385441719e-8))))));
+    real cos_x = real(1) + x2 * (real(-0.5) + x2 * (real(4.1666666666666667e-2)
+        + x2 * (real(-1.3888888888888889e-3) + x2 * (real(2.4801587301587302e-5)
+        + x2 * (real(-2.7557319223985891e-7) + x2 * real(2.0876756987868099e-9))))));
+
+    // Add the pi/4 of the middle of the quarter
+    const real HALF_SQRT2 = real(0.70710678118654752440);
+    real s0 = HALF_SQRT2 * (sin_x + cos_x);
+    real c0 = HALF_SQRT2 * (cos_x - sin_x);
+
+    // Rotate into quarter q: (c, s) -> (-s, c) -> (-c, -s) -> (s, -c)
+    s = (q & 1) ? c0 : s0;
+    c = (q & 1) ? -s0 : c0;
+    s = (q & 2) ? -s : s;
+    c = (q & 2) ? -c : c;
+}
+
+// A point on the unit sphere, every point is equally likely
+inline Vec3 sample_uniform_sphere(real u1, real u2) {
+    // z is uniform in [-1, 1]: slices of a sphere with the same thickness
+    // have the same area (Archimedes' hat-box theorem)
+    real z = 1 - 2 * u1;
+    real r = std::sqrt(std::max(real(0), 1 - z * z));
+    real s, c;
+    sincos_turns(u2, s, c);
+    return Vec3(r * c, r * s, z);
+}
+
+// A point inside the unit sphere, every point is equally likely
+inline Vec3 sample_uniform_ball(real u1, real u2, real u3) {
+    // The volume inside radius r grows with r^3, so r is the cube root
+    return std::cbrt(u3) * sample_uniform_sphere(u1, u2);
+}
+
+/**
+ * A point inside the unit disk (z = 0), every point is equally likely.
+ *
+ * Shirley and Chiu's concentric mapping: the square [-1, 1]^2 is split into
+ * four triangles and each one is squashed onto a quarter of the disk. Unlike
+ * picking r = sqrt(u1), phi = 2 pi u2 it keeps neighbouring points of the
+ * square close together on the disk, so stratified inputs stay stratified.
+ **/
+inline Vec3 sample_concentric_disk(real u1, real u2) {
+    real x = 2 * u1 - 1;
+    real y = 2 * u2 - 1;
+
+    // Which pair of triangles the point is in, x picks left and right, y
+    // picks top and bottom. The ternaries become selects, not branches
+    bool horizontal = std::fabs(x) > std::fabs(y);
+    real r = horizontal ? x : y;
+    real ratio = (horizontal ? y : x) / r;
+    // The center of the square goes to the center of the disk
+    ratio = r == 0 ? 0 : ratio;
+    // The angle in turns, a full circle is 1
+    real turns = horizontal
+        ? real(0.125) * ratio
+        : real(0.25) - real(0.125) * ratio;
+
+    real s, c;
+    sincos_turns(turns, s, c);
+    return Vec3(r * c, r * s, 0);
+}
+
+/**
+ * A direction around the normal n, with a chance proportional to the cosine
+ * of its angle to n (the distribution of a Lambertian surface).
+ *
+ * Moving a uniform point on the unit sphere by the normal gives exactly that
+ * distribution, so there is no need to build a coordinate frame around n.
+ * The result isn't normalized, and is zero when the point was -n.
+ **/
+inline Vec3 sample_cosine_hemisphere(const Vec3& n, real u1, real u2) {
+    return n + sample_uniform_sphere(u1, u2);
+}
+
+// The same, in a frame where the normal is +z: a uniform point on the disk
+// lifted up to the hemisphere (Malley's method), always unit length
+inline Vec3 sample_cosine_hemisphere(real u1, real u2) {
+    auto d = sample_concentric_disk(u1, u2);
+    real z = std::sqrt(std::max(real(0), 1 - d[0] * d[0] - d[1] * d[1]));
+    return Vec3(d[0], d[1], z);
+}
+
+/**
+ * The weight of a sample picked with pdf, when the same light could also have
+ * been found by a second strategy with other_pdf (Veach's power heuristic).
+ * The weights of the two strategies add up to 1, and each gets most of the
+ * weight where it is the better one, which cuts the noise of both.
+ **/
+inline real power_heuristic(real pdf, real other_pdf) {
+    auto a = pdf * pdf, b = other_pdf * other_pdf;
+    return a + b > 0 ? a / (a + b) : 0;
+}
+
+// Shortcuts that draw the random numbers from the thread sampler
+
+// Generate a random point within a sphere of 1 unit
+inline Vec3 random_in_unit_sphere() {
+    auto u1 = random_double();
+    auto u2 = random_double();
+    return sample_uniform_ball(u1, u2, random_double());
+}
+
+inline Vec3 random_unit_vector() {
+    auto u1 = random_double();
+    return sample_uniform_sphere(u1, random_double());
+}
+
+inline Vec3 random_in_unit_disk() {
+    auto u1 = random_double();
+    return sample_concentric_disk(u1, random_double());
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utility.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh.h"
+#include "packed_spheres.h"
+#include "sphere.h"
+
+/**
+ * The most a scene file or the command line may ask for. Far more than any
+ * render needs, they keep a bad number from overflowing the int it goes into,
+ * and keep the pixels of an image (32768 x 32768 at most) countable in an int.
+ **/
+const int MAX_IMAGE_SIZE = 1 << 15;
+const int MAX_SAMPLES = 1 << 20;
+const int MAX_BOUNCES = 1 << 16;
+
+// The camera and image of a scene, a scene file can set all of these
+struct SceneSettings {
+    int image_width = 400;
+    int image_height = 225;
+    // Samples per pixel, 0 lets the renderer pick from the image size
+    int samples = 0;
+    // Max depth is the ray bounce limit
+    int max_depth = 50;
+
+    Point3 lookfrom = Point3(13, 2, 3);
+    Point3 lookat = Point3(0, 0, 0);
+    Vec3 vup = Vec3(0, 1, 0);
+    // Vertical field of view in degrees
+    double vfov = 20;
+    double aperture = 0.1;
+    double focus_dist = 10;
+
+    // The sky gradient is multiplied by this, black for a scene lit only by its lights
+    Color sky = Color(1, 1, 1);
+
+    double aspect_ratio() const { return static_cast<double>(image_width) / image_height; }
+};
+
+/**
+ * The scene owns everything that gets rendered, the objects and the materials.
+ *
+ * Objects and hit records only keep plain pointers to their material. A
+ * shared_ptr would have to bump an atomic reference count every time a hit
+ * record is filled or copied, and with many threads all of them would be
+ * fighting over the same few reference counts. The materials live as long as
+ * the scene, so nothing else needs to own them.
+ *
+ * Spheres, which is what most scenes are made of, aren't objects of their own
+ * either. They go straight into the arrays of a PackedSpheres, so a scene of a
+ * million spheres is a few big allocations instead of a million small ones,
+ * and can be read from a file in one go (see scene_file.h).
+ *
+ * Geometry that appears many times is a prototype, placed in the world by
+ * instances (see instance.h). A prototype has its own spheres and tree, the
+ * instances only point at it.
+ *
+ * Triangle meshes keep their vertices and triangles in big arrays too (see
+ * mesh.h), each mesh is one object with its own tree.
+ *
+ * When the spheres do have to be objects of their own, for the BVH over all
+ * the objects, they are made in the scene's arena (see arena.h) instead of
+ * one make_shared at a time.
+ *
+ * The spheres with a light material are also the lights of the scene, which
+ * the integrator samples directly (see lights.h).
+ **/
+
+// Geometry that is only placed in the world through instances
+struct Prototype {
+    std::string name;
+    PackedSpheres spheres;
+};
+
+class Scene {
+public:
+    SceneSettings settings;
+    // Everything that isn't a sphere
+    HittableList objects;
+    PackedSpheres spheres;
+    // A deque never moves its elements when it grows, so the pointers handed
+    // out by make_material stay valid while the scene is being built
+    std::deque<Material> materials;
+    // A deque for the same reason, the instances point at the prototypes
+    std::deque<Prototype> prototypes;
+    std::vector<Instance> instances;
+    // A deque so the meshes stay where they are, the world points at them
+    std::deque<TriangleMesh> meshes;
+    // The Sphere objects of hittables() and bvh(), and the copies of the
+    // materials bvh() puts next to them
+    Arena arena;
+public:
+    Scene() {}
+
+    Scene(const Scene&) = delete;
+    Scene& operator= (const Scene&) = delete;
+    Scene(Scene&&) = default;
+    Scene& operator= (Scene&&) = default;
+
+    // Create a material owned by the scene, e.g. make_material<Lambertian>(albedo)
+    template <typename T, typename... Args>
+    const Material* make_material(Args&&... args) {
+        materials.emplace_back(T(std::forward<Args>(args)...));
+        return &materials.back();
+    }
+
+    void add(shared_ptr<Hittable> object) {
+        objects.add(object);
+    }
+
+    void add_sphere(const Point3& center, real radius, const Material* m) {
+        spheres.add(center, radius, m);
+    }
+
+    Prototype& add_prototype(const std::string& name) {
+        prototypes.emplace_back();
+        prototypes.back().name = name;
+        return prototypes.back();
+    }
+
+    /**
+     * Places a copy of the prototype, moved by transform and with all of its
+     * materials replaced by material unless that is null. The prototype gets
+     * its tree when it is first placed, so add its spheres before that.
+     **/
+    void add_instance(Prototype& prototype, const Transform& transform, const Material* material = nullptr) {
+        if (!prototype.spheres.committed)
+            prototype.spheres.commit(true);
+        instances.emplace_back(&prototype.spheres, transform, material);
+    }
+
+    // An empty mesh, fill it (or load_mesh into it) and commit it
+    TriangleMesh& add_mesh(const Material* m) {
+        meshes.emplace_back();
+        meshes.back().material = m;
+        return meshes.back();
+    }
+
+    std::size_t object_count() const {
+        return objects.objects.size() + spheres.size() + instances.size() + meshes.size();
+    }
+
+    std::size_t triangle_count() const {
+        std::size_t count = 0;
+        for (const auto& mesh : meshes)
+            count += mesh.size();
+        return count;
+    }
+
+    /**
+     * Every object as a Hittable, each sphere becomes a Sphere object of its
+     * own. The Spheres are made in the arena one after the other, in the
+     * order a list tests them, and live as long as the scene.
+     **/
+    HittableList hittables() {
+        HittableList list;
+        list.objects = objects.objects;
+        list.objects.reserve(object_count());
+        for (std::size_t k = 0; k < spheres.size(); k++)
+            list.add(unowned(make_sphere(k, spheres.materials[k])));
+        // All the instances go into one two level BVH of their own
+        if (!instances.empty())
+            list.add(make_shared<InstanceBvh>(instances));
+        for (auto& mesh : meshes)
+            list.add(unowned(&mesh));
+        return list;
+    }
+
+    /**
+     * The same objects as hittables() in one BVH, which comes out the same
+     * as BVH(hittables()), but with the memory in the order a ray walks it.
+     *
+     * The tree is built from the boxes alone first. Then the Spheres are made
+     * in the arena in the order of the leaves, and every material is copied
+     * into the arena right after the first sphere that uses it. The spheres of
+     * a leaf, and mostly their materials too, end up next to each other
+     * instead of wherever malloc found room for them.
+     **/
+    shared_ptr<Hittable> bvh() {
+        // Spheres are only made once their place is known, until then an
+        // entry only has the index of the sphere
+        struct Entry {
+            shared_ptr<Hittable> object;
+            std::size_t sphere = 0;
+        };
+        std::vector<Entry> entries;
+        std::vector<AABB> boxes;
+        entries.reserve(object_count());
+        boxes.reserve(object_count());
+
+        AABB box;
+        auto add_object = [&](shared_ptr<Hittable> object) {
+            if (!object->bounding_box(box)) {
+                std::cerr << "BVH: skipping an object without a bounding box" << '\n';
+                return;
+            }
+            boxes.push_back(box);
+            entries.push_back({ std::move(object) });
+        };
+
+        for (const auto& object : objects.objects)
+            add_object(object);
+        for (std::size_t k = 0; k < spheres.size(); k++) {
+            Sphere(Point3(spheres.cx[k], spheres.cy[k], spheres.cz[k]), spheres.radius[k], nullptr).bounding_box(box);
+            boxes.push_back(box);
+            entries.push_back({ nullptr, k });
+        }
+        if (!instances.empty())
+            add_object(make_shared<InstanceBvh>(instances));
+        for (auto& mesh : meshes)
+            add_object(unowned(&mesh));
+
+        BvhTree tree;
+        tree.build(boxes);
+
+        // The copy of every material, found by binary search in the sorted
+        // originals, which is two allocations instead of a map node each
+        std::vector<const Material*> originals(spheres.materials.begin(), spheres.materials.end());
+        std::sort(originals.begin(), originals.end());
+        originals.erase(std::unique(originals.begin(), originals.end()), originals.end());
+        std::vector<const Material*> copies(originals.size(), nullptr);
+
+        std::vector<shared_ptr<Hittable>> leaves;
+        leaves.reserve(entries.size());
+        for (auto k : tree.prim_order) {
+            auto& entry = entries[k];
+            if (entry.object) {
+                leaves.push_back(std::move(entry.object));
+                continue;
+            }
+            auto sphere = make_sphere(entry.sphere, nullptr);
+            auto original = spheres.materials[entry.sphere];
+            auto& copy = copies[std::lower_bound(originals.begin(), originals.end(), original) - originals.begin()];
+            if (!copy)
+                copy = arena.create<Material>(*original);
+            sphere->mat_ptr = copy;
+            leaves.push_back(unowned(sphere));
+        }
+        return make_shared<BVH>(std::move(tree), std::move(leaves));
+    }
+    /**
+     * The spheres that give off light, the ones in the world and those that
+     * are objects of their own. A light inside a prototype or a mesh still
+     * lights the scene when a path bounces into it, it just isn't sampled.
+     **/
+    LightList lights() const {
+        std::vector<SphereLight> found;
+        auto add = [&](const Point3& center, real radius, const Material* m) {
+            if (m && m->is<DiffuseLight>())
+                found.push_back({ center, radius, std::get<DiffuseLight>(m->model).emit });
+        };
+        for (std::size_t k = 0; k < spheres.size(); k++)
+            add(Point3(spheres.cx[k], spheres.cy[k], spheres.cz[k]), spheres.radius[k], spheres.materials[k]);
+        for (const auto& object : objects.objects)
+            if (auto sphere = dynamic_cast<const Sphere*>(object.get()))
+                add(sphere->center, sphere->radius, sphere->mat_ptr);
+        return LightList(std::move(found));
+    }
+private:
+    Sphere* make_sphere(std::size_t k, const Material* m) {
+        Point3 center(spheres.cx[k], spheres.cy[k], spheres.cz[k]);
+        return arena.create<Sphere>(center, spheres.radius[k], m);
+    }
+
+    // The scene owns it, the shared_ptr only points at it
+    static shared_ptr<Hittable> unowned(Hittable* object) {
+        return shared_ptr<Hittable>(shared_ptr<Hittable>(), object);
+    }
+};
@@ -0,0 +1,908 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utility.h"
+#include "scene.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "mesh_file.h"
+#include "mapped_file.h"
+
+/**
+ * Reading and writing scenes.
+ *
+ * The text format has one statement per line, # starts a comment:
+ *
+ *   image 400 225                   width and height in pixels
+ *   samples 64                      samples per pixel
+ *   depth 50                        max bounces of a path
+ *   camera from 13 2 3 at 0 0 0 up 0 1 0 fov 20 aperture 0.1 focus 10
+ *   material ground lambertian 0.5 0.5 0.5      albedo
+ *   material steel metal 0.7 0.6 0.5 0.1        albedo, fuzz
+ *   material glass dielectric 1.5               index of refraction
+ *   material lamp light 4 4 4                   emitted color
+ *   sky 0 0 0                       tint of the sky, 0 0 0 for none
+ *   sphere 0 -1000 0 1000 ground                center, radius, material
+ *   group tree                      the spheres up to end make up a prototype
+ *   sphere 0 1 0 0.5 leaves
+ *   end
+ *   instance tree translate 4 0 2 rotate 0 1 0 45 scale 2 material gold
+ *   mesh models/bunny.ply gold scale 2 translate 0 1 0
+ *                                   an OBJ or PLY file, its material and place
+ *
+ * Everything but the spheres is optional, the camera takes its parts in any
+ * order and anything left out keeps the value from SceneSettings. A material
+ * has to be defined before a sphere uses it.
+ *
+ * An instance places a copy of a group (see instance.h). Its transform is
+ * made of translate x y z, rotate x y z degrees (around the axis x y z),
+ * scale s or scale x y z, and matrix with the 12 numbers of a 3x4 matrix row
+ * by row, applied in the order they are written. material replaces every
+ * material of the group.
+ *
+ * The path of a mesh is relative to the scene file and can't have spaces,
+ * the file is read with load_mesh (see mesh_file.h). It can be moved with the
+ * same transforms as an instance, they are applied to its vertices.
+ *
+ * The binary format is for big scenes that get rendered more than once. It
+ * holds the spheres in the arrays of PackedSpheres, already sorted into the
+ * leaves of their BVH, and the BVH nodes themselves, and the same for the
+ * vertices and triangles of the meshes. Loading it is a handful
+ * of memcpys out of the memory mapped file: no parsing, no tree build and no
+ * allocation per sphere. It is written with the real type of the build (see
+ * real.h), the other precision can't read it.
+ **/
+
+namespace scene_file_detail {
+
+// The last character is the version, version 1 had no prototypes or instances,
+// version 2 no meshes and version 3 no sky
+const char BINARY_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', '0', '4' };
+const uint32_t NO_MATERIAL = 0xffffffff;
+
+// Every material model with its name and its parameters as numbers
+static_assert(MATERIAL_TYPE_COUNT == 4, "Teach scene_file.h about the new material model");
+const char* const* const MODEL_NAMES = MATERIAL_TYPE_NAMES;
+const int PARAMETER_COUNTS[MATERIAL_TYPE_COUNT] = { 3, 4, 1, 3 };
+const int MAX_PARAMETERS = 4;
+
+inline void get_parameters(const Lambertian& m, double* p) {
+    p[0] = m.albedo[0]; p[1] = m.albedo[1]; p[2] = m.albedo[2];
+}
+
+inline void get_parameters(const Metal& m, double* p) {
+    p[0] = m.albedo[0]; p[1] = m.albedo[1]; p[2] = m.albedo[2];
+    p[3] = m.fuzz;
+}
+
+inline void get_parameters(const Dielectric& m, double* p) {
+    p[0] = m.ir;
+}
+
+inline void get_parameters(const DiffuseLight& m, double* p) {
+    p[0] = m.emit[0]; p[1] = m.emit[1]; p[2] = m.emit[2];
+}
+
+inline const Material* make_material(Scene& scene, std::size_t type, const double* p) {
+    switch (type) {
+        case 0: return scene.make_material<Lambertian>(Color(p[0], p[1], p[2]));
+        case 1: return scene.make_material<Metal>(Color(p[0], p[1], p[2]), p[3]);
+        case 2: return scene.make_material<Dielectric>(p[0]);
+        default: return scene.make_material<DiffuseLight>(Color(p[0], p[1], p[2]));
+    }
+}
+
+inline void material_parameters(const Material& m, double* p) {
+    std::visit([&](const auto& model) { get_parameters(model, p); }, m.model);
+}
+
+// Index of every material of the scene, to write materials as numbers
+inline std::unordered_map<const Material*, uint32_t> material_indices(const Scene& scene) {
+    std::unordered_map<const Material*, uint32_t> indices;
+    uint32_t k = 0;
+    for (const auto& m : scene.materials)
+        indices[&m] = k++;
+    return indices;
+}
+
+// The index of every prototype, by the geometry the instances point at
+inline std::unordered_map<const Hittable*, uint32_t> prototype_indices(const Scene& scene) {
+    std::unordered_map<const Hittable*, uint32_t> indices;
+    uint32_t k = 0;
+    for (const auto& prototype : scene.prototypes)
+        indices[&prototype.spheres] = k++;
+    return indices;
+}
+
+// Reads values one after another out of a block of memory
+struct BinaryReader {
+    const char* p;
+    const char* end;
+
+    bool read(void* out, std::size_t bytes) {
+        if (static_cast<std::size_t>(end - p) < bytes)
+            return false;
+        std::memcpy(out, p, bytes);
+        p += bytes;
+        return true;
+    }
+
+    template <typename T>
+    bool read(T& v) { return read(&v, sizeof(v)); }
+
+    // The values of size bytes each that the rest of the file could hold
+    std::size_t room_for(std::size_t size) const { return static_cast<std::size_t>(end - p) / size; }
+
+    /**
+     * Reads count values into v, after resizing it to count + padding. The
+     * count comes from the file, a broken one must not allocate more than the
+     * file could hold
+     **/
+    template <typename T>
+    bool read_array(std::vector<T>& v, std::size_t count, std::size_t padding = 0) {
+        if (count > room_for(sizeof(T)))
+            return false;
+        v.assign(count + padding, T());
+        return read(v.data(), count * sizeof(T));
+    }
+};
+
+template <typename T>
+void write_value(std::ostream& out, const T& v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+void write_array(std::ostream& out, const std::vector<T>& v, std::size_t count) {
+    out.write(reinterpret_cast<const char*>(v.data()), count * sizeof(T));
+}
+
+// Splits a line into its words
+inline void split_words(const char* begin, const char* end, std::vector<std::string>& words) {
+    words.clear();
+    while (begin < end) {
+        while (begin < end && std::isspace(static_cast<unsigned char>(*begin))) begin++;
+        auto word = begin;
+        while (begin < end && !std::isspace(static_cast<unsigned char>(*begin))) begin++;
+        if (begin > word)
+            words.emplace_back(word, begin);
+    }
+}
+
+inline bool parse_number(const std::string& word, double& value) {
+    char* end;
+    value = std::strtod(word.c_str(), &end);
+    return !word.empty() && *end == '\0';
+}
+
+} // namespace scene_file_detail
+
+/**
+ * Parses a scene in the text format, adding to whatever is in scene already.
+ * The paths of meshes are relative to directory. Returns false and sets error
+ * (with the line number) on the first mistake.
+ **/
+inline bool parse_scene_text(
+    const char* text, std::size_t size, Scene& scene, std::string& error,
+    const std::string& directory = ""
+) {
+    using namespace scene_file_detail;
+
+    std::unordered_map<std::string, const Material*> materials;
+    std::unordered_map<std::string, Prototype*> groups;
+    // The group whose spheres are being read, if any
+    Prototype* group = nullptr;
+    std::vector<std::string> words;
+    double v[12];
+    auto& settings = scene.settings;
+
+    const char* end = text + size;
+    int line = 0;
+    for (const char* p = text; p < end; ) {
+        line++;
+        auto line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!line_end) line_end = end;
+        auto comment = static_cast<const char*>(std::memchr(p, '#', line_end - p));
+        split_words(p, comment ? comment : line_end, words);
+        p = line_end + 1;
+
+        if (words.empty())
+            continue;
+
+        auto fail = [&](const std::string& message) {
+            error = "line " + std::to_string(line) + ": " + message;
+            return false;
+        };
+        // Parses words[first] to words[first + count - 1] into v
+        auto numbers = [&](std::size_t first, std::size_t count) {
+            if (words.size() < first + count)
+                return false;
+            for (std::size_t k = 0; k < count; k++)
+                if (!parse_number(words[first + k], v[k]))
+                    return false;
+            return true;
+        };
+
+        /**
+         * Parses the transform parts from words[first] to the end of the line
+         * into transform, and material <name> into material if that isn't null.
+         **/
+        auto transforms = [&](std::size_t first, Transform& transform, const Material** material) {
+            for (std::size_t k = first; k < words.size(); ) {
+                const auto& part = words[k];
+                if (part == "material" && material) {
+                    auto m = k + 1 < words.size() ? materials.find(words[k + 1]) : materials.end();
+                    if (m == materials.end())
+                        return fail("expected material <name> of a known material");
+                    *material = m->second;
+                    k += 2;
+                    continue;
+                }
+
+                // scale takes one number or three
+                std::size_t count = part == "translate" ? 3 : part == "rotate" ? 4
+                    : part == "matrix" ? 12 : part == "scale" ? (numbers(k + 1, 3) ? 3 : 1) : 0;
+                if (count == 0 || !numbers(k + 1, count))
+                    return fail("expected translate x y z, rotate x y z degrees, scale s, scale x y z or matrix <12 numbers>");
+
+                Transform t;
+                if (part == "translate") {
+                    t = Transform::translate(Vec3(v[0], v[1], v[2]));
+                } else if (part == "rotate") {
+                    if (v[0] == 0 && v[1] == 0 && v[2] == 0)
+                        return fail("the rotation axis can't be 0 0 0");
+                    t = Transform::rotate(Vec3(v[0], v[1], v[2]), v[3]);
+                } else if (part == "scale") {
+                    t = count == 3 ? Transform::scale(Vec3(v[0], v[1], v[2]))
+                                   : Transform::scale(Vec3(v[0], v[0], v[0]));
+                } else {
+                    for (int c = 0; c < 12; c++)
+                        t.m[c / 4][c % 4] = v[c];
+                }
+                if (t.determinant() == 0)
+                    return fail("the transform flattens the geometry");
+                transform = t * transform;
+                k += 1 + count;
+            }
+            return true;
+        };
+
+        const auto& keyword = words[0];
+        if (keyword == "sphere") {
+            if (words.size() != 6 || !numbers(1, 4))
+                return fail("expected sphere <x> <y> <z> <radius> <material>");
+            auto m = materials.find(words[5]);
+            if (m == materials.end())
+                return fail("unknown material " + words[5]);
+            if (group)
+                group->spheres.add(Point3(v[0], v[1], v[2]), v[3], m->second);
+            else
+                scene.add_sphere(Point3(v[0], v[1], v[2]), v[3], m->second);
+        } else if (keyword == "mesh") {
+            if (words.size() < 3)
+                return fail("expected mesh <file> <material> [transforms]");
+            auto m = materials.find(words[2]);
+            if (m == materials.end())
+                return fail("unknown material " + words[2]);
+            Transform transform;
+            if (!transforms(3, transform, nullptr))
+                return false;
+
+            auto path = std::filesystem::path(directory) / words[1];
+            auto& mesh = scene.add_mesh(m->second);
+            std::string mesh_error;
+            if (!load_mesh(path.string(), mesh, mesh_error))
+                return fail(mesh_error);
+            mesh.place(transform);
+            mesh.commit();
+        } else if (keyword == "group") {
+            if (words.size() != 2)
+                return fail("expected group <name>");
+            if (group)
+                return fail("groups can't be inside groups");
+            if (groups.count(words[1]))
+                return fail("there already is a group " + words[1]);
+            group = &scene.add_prototype(words[1]);
+            groups[words[1]] = group;
+        } else if (keyword == "end") {
+            if (!group)
+                return fail("end without a group");
+            group = nullptr;
+        } else if (keyword == "instance") {
+            if (words.size() < 2)
+                return fail("expected instance <group> [transforms] [material <name>]");
+            auto g = groups.find(words[1]);
+            if (g == groups.end() || g->second == group)
+                return fail("unknown group " + words[1]);
+
+            Transform transform;
+            const Material* material = nullptr;
+            if (!transforms(2, transform, &material))
+                return false;
+            scene.add_instance(*g->second, transform, material);
+        } else if (keyword == "material") {
+            std::size_t type = 0;
+            while (type < MATERIAL_TYPE_COUNT && (words.size() < 3 || words[2] != MODEL_NAMES[type]))
+                type++;
+            if (type == MATERIAL_TYPE_COUNT)
+                return fail("expected material <name> lambertian|metal|dielectric|light <parameters>");
+            auto count = static_cast<std::size_t>(PARAMETER_COUNTS[type]);
+            if (words.size() != 3 + count || !numbers(3, count))
+                return fail(std::string(MODEL_NAMES[type]) + " takes " + std::to_string(count) + " numbers");
+            materials[words[1]] = make_material(scene, type, v);
+        } else if (keyword == "image") {
+            if (words.size() != 3 || !numbers(1, 2) || !(v[0] >= 2 && v[0] <= MAX_IMAGE_SIZE)
+                || !(v[1] >= 2 && v[1] <= MAX_IMAGE_SIZE))
+                return fail("expected image <width> <height>, 2 to " + std::to_string(MAX_IMAGE_SIZE) + " pixels each");
+            settings.image_width = static_cast<int>(v[0]);
+            settings.image_height = static_cast<int>(v[1]);
+        } else if (keyword == "samples") {
+            if (words.size() != 2 || !numbers(1, 1) || !(v[0] >= 1 && v[0] <= MAX_SAMPLES))
+                return fail("expected samples <count>, 1 to " + std::to_string(MAX_SAMPLES));
+            settings.samples = static_cast<int>(v[0]);
+        } else if (keyword == "depth") {
+            if (words.size() != 2 || !numbers(1, 1) || !(v[0] >= 1 && v[0] <= MAX_BOUNCES))
+                return fail("expected depth <bounces>, 1 to " + std::to_string(MAX_BOUNCES));
+            settings.max_depth = static_cast<int>(v[0]);
+        } else if (keyword == "sky") {
+            if (words.size() != 4 || !numbers(1, 3) || v[0] < 0 || v[1] < 0 || v[2] < 0)
+                return fail("expected sky <r> <g> <b>");
+            settings.sky = Color(v[0], v[1], v[2]);
+        } else if (keyword == "camera") {
+            for (std::size_t k = 1; k < words.size(); ) {
+                const auto& part = words[k];
+                bool is_vector = part == "from" || part == "at" || part == "up";
+                bool is_number = part == "fov" || part == "aperture" || part == "focus";
+                std::size_t count = is_vector ? 3 : 1;
+                if (!(is_vector || is_number) || !numbers(k + 1, count))
+                    return fail("expected camera [from x y z] [at x y z] [up x y z] [fov f] [aperture a] [focus d]");
+                if (part == "from") settings.lookfrom = Point3(v[0], v[1], v[2]);
+                else if (part == "at") settings.lookat = Point3(v[0], v[1], v[2]);
+                else if (part == "up") settings.vup = Vec3(v[0], v[1], v[2]);
+                else if (part == "fov") settings.vfov = v[0];
+                else if (part == "aperture") settings.aperture = v[0];
+                else settings.focus_dist = v[0];
+                k += 1 + count;
+            }
+        } else {
+            return fail("unknown statement " + keyword);
+        }
+    }
+    if (group) {
+        error = "group " + group->name + " has no end";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes the scene in the text format, the materials get made up names. The
+ * meshes are written as the path of the file they came from, relative to the
+ * new scene file, meshes that weren't loaded from a file are left out.
+ **/
+inline bool save_scene_text(const std::string& path, const Scene& scene) {
+    using namespace scene_file_detail;
+
+    std::ofstream out(path);
+    if (!out)
+        return false;
+    out << std::setprecision(std::numeric_limits<real>::max_digits10);
+
+    const auto& s = scene.settings;
+    out << "image " << s.image_width << ' ' << s.image_height << '\n';
+    if (s.samples > 0)
+        out << "samples " << s.samples << '\n';
+    out << "depth " << s.max_depth << '\n';
+    out << "camera from " << s.lookfrom << " at " << s.lookat << " up " << s.vup
+        << " fov " << s.vfov << " aperture " << s.aperture << " focus " << s.focus_dist << '\n';
+    out << "sky " << s.sky << '\n';
+
+    uint32_t k = 0;
+    for (const auto& m : scene.materials) {
+        double p[MAX_PARAMETERS];
+        material_parameters(m, p);
+        out << "material m" << k++ << ' ' << MODEL_NAMES[m.type()];
+        for (int n = 0; n < PARAMETER_COUNTS[m.type()]; n++)
+            out << ' ' << p[n];
+        out << '\n';
+    }
+
+    auto indices = material_indices(scene);
+    auto write_spheres = [&](const PackedSpheres& spheres) {
+        for (std::size_t n = 0; n < spheres.size(); n++) {
+            out << "sphere " << spheres.cx[n] << ' ' << spheres.cy[n] << ' ' << spheres.cz[n] << ' '
+                << spheres.radius[n] << " m" << indices[spheres.materials[n]] << '\n';
+        }
+    };
+    write_spheres(scene.spheres);
+
+    // The groups get made up names too, the names they had may not be words
+    for (std::size_t k = 0; k < scene.prototypes.size(); k++) {
+        out << "group g" << k << '\n';
+        write_spheres(scene.prototypes[k].spheres);
+        out << "end" << '\n';
+    }
+
+    auto prototypes = prototype_indices(scene);
+    for (const auto& instance : scene.instances) {
+        out << "instance g" << prototypes.at(instance.geometry) << " matrix";
+        for (int c = 0; c < 12; c++)
+            out << ' ' << instance.object_to_world.m[c / 4][c % 4];
+        if (instance.material)
+            out << " material m" << indices[instance.material];
+        out << '\n';
+    }
+
+    auto directory = std::filesystem::absolute(std::filesystem::path(path)).parent_path();
+    for (const auto& mesh : scene.meshes) {
+        if (mesh.source.empty()) {
+            std::cerr << "Leaving out a mesh that has no file" << '\n';
+            continue;
+        }
+        std::error_code failed;
+        auto source = std::filesystem::absolute(mesh.source);
+        auto relative = std::filesystem::relative(source, directory, failed);
+        out << "mesh " << (failed || relative.empty() ? source : relative).generic_string()
+            << " m" << indices[mesh.material] << " matrix";
+        for (int c = 0; c < 12; c++)
+            out << ' ' << mesh.placement.m[c / 4][c % 4];
+        out << '\n';
+    }
+
+    return static_cast<bool>(out.flush());
+}
+
+namespace scene_file_detail {
+
+// Writes a block of spheres with their tree, built here unless they already have one
+inline void write_spheres(
+    std::ostream& out, const PackedSpheres& source,
+    const std::unordered_map<const Material*, uint32_t>& indices
+) {
+    PackedSpheres built;
+    const PackedSpheres* spheres = &source;
+    if (!spheres->committed || !spheres->use_tree) {
+        built = source;
+        if (built.committed) {
+            // Take the padding back off before building the tree
+            auto n = built.size();
+            built.cx.resize(n); built.cy.resize(n); built.cz.resize(n); built.radius.resize(n);
+        }
+        built.commit(true);
+        spheres = &built;
+    }
+
+    auto n = spheres->size();
+    write_value(out, static_cast<uint64_t>(n));
+    write_value(out, static_cast<uint64_t>(spheres->tree.nodes.size()));
+    write_array(out, spheres->cx, n);
+    write_array(out, spheres->cy, n);
+    write_array(out, spheres->cz, n);
+    write_array(out, spheres->radius, n);
+
+    std::vector<uint32_t> sphere_materials(n);
+    for (std::size_t k = 0; k < n; k++)
+        sphere_materials[k] = indices.at(spheres->materials[k]);
+    write_array(out, sphere_materials, n);
+    write_array(out, spheres->tree.nodes, spheres->tree.nodes.size());
+}
+
+// Reads a block of spheres written by write_spheres
+inline bool read_spheres(
+    BinaryReader& in, PackedSpheres& spheres, const std::vector<const Material*>& materials,
+    std::string& error
+) {
+    uint64_t n, node_count;
+    std::vector<uint32_t> sphere_materials;
+    // The arrays are padded for the SIMD loads, like PackedSpheres::commit does
+    std::size_t padding = SimdReal::WIDTH;
+    if (!in.read(n) || !in.read(node_count)
+        || !in.read_array(spheres.cx, n, padding) || !in.read_array(spheres.cy, n, padding)
+        || !in.read_array(spheres.cz, n, padding) || !in.read_array(spheres.radius, n, padding)
+        || !in.read_array(sphere_materials, n) || !in.read_array(spheres.tree.nodes, node_count)) {
+        error = "the file is cut short";
+        return false;
+    }
+
+    spheres.materials.resize(n);
+    for (std::size_t k = 0; k < n; k++) {
+        if (sphere_materials[k] >= materials.size()) {
+            error = "sphere " + std::to_string(k) + " has no material";
+            return false;
+        }
+        spheres.materials[k] = materials[sphere_materials[k]];
+    }
+
+    if (!spheres.tree.valid(n)) {
+        error = "the tree is broken";
+        return false;
+    }
+
+    spheres.bounds = node_count > 0 ? spheres.tree.nodes[0].box : AABB();
+    spheres.use_tree = node_count > 0;
+    spheres.committed = true;
+    spheres.check_simd_limit();
+    return true;
+}
+
+} // namespace scene_file_detail
+
+/**
+ * Writes the scene in the binary format, with the spheres sorted into a BVH.
+ * The tree is built here unless the spheres already have one. The prototypes
+ * follow the spheres, each with its own tree, and then the instances.
+ **/
+inline bool save_scene_binary(const std::string& path, const Scene& scene) {
+    using namespace scene_file_detail;
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        return false;
+
+    out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    write_value(out, static_cast<uint32_t>(sizeof(real)));
+    write_value(out, static_cast<uint32_t>(sizeof(BvhNode)));
+
+    const auto& s = scene.settings;
+    int32_t ints[4] = { s.image_width, s.image_height, s.samples, s.max_depth };
+    double camera[12] = {
+        s.lookfrom[0], s.lookfrom[1], s.lookfrom[2], s.lookat[0], s.lookat[1], s.lookat[2],
+        s.vup[0], s.vup[1], s.vup[2], s.vfov, s.aperture, s.focus_dist
+    };
+    double sky[3] = { s.sky[0], s.sky[1], s.sky[2] };
+    write_value(out, ints);
+    write_value(out, camera);
+    write_value(out, sky);
+
+    write_value(out, static_cast<uint32_t>(scene.materials.size()));
+    for (const auto& m : scene.materials) {
+        double p[MAX_PARAMETERS] = {};
+        material_parameters(m, p);
+        write_value(out, static_cast<uint32_t>(m.type()));
+        write_value(out, p);
+    }
+
+    auto indices = material_indices(scene);
+    write_spheres(out, scene.spheres, indices);
+
+    write_value(out, static_cast<uint32_t>(scene.prototypes.size()));
+    for (const auto& prototype : scene.prototypes) {
+        write_value(out, static_cast<uint32_t>(prototype.name.size()));
+        out.write(prototype.name.data(), static_cast<std::streamsize>(prototype.name.size()));
+        write_spheres(out, prototype.spheres, indices);
+    }
+
+    auto prototypes = prototype_indices(scene);
+    write_value(out, static_cast<uint64_t>(scene.instances.size()));
+    for (const auto& instance : scene.instances) {
+        uint32_t ids[2] = {
+            prototypes.at(instance.geometry),
+            instance.material ? indices.at(instance.material) : NO_MATERIAL
+        };
+        double matrix[12];
+        for (int k = 0; k < 12; k++)
+            matrix[k] = instance.object_to_world.m[k / 4][k % 4];
+        write_value(out, ids);
+        write_value(out, matrix);
+    }
+
+    write_value(out, static_cast<uint32_t>(scene.meshes.size()));
+    for (const auto& mesh : scene.meshes) {
+        // A mesh without its tree gets one here
+        TriangleMesh committed;
+        const TriangleMesh* m = &mesh;
+        if (mesh.tree.nodes.empty() && mesh.size() > 0) {
+            committed.vertices = mesh.vertices;
+            committed.indices = mesh.indices;
+            committed.commit();
+            m = &committed;
+        }
+        write_value(out, mesh.material ? indices.at(mesh.material) : NO_MATERIAL);
+        write_value(out, static_cast<uint32_t>(mesh.source.size()));
+        out.write(mesh.source.data(), static_cast<std::streamsize>(mesh.source.size()));
+        double matrix[12];
+        for (int c = 0; c < 12; c++)
+            matrix[c] = mesh.placement.m[c / 4][c % 4];
+        write_value(out, matrix);
+        uint64_t counts[3] = { m->vertices.size(), m->size(), m->tree.nodes.size() };
+        write_value(out, counts);
+        write_array(out, m->vertices, m->vertices.size());
+        write_array(out, m->indices, m->indices.size());
+        write_array(out, m->tree.nodes, m->tree.nodes.size());
+    }
+
+    return static_cast<bool>(out.flush());
+}
+
+// Reads a scene in the binary format into an empty scene
+inline bool parse_scene_binary(const char* data, std::size_t size, Scene& scene, std::string& error) {
+    using namespace scene_file_detail;
+
+    BinaryReader in{ data + sizeof(BINARY_MAGIC), data + size };
+    auto truncated = [&]() {
+        error = "the file is cut short";
+        return false;
+    };
+    // Version 1 files end after the spheres, version 2 files after the instances,
+    // versions before 4 have no sky
+    bool has_instances = data[sizeof(BINARY_MAGIC) - 1] >= '2';
+    bool has_meshes = data[sizeof(BINARY_MAGIC) - 1] >= '3';
+    bool has_sky = data[sizeof(BINARY_MAGIC) - 1] >= '4';
+
+    uint32_t real_size, node_size;
+    if (!in.read(real_size) || !in.read(node_size))
+        return truncated();
+    if (real_size != sizeof(real) || node_size != sizeof(BvhNode)) {
+        error = std::string("written by a build with ") + (real_size == 4 ? "float" : "double")
+              + " geometry, this one uses " + RT_REAL_NAME;
+        return false;
+    }
+
+    int32_t ints[4];
+    double camera[12];
+    if (!in.read(ints) || !in.read(camera))
+        return truncated();
+    if (ints[0] < 2 || ints[1] < 2 || ints[0] > MAX_IMAGE_SIZE || ints[1] > MAX_IMAGE_SIZE) {
+        error = "the image isn't 2 to " + std::to_string(MAX_IMAGE_SIZE) + " pixels wide and high";
+        return false;
+    }
+    // The same limits as the text format, but 0 samples is a scene that leaves them to the renderer
+    if (ints[2] < 0 || ints[2] > MAX_SAMPLES || ints[3] < 1 || ints[3] > MAX_BOUNCES) {
+        error = "the samples or the depth are out of range";
+        return false;
+    }
+    auto& s = scene.settings;
+    s.image_width = ints[0];
+    s.image_height = ints[1];
+    s.samples = ints[2];
+    s.max_depth = ints[3];
+    s.lookfrom = Point3(camera[0], camera[1], camera[2]);
+    s.lookat = Point3(camera[3], camera[4], camera[5]);
+    s.vup = Vec3(camera[6], camera[7], camera[8]);
+    s.vfov = camera[9];
+    s.aperture = camera[10];
+    s.focus_dist = camera[11];
+    if (has_sky) {
+        double sky[3];
+        if (!in.read(sky))
+            return truncated();
+        s.sky = Color(sky[0], sky[1], sky[2]);
+    }
+
+    uint32_t material_count;
+    if (!in.read(material_count))
+        return truncated();
+    std::vector<const Material*> materials;
+    for (uint32_t k = 0; k < material_count; k++) {
+        uint32_t type;
+        double p[MAX_PARAMETERS];
+        if (!in.read(type) || !in.read(p))
+            return truncated();
+        if (type >= MATERIAL_TYPE_COUNT) {
+            error = "unknown material model " + std::to_string(type);
+            return false;
+        }
+        materials.push_back(make_material(scene, type, p));
+    }
+
+    if (!read_spheres(in, scene.spheres, materials, error))
+        return false;
+    if (!has_instances)
+        return true;
+
+    uint32_t prototype_count;
+    if (!in.read(prototype_count))
+        return truncated();
+    for (uint32_t k = 0; k < prototype_count; k++) {
+        uint32_t length;
+        if (!in.read(length) || static_cast<std::size_t>(in.end - in.p) < length)
+            return truncated();
+        auto& prototype = scene.add_prototype(std::string(in.p, length));
+        in.p += length;
+        if (!read_spheres(in, prototype.spheres, materials, error))
+            return false;
+    }
+
+    uint64_t instance_count;
+    if (!in.read(instance_count) || instance_count > in.room_for(2 * sizeof(uint32_t) + 12 * sizeof(double)))
+        return truncated();
+    scene.instances.reserve(instance_count);
+    for (uint64_t k = 0; k < instance_count; k++) {
+        uint32_t ids[2];
+        double matrix[12];
+        if (!in.read(ids) || !in.read(matrix))
+            return truncated();
+        if (ids[0] >= prototype_count || (ids[1] != NO_MATERIAL && ids[1] >= materials.size())) {
+            error = "instance " + std::to_string(k) + " points outside the file";
+            return false;
+        }
+        Transform transform;
+        for (int c = 0; c < 12; c++)
+            transform.m[c / 4][c % 4] = static_cast<real>(matrix[c]);
+        scene.add_instance(scene.prototypes[ids[0]], transform,
+                           ids[1] == NO_MATERIAL ? nullptr : materials[ids[1]]);
+    }
+    if (!has_meshes)
+        return true;
+
+    uint32_t mesh_count;
+    if (!in.read(mesh_count))
+        return truncated();
+    for (uint32_t k = 0; k < mesh_count; k++) {
+        uint32_t material, length;
+        if (!in.read(material) || !in.read(length) || static_cast<std::size_t>(in.end - in.p) < length)
+            return truncated();
+        if (material != NO_MATERIAL && material >= materials.size()) {
+            error = "mesh " + std::to_string(k) + " has no material";
+            return false;
+        }
+        auto& mesh = scene.add_mesh(material == NO_MATERIAL ? nullptr : materials[material]);
+        mesh.source.assign(in.p, length);
+        in.p += length;
+
+        double matrix[12];
+        uint64_t counts[3];
+        // Three indices a triangle, a count too big for that can't be in the file anyway
+        if (!in.read(matrix) || !in.read(counts) || !in.read_array(mesh.vertices, counts[0])
+            || counts[1] > in.room_for(3 * sizeof(uint32_t)) || !in.read_array(mesh.indices, 3 * counts[1]) || !in.read_array(mesh.tree.nodes, counts[2]))
+            return truncated();
+        for (auto index : mesh.indices) {
+            if (index >= counts[0]) {
+                error = "mesh " + std::to_string(k) + " uses a vertex that isn't there";
+                return false;
+            }
+        }
+        if (!mesh.tree.valid(counts[1])) {
+            error = "the tree of mesh " + std::to_string(k) + " is broken";
+            return false;
+        }
+        // The tree is loaded instead of built, so commit() isn't called
+        mesh.check_simd_limit();
+        for (int c = 0; c < 12; c++)
+            mesh.placement.m[c / 4][c % 4] = static_cast<real>(matrix[c]);
+        if (!mesh.tree.nodes.empty())
+            mesh.bounds = mesh.tree.nodes[0].box;
+    }
+    return true;
+}
+
+/**
+ * Loads a scene file in either format into an empty scene, the binary one is
+ * recognized by its first bytes. Returns false and sets error if the file
+ * can't be read or has a mistake in it.
+ **/
+inline bool load_scene(const std::string& path, Scene& scene, std::string& error) {
+    using namespace scene_file_detail;
+
+    MappedFile file;
+    if (!file.open(path)) {
+        error = "can't open the file";
+        return false;
+    }
+
+    // Any version up to this one
+    if (file.size >= sizeof(BINARY_MAGIC)
+        && std::memcmp(file.data, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) == 0
+        && file.data[sizeof(BINARY_MAGIC) - 1] >= '1'
+        && file.data[sizeof(BINARY_MAGIC) - 1] <= BINARY_MAGIC[sizeof(BINARY_MAGIC) - 1])
+        return parse_scene_binary(file.data, file.size, scene, error);
+    auto directory = std::filesystem::path(path).parent_path().string();
+    return parse_scene_text(file.data, file.size, scene, error, directory);
+}
+
+// Writes the binary format if path ends in .rtscene, otherwise the text format
+inline bool save_scene(const std::string& path, const Scene& scene) {
+    const std::string extension = ".rtscene";
+    bool binary = path.size() >= extension.size()
+        && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+    return binary ? save_scene_binary(path, scene) : save_scene_text(path, scene);
+}
+
+namespace scene_file_detail {
+
+// Adds values to a 64 bit hash one after another
+struct Hasher {
+    uint64_t hash = 0;
+
+    void add_bits(uint64_t bits) { hash = mix_bits(hash ^ bits); }
+
+    void add_number(double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        add_bits(bits);
+    }
+
+    void add_vector(const Vec3& v) {
+        for (int k = 0; k < 3; k++)
+            add_number(v[k]);
+    }
+};
+
+} // namespace scene_file_detail
+
+/**
+ * A hash of everything in the scene that changes the image besides the size,
+ * samples and bounces: the camera, the sky, the materials and the geometry.
+ * A checkpoint keeps it, so resuming with another scene is caught (see
+ * Checkpoint). The spheres are added up in any order, the same spheres with
+ * or without their tree hash the same. Objects that aren't spheres, instances
+ * or meshes only count by their number.
+ **/
+inline uint64_t scene_hash(const Scene& scene) {
+    using namespace scene_file_detail;
+
+    Hasher h;
+    const auto& s = scene.settings;
+    h.add_vector(s.lookfrom);
+    h.add_vector(s.lookat);
+    h.add_vector(s.vup);
+    h.add_number(s.vfov);
+    h.add_number(s.aperture);
+    h.add_number(s.focus_dist);
+    h.add_vector(s.sky);
+
+    for (const auto& m : scene.materials) {
+        double p[MAX_PARAMETERS];
+        material_parameters(m, p);
+        h.add_bits(m.type());
+        for (int n = 0; n < PARAMETER_COUNTS[m.type()]; n++)
+            h.add_number(p[n]);
+    }
+
+    auto indices = material_indices(scene);
+    auto material_index = [&](const Material* m) {
+        return m ? static_cast<uint64_t>(indices.at(m)) : ~uint64_t(0);
+    };
+    auto add_spheres = [&](const PackedSpheres& spheres) {
+        uint64_t sum = 0;
+        for (std::size_t n = 0; n < spheres.size(); n++) {
+            Hasher sphere;
+            sphere.add_number(spheres.cx[n]);
+            sphere.add_number(spheres.cy[n]);
+            sphere.add_number(spheres.cz[n]);
+            sphere.add_number(spheres.radius[n]);
+            sphere.add_bits(material_index(spheres.materials[n]));
+            sum += sphere.hash;
+        }
+        h.add_bits(spheres.size());
+        h.add_bits(sum);
+    };
+    add_spheres(scene.spheres);
+    for (const auto& prototype : scene.prototypes)
+        add_spheres(prototype.spheres);
+
+    auto prototypes = prototype_indices(scene);
+    auto add_transform = [&](const Transform& t) {
+        for (int c = 0; c < 12; c++)
+            h.add_number(t.m[c / 4][c % 4]);
+    };
+    for (const auto& instance : scene.instances) {
+        h.add_bits(prototypes.at(instance.geometry));
+        add_transform(instance.object_to_world);
+        h.add_bits(material_index(instance.material));
+    }
+
+    for (const auto& mesh : scene.meshes) {
+        h.add_bits(material_index(mesh.material));
+        add_transform(mesh.placement);
+        for (const auto& v : mesh.vertices)
+            h.add_vector(v);
+        for (auto index : mesh.indices)
+            h.add_bits(index);
+    }
+
+    h.add_bits(scene.objects.objects.size());
+    return h.hash;
+}
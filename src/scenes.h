@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "utility.h"
+#include "scene.h"
+#include "sphere.h"
+#include "material.h"
+
+/**
+ * The final scene of the book, a big ground sphere, three large spheres and a
+ * grid of small spheres with random materials. The random numbers come from
+ * the thread sampler, so seed it first to get the same scene every time.
+ **/
+inline Scene random_scene() {
+    // The scene owns the materials, spheres only point at them. The camera
+    // and image are the defaults of SceneSettings
+    Scene world;
+
+    // random elements
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            Point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
+                const Material* sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = Color::random() * Color::random();
+                    sphere_material = world.make_material<Lambertian>(albedo);
+                    world.add_sphere(center, 0.2, sphere_material);
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = Color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = world.make_material<Metal>(albedo, fuzz);
+                    world.add_sphere(center, 0.2, sphere_material);
+                } else {
+                    // glass
+                    sphere_material = world.make_material<Dielectric>(1.5);
+                    world.add_sphere(center, 0.2, sphere_material);
+                }
+            }
+        }
+    }
+
+    // Basic elements
+    auto ground_material = world.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+    auto metal = world.make_material<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+    auto dielectric = world.make_material<Dielectric>(1.5);
+    auto lamber = world.make_material<Lambertian>(Color(0.4, 0.2, 0.1));
+
+    world.add_sphere(Point3(0, -1000, 0), 1000, ground_material);
+    world.add_sphere(Point3(4, 1, 0), 1.0, metal);
+    world.add_sphere(Point3(0, 1, 0), 1.0, dielectric);
+    world.add_sphere(Point3(-4, 1, 0), 1.0, lamber);
+
+    return world;
+}
+
+/**
+ * Like the book's scene, but with count spheres: the ground and count - 1
+ * small spheres in a square field, one per unit cell, with the same mix of
+ * materials. The benchmarks use it to see how the renderer scales with the
+ * size of the scene. The camera and the ground grow with the field, so the
+ * whole field stays in view from the same angle.
+ **/
+inline Scene sphere_field(int count) {
+    Scene world;
+    int small = std::max(count - 1, 0);
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(small))));
+    double scale = std::max(1.0, side / 22.0);
+
+    for (int k = 0; k < small; k++) {
+        auto choose_mat = random_double();
+        Point3 center(k % side - side / 2.0 + 0.9*random_double(), 0.2,
+                      k / side - side / 2.0 + 0.9*random_double());
+
+        const Material* sphere_material;
+        if (choose_mat < 0.8) {
+            auto albedo = Color::random() * Color::random();
+            sphere_material = world.make_material<Lambertian>(albedo);
+        } else if (choose_mat < 0.95) {
+            auto albedo = Color::random(0.5, 1);
+            auto fuzz = random_double(0, 0.5);
+            sphere_material = world.make_material<Metal>(albedo, fuzz);
+        } else {
+            sphere_material = world.make_material<Dielectric>(1.5);
+        }
+        world.add_sphere(center, 0.2, sphere_material);
+    }
+
+    if (count > 0) {
+        auto ground_material = world.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+        world.add_sphere(Point3(0, -1000 * scale, 0), 1000 * scale, ground_material);
+    }
+
+    world.settings.lookfrom = scale * Point3(13, 2, 3);
+    world.settings.focus_dist = 10 * scale;
+    return world;
+}
+
+/**
+ * Three big diffuse spheres where the book has its three, at night, lit only
+ * by a small bright lamp above them and a dim one far behind
+ * (scenes/small_light.scene is the same scene). Light that comes from a small
+ * spot is what next event estimation is for, bench/nee.cpp renders it with
+ * and without.
+ **/
+inline Scene small_light() {
+    Scene world;
+    auto ground = world.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+    world.add_sphere(Point3(0, -1000, 0), 1000, ground);
+    world.add_sphere(Point3(4, 1, 0), 1, world.make_material<Lambertian>(Color(0.2, 0.3, 0.6)));
+    world.add_sphere(Point3(0, 1, 0), 1, world.make_material<Lambertian>(Color(0.8, 0.8, 0.8)));
+    world.add_sphere(Point3(-4, 1, 0), 1, world.make_material<Lambertian>(Color(0.4, 0.2, 0.1)));
+    world.add_sphere(Point3(1, 6, 2), 0.1, world.make_material<DiffuseLight>(Color(600, 570, 510)));
+    world.add_sphere(Point3(-6, 3, -4), 0.3, world.make_material<DiffuseLight>(Color(20, 20, 30)));
+    world.settings.sky = Color(0, 0, 0);
+    world.settings.samples = 16;
+    return world;
+}
+
+/**
+ * A forest of count copies of one tree, to show off instancing. The tree is a
+ * prototype of a few hundred small spheres, a trunk and a round crown, and
+ * every copy of it is an instance turned around the vertical axis, scaled
+ * and on its own spot of a grid. Every third one gets an autumn color in
+ * place of the tree's own materials.
+ *
+ * The spheres of the tree are stored once however many trees there are, see
+ * bench/instancing.cpp for the same forest with every sphere stored.
+ **/
+inline Scene sphere_forest(int count) {
+    Scene world;
+    auto& tree = world.add_prototype("tree");
+
+    auto bark = world.make_material<Lambertian>(Color(0.3, 0.2, 0.1));
+    for (int k = 0; k < 8; k++)
+        tree.spheres.add(Point3(0, 0.15 + 0.2 * k, 0), 0.15, bark);
+
+    auto leaves = world.make_material<Lambertian>(Color(0.1, 0.4, 0.1));
+    auto dew = world.make_material<Metal>(Color(0.8, 0.9, 0.8), 0.1);
+    for (int k = 0; k < 300; k++) {
+        auto direction = random_unit_vector();
+        auto center = Point3(0, 2.0, 0) + 0.8 * std::cbrt(random_double()) * direction;
+        tree.spheres.add(center, 0.12, random_double() < 0.9 ? leaves : dew);
+    }
+
+    const Material* autumn[] = {
+        world.make_material<Lambertian>(Color(0.7, 0.3, 0.05)),
+        world.make_material<Lambertian>(Color(0.6, 0.1, 0.05)),
+        world.make_material<Metal>(Color(0.8, 0.6, 0.2), 0.2),
+    };
+
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(count))));
+    double spacing = 2.5;
+    for (int k = 0; k < count; k++) {
+        Vec3 spot((k % side - side / 2.0 + 0.5 * random_double()) * spacing, 0,
+                  (k / side - side / 2.0 + 0.5 * random_double()) * spacing);
+        auto turn = Transform::rotate(Vec3(0, 1, 0), random_double(0, 360));
+        auto size = random_double(0.6, 1.4);
+        auto transform = Transform::translate(spot) * Transform::scale(Vec3(size, size, size)) * turn;
+        world.add_instance(tree, transform, k % 3 == 2 ? autumn[k / 3 % 3] : nullptr);
+    }
+
+    double scale = std::max(1.0, side * spacing / 22.0);
+    auto ground_material = world.make_material<Lambertian>(Color(0.5, 0.5, 0.5));
+    world.add_sphere(Point3(0, -1000 * scale, 0), 1000 * scale, ground_material);
+
+    world.settings.lookfrom = scale * Point3(13, 4, 3);
+    world.settings.lookat = Point3(0, 1, 0);
+    world.settings.focus_dist = 10 * scale;
+    return world;
+}
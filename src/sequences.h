@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "random.h"
+
+/**
+ * The building blocks of the samplers in sampler.h that spread the samples of a
+ * pixel out more evenly than independent random numbers do.
+ *
+ * All of them hand out points two dimensions at a time, the pixel position is
+ * one pair, the lens another and so on. Each pair gets its own scramble, so the
+ * pairs don't line up with each other. The point of sample s only depends on
+ * the pixel, s and the pair, the same as the random numbers of the
+ * independent sampler, so the image still doesn't depend on the threads.
+ **/
+
+// A hash of a and b, for seeding the scrambles
+inline uint64_t hash_pair(uint64_t a, uint64_t b) {
+    return mix_bits(a ^ (b * 0x9e3779b97f4a7c15ULL));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+#if defined(__GNUC__)
+    // The byte order is a single instruction
+    return __builtin_bswap32(x);
+#else
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+#endif
+}
+
+// 32 bits as a real in [0, 1)
+inline double bits_to_unit(uint32_t x) {
+    return x * 0x1p-32;
+}
+
+/**
+ * The first two dimensions of the Sobol sequence, with Owen scrambling.
+ *
+ * Every block of 2^m points that starts at a multiple of 2^m is a (0, m, 2)
+ * net: cut the unit square into 2^m equal rectangles of any shape (1 x 1/2^m,
+ * 1/2 x 1/2^(m-1), ...) and every rectangle gets exactly one point. The first
+ * dimension is the van der Corput sequence, the bits of the index mirrored.
+ * The second xors together one direction number per set bit of the index.
+ *
+ * Owen scrambling (after Burley's "Practical Hash-based Owen Scrambling")
+ * flips every bit of a fraction depending on the bits in front of it. That
+ * randomizes the points (every single one is uniform in [0, 1), so the
+ * average stays unbiased) while keeping the nets intact. Laine and Karras
+ * noticed that a multiplication by an even number mixes every bit into the
+ * bits above it, so on the fraction with its bits reversed a few multiplies
+ * do the job. The first dimension with its bits reversed is just the index,
+ * so it can go straight into the scramble.
+ **/
+namespace sequences_detail {
+
+// The Owen scramble of a fraction with its bits reversed
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+/**
+ * The second dimension of index with its bits reversed, ready for the
+ * scramble. The scrambled indices use all 32 bits, so instead of a loop over
+ * the bits the xors of every byte are looked up in a table, one per byte
+ * position.
+ **/
+struct SobolTable {
+    uint32_t bytes[4][256];
+
+    SobolTable() {
+        // The direction numbers are the rows of Pascal's triangle mod 2, each
+        // one is the one before xored with itself shifted
+        uint32_t directions[32];
+        directions[0] = 1u << 31;
+        for (int k = 1; k < 32; k++)
+            directions[k] = directions[k - 1] ^ (directions[k - 1] >> 1);
+
+        for (int b = 0; b < 4; b++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                uint32_t x = 0;
+                for (int k = 0; k < 8; k++)
+                    if (value & (1u << k))
+                        x ^= directions[8 * b + k];
+                bytes[b][value] = reverse_bits(x);
+            }
+        }
+    }
+};
+
+inline const SobolTable& sobol_table() {
+    static const SobolTable table;
+    return table;
+}
+
+} // namespace sequences_detail
+
+/**
+ * Point index of the Owen scrambled Sobol sequence, seeded by seed. The index
+ * is scrambled too, which shuffles the order of the points: two pairs seeded
+ * differently visit the points in a different order and don't line up, but
+ * the first 2^m samples are still a whole block and so still a net.
+ **/
+inline void scrambled_sobol_2d(uint32_t index, uint64_t seed, double& x, double& y) {
+    using namespace sequences_detail;
+    const auto& table = sobol_table();
+
+    // Three scramble seeds out of the 64 bits of seed
+    auto seed_index = static_cast<uint32_t>(seed);
+    auto seed_x = static_cast<uint32_t>(seed >> 32);
+    auto seed_y = (seed_index ^ seed_x) * 0x9e3779b9u;
+
+    // The shuffled index, which is also the first dimension reversed
+    index = reverse_bits(laine_karras_permutation(reverse_bits(index), seed_index));
+    uint32_t second = table.bytes[0][index & 0xff] ^ table.bytes[1][(index >> 8) & 0xff]
+                    ^ table.bytes[2][(index >> 16) & 0xff] ^ table.bytes[3][index >> 24];
+
+    x = bits_to_unit(reverse_bits(laine_karras_permutation(index, seed_x)));
+    y = bits_to_unit(reverse_bits(laine_karras_permutation(second, seed_y)));
+}
+
+/**
+ * A permutation of 0..length-1 picked by seed, Kensler's hash from
+ * "Correlated Multi-Jittered Sampling". It mixes the bits of i inside the
+ * smallest power of two that holds length, and tries again while it lands
+ * outside, so no table is needed.
+ **/
+inline uint32_t permute_index(uint32_t i, uint32_t length, uint32_t seed) {
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + seed) % length;
+}
+
+/**
+ * Sample s of count stratified samples, Kensler's correlated multi-jittered
+ * sampling. The square is cut into an m x n grid of cells with m * n >= count,
+ * as close to square as possible, and every sample lands in its own cell at a
+ * random spot. On top of that the samples are also spread over the columns and
+ * rows inside a cell (like the n-rooks pattern), so each of x and y on its own
+ * is stratified into m * n strata too. Unlike a plain grid it works for any
+ * count, not just square numbers, though only m * n = count fills every cell.
+ **/
+inline void multi_jittered_2d(uint32_t s, uint32_t count, uint64_t seed64, double& x, double& y) {
+    auto seed = static_cast<uint32_t>(seed64);
+    auto m = static_cast<uint32_t>(std::max(1.0, std::sqrt(static_cast<double>(count))));
+    uint32_t n = (count + m - 1) / m;
+
+    // The order of the samples is shuffled too, so the first few samples
+    // of a progressive render are spread out and not just the first rows
+    s = permute_index(s, count, seed * 0x51633e2du);
+    uint32_t sx = permute_index(s % m, m, seed * 0x68bc21ebu);
+    uint32_t sy = permute_index(s / m, n, seed * 0x02e5be93u);
+    auto jitter = hash_pair(seed64, s);
+    double jx = bits_to_unit(static_cast<uint32_t>(jitter));
+    double jy = bits_to_unit(static_cast<uint32_t>(jitter >> 32));
+
+    x = std::min((s % m + (sy + jx) / n) / m, 1 - 0x1p-53);
+    y = std::min((s / m + (sx + jy) / m) / n, 1 - 0x1p-53);
+}
+
+/**
+ * A 64 x 64 blue noise mask: every pixel holds a different rank from 0 to
+ * 4095, and the pixels below any rank are spread evenly over the mask without
+ * clumps, like the cells of a stippled drawing. It tiles, the right edge
+ * continues on the left.
+ *
+ * Built once with Ulichney's void and cluster method. Every pixel that is
+ * switched on adds a gaussian bump of energy around it, so the pixel with the
+ * least energy is the center of the largest void, the one with the most the
+ * tightest cluster:
+ *   1. switch on a tenth of the pixels at random, then keep moving the
+ *      tightest cluster into the largest void until that changes nothing
+ *   2. switch them off again one by one, tightest cluster first, counting
+ *      the rank down
+ *   3. starting from the pattern of step 1, switch on the largest void one
+ *      by one, counting the rank up until every pixel is on
+ **/
+const int BLUE_NOISE_SIZE = 64;
+
+inline std::vector<uint16_t> build_blue_noise_mask() {
+    const int N = BLUE_NOISE_SIZE;
+    const int count = N * N;
+    const double sigma = 1.5;
+
+    // The energy bump, distances wrap around the mask
+    std::vector<double> kernel(count);
+    for (int y = 0; y < N; y++) {
+        for (int x = 0; x < N; x++) {
+            int dx = std::min(x, N - x);
+            int dy = std::min(y, N - y);
+            kernel[y * N + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<char> on(count, 0);
+    std::vector<double> energy(count, 0.0);
+    auto toggle = [&](int p, bool value) {
+        on[p] = value;
+        double sign = value ? 1 : -1;
+        int px = p % N, py = p / N;
+        for (int y = 0; y < N; y++) {
+            const double* row = &kernel[((y - py + N) % N) * N];
+            for (int x = 0; x < N; x++)
+                energy[y * N + x] += sign * row[(x - px + N) % N];
+        }
+    };
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int p = 0; p < count; p++)
+            if (on[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        return best;
+    };
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int p = 0; p < count; p++)
+            if (!on[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        return best;
+    };
+
+    // 1. The initial pattern
+    Pcg32 rng(0x626c7565, 0);
+    int initial = count / 10;
+    for (int placed = 0; placed < initial; ) {
+        auto p = static_cast<int>(rng.next_uint() % count);
+        if (!on[p]) {
+            toggle(p, true);
+            placed++;
+        }
+    }
+    while (true) {
+        int cluster = tightest_cluster();
+        toggle(cluster, false);
+        int gap = largest_void();
+        toggle(gap, true);
+        if (gap == cluster)
+            break;
+    }
+    auto initial_on = on;
+    auto initial_energy = energy;
+
+    std::vector<uint16_t> rank(count);
+
+    // 2. Rank the initial pixels from the top down
+    for (int r = initial - 1; r >= 0; r--) {
+        int cluster = tightest_cluster();
+        toggle(cluster, false);
+        rank[cluster] = static_cast<uint16_t>(r);
+    }
+
+    // 3. Rank the rest from the bottom up
+    on = initial_on;
+    energy = initial_energy;
+    for (int r = initial; r < count; r++) {
+        int gap = largest_void();
+        toggle(gap, true);
+        rank[gap] = static_cast<uint16_t>(r);
+    }
+
+    return rank;
+}
+
+inline const std::vector<uint16_t>& blue_noise_mask() {
+    // Built by the first thread that needs it, the others wait for it
+    static const std::vector<uint16_t> mask = build_blue_noise_mask();
+    return mask;
+}
+
+// The mask value at (x, y) as a real in (0, 1), the mask repeats in both directions
+inline double blue_noise(int x, int y) {
+    const int N = BLUE_NOISE_SIZE;
+    // N is a power of two, so the mask also wraps the negative numbers right
+    x &= N - 1;
+    y &= N - 1;
+    return (blue_noise_mask()[y * N + x] + 0.5) * (1.0 / (N * N));
+}
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <cmath>
+
+#include "real.h"
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * A tiny wrapper around the SIMD registers of the machine.
+ *
+ * A SimdDouble holds WIDTH doubles and every operation works on all of them at
+ * once, so the intersection code can test WIDTH objects (or rays) with the same
+ * instructions it would use for one. Comparisons give back a SimdMask with one
+ * bit per lane, which can be used to pick values with select(). SimdFloat and
+ * SimdFloatMask are the same for floats, and SimdReal is whichever of the two
+ * matches the real type of the build.
+ *
+ * Which registers are used is decided by what the compiler is allowed to use:
+ *   AVX-512   8 doubles or 16 floats
+ *   AVX       4 doubles or 8 floats
+ *   SSE2      2 doubles or 4 floats
+ *   otherwise 1 double or float, plain scalar code
+ * Build with -march=native (the RT_NATIVE_ARCH cmake option) to get the widest.
+ **/
+
+#if defined(__AVX512F__)
+
+#define RT_SIMD_NAME "AVX-512"
+
+struct SimdMask {
+    __mmask8 m;
+
+    int bits() const { return m; }
+    bool any() const { return m != 0; }
+    SimdMask operator& (SimdMask o) const { return { static_cast<__mmask8>(m & o.m) }; }
+    SimdMask operator| (SimdMask o) const { return { static_cast<__mmask8>(m | o.m) }; }
+};
+
+struct SimdDouble {
+    static constexpr int WIDTH = 8;
+    __m512d v;
+
+    SimdDouble() {}
+    SimdDouble(__m512d x) : v(x) {}
+    SimdDouble(double x) : v(_mm512_set1_pd(x)) {}
+
+    static SimdDouble load(const double* p) { return _mm512_loadu_pd(p); }
+    void store(double* p) const { _mm512_storeu_pd(p, v); }
+
+    // A mask with the first n lanes set
+    static SimdMask first_lanes(int n) {
+        return { static_cast<__mmask8>(n >= WIDTH ? 0xff : (1 << n) - 1) };
+    }
+
+    // 0, 1, 2, ... WIDTH-1
+    static SimdDouble lane_index() { return _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0); }
+};
+
+inline SimdDouble operator+ (SimdDouble a, SimdDouble b) { return _mm512_add_pd(a.v, b.v); }
+inline SimdDouble operator- (SimdDouble a, SimdDouble b) { return _mm512_sub_pd(a.v, b.v); }
+inline SimdDouble operator* (SimdDouble a, SimdDouble b) { return _mm512_mul_pd(a.v, b.v); }
+inline SimdDouble operator/ (SimdDouble a, SimdDouble b) { return _mm512_div_pd(a.v, b.v); }
+inline SimdDouble sqrt(SimdDouble a) { return _mm512_sqrt_pd(a.v); }
+inline SimdDouble max(SimdDouble a, SimdDouble b) { return _mm512_max_pd(a.v, b.v); }
+inline SimdDouble min(SimdDouble a, SimdDouble b) { return _mm512_min_pd(a.v, b.v); }
+
+inline SimdMask operator< (SimdDouble a, SimdDouble b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdMask operator> (SimdDouble a, SimdDouble b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdMask operator<= (SimdDouble a, SimdDouble b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdMask operator>= (SimdDouble a, SimdDouble b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_GE_OQ) }; }
+
+// Lanes where the mask is set come from a, the rest from b
+inline SimdDouble select(SimdMask mask, SimdDouble a, SimdDouble b) {
+    return _mm512_mask_blend_pd(mask.m, b.v, a.v);
+}
+
+
+struct SimdFloatMask {
+    __mmask16 m;
+
+    int bits() const { return m; }
+    bool any() const { return m != 0; }
+    SimdFloatMask operator& (SimdFloatMask o) const { return { static_cast<__mmask16>(m & o.m) }; }
+    SimdFloatMask operator| (SimdFloatMask o) const { return { static_cast<__mmask16>(m | o.m) }; }
+};
+
+struct SimdFloat {
+    static constexpr int WIDTH = 16;
+    __m512 v;
+
+    SimdFloat() {}
+    SimdFloat(__m512 x) : v(x) {}
+    SimdFloat(float x) : v(_mm512_set1_ps(x)) {}
+
+    static SimdFloat load(const float* p) { return _mm512_loadu_ps(p); }
+    void store(float* p) const { _mm512_storeu_ps(p, v); }
+
+    static SimdFloatMask first_lanes(int n) {
+        return { static_cast<__mmask16>(n >= WIDTH ? 0xffff : (1 << n) - 1) };
+    }
+
+    static SimdFloat lane_index() {
+        return _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    }
+};
+
+inline SimdFloat operator+ (SimdFloat a, SimdFloat b) { return _mm512_add_ps(a.v, b.v); }
+inline SimdFloat operator- (SimdFloat a, SimdFloat b) { return _mm512_sub_ps(a.v, b.v); }
+inline SimdFloat operator* (SimdFloat a, SimdFloat b) { return _mm512_mul_ps(a.v, b.v); }
+inline SimdFloat operator/ (SimdFloat a, SimdFloat b) { return _mm512_div_ps(a.v, b.v); }
+inline SimdFloat sqrt(SimdFloat a) { return _mm512_sqrt_ps(a.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return _mm512_max_ps(a.v, b.v); }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return _mm512_min_ps(a.v, b.v); }
+
+inline SimdFloatMask operator< (SimdFloat a, SimdFloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdFloatMask operator> (SimdFloat a, SimdFloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdFloatMask operator<= (SimdFloat a, SimdFloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdFloatMask operator>= (SimdFloat a, SimdFloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+
+inline SimdFloat select(SimdFloatMask mask, SimdFloat a, SimdFloat b) {
+    return _mm512_mask_blend_ps(mask.m, b.v, a.v);
+}
+
+#elif defined(__AVX__)
+
+#define RT_SIMD_NAME "AVX"
+
+struct SimdMask {
+    __m256d m;
+
+    int bits() const { return _mm256_movemask_pd(m); }
+    bool any() const { return bits() != 0; }
+    SimdMask operator& (SimdMask o) const { return { _mm256_and_pd(m, o.m) }; }
+    SimdMask operator| (SimdMask o) const { return { _mm256_or_pd(m, o.m) }; }
+};
+
+struct SimdDouble {
+    static constexpr int WIDTH = 4;
+    __m256d v;
+
+    SimdDouble() {}
+    SimdDouble(__m256d x) : v(x) {}
+    SimdDouble(double x) : v(_mm256_set1_pd(x)) {}
+
+    static SimdDouble load(const double* p) { return _mm256_loadu_pd(p); }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+
+    static SimdMask first_lanes(int n) {
+        auto lane = _mm256_set_pd(3, 2, 1, 0);
+        return { _mm256_cmp_pd(lane, _mm256_set1_pd(n), _CMP_LT_OQ) };
+    }
+
+    static SimdDouble lane_index() { return _mm256_set_pd(3, 2, 1, 0); }
+};
+
+inline SimdDouble operator+ (SimdDouble a, SimdDouble b) { return _mm256_add_pd(a.v, b.v); }
+inline SimdDouble operator- (SimdDouble a, SimdDouble b) { return _mm256_sub_pd(a.v, b.v); }
+inline SimdDouble operator* (SimdDouble a, SimdDouble b) { return _mm256_mul_pd(a.v, b.v); }
+inline SimdDouble operator/ (SimdDouble a, SimdDouble b) { return _mm256_div_pd(a.v, b.v); }
+inline SimdDouble sqrt(SimdDouble a) { return _mm256_sqrt_pd(a.v); }
+inline SimdDouble max(SimdDouble a, SimdDouble b) { return _mm256_max_pd(a.v, b.v); }
+inline SimdDouble min(SimdDouble a, SimdDouble b) { return _mm256_min_pd(a.v, b.v); }
+
+inline SimdMask operator< (SimdDouble a, SimdDouble b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdMask operator> (SimdDouble a, SimdDouble b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdMask operator<= (SimdDouble a, SimdDouble b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdMask operator>= (SimdDouble a, SimdDouble b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ) }; }
+
+inline SimdDouble select(SimdMask mask, SimdDouble a, SimdDouble b) {
+    return _mm256_blendv_pd(b.v, a.v, mask.m);
+}
+
+
+struct SimdFloatMask {
+    __m256 m;
+
+    int bits() const { return _mm256_movemask_ps(m); }
+    bool any() const { return bits() != 0; }
+    SimdFloatMask operator& (SimdFloatMask o) const { return { _mm256_and_ps(m, o.m) }; }
+    SimdFloatMask operator| (SimdFloatMask o) const { return { _mm256_or_ps(m, o.m) }; }
+};
+
+struct SimdFloat {
+    static constexpr int WIDTH = 8;
+    __m256 v;
+
+    SimdFloat() {}
+    SimdFloat(__m256 x) : v(x) {}
+    SimdFloat(float x) : v(_mm256_set1_ps(x)) {}
+
+    static SimdFloat load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    static SimdFloatMask first_lanes(int n) {
+        return { _mm256_cmp_ps(lane_index().v, _mm256_set1_ps(static_cast<float>(n)), _CMP_LT_OQ) };
+    }
+
+    static SimdFloat lane_index() { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+};
+
+inline SimdFloat operator+ (SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator- (SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator* (SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/ (SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat sqrt(SimdFloat a) { return _mm256_sqrt_ps(a.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+
+inline SimdFloatMask operator< (SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdFloatMask operator> (SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdFloatMask operator<= (SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdFloatMask operator>= (SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+
+inline SimdFloat select(SimdFloatMask mask, SimdFloat a, SimdFloat b) {
+    return _mm256_blendv_ps(b.v, a.v, mask.m);
+}
+
+#elif defined(__SSE2__)
+
+#define RT_SIMD_NAME "SSE2"
+
+struct SimdMask {
+    __m128d m;
+
+    int bits() const { return _mm_movemask_pd(m); }
+    bool any() const { return bits() != 0; }
+    SimdMask operator& (SimdMask o) const { return { _mm_and_pd(m, o.m) }; }
+    SimdMask operator| (SimdMask o) const { return { _mm_or_pd(m, o.m) }; }
+};
+
+struct SimdDouble {
+    static constexpr int WIDTH = 2;
+    __m128d v;
+
+    SimdDouble() {}
+    SimdDouble(__m128d x) : v(x) {}
+    SimdDouble(double x) : v(_mm_set1_pd(x)) {}
+
+    static SimdDouble load(const double* p) { return _mm_loadu_pd(p); }
+    void store(double* p) const { _mm_storeu_pd(p, v); }
+
+    static SimdMask first_lanes(int n) {
+        return { _mm_cmplt_pd(_mm_set_pd(1, 0), _mm_set1_pd(n)) };
+    }
+
+    static SimdDouble lane_index() { return _mm_set_pd(1, 0); }
+};
+
+inline SimdDouble operator+ (SimdDouble a, SimdDouble b) { return _mm_add_pd(a.v, b.v); }
+inline SimdDouble operator- (SimdDouble a, SimdDouble b) { return _mm_sub_pd(a.v, b.v); }
+inline SimdDouble operator* (SimdDouble a, SimdDouble b) { return _mm_mul_pd(a.v, b.v); }
+inline SimdDouble operator/ (SimdDouble a, SimdDouble b) { return _mm_div_pd(a.v, b.v); }
+inline SimdDouble sqrt(SimdDouble a) { return _mm_sqrt_pd(a.v); }
+inline SimdDouble max(SimdDouble a, SimdDouble b) { return _mm_max_pd(a.v, b.v); }
+inline SimdDouble min(SimdDouble a, SimdDouble b) { return _mm_min_pd(a.v, b.v); }
+
+inline SimdMask operator< (SimdDouble a, SimdDouble b) { return { _mm_cmplt_pd(a.v, b.v) }; }
+inline SimdMask operator> (SimdDouble a, SimdDouble b) { return { _mm_cmpgt_pd(a.v, b.v) }; }
+inline SimdMask operator<= (SimdDouble a, SimdDouble b) { return { _mm_cmple_pd(a.v, b.v) }; }
+inline SimdMask operator>= (SimdDouble a, SimdDouble b) { return { _mm_cmpge_pd(a.v, b.v) }; }
+
+inline SimdDouble select(SimdMask mask, SimdDouble a, SimdDouble b) {
+    // SSE2 has no blend, so mask out both sides and combine them
+    return _mm_or_pd(_mm_and_pd(mask.m, a.v), _mm_andnot_pd(mask.m, b.v));
+}
+
+
+struct SimdFloatMask {
+    __m128 m;
+
+    int bits() const { return _mm_movemask_ps(m); }
+    bool any() const { return bits() != 0; }
+    SimdFloatMask operator& (SimdFloatMask o) const { return { _mm_and_ps(m, o.m) }; }
+    SimdFloatMask operator| (SimdFloatMask o) const { return { _mm_or_ps(m, o.m) }; }
+};
+
+struct SimdFloat {
+    static constexpr int WIDTH = 4;
+    __m128 v;
+
+    SimdFloat() {}
+    SimdFloat(__m128 x) : v(x) {}
+    SimdFloat(float x) : v(_mm_set1_ps(x)) {}
+
+    static SimdFloat load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    static SimdFloatMask first_lanes(int n) {
+        return { _mm_cmplt_ps(lane_index().v, _mm_set1_ps(static_cast<float>(n))) };
+    }
+
+    static SimdFloat lane_index() { return _mm_set_ps(3, 2, 1, 0); }
+};
+
+inline SimdFloat operator+ (SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat operator- (SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat operator* (SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat operator/ (SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+inline SimdFloat sqrt(SimdFloat a) { return _mm_sqrt_ps(a.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+
+inline SimdFloatMask operator< (SimdFloat a, SimdFloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline SimdFloatMask operator> (SimdFloat a, SimdFloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+inline SimdFloatMask operator<= (SimdFloat a, SimdFloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+inline SimdFloatMask operator>= (SimdFloat a, SimdFloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+
+inline SimdFloat select(SimdFloatMask mask, SimdFloat a, SimdFloat b) {
+    return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+
+#else
+
+#define RT_SIMD_NAME "scalar"
+
+struct SimdMask {
+    bool m;
+
+    int bits() const { return m ? 1 : 0; }
+    bool any() const { return m; }
+    SimdMask operator& (SimdMask o) const { return { m && o.m }; }
+    SimdMask operator| (SimdMask o) const { return { m || o.m }; }
+};
+
+struct SimdDouble {
+    static constexpr int WIDTH = 1;
+    double v;
+
+    SimdDouble() {}
+    SimdDouble(double x) : v(x) {}
+
+    static SimdDouble load(const double* p) { return *p; }
+    void store(double* p) const { *p = v; }
+
+    static SimdMask first_lanes(int n) { return { n > 0 }; }
+
+    static SimdDouble lane_index() { return 0.0; }
+};
+
+inline SimdDouble operator+ (SimdDouble a, SimdDouble b) { return a.v + b.v; }
+inline SimdDouble operator- (SimdDouble a, SimdDouble b) { return a.v - b.v; }
+inline SimdDouble operator* (SimdDouble a, SimdDouble b) { return a.v * b.v; }
+inline SimdDouble operator/ (SimdDouble a, SimdDouble b) { return a.v / b.v; }
+inline SimdDouble sqrt(SimdDouble a) { return std::sqrt(a.v); }
+inline SimdDouble max(SimdDouble a, SimdDouble b) { return a.v > b.v ? a.v : b.v; }
+inline SimdDouble min(SimdDouble a, SimdDouble b) { return a.v < b.v ? a.v : b.v; }
+
+inline SimdMask operator< (SimdDouble a, SimdDouble b) { return { a.v < b.v }; }
+inline SimdMask operator> (SimdDouble a, SimdDouble b) { return { a.v > b.v }; }
+inline SimdMask operator<= (SimdDouble a, SimdDouble b) { return { a.v <= b.v }; }
+inline SimdMask operator>= (SimdDouble a, SimdDouble b) { return { a.v >= b.v }; }
+
+inline SimdDouble select(SimdMask mask, SimdDouble a, SimdDouble b) {
+    return mask.m ? a : b;
+}
+
+
+struct SimdFloatMask {
+    bool m;
+
+    int bits() const { return m ? 1 : 0; }
+    bool any() const { return m; }
+    SimdFloatMask operator& (SimdFloatMask o) const { return { m && o.m }; }
+    SimdFloatMask operator| (SimdFloatMask o) const { return { m || o.m }; }
+};
+
+struct SimdFloat {
+    static constexpr int WIDTH = 1;
+    float v;
+
+    SimdFloat() {}
+    SimdFloat(float x) : v(x) {}
+
+    static SimdFloat load(const float* p) { return *p; }
+    void store(float* p) const { *p = v; }
+
+    static SimdFloatMask first_lanes(int n) { return { n > 0 }; }
+
+    static SimdFloat lane_index() { return 0.0f; }
+};
+
+inline SimdFloat operator+ (SimdFloat a, SimdFloat b) { return a.v + b.v; }
+inline SimdFloat operator- (SimdFloat a, SimdFloat b) { return a.v - b.v; }
+inline SimdFloat operator* (SimdFloat a, SimdFloat b) { return a.v * b.v; }
+inline SimdFloat operator/ (SimdFloat a, SimdFloat b) { return a.v / b.v; }
+inline SimdFloat sqrt(SimdFloat a) { return std::sqrt(a.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return a.v > b.v ? a.v : b.v; }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return a.v < b.v ? a.v : b.v; }
+
+inline SimdFloatMask operator< (SimdFloat a, SimdFloat b) { return { a.v < b.v }; }
+inline SimdFloatMask operator> (SimdFloat a, SimdFloat b) { return { a.v > b.v }; }
+inline SimdFloatMask operator<= (SimdFloat a, SimdFloat b) { return { a.v <= b.v }; }
+inline SimdFloatMask operator>= (SimdFloat a, SimdFloat b) { return { a.v >= b.v }; }
+
+inline SimdFloat select(SimdFloatMask mask, SimdFloat a, SimdFloat b) {
+    return mask.m ? a : b;
+}
+
+#endif
+
+// The wrapper for the real type of the geometry, see real.h
+#ifdef RT_SINGLE_PRECISION
+using SimdReal = SimdFloat;
+using SimdRealMask = SimdFloatMask;
+#else
+using SimdReal = SimdDouble;
+using SimdRealMask = SimdMask;
+#endif
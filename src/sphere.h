@@ -1,23 +1,79 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+
 #include "utility.h"
 #include "hittable.h"
 
+/**
+ * Fills in rec for a ray r that hits the sphere at t.
+ *
+ * r.at(t) can be quite far from the surface: near the edge of the sphere
+ * the two roots of the quadratic are close together and the rounding errors
+ * of t get blown up. So the point is moved back onto the sphere along the
+ * line from the center. After that it is only off by a few rounding errors of
+ * the center and radius, which is what rec.error is.
+ **/
+inline void set_sphere_hit(
+    const Ray& r, real t, const Point3& center, real radius, const Material* m, hit_record& rec
+) {
+    Vec3 from_center = r.at(t) - center;
+    from_center *= radius / from_center.length();
+
+    rec.t = t;
+    rec.p = center + from_center;
+
+    // Calculate the normal and set normal
+    Vec3 outward_normal = from_center / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = m;
+
+    auto extent = std::max(std::fabs(center[0]), std::max(std::fabs(center[1]), std::fabs(center[2])));
+    rec.error = SELF_HIT_EPSILON * (extent + radius);
+}
+
 class Sphere : public Hittable {
 public:
     Point3 center;
-    double radius;
-    shared_ptr<Material> mat_ptr;
+    real radius;
+    // Owned by the scene
+    const Material* mat_ptr = nullptr;
 public:
     Sphere() {}
-    Sphere(Point3 cen, double r, shared_ptr<Material> m)
+    Sphere(Point3 cen, real r, const Material* m)
         : center(cen), radius(r), mat_ptr(m) {};
 
-    virtual bool hit(const Ray& r, double t_min, double t_max, hit_record& rec)
+    virtual bool hit(const Ray& r, real t_min, real t_max, hit_record& rec)
         const override;
+
+    // The same roots as hit, without the hit record
+    virtual bool occluded(const Ray& r, real t_min, real t_max) const override {
+        RT_STAT(thread_stats().intersection_tests++);
+        Vec3 oc = r.origin() - center;
+        auto a = r.direction().lengthSquared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.lengthSquared() - radius * radius;
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0)
+            return false;
+        auto sqrt_d = std::sqrt(discriminant);
+        auto near = (-half_b - sqrt_d) / a;
+        auto far = (-half_b + sqrt_d) / a;
+        return (t_min <= near && near <= t_max) || (t_min <= far && far <= t_max);
+    }
+
+    virtual bool bounding_box(AABB& output_box) const override {
+        // The box around a sphere is just the center plus and minus the radius
+        auto extent = Vec3(radius, radius, radius);
+        output_box = AABB(center - extent, center + extent);
+        return true;
+    }
 };
 
-bool Sphere::hit(const Ray& r, double t_min, double t_max, hit_record& rec) const {
+bool Sphere::hit(const Ray& r, real t_min, real t_max, hit_record& rec) const {
+    RT_STAT(thread_stats().intersection_tests++);
+
     /**
      * Any point on the sphere should satisfy the following mathematical property
      * (x - Cx)^2 + (y - Cy)^2 + (z - Cz)^2= r^2 or,
@@ -70,13 +126,7 @@ bool Sphere::hit(const Ray& r, double t_min, double t_max, hit_record& rec) cons
     }
 
 
-    rec.t = root;
-    rec.p = r.at(rec.t);
-
-    // Calculate the normal and set normal
-    Vec3 outward_normal = (rec.p - center) / radius;
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    set_sphere_hit(r, root, center, radius, mat_ptr, rec);
 
     return true;
 }
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Counters that show where the render time goes: rays per bounce, the
+ * primitive tests and BVH nodes per ray, the scatters of every material type,
+ * how the paths ended, and (in renderer.h) the time spent on every pixel.
+ *
+ * They are only there when built with RT_STATS (configure with
+ * -D RT_STATS=ON). Otherwise RT_STAT(...) expands to nothing and the hot
+ * loops are exactly what they would be without it. Counting costs a little
+ * time, so don't compare the speed of a stats build with a normal one.
+ *
+ * Every thread counts into its own RenderStats, so the threads never write
+ * to the same cache line. The registry knows all of them and adds them up
+ * for the report once the render is done.
+ **/
+#ifndef RT_STATS
+#define RT_STATS 0
+#endif
+
+#if RT_STATS
+#define RT_STAT(statement) do { statement; } while (0)
+#else
+#define RT_STAT(statement) do { } while (0)
+#endif
+
+// Rays deeper than this are counted with the last depth
+const int STATS_MAX_DEPTH = 64;
+// Room for this many material types, integrator.h checks there are no more
+const int STATS_MAX_MATERIAL_TYPES = 8;
+
+struct RenderStats {
+    // Rays traced at every depth, the camera rays are depth 1
+    uint64_t rays_by_depth[STATS_MAX_DEPTH] = {};
+    // Ray against primitive tests, a SIMD test of W spheres counts W
+    uint64_t intersection_tests = 0;
+    // BVH nodes whose box was tested
+    uint64_t node_visits = 0;
+    // Shadow rays toward the lights, and how many of them found something in the way
+    uint64_t shadow_rays = 0;
+    uint64_t shadow_rays_blocked = 0;
+    // Calls to every material type's scatter, and how many absorbed the ray
+    uint64_t scatters[STATS_MAX_MATERIAL_TYPES] = {};
+    uint64_t absorbed[STATS_MAX_MATERIAL_TYPES] = {};
+
+    // How the paths ended
+    uint64_t escaped = 0;
+    uint64_t absorbed_paths = 0;
+    uint64_t max_depth_paths = 0;
+    uint64_t roulette_paths = 0;
+
+    void count_ray(int depth) {
+        rays_by_depth[depth < STATS_MAX_DEPTH ? depth - 1 : STATS_MAX_DEPTH - 1]++;
+    }
+
+    void count_scatter(std::size_t type, bool did_scatter) {
+        scatters[type]++;
+        absorbed[type] += !did_scatter;
+    }
+
+    uint64_t rays() const {
+        uint64_t total = 0;
+        for (auto n : rays_by_depth)
+            total += n;
+        return total;
+    }
+
+    uint64_t paths() const {
+        return escaped + absorbed_paths + max_depth_paths + roulette_paths;
+    }
+
+    void add(const RenderStats& other) {
+        for (int d = 0; d < STATS_MAX_DEPTH; d++)
+            rays_by_depth[d] += other.rays_by_depth[d];
+        intersection_tests += other.intersection_tests;
+        node_visits += other.node_visits;
+        shadow_rays += other.shadow_rays;
+        shadow_rays_blocked += other.shadow_rays_blocked;
+        for (int t = 0; t < STATS_MAX_MATERIAL_TYPES; t++) {
+            scatters[t] += other.scatters[t];
+            absorbed[t] += other.absorbed[t];
+        }
+        escaped += other.escaped;
+        absorbed_paths += other.absorbed_paths;
+        max_depth_paths += other.max_depth_paths;
+        roulette_paths += other.roulette_paths;
+    }
+};
+
+// Keeps track of the counters of every thread
+class StatsRegistry {
+private:
+    std::mutex mutex;
+    std::vector<const RenderStats*> threads;
+    // The counts of the threads that have already exited
+    RenderStats exited;
+public:
+    void add(const RenderStats* stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.push_back(stats);
+    }
+
+    void remove(const RenderStats* stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        exited.add(*stats);
+        for (auto& t : threads) {
+            if (t == stats) {
+                t = threads.back();
+                threads.pop_back();
+                break;
+            }
+        }
+    }
+
+    // The counts of all the threads, only exact while no thread is rendering
+    RenderStats total() {
+        std::lock_guard<std::mutex> lock(mutex);
+        RenderStats sum = exited;
+        for (auto t : threads)
+            sum.add(*t);
+        return sum;
+    }
+};
+
+inline StatsRegistry& stats_registry() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+// The counters of a thread, they sign up with the registry while the thread lives
+struct ThreadStats : RenderStats {
+    ThreadStats() { stats_registry().add(this); }
+    ~ThreadStats() { stats_registry().remove(this); }
+    ThreadStats(const ThreadStats&) = delete;
+    ThreadStats& operator= (const ThreadStats&) = delete;
+};
+
+inline RenderStats& thread_stats() {
+    thread_local ThreadStats stats;
+    return stats;
+}
+
+/**
+ * Prints the counters, material_names[t] is the name of material type t. The
+ * pixel times are the seconds spent on every pixel (see RenderResult::cost),
+ * empty if there are none.
+ **/
+inline void print_stats_report(
+    std::ostream& out, const RenderStats& stats, const std::vector<std::string>& material_names,
+    const std::vector<float>& pixel_seconds
+) {
+    auto rays = stats.rays();
+    auto per_ray = [&](uint64_t n) { return rays > 0 ? static_cast<double>(n) / rays : 0.0; };
+    auto percent = [](uint64_t n, uint64_t total) { return total > 0 ? 100.0 * n / total : 0.0; };
+
+    out << std::fixed << std::setprecision(2)
+        << "Render statistics" << '\n'
+        << "  rays                " << rays << '\n'
+        << "  rays by depth      ";
+    // The deep bounces are rare, once less than 0.1% of the rays are left
+    // they are lumped together
+    uint64_t left = rays;
+    for (int d = 0; d < STATS_MAX_DEPTH && left > 0; d++) {
+        bool rest = d + 1 == STATS_MAX_DEPTH || left * 1000 < rays;
+        out << ' ' << d + 1 << (rest ? "+" : "") << ": "
+            << percent(rest ? left : stats.rays_by_depth[d], rays) << "%";
+        if (rest) break;
+        left -= stats.rays_by_depth[d];
+    }
+    out << '\n'
+        << "  intersection tests  " << stats.intersection_tests << " ("
+        << per_ray(stats.intersection_tests) << " per ray)" << '\n'
+        << "  BVH nodes visited   " << stats.node_visits << " ("
+        << per_ray(stats.node_visits) << " per ray)" << '\n';
+    if (stats.shadow_rays > 0) {
+        out << "  shadow rays         " << stats.shadow_rays << " ("
+            << percent(stats.shadow_rays_blocked, stats.shadow_rays) << "% blocked)" << '\n';
+    }
+
+    uint64_t scatters = 0;
+    for (auto n : stats.scatters)
+        scatters += n;
+    for (std::size_t t = 0; t < material_names.size(); t++) {
+        out << "  " << std::left << std::setw(20) << "scatter " + material_names[t] << std::right
+            << stats.scatters[t] << " (" << percent(stats.scatters[t], scatters) << "% of scatters, "
+            << percent(stats.absorbed[t], stats.scatters[t]) << "% absorbed)" << '\n';
+    }
+
+    auto paths = stats.paths();
+    out << "  paths               " << paths << ", " << (paths > 0 ? static_cast<double>(rays) / paths : 0.0)
+        << " rays each" << '\n'
+        << "    escaped           " << percent(stats.escaped, paths) << "%" << '\n'
+        << "    absorbed          " << percent(stats.absorbed_paths, paths) << "%" << '\n'
+        << "    max depth         " << percent(stats.max_depth_paths, paths) << "%" << '\n'
+        << "    russian roulette  " << percent(stats.roulette_paths, paths) << "%" << '\n';
+
+    if (!pixel_seconds.empty()) {
+        double total = 0;
+        std::size_t slowest = 0;
+        for (std::size_t p = 0; p < pixel_seconds.size(); p++) {
+            total += pixel_seconds[p];
+            if (pixel_seconds[p] > pixel_seconds[slowest])
+                slowest = p;
+        }
+        out << "  time per pixel      " << total / pixel_seconds.size() * 1e6 << "us on average, "
+            << pixel_seconds[slowest] * 1e6 << "us at most" << '\n';
+    }
+    out.unsetf(std::ios::floatfield);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed size pool of worker threads that balances work by stealing.
+ *
+ * Every worker owns its own queue of tasks. A worker takes tasks from the back
+ * of its own queue, and once that runs dry it steals from the front of the
+ * other workers' queues. Render tiles take very different amounts of time, a
+ * tile full of glass spheres bounces rays around a lot longer than a tile of
+ * plain sky, so if we just split the tiles evenly between threads some threads
+ * would finish early and sit idle. With stealing every thread stays busy until
+ * there is no work left at all.
+ *
+ * The pool is created once and can be reused for any number of batches of
+ * work, submit() some tasks and then wait() for all of them to finish.
+ **/
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+private:
+    // Every worker has a queue, the mutex is only ever contended
+    // when someone is stealing from it
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex state_mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+
+    // Tasks sitting in some queue which no worker has picked yet
+    std::size_t queued = 0;
+    // Tasks submitted but not finished yet
+    std::size_t pending = 0;
+    // The queue the next submitted task goes to
+    std::size_t next_queue = 0;
+    bool stopping = false;
+public:
+    // A thread_count of 0 or less uses every hardware thread
+    explicit ThreadPool(int thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // Queue a task, tasks are spread round robin over the worker queues
+    void submit(Task task);
+    // Block until every submitted task has finished
+    void wait();
+private:
+    void worker_loop(std::size_t index);
+    bool try_pop(std::size_t index, Task& task);
+};
+
+inline ThreadPool::ThreadPool(int thread_count) {
+    if (thread_count <= 0)
+        thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    // hardware_concurrency is allowed to return 0 if it does not know
+    if (thread_count <= 0)
+        thread_count = 1;
+
+    for (int i = 0; i < thread_count; i++)
+        queues.push_back(std::make_unique<WorkQueue>());
+
+    for (int i = 0; i < thread_count; i++)
+        workers.emplace_back(&ThreadPool::worker_loop, this, static_cast<std::size_t>(i));
+}
+
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+inline void ThreadPool::submit(Task task) {
+    std::size_t index;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        index = next_queue;
+        next_queue = (next_queue + 1) % queues.size();
+    }
+
+    // The task has to be in the queue before we tell anyone about it
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        queued++;
+        pending++;
+    }
+    work_available.notify_one();
+}
+
+inline void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    work_done.wait(lock, [this] { return pending == 0; });
+}
+
+inline bool ThreadPool::try_pop(std::size_t index, Task& task) {
+    const auto count = queues.size();
+
+    // Look at our own queue first and then at everyone else's. We take from
+    // the back of our own queue but steal from the front of others, so the
+    // owner and the thief don't fight over the same end of the queue
+    for (std::size_t k = 0; k < count; k++) {
+        auto& queue = *queues[(index + k) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+
+        if (k == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+inline void ThreadPool::worker_loop(std::size_t index) {
+    while (true) {
+        Task task;
+        if (try_pop(index, task)) {
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                queued--;
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (--pending == 0)
+                work_done.notify_all();
+            continue;
+        }
+
+        // Nothing to do, sleep until someone submits more work
+        std::unique_lock<std::mutex> lock(state_mutex);
+        work_available.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
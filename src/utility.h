@@ -5,13 +5,16 @@
 #include <limits>
 #include <memory>
 
+#include "sampler.h"
+#include "real.h"
+
 // Usings
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
 // Constants
-const double INF = std::numeric_limits<double>::infinity();
+const real INF = std::numeric_limits<real>::infinity();
 const double PI = 3.1415926535897932385;
 
 // Utility functions
@@ -28,9 +31,10 @@ inline double clamp(double x, double min, double max) {
 // Some random number generation utilities
 inline double random_double() {
     // Returns a random real in [0, 1)
-    // rand function returns result between 0 and RAND_MAX
-    // as we want the result between [0, 1) we divide by RAND_MAX + 1
-    return rand() / (RAND_MAX + 1.0);
+    // We don't use rand here, it has a hidden global state that all threads
+    // share and only gives RAND_MAX different values. Instead every thread
+    // draws from its own sampler, see sampler.h
+    return thread_sampler().next_double();
 }
 
 inline double random_double(double min, double max) {
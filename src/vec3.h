@@ -6,15 +6,15 @@
 
 class Vec3 {
 public:
-    double vec3[3];
+    real vec3[3];
 public:
     // Class constructors
     Vec3() : vec3{0, 0, 0} {}
-    Vec3(double x, double y, double z) : vec3{x, y, z} {}
+    Vec3(real x, real y, real z) : vec3{x, y, z} {}
 
     // Vec3[index] will return the value of vec3 at that index
-    double operator[] (int i) const { return vec3[i]; }
-    double& operator[] (int i) { return vec3[i]; }
+    real operator[] (int i) const { return vec3[i]; }
+    real& operator[] (int i) { return vec3[i]; }
     /**
      * The above two functions may seem similar at first glance but are different
      * that first one will copy the value of vec3[i] to a new variable and return it
@@ -22,11 +22,11 @@ public:
      * For e.g.
      * 
      * Vec3 color();
-     * double i = color[0];
+     * real i = color[0];
      * i = 34.0;
      * Changing the value of i, does not affect value of color
      * 
-     * double& j = color[0];
+     * real& j = color[0];
      * j = 34.0
      * Changing value of j, will change value of color
      **/
@@ -53,25 +53,25 @@ public:
         return *this;
     }
 
-    // Multiplies the vector by the double
-    Vec3& operator*= (const double t) {
+    // Multiplies the vector by a number
+    Vec3& operator*= (const real t) {
         vec3[0] *= t;
         vec3[1] *= t;
         vec3[2] *= t;
         return *this;
     }
 
-    // Divides the vector by the double
-    Vec3& operator/= (const double t) {
+    // Divides the vector by a number
+    Vec3& operator/= (const real t) {
         return *this *= 1/t;
     }
 
     // Calculate the length of the vector from the origin
-    double length() const {
+    real length() const {
         return sqrt(lengthSquared());
     }
 
-    double lengthSquared() const {
+    real lengthSquared() const {
         return vec3[0]*vec3[0] + vec3[1]*vec3[1] + vec3[2]*vec3[2];
     }
 
@@ -80,7 +80,7 @@ public:
         return Vec3(random_double(), random_double(), random_double());
     }
 
-    inline static Vec3 random(double min, double max) {
+    inline static Vec3 random(real min, real max) {
         return Vec3(
             random_double(min, max),
             random_double(min, max),
@@ -117,18 +117,18 @@ inline Vec3 operator* (const Vec3 &u, const Vec3 &v) {
     return Vec3(u[0] * v[0], u[1] * v[1], u[2] * v[2]);
 }
 
-// Multiply the vector with a double
-inline Vec3 operator* (double t, const Vec3 &v) {
+// Multiply the vector with a number
+inline Vec3 operator* (real t, const Vec3 &v) {
     return Vec3(t*v[0], t*v[1], t*v[2]);
 }
 
-// Multiply the vector with the double
-inline Vec3 operator* (const Vec3 &v, double t) {
+// Multiply the vector with a number
+inline Vec3 operator* (const Vec3 &v, real t) {
     return t * v;
 }
 
-// Divide the vector by the double
-inline Vec3 operator/(Vec3 v, double t) {
+// Divide the vector by a number
+inline Vec3 operator/(Vec3 v, real t) {
     return (1/t) * v;
 }
 
@@ -136,7 +136,7 @@ inline Vec3 operator/(Vec3 v, double t) {
 // https://www.math.ucla.edu/~josephbreen/Understanding_the_Dot_Product_and_the_Cross_Product.pdf
 
 // Find the dot product between two vectors
-inline double dot(const Vec3 &p1, const Vec3 &p2) {
+inline real dot(const Vec3 &p1, const Vec3 &p2) {
     return p1[0] * p2[0]
          + p1[1] * p2[1]
          + p1[2] * p2[2];
@@ -155,40 +155,12 @@ inline Vec3 unit_vector(Vec3 v) {
     return v / v.length();
 }
 
-// Generate a random point within a sphere of 1 unit
-inline Vec3 random_in_unit_sphere() {
-    while (true) {
-        // Generate a random point between -1 and 1
-        // As random is static we use ::
-        auto p = Vec3::random(-1, 1);
-
-        // If the length from the origin to the point
-        // is less 1 return p else continue
-
-        // We should ideally use length function but we dont need to here
-        // length function takes sqrt of the length squared
-        if (p.lengthSquared() >= 1) continue;
-        return p;
-    }
-}
-
-inline Vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
-}
-
-Vec3 random_in_hemisphere(const Vec3& center) {
-    Vec3 in_unit_sphere = random_unit_vector();
-    if (dot(in_unit_sphere, center) > 0.0)
-        return in_unit_sphere;
-    return -in_unit_sphere;
-}
-
 // Reflects a vector along a particular normal
 Vec3 reflect(const Vec3& v, const Vec3& n) {
     return v - 2*dot(v, n)*n;
 }
 
-Vec3 refract(const Vec3& uv, const Vec3& normal, double refractive_index) {
+Vec3 refract(const Vec3& uv, const Vec3& normal, real refractive_index) {
     // Find the cos theta, dot product of two vectors is
     // product of their length and the cos theta as normal and uv are expected
     // to be unit vector this will result in the cos of angle between them
@@ -205,14 +177,6 @@ Vec3 refract(const Vec3& uv, const Vec3& normal, double refractive_index) {
     return r_perp + r_parallel;
 }
 
-Vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = Vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.lengthSquared() >= 1) continue;
-        return p;
-    }
-}
-
 // Type aliases for Vec3
 using Point3 = Vec3;   // 3D point
 using Color = Vec3;    // RGB color